@@ -0,0 +1,114 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _XENCONS_CAPTURE_H
+#define _XENCONS_CAPTURE_H
+
+// Layout of the console capture files written by the monitor.
+//
+// A capture file is an XENCONS_CAPTURE_HEADER followed by any number of
+// blocks. Each block is an XENCONS_CAPTURE_BLOCK followed by
+// CompressedLength bytes of data. Blocks are compressed independently
+// with the Windows Compression API, in raw mode (COMPRESS_RAW), using
+// the algorithm named in the file header. Each one can be decompressed
+// without reference to any other, given its Length. A block with
+// XENCONS_CAPTURE_BLOCK_STORED set holds Length bytes of plain data.
+//
+// Offset is the position of a block's first byte in the console's
+// output stream since the monitor started capturing. It carries on
+// across rotated files, so gaps in a set of files show up as gaps in
+// Offset; output the monitor had to drop also ends the block before
+// it. Time is the UTC FILETIME at which the first byte of the block was
+// taken from the console, to within 10ms (it can be earlier, but never
+// later, if the monitor falls far behind). Neither ever goes backwards
+// within a file, even if the system clock does.
+//
+// Each capture file has a sidecar index file with the same name and
+// the XENCONS_CAPTURE_INDEX_EXTENSION, rotated along with it. It is an
+// XENCONS_CAPTURE_INDEX_HEADER followed by one entry of EntrySize bytes
+// per block, in block order, so entries can be binary searched on Time
+// or Offset. An index is only valid for the capture file whose header
+// Time matches its own. It may hold fewer entries than the file has
+// blocks (e.g. after a crash); readers should carry on from the last
+// entry by walking the block headers.
+//
+// All fields are little-endian. Readers should reject files with a
+// Version they don't know.
+
+#define XENCONS_CAPTURE_MAGIC       'PACX'  // "XCAP"
+#define XENCONS_CAPTURE_VERSION     1
+
+#define XENCONS_CAPTURE_EXTENSION   "xcap"
+
+typedef struct _XENCONS_CAPTURE_HEADER {
+    ULONG       Magic;
+    ULONG       Version;
+    ULONG       Algorithm;  // COMPRESS_ALGORITHM_*
+    ULONG       BlockSize;  // Largest Length of any block
+    ULONGLONG   Time;       // When the file was created
+    ULONGLONG   Offset;     // Of the first block
+    CHAR        Name[64];   // The console's name, NUL terminated
+} XENCONS_CAPTURE_HEADER, *PXENCONS_CAPTURE_HEADER;
+
+#define XENCONS_CAPTURE_BLOCK_MAGIC 'KLBX'  // "XBLK"
+
+#define XENCONS_CAPTURE_BLOCK_STORED    0x00000001
+
+typedef struct _XENCONS_CAPTURE_BLOCK {
+    ULONG       Magic;
+    ULONG       Flags;
+    ULONG       Length;             // Of the data once decompressed
+    ULONG       CompressedLength;   // Of the data that follows
+    ULONGLONG   Offset;
+    ULONGLONG   Time;
+} XENCONS_CAPTURE_BLOCK, *PXENCONS_CAPTURE_BLOCK;
+
+#define XENCONS_CAPTURE_INDEX_MAGIC     'XDIX'  // "XIDX"
+#define XENCONS_CAPTURE_INDEX_VERSION   1
+
+#define XENCONS_CAPTURE_INDEX_EXTENSION "xidx"
+
+typedef struct _XENCONS_CAPTURE_INDEX_HEADER {
+    ULONG       Magic;
+    ULONG       Version;
+    ULONG       EntrySize;  // Entries may grow in later versions
+    ULONG       Reserved;
+    ULONGLONG   Time;       // XENCONS_CAPTURE_HEADER::Time of the capture
+} XENCONS_CAPTURE_INDEX_HEADER, *PXENCONS_CAPTURE_INDEX_HEADER;
+
+typedef struct _XENCONS_CAPTURE_INDEX_ENTRY {
+    ULONGLONG   Time;       // XENCONS_CAPTURE_BLOCK::Time
+    ULONGLONG   Offset;     // XENCONS_CAPTURE_BLOCK::Offset
+    ULONGLONG   Position;   // Of the XENCONS_CAPTURE_BLOCK in the capture
+} XENCONS_CAPTURE_INDEX_ENTRY, *PXENCONS_CAPTURE_INDEX_ENTRY;
+
+#endif  // _XENCONS_CAPTURE_H
@@ -54,4 +54,93 @@ DEFINE_GUID(GUID_XENCONS_DEVICE,
                                              METHOD_BUFFERED,           \
                                              FILE_ANY_ACCESS)
 
+#define IOCTL_XENCONS_GET_STATISTICS    CTL_CODE(FILE_DEVICE_UNKNOWN,       \
+                                                 __IOCTL_XENCONS_BEGIN + 3, \
+                                                 METHOD_BUFFERED,           \
+                                                 FILE_ANY_ACCESS)
+
+// Completes once any write data the driver has accepted but not yet
+// passed to the backend has been placed in the shared ring.
+#define IOCTL_XENCONS_FLUSH         CTL_CODE(FILE_DEVICE_UNKNOWN,       \
+                                             __IOCTL_XENCONS_BEGIN + 4, \
+                                             METHOD_BUFFERED,           \
+                                             FILE_ANY_ACCESS)
+
+// Sets how reads on this handle are completed. The input buffer is a
+// XENCONS_READ_POLICY.
+#define IOCTL_XENCONS_SET_READ_POLICY   CTL_CODE(FILE_DEVICE_UNKNOWN,       \
+                                                 __IOCTL_XENCONS_BEGIN + 5, \
+                                                 METHOD_BUFFERED,           \
+                                                 FILE_ANY_ACCESS)
+
+// Sets how writes on this handle are completed. The input buffer is a
+// ULONG of XENCONS_WRITE_MODE flags.
+#define IOCTL_XENCONS_SET_WRITE_MODE    CTL_CODE(FILE_DEVICE_UNKNOWN,       \
+                                                 __IOCTL_XENCONS_BEGIN + 6, \
+                                                 METHOD_BUFFERED,           \
+                                                 FILE_ANY_ACCESS)
+
+// Maps a pair of byte rings (see xencons_shared.h) into the calling
+// process. Only one handle at a time may have the rings mapped. The
+// driver stops using them when that handle is closed, but the caller's
+// view stays until it is released with UnmapViewOfFile() or the process
+// exits.
+#define IOCTL_XENCONS_MAP_SHARED        CTL_CODE(FILE_DEVICE_UNKNOWN,       \
+                                                 __IOCTL_XENCONS_BEGIN + 7, \
+                                                 METHOD_BUFFERED,           \
+                                                 FILE_ANY_ACCESS)
+
+// Tells the driver there is new data in, or space in, the mapped rings.
+// Only accepted on the handle, and from the process, that mapped them.
+#define IOCTL_XENCONS_KICK_SHARED       CTL_CODE(FILE_DEVICE_UNKNOWN,       \
+                                                 __IOCTL_XENCONS_BEGIN + 8, \
+                                                 METHOD_BUFFERED,           \
+                                                 FILE_ANY_ACCESS)
+
+#define XENCONS_STATISTICS_VERSION  2
+
+// Latency bucket N counts requests that took [2^N, 2^(N+1)) microseconds
+// from being queued to being completed (bucket 0 also covers < 1us).
+#define XENCONS_LATENCY_BUCKETS     32
+
+typedef struct _XENCONS_STATISTICS {
+    ULONG       Version;
+    ULONG       Size;
+    ULONGLONG   BytesRead;
+    ULONGLONG   BytesWritten;
+    ULONGLONG   ReadsCompleted;
+    ULONGLONG   WritesCompleted;
+    ULONGLONG   ReadStalls;     // Reads pending but the console was empty
+    ULONGLONG   WriteStalls;    // Writes pending but the console was full
+    ULONGLONG   Events;
+    ULONGLONG   Dpcs;
+    ULONGLONG   Polls;
+    ULONGLONG   ReadLatency[XENCONS_LATENCY_BUCKETS];
+    ULONGLONG   WriteLatency[XENCONS_LATENCY_BUCKETS];
+    // Version 2
+    ULONGLONG   ReadAheadOverflows; // Passes that left input in the ring
+    ULONGLONG   ReadAheadHighWater; // Most bytes held in read-ahead
+} XENCONS_STATISTICS, *PXENCONS_STATISTICS;
+
+// Complete a read as soon as data containing CR or LF has been copied
+#define XENCONS_READ_POLICY_LINE    0x00000001
+
+// A read completes when its buffer is full or:
+//  - at least MinimumBytes have been copied (any data at all if
+//    MinimumBytes is zero and XENCONS_READ_POLICY_LINE is clear), or
+//  - XENCONS_READ_POLICY_LINE is set and a line ending was copied, or
+//  - some data has been copied and no more has arrived for
+//    InterByteTimeout milliseconds (zero means no timeout).
+// The default (all zero) policy completes reads as soon as any data
+// is available.
+typedef struct _XENCONS_READ_POLICY {
+    ULONG   MinimumBytes;
+    ULONG   InterByteTimeout;
+    ULONG   Flags;
+} XENCONS_READ_POLICY, *PXENCONS_READ_POLICY;
+
+// Hold each write until all of its data has been passed to the
+// console, rather than completing it with however much would fit.
+#define XENCONS_WRITE_MODE_FULL     0x00000001
+
 #endif  // _XENCONS_DEVICE_H
@@ -0,0 +1,292 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _XENCONS_SHARED_H
+#define _XENCONS_SHARED_H
+
+// Layout of the memory mapped by IOCTL_XENCONS_MAP_SHARED.
+//
+// The mapping starts with an XENCONS_SHARED header page, followed by
+// two byte rings of XENCONS_SHARED::Size bytes each (a power of 2):
+// In carries console input to the application and Out carries the
+// application's output to the console. Each ring has exactly one
+// producer and one consumer.
+//
+// Prod and Cons are free-running byte counts; only the producer moves
+// Prod and only the consumer moves Cons. Data is copied before the
+// index is moved, and the other side's index is read before touching
+// the data it covers.
+//
+// A side that wants to sleep sets its Waiting flag and then re-checks
+// the ring. The other side clears the flag and notifies after it next
+// moves its index:
+//  - the driver notifies the application by signalling the event it
+//    passed to IOCTL_XENCONS_MAP_SHARED for that ring
+//  - the application notifies the driver with IOCTL_XENCONS_KICK_SHARED
+//
+// Nothing here depends on anything but the layout, so any other
+// implementation of either side only has to follow the same rules.
+
+#define XENCONS_SHARED_VERSION      1
+
+typedef struct _XENCONS_SHARED_RING {
+    volatile ULONG  Prod;
+    volatile ULONG  ProdWaiting;    // Producer is waiting for space
+    UCHAR           Pad0[56];
+    volatile ULONG  Cons;
+    volatile ULONG  ConsWaiting;    // Consumer is waiting for data
+    UCHAR           Pad1[56];
+} XENCONS_SHARED_RING, *PXENCONS_SHARED_RING;
+
+typedef struct _XENCONS_SHARED {
+    ULONG               Version;
+    ULONG               Size;       // Bytes of data in each ring
+    ULONG               InOffset;   // Of the In data from the start
+    ULONG               OutOffset;  // Of the Out data from the start
+    UCHAR               Pad[48];
+    XENCONS_SHARED_RING In;
+    XENCONS_SHARED_RING Out;
+} XENCONS_SHARED, *PXENCONS_SHARED;
+
+// Input to IOCTL_XENCONS_MAP_SHARED. InEvent is signalled when there
+// is new data in In and OutEvent when space has been made in Out. The
+// handles are carried in 64-bit fields so that the layout is the same
+// for 32-bit callers.
+typedef struct _XENCONS_SHARED_MAP_IN {
+    ULONGLONG   InEvent;
+    ULONGLONG   OutEvent;
+} XENCONS_SHARED_MAP_IN, *PXENCONS_SHARED_MAP_IN;
+
+// Output from IOCTL_XENCONS_MAP_SHARED
+typedef struct _XENCONS_SHARED_MAP_OUT {
+    ULONGLONG   Address;
+    ULONG       Length;     // Of the whole mapping
+    ULONG       Pad;
+} XENCONS_SHARED_MAP_OUT, *PXENCONS_SHARED_MAP_OUT;
+
+#define __XenconsSharedBarrier()    MemoryBarrier()
+
+// Return the number of bytes that can be written in one go at
+// Data[*Offset], or zero if the ring is full. The indexes are not
+// trusted: if they do not make sense the ring is treated as full.
+static FORCEINLINE ULONG
+XenconsSharedWriteSpace(
+    _In_ PXENCONS_SHARED_RING   Ring,
+    _In_ ULONG                  Size,
+    _Out_ PULONG                Offset
+    )
+{
+    ULONG                       Prod = Ring->Prod;
+    ULONG                       Cons = Ring->Cons;
+    ULONG                       Used;
+
+    __XenconsSharedBarrier();
+
+    Used = Prod - Cons;
+    if (Used >= Size)
+        return 0;
+
+    *Offset = Prod & (Size - 1);
+    return __min(Size - Used, Size - *Offset);
+}
+
+static FORCEINLINE VOID
+XenconsSharedWriteCommit(
+    _In_ PXENCONS_SHARED_RING   Ring,
+    _In_ ULONG                  Length
+    )
+{
+    __XenconsSharedBarrier();
+    Ring->Prod += Length;
+}
+
+// Return the number of bytes that can be read in one go at
+// Data[*Offset], or zero if the ring is empty. As above, indexes
+// that do not make sense make the ring look empty.
+static FORCEINLINE ULONG
+XenconsSharedReadSpace(
+    _In_ PXENCONS_SHARED_RING   Ring,
+    _In_ ULONG                  Size,
+    _Out_ PULONG                Offset
+    )
+{
+    ULONG                       Prod = Ring->Prod;
+    ULONG                       Cons = Ring->Cons;
+    ULONG                       Used;
+
+    __XenconsSharedBarrier();
+
+    Used = Prod - Cons;
+    if (Used == 0 || Used > Size)
+        return 0;
+
+    *Offset = Cons & (Size - 1);
+    return __min(Used, Size - *Offset);
+}
+
+static FORCEINLINE VOID
+XenconsSharedReadCommit(
+    _In_ PXENCONS_SHARED_RING   Ring,
+    _In_ ULONG                  Length
+    )
+{
+    __XenconsSharedBarrier();
+    Ring->Cons += Length;
+}
+
+static FORCEINLINE ULONG
+XenconsSharedWrite(
+    _In_ PXENCONS_SHARED_RING   Ring,
+    _In_ PUCHAR                 Data,
+    _In_ ULONG                  Size,
+    _In_ const UCHAR            *Buffer,
+    _In_ ULONG                  Length
+    )
+{
+    ULONG                       Written;
+
+    Written = 0;
+    while (Length != 0) {
+        ULONG   Offset;
+        ULONG   Space;
+
+        Space = XenconsSharedWriteSpace(Ring, Size, &Offset);
+        if (Space == 0)
+            break;
+
+        Space = __min(Space, Length);
+        memcpy(&Data[Offset], Buffer, Space);
+
+        XenconsSharedWriteCommit(Ring, Space);
+
+        Buffer += Space;
+        Length -= Space;
+        Written += Space;
+    }
+
+    return Written;
+}
+
+static FORCEINLINE ULONG
+XenconsSharedRead(
+    _In_ PXENCONS_SHARED_RING   Ring,
+    _In_ PUCHAR                 Data,
+    _In_ ULONG                  Size,
+    _Out_writes_(Length) PUCHAR Buffer,
+    _In_ ULONG                  Length
+    )
+{
+    ULONG                       Read;
+
+    Read = 0;
+    while (Length != 0) {
+        ULONG   Offset;
+        ULONG   Space;
+
+        Space = XenconsSharedReadSpace(Ring, Size, &Offset);
+        if (Space == 0)
+            break;
+
+        Space = __min(Space, Length);
+        memcpy(Buffer, &Data[Offset], Space);
+
+        XenconsSharedReadCommit(Ring, Space);
+
+        Buffer += Space;
+        Length -= Space;
+        Read += Space;
+    }
+
+    return Read;
+}
+
+// Called by the producer after moving Prod. Returns TRUE if the
+// consumer asked to be notified.
+static FORCEINLINE BOOLEAN
+XenconsSharedProdCheckNotify(
+    _In_ PXENCONS_SHARED_RING   Ring
+    )
+{
+    __XenconsSharedBarrier();
+
+    if (!Ring->ConsWaiting)
+        return FALSE;
+
+    Ring->ConsWaiting = 0;
+    return TRUE;
+}
+
+// Called by the consumer after moving Cons. Returns TRUE if the
+// producer asked to be notified.
+static FORCEINLINE BOOLEAN
+XenconsSharedConsCheckNotify(
+    _In_ PXENCONS_SHARED_RING   Ring
+    )
+{
+    __XenconsSharedBarrier();
+
+    if (!Ring->ProdWaiting)
+        return FALSE;
+
+    Ring->ProdWaiting = 0;
+    return TRUE;
+}
+
+// Called by a consumer that found the ring empty. Returns FALSE if
+// data arrived in the meantime, in which case it must not sleep.
+static FORCEINLINE BOOLEAN
+XenconsSharedConsPrepareWait(
+    _In_ PXENCONS_SHARED_RING   Ring
+    )
+{
+    Ring->ConsWaiting = 1;
+    __XenconsSharedBarrier();
+
+    return (Ring->Prod == Ring->Cons) ? TRUE : FALSE;
+}
+
+// Called by a producer that found the ring full. Returns FALSE if
+// space was made in the meantime, in which case it must not sleep.
+static FORCEINLINE BOOLEAN
+XenconsSharedProdPrepareWait(
+    _In_ PXENCONS_SHARED_RING   Ring,
+    _In_ ULONG                  Size
+    )
+{
+    Ring->ProdWaiting = 1;
+    __XenconsSharedBarrier();
+
+    return (Ring->Prod - Ring->Cons >= Size) ? TRUE : FALSE;
+}
+
+#endif  // _XENCONS_SHARED_H
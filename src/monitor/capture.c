@@ -0,0 +1,430 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+// Streams a console's output to a rotating set of capture files and
+// their indexes (see xencons_capture.h). Output is handed over through a
+// bounded queue and everything that touches the disk happens on the
+// capture's own thread, in capture_writer.c, so a slow disk costs
+// captured output, never console throughput.
+
+#include <windows.h>
+#include <compressapi.h>
+#include <stdlib.h>
+#include <strsafe.h>
+
+#include <xencons_capture.h>
+
+#include "hub.h"
+#include "capture_writer.h"
+#include "capture.h"
+
+#define CAPTURE_QUEUE_SIZE      (1024 * 1024)
+#define CAPTURE_FLUSH_INTERVAL  1000    // Longest a partial block is held (ms)
+#define CAPTURE_MARKS           256
+#define CAPTURE_MARK_INTERVAL   100000  // Finest Time resolution (10ms)
+
+// When the output at Offset in the console stream was put
+typedef struct _CAPTURE_MARK {
+    ULONGLONG   Offset;
+    ULONGLONG   Time;
+} CAPTURE_MARK, *PCAPTURE_MARK;
+
+struct _CAPTURE {
+    CRITICAL_SECTION        Lock;
+    HUB_QUEUE               Queue;              // Protected by Lock
+    ULONGLONG               Input;              // Protected by Lock
+    CAPTURE_MARK            Marks[CAPTURE_MARKS]; // Protected by Lock
+    DWORD                   MarkHead;           // Protected by Lock
+    DWORD                   MarkCount;          // Protected by Lock
+    HANDLE                  Event;
+    HANDLE                  StopEvent;
+    HANDLE                  Thread;
+    COMPRESSOR_HANDLE       Compressor;
+    PCAPTURE_WRITER         Writer;
+    ULONGLONG               Offset;
+    DWORD                   BlockLength;
+    ULONGLONG               BlockTime;          // Never goes backwards
+    ULONGLONG               BlockTick;
+    UCHAR                   Block[CAPTURE_BLOCK_SIZE];
+};
+
+static ULONGLONG
+__CaptureTime(
+    VOID
+    )
+{
+    FILETIME    Time;
+
+    GetSystemTimeAsFileTime(&Time);
+
+    return ((ULONGLONG)Time.dwHighDateTime << 32) | Time.dwLowDateTime;
+}
+
+static VOID
+CaptureWriteBlock(
+    _In_ PCAPTURE   Capture
+    )
+{
+    CaptureWriterWrite(Capture->Writer,
+                       Capture->Block,
+                       Capture->BlockLength,
+                       Capture->Offset,
+                       Capture->BlockTime);
+
+    Capture->Offset += Capture->BlockLength;
+    Capture->BlockLength = 0;
+}
+
+// Called with the lock held. Only the oldest mark at or before Offset
+// is still needed once the writer has got that far.
+static ULONGLONG
+__CaptureMarkTime(
+    _In_ PCAPTURE   Capture,
+    _In_ ULONGLONG  Offset
+    )
+{
+    while (Capture->MarkCount > 1) {
+        DWORD   Next = (Capture->MarkHead + 1) % CAPTURE_MARKS;
+
+        if (Capture->Marks[Next].Offset > Offset)
+            break;
+
+        Capture->MarkHead = Next;
+        --Capture->MarkCount;
+    }
+
+    return (Capture->MarkCount != 0) ?
+           Capture->Marks[Capture->MarkHead].Time :
+           __CaptureTime();
+}
+
+static DWORD WINAPI
+CaptureThread(
+    _In_ LPVOID     Argument
+    )
+{
+    PCAPTURE        Capture = Argument;
+    HANDLE          Handles[2];
+    BOOL            Stopping;
+
+    Handles[0] = Capture->StopEvent;
+    Handles[1] = Capture->Event;
+
+    do {
+        DWORD   Length;
+
+        Stopping = (WaitForMultipleObjects(ARRAYSIZE(Handles),
+                                           Handles,
+                                           FALSE,
+                                           CAPTURE_FLUSH_INTERVAL) == WAIT_OBJECT_0);
+
+        for (;;) {
+            ULONGLONG   Offset;
+            ULONGLONG   Time;
+
+            EnterCriticalSection(&Capture->Lock);
+
+            // The queue only ever drops its oldest bytes, so whatever
+            // is left ends where the console's output does
+            Offset = Capture->Input - Capture->Queue.Count;
+
+            if (Capture->BlockLength != 0 &&
+                Offset != Capture->Offset + Capture->BlockLength) {
+                LeaveCriticalSection(&Capture->Lock);
+
+                // Output was dropped; end the block at the gap
+                CaptureWriteBlock(Capture);
+                continue;
+            }
+
+            Time = (Capture->BlockLength == 0) ?
+                   __CaptureMarkTime(Capture, Offset) :
+                   0;
+
+            Length = HubQueuePop(&Capture->Queue,
+                                 &Capture->Block[Capture->BlockLength],
+                                 CAPTURE_BLOCK_SIZE - Capture->BlockLength);
+            LeaveCriticalSection(&Capture->Lock);
+
+            if (Length == 0)
+                break;
+
+            if (Capture->BlockLength == 0) {
+                Capture->Offset = Offset;
+                Capture->BlockTime = __max(Capture->BlockTime, Time);
+                Capture->BlockTick = GetTickCount64();
+            }
+
+            Capture->BlockLength += Length;
+
+            if (Capture->BlockLength == CAPTURE_BLOCK_SIZE)
+                CaptureWriteBlock(Capture);
+        }
+
+        if (Capture->BlockLength != 0 &&
+            (Stopping ||
+             GetTickCount64() - Capture->BlockTick >= CAPTURE_FLUSH_INTERVAL))
+            CaptureWriteBlock(Capture);
+    } while (!Stopping);
+
+    return 0;
+}
+
+static DWORD
+CaptureCompress(
+    _In_ PVOID                                  Context,
+    _In_reads_bytes_(Length) PUCHAR             Data,
+    _In_ DWORD                                  Length,
+    _Out_writes_bytes_(OutputLength) PUCHAR     Output,
+    _In_ DWORD                                  OutputLength
+    )
+{
+    COMPRESSOR_HANDLE                           Compressor = Context;
+    SIZE_T                                      Compressed;
+
+    if (!Compress(Compressor,
+                  Data,
+                  Length,
+                  Output,
+                  OutputLength,
+                  &Compressed))
+        return 0;
+
+    return (DWORD)Compressed;
+}
+
+PCAPTURE
+CaptureCreate(
+    _In_ PCSTR                  Name,
+    _In_ PCAPTURE_PARAMETERS    Parameters
+    )
+{
+    PCAPTURE                    Capture;
+    CHAR                        Path[MAX_PATH];
+    CAPTURE_CODEC               Codec;
+    HRESULT                     Error;
+
+    Capture = calloc(1, sizeof(CAPTURE));
+    if (Capture == NULL)
+        goto fail1;
+
+    Error = StringCchPrintfA(Path,
+                             MAX_PATH,
+                             "%s\\%s",
+                             Parameters->Directory,
+                             Name);
+    if (Error != S_OK)
+        goto fail2;
+
+    if (!CreateDirectoryA(Parameters->Directory, NULL) &&
+        GetLastError() != ERROR_ALREADY_EXISTS)
+        goto fail3;
+
+    InitializeCriticalSection(&Capture->Lock);
+
+    if (!HubQueueInitialize(&Capture->Queue,
+                            CAPTURE_QUEUE_SIZE,
+                            HUB_OVERFLOW_DROP_OLDEST)) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        goto fail4;
+    }
+
+    if (Parameters->Algorithm != 0 &&
+        !CreateCompressor(Parameters->Algorithm | COMPRESS_RAW,
+                          NULL,
+                          &Capture->Compressor))
+        goto fail5;
+
+    Codec.Algorithm = Parameters->Algorithm;
+    Codec.Compress = CaptureCompress;
+    Codec.Context = Capture->Compressor;
+
+    Capture->Writer = CaptureWriterCreate(Path,
+                                          Name,
+                                          Parameters,
+                                          (Capture->Compressor != NULL) ?
+                                          &Codec :
+                                          NULL);
+    if (Capture->Writer == NULL) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        goto fail6;
+    }
+
+    Capture->Event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (Capture->Event == NULL)
+        goto fail7;
+
+    Capture->StopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (Capture->StopEvent == NULL)
+        goto fail8;
+
+    Capture->Thread = CreateThread(NULL,
+                                   0,
+                                   CaptureThread,
+                                   Capture,
+                                   0,
+                                   NULL);
+    if (Capture->Thread == NULL)
+        goto fail9;
+
+    return Capture;
+
+fail9:
+    CloseHandle(Capture->StopEvent);
+
+fail8:
+    CloseHandle(Capture->Event);
+
+fail7:
+    CaptureWriterDestroy(Capture->Writer);
+
+fail6:
+    if (Capture->Compressor != NULL)
+        CloseCompressor(Capture->Compressor);
+
+fail5:
+    HubQueueTeardown(&Capture->Queue);
+
+fail4:
+    DeleteCriticalSection(&Capture->Lock);
+
+fail3:
+fail2:
+    free(Capture);
+
+fail1:
+    return NULL;
+}
+
+VOID
+CaptureDestroy(
+    _In_ PCAPTURE   Capture
+    )
+{
+    SetEvent(Capture->StopEvent);
+    WaitForSingleObject(Capture->Thread, INFINITE);
+
+    CloseHandle(Capture->Thread);
+    CloseHandle(Capture->StopEvent);
+    CloseHandle(Capture->Event);
+
+    CaptureWriterDestroy(Capture->Writer);
+
+    if (Capture->Compressor != NULL)
+        CloseCompressor(Capture->Compressor);
+
+    HubQueueTeardown(&Capture->Queue);
+    DeleteCriticalSection(&Capture->Lock);
+
+    free(Capture);
+}
+
+// Called with the lock held. Output is stamped when it is put, at
+// most once per CAPTURE_MARK_INTERVAL. If the writer falls so far
+// behind that all the marks are in use, later output shares the time
+// of the newest one.
+static VOID
+__CaptureMark(
+    _In_ PCAPTURE   Capture,
+    _In_ ULONGLONG  Time
+    )
+{
+    PCAPTURE_MARK   Mark;
+
+    if (Capture->MarkCount != 0) {
+        Mark = &Capture->Marks[(Capture->MarkHead + Capture->MarkCount - 1) %
+                               CAPTURE_MARKS];
+
+        if (Time < Mark->Time + CAPTURE_MARK_INTERVAL)
+            return;
+    }
+
+    if (Capture->MarkCount == CAPTURE_MARKS)
+        return;
+
+    Mark = &Capture->Marks[(Capture->MarkHead + Capture->MarkCount) %
+                           CAPTURE_MARKS];
+    Mark->Offset = Capture->Input;
+    Mark->Time = Time;
+
+    Capture->MarkCount++;
+}
+
+VOID
+CapturePut(
+    _In_ PCAPTURE                   Capture,
+    _In_reads_bytes_(Length) PUCHAR Buffer,
+    _In_ DWORD                      Length
+    )
+{
+    ULONGLONG                       Time;
+    DWORD                           Count;
+    BOOL                            Kick;
+
+    Time = __CaptureTime();
+
+    EnterCriticalSection(&Capture->Lock);
+    __CaptureMark(Capture, Time);
+    Capture->Input += Length;
+
+    Count = Capture->Queue.Count;
+    (VOID) HubQueuePush(&Capture->Queue, Buffer, Length);
+    Kick = (Count < CAPTURE_BLOCK_SIZE &&
+            Capture->Queue.Count >= CAPTURE_BLOCK_SIZE);
+    LeaveCriticalSection(&Capture->Lock);
+
+    // Wake the writer once there is a whole block for it; otherwise it
+    // picks the output up within CAPTURE_FLUSH_INTERVAL
+    if (Kick)
+        SetEvent(Capture->Event);
+}
+
+VOID
+CaptureGetStatistics(
+    _In_ PCAPTURE               Capture,
+    _Out_ PCAPTURE_STATISTICS   Statistics
+    )
+{
+    CAPTURE_WRITER_STATISTICS   Writer;
+
+    CaptureWriterGetStatistics(Capture->Writer, &Writer);
+
+    Statistics->BytesWritten = Writer.BytesWritten;
+    Statistics->Blocks = Writer.Blocks;
+    Statistics->Files = Writer.Files;
+    Statistics->Errors = Writer.Errors;
+
+    EnterCriticalSection(&Capture->Lock);
+    Statistics->BytesQueued = Capture->Queue.BytesQueued;
+    Statistics->BytesDropped = Capture->Queue.BytesDropped;
+    LeaveCriticalSection(&Capture->Lock);
+}
@@ -0,0 +1,74 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _MONITOR_CAPTURE_H
+#define _MONITOR_CAPTURE_H
+
+#include "capture_writer.h"
+
+typedef struct _CAPTURE_STATISTICS {
+    ULONGLONG   BytesQueued;
+    ULONGLONG   BytesDropped;   // Because the writer fell behind
+    ULONGLONG   BytesWritten;   // To disk, after compression
+    ULONGLONG   Blocks;
+    DWORD       Files;
+    DWORD       Errors;
+} CAPTURE_STATISTICS, *PCAPTURE_STATISTICS;
+
+typedef struct _CAPTURE  CAPTURE, *PCAPTURE;
+
+extern PCAPTURE
+CaptureCreate(
+    _In_ PCSTR                  Name,
+    _In_ PCAPTURE_PARAMETERS    Parameters
+    );
+
+extern VOID
+CaptureDestroy(
+    _In_ PCAPTURE   Capture
+    );
+
+// Never waits for the disk; output is dropped if the writer can't keep up
+extern VOID
+CapturePut(
+    _In_ PCAPTURE                   Capture,
+    _In_reads_bytes_(Length) PUCHAR Buffer,
+    _In_ DWORD                      Length
+    );
+
+extern VOID
+CaptureGetStatistics(
+    _In_ PCAPTURE               Capture,
+    _Out_ PCAPTURE_STATISTICS   Statistics
+    );
+
+#endif  // _MONITOR_CAPTURE_H
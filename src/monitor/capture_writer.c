@@ -0,0 +1,463 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+// Writes capture blocks and their index entries to disk, compressing
+// each block on its own and rotating the files by size and age. Only
+// the flush and clock helpers differ between Windows and elsewhere.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "monitor_compat.h"
+
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#include <xencons_capture.h>
+
+#include "capture_writer.h"
+
+struct _CAPTURE_WRITER {
+    CAPTURE_PARAMETERS          Parameters;
+    CAPTURE_CODEC               Codec;
+    BOOL                        Compress;
+    CHAR                        Name[64];
+    CHAR                        Path[CAPTURE_MAXIMUM_PATH]; // Less the extension
+    FILE                        *File;
+    ULONGLONG                   FileSize;
+    ULONGLONG                   FileTick;
+    FILE                        *IndexFile;     // Capture goes on without it
+    UCHAR                       Compressed[CAPTURE_BLOCK_SIZE];
+    CAPTURE_WRITER_STATISTICS   Statistics;
+};
+
+static ULONGLONG
+__CaptureWriterTime(
+    VOID
+    )
+{
+#if defined(_WIN32)
+    FILETIME        Time;
+
+    GetSystemTimeAsFileTime(&Time);
+
+    return ((ULONGLONG)Time.dwHighDateTime << 32) | Time.dwLowDateTime;
+#else
+    struct timespec Now;
+
+    (VOID) clock_gettime(CLOCK_REALTIME, &Now);
+
+    // FILETIME counts 100ns intervals from 1601
+    return ((ULONGLONG)Now.tv_sec * 10000000) + (Now.tv_nsec / 100) +
+           116444736000000000ull;
+#endif
+}
+
+// Milliseconds, for file age
+static ULONGLONG
+__CaptureWriterTick(
+    VOID
+    )
+{
+#if defined(_WIN32)
+    return GetTickCount64();
+#else
+    struct timespec Now;
+
+    (VOID) clock_gettime(CLOCK_MONOTONIC, &Now);
+
+    return ((ULONGLONG)Now.tv_sec * 1000) + (Now.tv_nsec / 1000000);
+#endif
+}
+
+// Get what has been written as far as the disk
+static VOID
+__CaptureWriterFlush(
+    _In_ FILE   *File
+    )
+{
+    if (fflush(File) != 0)
+        return;
+
+#if defined(_WIN32)
+    (VOID) _commit(_fileno(File));
+#else
+    (VOID) fsync(fileno(File));
+#endif
+}
+
+// Index 0 is the file being written; 1 is the most recently rotated
+static BOOL
+__CaptureWriterFileName(
+    _In_ PCAPTURE_WRITER        Writer,
+    _In_ DWORD                  Index,
+    _In_ PCSTR                  Extension,
+    _Out_writes_z_(CAPTURE_MAXIMUM_PATH) PSTR FileName
+    )
+{
+    int                         Length;
+
+    if (Index == 0)
+        Length = snprintf(FileName,
+                          CAPTURE_MAXIMUM_PATH,
+                          "%s.%s",
+                          Writer->Path,
+                          Extension);
+    else
+        Length = snprintf(FileName,
+                          CAPTURE_MAXIMUM_PATH,
+                          "%s.%u.%s",
+                          Writer->Path,
+                          (unsigned int)Index,
+                          Extension);
+
+    return (Length > 0 && Length < CAPTURE_MAXIMUM_PATH);
+}
+
+static VOID
+__CaptureWriterShift(
+    _In_ PCAPTURE_WRITER    Writer,
+    _In_ PCSTR              Extension
+    )
+{
+    CHAR                    From[CAPTURE_MAXIMUM_PATH];
+    CHAR                    To[CAPTURE_MAXIMUM_PATH];
+    DWORD                   Index;
+
+    if (Writer->Parameters.Files == 0) {
+        if (__CaptureWriterFileName(Writer, 0, Extension, From))
+            (VOID) remove(From);
+
+        return;
+    }
+
+    for (Index = Writer->Parameters.Files; Index != 0; --Index) {
+        if (!__CaptureWriterFileName(Writer, Index - 1, Extension, From) ||
+            !__CaptureWriterFileName(Writer, Index, Extension, To))
+            continue;
+
+        // rename() will not replace a file on Windows
+        (VOID) remove(To);
+        (VOID) rename(From, To);
+    }
+}
+
+static BOOL
+__CaptureWriterWrite(
+    _In_ FILE                       *File,
+    _In_reads_bytes_(Length) PVOID  Buffer,
+    _In_ DWORD                      Length
+    )
+{
+    return (fwrite(Buffer, 1, Length, File) == Length);
+}
+
+static VOID
+__CaptureWriterCloseFile(
+    _In_ PCAPTURE_WRITER    Writer,
+    _Inout_ FILE            **File
+    )
+{
+    if (*File == NULL)
+        return;
+
+    if (Writer->Parameters.Flush != CAPTURE_FLUSH_NEVER)
+        __CaptureWriterFlush(*File);
+
+    if (fclose(*File) != 0)
+        Writer->Statistics.Errors++;
+
+    *File = NULL;
+}
+
+static VOID
+CaptureWriterClose(
+    _In_ PCAPTURE_WRITER    Writer
+    )
+{
+    __CaptureWriterCloseFile(Writer, &Writer->IndexFile);
+    __CaptureWriterCloseFile(Writer, &Writer->File);
+}
+
+static VOID
+CaptureWriterOpenIndex(
+    _In_ PCAPTURE_WRITER            Writer,
+    _In_ ULONGLONG                  Time
+    )
+{
+    XENCONS_CAPTURE_INDEX_HEADER    Header;
+    CHAR                            FileName[CAPTURE_MAXIMUM_PATH];
+
+    __CaptureWriterShift(Writer, XENCONS_CAPTURE_INDEX_EXTENSION);
+
+    if (!__CaptureWriterFileName(Writer,
+                                 0,
+                                 XENCONS_CAPTURE_INDEX_EXTENSION,
+                                 FileName))
+        goto fail1;
+
+    Writer->IndexFile = fopen(FileName, "wb");
+    if (Writer->IndexFile == NULL)
+        goto fail2;
+
+    ZeroMemory(&Header, sizeof(XENCONS_CAPTURE_INDEX_HEADER));
+    Header.Magic = XENCONS_CAPTURE_INDEX_MAGIC;
+    Header.Version = XENCONS_CAPTURE_INDEX_VERSION;
+    Header.EntrySize = sizeof(XENCONS_CAPTURE_INDEX_ENTRY);
+    Header.Time = Time;
+
+    if (!__CaptureWriterWrite(Writer->IndexFile, &Header, sizeof(Header)))
+        goto fail3;
+
+    return;
+
+fail3:
+    fclose(Writer->IndexFile);
+    Writer->IndexFile = NULL;
+
+fail2:
+fail1:
+    Writer->Statistics.Errors++;
+}
+
+static BOOL
+CaptureWriterOpen(
+    _In_ PCAPTURE_WRITER    Writer,
+    _In_ ULONGLONG          Offset
+    )
+{
+    XENCONS_CAPTURE_HEADER  Header;
+    CHAR                    FileName[CAPTURE_MAXIMUM_PATH];
+
+    __CaptureWriterShift(Writer, XENCONS_CAPTURE_EXTENSION);
+
+    if (!__CaptureWriterFileName(Writer,
+                                 0,
+                                 XENCONS_CAPTURE_EXTENSION,
+                                 FileName))
+        goto fail1;
+
+    Writer->File = fopen(FileName, "wb");
+    if (Writer->File == NULL)
+        goto fail2;
+
+    ZeroMemory(&Header, sizeof(XENCONS_CAPTURE_HEADER));
+    Header.Magic = XENCONS_CAPTURE_MAGIC;
+    Header.Version = XENCONS_CAPTURE_VERSION;
+    Header.Algorithm = (Writer->Compress) ? Writer->Codec.Algorithm : 0;
+    Header.BlockSize = CAPTURE_BLOCK_SIZE;
+    Header.Time = __CaptureWriterTime();
+    Header.Offset = Offset;
+    memcpy(Header.Name, Writer->Name, sizeof(Header.Name));
+
+    if (!__CaptureWriterWrite(Writer->File, &Header, sizeof(Header)))
+        goto fail3;
+
+    Writer->FileSize = sizeof(Header);
+    Writer->FileTick = __CaptureWriterTick();
+    Writer->Statistics.Files++;
+
+    CaptureWriterOpenIndex(Writer, Header.Time);
+
+    return TRUE;
+
+fail3:
+    fclose(Writer->File);
+    Writer->File = NULL;
+
+fail2:
+fail1:
+    return FALSE;
+}
+
+static BOOL
+__CaptureWriterIsFull(
+    _In_ PCAPTURE_WRITER    Writer
+    )
+{
+    ULONGLONG               Age;
+
+    Age = (__CaptureWriterTick() - Writer->FileTick) / 1000;
+
+    return (Writer->FileSize >= Writer->Parameters.MaximumSize ||
+            Age >= Writer->Parameters.MaximumAge);
+}
+
+VOID
+CaptureWriterWrite(
+    _In_ PCAPTURE_WRITER            Writer,
+    _In_reads_bytes_(Length) PUCHAR Data,
+    _In_ DWORD                      Length,
+    _In_ ULONGLONG                  Offset,
+    _In_ ULONGLONG                  Time
+    )
+{
+    XENCONS_CAPTURE_BLOCK           Block;
+    XENCONS_CAPTURE_INDEX_ENTRY     Entry;
+    DWORD                           CompressedLength;
+
+    if (Writer->File != NULL && __CaptureWriterIsFull(Writer))
+        CaptureWriterClose(Writer);
+
+    if (Writer->File == NULL &&
+        !CaptureWriterOpen(Writer, Offset))
+        goto fail1;
+
+    ZeroMemory(&Block, sizeof(XENCONS_CAPTURE_BLOCK));
+    Block.Magic = XENCONS_CAPTURE_BLOCK_MAGIC;
+    Block.Length = Length;
+    Block.Offset = Offset;
+    Block.Time = Time;
+
+    // Anything that doesn't shrink is stored as it is
+    CompressedLength = (Writer->Compress) ?
+                       Writer->Codec.Compress(Writer->Codec.Context,
+                                              Data,
+                                              Length,
+                                              Writer->Compressed,
+                                              sizeof(Writer->Compressed)) :
+                       0;
+
+    if (CompressedLength != 0 && CompressedLength < Length) {
+        Data = Writer->Compressed;
+    } else {
+        Block.Flags |= XENCONS_CAPTURE_BLOCK_STORED;
+        CompressedLength = Length;
+    }
+
+    Block.CompressedLength = CompressedLength;
+
+    if (!__CaptureWriterWrite(Writer->File, &Block, sizeof(Block)) ||
+        !__CaptureWriterWrite(Writer->File, Data, CompressedLength))
+        goto fail2;
+
+    if (Writer->Parameters.Flush == CAPTURE_FLUSH_BLOCK)
+        __CaptureWriterFlush(Writer->File);
+    else if (Writer->IndexFile != NULL && fflush(Writer->File) != 0)
+        goto fail3;
+
+    // The block is out of the stdio buffer before its index entry, so
+    // an index never points past the end of its capture
+    if (Writer->IndexFile != NULL) {
+        Entry.Time = Block.Time;
+        Entry.Offset = Block.Offset;
+        Entry.Position = Writer->FileSize;
+
+        if (!__CaptureWriterWrite(Writer->IndexFile, &Entry, sizeof(Entry))) {
+            // Leave the entries that made it; readers walk on from there
+            fclose(Writer->IndexFile);
+            Writer->IndexFile = NULL;
+
+            Writer->Statistics.Errors++;
+        } else if (Writer->Parameters.Flush == CAPTURE_FLUSH_BLOCK) {
+            __CaptureWriterFlush(Writer->IndexFile);
+        }
+    }
+
+    Writer->FileSize += sizeof(Block) + CompressedLength;
+    Writer->Statistics.BytesWritten += sizeof(Block) + CompressedLength;
+    Writer->Statistics.Blocks++;
+
+    return;
+
+fail3:
+fail2:
+    // Start a new file rather than leave a torn block in the middle
+    // of this one
+    CaptureWriterClose(Writer);
+
+fail1:
+    Writer->Statistics.Errors++;
+}
+
+PCAPTURE_WRITER
+CaptureWriterCreate(
+    _In_ PCSTR                  Path,
+    _In_ PCSTR                  Name,
+    _In_ PCAPTURE_PARAMETERS    Parameters,
+    _In_opt_ PCAPTURE_CODEC     Codec
+    )
+{
+    PCAPTURE_WRITER             Writer;
+
+    Writer = calloc(1, sizeof(CAPTURE_WRITER));
+    if (Writer == NULL)
+        goto fail1;
+
+    if (strlen(Path) >= sizeof(Writer->Path))
+        goto fail2;
+
+    if (strlen(Name) >= sizeof(Writer->Name))
+        goto fail3;
+
+    strcpy(Writer->Path, Path);
+    strcpy(Writer->Name, Name);
+
+    Writer->Parameters = *Parameters;
+
+    if (Codec != NULL) {
+        Writer->Codec = *Codec;
+        Writer->Compress = TRUE;
+    }
+
+    return Writer;
+
+fail3:
+fail2:
+    free(Writer);
+
+fail1:
+    return NULL;
+}
+
+VOID
+CaptureWriterDestroy(
+    _In_ PCAPTURE_WRITER    Writer
+    )
+{
+    CaptureWriterClose(Writer);
+    free(Writer);
+}
+
+VOID
+CaptureWriterGetStatistics(
+    _In_ PCAPTURE_WRITER                Writer,
+    _Out_ PCAPTURE_WRITER_STATISTICS    Statistics
+    )
+{
+    *Statistics = Writer->Statistics;
+}
@@ -0,0 +1,119 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _MONITOR_CAPTURE_WRITER_H
+#define _MONITOR_CAPTURE_WRITER_H
+
+#include "monitor_compat.h"
+
+#define CAPTURE_MAXIMUM_PATH    260
+#define CAPTURE_BLOCK_SIZE      (64 * 1024)
+
+typedef enum _CAPTURE_FLUSH_POLICY {
+    CAPTURE_FLUSH_NEVER = 0,    // Leave it to the cache manager
+    CAPTURE_FLUSH_BLOCK,        // After every block
+    CAPTURE_FLUSH_ROTATE,       // Once a file is finished with
+    CAPTURE_FLUSH_POLICY_COUNT
+} CAPTURE_FLUSH_POLICY, *PCAPTURE_FLUSH_POLICY;
+
+typedef struct _CAPTURE_PARAMETERS {
+    CHAR                    Directory[CAPTURE_MAXIMUM_PATH];
+    ULONGLONG               MaximumSize;    // Bytes per file
+    DWORD                   MaximumAge;     // Seconds per file
+    DWORD                   Files;          // Rotated files to keep
+    DWORD                   Algorithm;      // COMPRESS_ALGORITHM_*, 0 for none
+    CAPTURE_FLUSH_POLICY    Flush;
+} CAPTURE_PARAMETERS, *PCAPTURE_PARAMETERS;
+
+// Compress Length bytes of Data into Output. Returns the compressed
+// length, or 0 if it does not fit in OutputLength. Each block must
+// decompress on its own.
+typedef DWORD
+(*CAPTURE_COMPRESS)(
+    _In_ PVOID                                  Context,
+    _In_reads_bytes_(Length) PUCHAR             Data,
+    _In_ DWORD                                  Length,
+    _Out_writes_bytes_(OutputLength) PUCHAR     Output,
+    _In_ DWORD                                  OutputLength
+    );
+
+typedef struct _CAPTURE_CODEC {
+    DWORD               Algorithm;  // For XENCONS_CAPTURE_HEADER
+    CAPTURE_COMPRESS    Compress;
+    PVOID               Context;
+} CAPTURE_CODEC, *PCAPTURE_CODEC;
+
+typedef struct _CAPTURE_WRITER_STATISTICS {
+    ULONGLONG   BytesWritten;   // To disk, after compression
+    ULONGLONG   Blocks;
+    DWORD       Files;
+    DWORD       Errors;
+} CAPTURE_WRITER_STATISTICS, *PCAPTURE_WRITER_STATISTICS;
+
+// The disk half of a capture: blocks go into <Path>.xcap and their
+// index entries into <Path>.xidx, which are rotated by size and age.
+// It does no locking of its own and uses only standard C and the C
+// runtime, so src/test/capture_test.c can run it elsewhere.
+typedef struct _CAPTURE_WRITER  CAPTURE_WRITER, *PCAPTURE_WRITER;
+
+extern PCAPTURE_WRITER
+CaptureWriterCreate(
+    _In_ PCSTR                  Path,
+    _In_ PCSTR                  Name,
+    _In_ PCAPTURE_PARAMETERS    Parameters,
+    _In_opt_ PCAPTURE_CODEC     Codec
+    );
+
+extern VOID
+CaptureWriterDestroy(
+    _In_ PCAPTURE_WRITER    Writer
+    );
+
+// Write one block of at most CAPTURE_BLOCK_SIZE bytes, which
+// started at Offset in the console stream and was put at Time (UTC, as
+// a FILETIME). A block that cannot be written is counted and lost.
+extern VOID
+CaptureWriterWrite(
+    _In_ PCAPTURE_WRITER            Writer,
+    _In_reads_bytes_(Length) PUCHAR Data,
+    _In_ DWORD                      Length,
+    _In_ ULONGLONG                  Offset,
+    _In_ ULONGLONG                  Time
+    );
+
+extern VOID
+CaptureWriterGetStatistics(
+    _In_ PCAPTURE_WRITER                Writer,
+    _Out_ PCAPTURE_WRITER_STATISTICS    Statistics
+    );
+
+#endif  // _MONITOR_CAPTURE_WRITER_H
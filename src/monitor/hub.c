@@ -0,0 +1,184 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+// Per-client output queues for fanning console output out to pipe
+// clients. Nothing here touches a handle, so a client that stops
+// reading can only ever fill its own queue. Only standard C is used,
+// so src/test/hub_test.c can run it elsewhere.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "hub.h"
+
+BOOL
+HubQueueInitialize(
+    _Out_ PHUB_QUEUE            Queue,
+    _In_ DWORD                  Size,
+    _In_ HUB_OVERFLOW_POLICY    Policy
+    )
+{
+    ZeroMemory(Queue, sizeof(HUB_QUEUE));
+
+    if (Size == 0 || Policy >= HUB_OVERFLOW_POLICY_COUNT)
+        goto fail1;
+
+    Queue->Buffer = malloc(Size);
+    if (Queue->Buffer == NULL)
+        goto fail2;
+
+    Queue->Size = Size;
+    Queue->Policy = Policy;
+
+    return TRUE;
+
+fail2:
+fail1:
+    return FALSE;
+}
+
+VOID
+HubQueueTeardown(
+    _In_ PHUB_QUEUE Queue
+    )
+{
+    free(Queue->Buffer);
+    ZeroMemory(Queue, sizeof(HUB_QUEUE));
+}
+
+static VOID
+__HubQueueCopyIn(
+    _In_ PHUB_QUEUE                 Queue,
+    _In_reads_bytes_(Length) PUCHAR Data,
+    _In_ DWORD                      Length
+    )
+{
+    DWORD                           Tail;
+    DWORD                           Chunk;
+
+    Tail = (Queue->Head + Queue->Count) % Queue->Size;
+
+    Chunk = Queue->Size - Tail;
+    if (Chunk > Length)
+        Chunk = Length;
+
+    memcpy(&Queue->Buffer[Tail], Data, Chunk);
+    memcpy(Queue->Buffer, Data + Chunk, Length - Chunk);
+
+    Queue->Count += Length;
+}
+
+static VOID
+__HubQueueDrop(
+    _In_ PHUB_QUEUE Queue,
+    _In_ DWORD      Length
+    )
+{
+    Queue->Head = (Queue->Head + Length) % Queue->Size;
+    Queue->Count -= Length;
+
+    Queue->BytesDropped += Length;
+}
+
+BOOL
+HubQueuePush(
+    _In_ PHUB_QUEUE                 Queue,
+    _In_reads_bytes_(Length) PUCHAR Data,
+    _In_ DWORD                      Length
+    )
+{
+    DWORD                           Space;
+
+    if (Queue->Overflowed)
+        return FALSE;
+
+    Space = Queue->Size - Queue->Count;
+
+    if (Length > Space) {
+        switch (Queue->Policy) {
+        case HUB_OVERFLOW_DROP_OLDEST:
+            // Only the newest Size bytes can ever be kept
+            if (Length > Queue->Size) {
+                Queue->BytesDropped += Length - Queue->Size;
+                Data += Length - Queue->Size;
+                Length = Queue->Size;
+            }
+
+            __HubQueueDrop(Queue, Length - Space);
+            break;
+
+        case HUB_OVERFLOW_DROP_NEWEST:
+            Queue->BytesDropped += Length - Space;
+            Length = Space;
+            break;
+
+        case HUB_OVERFLOW_DISCONNECT:
+        default:
+            Queue->BytesDropped += Length;
+            Queue->Overflowed = TRUE;
+            return FALSE;
+        }
+    }
+
+    __HubQueueCopyIn(Queue, Data, Length);
+
+    Queue->BytesQueued += Length;
+    if (Queue->Count > Queue->HighWater)
+        Queue->HighWater = Queue->Count;
+
+    return TRUE;
+}
+
+DWORD
+HubQueuePop(
+    _In_ PHUB_QUEUE                     Queue,
+    _Out_writes_bytes_(Length) PUCHAR   Data,
+    _In_ DWORD                          Length
+    )
+{
+    DWORD                               Chunk;
+
+    if (Length > Queue->Count)
+        Length = Queue->Count;
+
+    Chunk = Queue->Size - Queue->Head;
+    if (Chunk > Length)
+        Chunk = Length;
+
+    memcpy(Data, &Queue->Buffer[Queue->Head], Chunk);
+    memcpy(Data + Chunk, Queue->Buffer, Length - Chunk);
+
+    Queue->Head = (Queue->Head + Length) % Queue->Size;
+    Queue->Count -= Length;
+
+    return Length;
+}
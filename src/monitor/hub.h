@@ -0,0 +1,90 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _MONITOR_HUB_H
+#define _MONITOR_HUB_H
+
+#include "monitor_compat.h"
+
+// What to do when console output arrives for a client whose queue
+// is full.
+typedef enum _HUB_OVERFLOW_POLICY {
+    HUB_OVERFLOW_DROP_OLDEST = 0,   // Discard the oldest queued output
+    HUB_OVERFLOW_DROP_NEWEST,       // Discard the output that won't fit
+    HUB_OVERFLOW_DISCONNECT,        // Give up on the client
+    HUB_OVERFLOW_POLICY_COUNT
+} HUB_OVERFLOW_POLICY, *PHUB_OVERFLOW_POLICY;
+
+// A bounded byte queue between the thread draining the console and
+// the thread writing to one client. The queue does no locking of its
+// own and makes no system calls.
+typedef struct _HUB_QUEUE {
+    PUCHAR              Buffer;
+    DWORD               Size;
+    DWORD               Head;       // Offset of the oldest byte
+    DWORD               Count;      // Bytes queued
+    HUB_OVERFLOW_POLICY Policy;
+    BOOL                Overflowed; // Set once a DISCONNECT queue fills
+    DWORD               HighWater;  // Most bytes ever queued
+    ULONGLONG           BytesQueued;
+    ULONGLONG           BytesDropped;
+} HUB_QUEUE, *PHUB_QUEUE;
+
+extern BOOL
+HubQueueInitialize(
+    _Out_ PHUB_QUEUE            Queue,
+    _In_ DWORD                  Size,
+    _In_ HUB_OVERFLOW_POLICY    Policy
+    );
+
+extern VOID
+HubQueueTeardown(
+    _In_ PHUB_QUEUE Queue
+    );
+
+// Returns FALSE if the client should be disconnected
+extern BOOL
+HubQueuePush(
+    _In_ PHUB_QUEUE                 Queue,
+    _In_reads_bytes_(Length) PUCHAR Data,
+    _In_ DWORD                      Length
+    );
+
+// Copies up to Length of the oldest queued bytes out of the queue
+extern DWORD
+HubQueuePop(
+    _In_ PHUB_QUEUE                     Queue,
+    _Out_writes_bytes_(Length) PUCHAR   Data,
+    _In_ DWORD                          Length
+    );
+
+#endif  // _MONITOR_HUB_H
@@ -35,19 +35,26 @@
 #include <windows.h>
 #include <winioctl.h>
 #include <stdlib.h>
+#include <stdio.h>
 #include <strsafe.h>
 #include <wtsapi32.h>
 #include <cfgmgr32.h>
 #include <dbt.h>
 #include <setupapi.h>
 #include <sddl.h>
+#include <compressapi.h>
 #include <malloc.h>
 #include <assert.h>
 
 #include <xencons_device.h>
+#include <xencons_shared.h>
 #include <version.h>
 
 #include "messages.h"
+#include "hub.h"
+#include "reactor.h"
+#include "capture.h"
+#include "query.h"
 
 #define stringify_literal(_text) #_text
 #define stringify(_text) stringify_literal(_text)
@@ -56,6 +63,23 @@
 #define MONITOR_NAME        __MODULE__
 #define MONITOR_DISPLAYNAME MONITOR_NAME
 
+// sc control <service> 128 logs the monitor's statistics
+#define MONITOR_CONTROL_STATISTICS  128
+
+#define MAXIMUM_BUFFER_SIZE 1024
+
+#define OUTPUT_QUEUE_SIZE   (64 * 1024)
+
+#define REACTOR_THREADS     2
+
+#define DEVICE_READ_COUNT   4
+#define DEVICE_READ_SIZE    (16 * 1024)
+#define MAXIMUM_READ_COUNT  64
+
+#define CAPTURE_MAXIMUM_SIZE    64          // MB
+#define CAPTURE_MAXIMUM_AGE     (24 * 60 * 60)
+#define CAPTURE_FILES           8
+
 typedef struct _MONITOR_CONTEXT {
     SERVICE_STATUS          Status;
     SERVICE_STATUS_HANDLE   Service;
@@ -63,11 +87,27 @@ typedef struct _MONITOR_CONTEXT {
     HANDLE                  StopEvent;
     HKEY                    ParametersKey;
     HDEVNOTIFY              InterfaceNotification;
+    SRWLOCK                 ControlLock;
+    BOOL                    Stopping;   // Protected by ControlLock
     CRITICAL_SECTION        CriticalSection;
     LIST_ENTRY              ListHead;
     DWORD                   ListCount;
+    DWORD                   OutputQueueSize;
+    HUB_OVERFLOW_POLICY     OutputOverflowPolicy;
+    DWORD                   DeviceReadCount;
+    DWORD                   DeviceReadSize;
+    CAPTURE_PARAMETERS      CaptureParameters;
 } MONITOR_CONTEXT, *PMONITOR_CONTEXT;
 
+typedef struct _MONITOR_READ {
+    REACTOR_IO              Io;
+    ULONG                   Sequence;
+    BOOL                    Completed;
+    DWORD                   Error;
+    DWORD                   Length;
+    PUCHAR                  Buffer;
+} MONITOR_READ, *PMONITOR_READ;
+
 typedef struct _MONITOR_CONSOLE {
     LIST_ENTRY              ListEntry;
     PWCHAR                  DevicePath;
@@ -78,18 +118,52 @@ typedef struct _MONITOR_CONSOLE {
     HANDLE                  ExecutableEvent;
     HANDLE                  DeviceThread;
     HANDLE                  DeviceEvent;
-    HANDLE                  ServerThread;
+    HANDLE                  InputThread;
+    HANDLE                  InputEvent;
+    LIST_ENTRY              InputList;  // Protected by CriticalSection
+    HANDLE                  ReadHandle;
+    PMONITOR_READ           Reads;
+    DWORD                   ReadCount;
+    DWORD                   ReadSize;
+    PUCHAR                  ReadPool;
+    ULONG                   ReadSequence;       // Next to issue
+    ULONG                   DeliverSequence;    // Next to broadcast
+    BOOL                    ReadFailed;
+    ULONGLONG               BytesRead;
+    ULONGLONG               StartTime;
+    PCAPTURE                Capture;
     HANDLE                  ServerEvent;
+    CHAR                    PipeName[MAXIMUM_BUFFER_SIZE];
+    PSECURITY_DESCRIPTOR    PipeSecurity;
+    HANDLE                  AcceptPipe;
+    REACTOR_IO              AcceptIo;
+    BOOL                    Stopping;
+    LONG                    References;
+    HANDLE                  IdleEvent;
     CRITICAL_SECTION        CriticalSection;
     LIST_ENTRY              ListHead;
     DWORD                   ListCount;
+    PXENCONS_SHARED         Shared;
+    HANDLE                  SharedInEvent;
+    HANDLE                  SharedOutEvent;
+    CRITICAL_SECTION        SharedLock; // Serializes producers of Out
 } MONITOR_CONSOLE, *PMONITOR_CONSOLE;
 
 typedef struct _MONITOR_CONNECTION {
     PMONITOR_CONSOLE        Console;
     LIST_ENTRY              ListEntry;
     HANDLE                  Pipe;
-    HANDLE                  Thread;
+    LONG                    References;
+    BOOL                    Closing;    // Protected by Console->CriticalSection
+    BOOL                    Writing;    // Protected by Console->CriticalSection
+    HUB_QUEUE               Queue;      // Protected by Console->CriticalSection
+    ULONGLONG               BytesWritten;
+    LIST_ENTRY              InputEntry; // Protected by Console->CriticalSection
+    DWORD                   InputLength;
+    REACTOR_IO              ReadIo;
+    REACTOR_IO              WriteIo;
+    UCHAR                   ReadBuffer[MAXIMUM_BUFFER_SIZE];
+    UCHAR                   WriteBuffer[MAXIMUM_BUFFER_SIZE];
 } MONITOR_CONNECTION, *PMONITOR_CONNECTION;
 
 static MONITOR_CONTEXT MonitorContext;
@@ -98,8 +172,6 @@ static MONITOR_CONTEXT MonitorContext;
 // FILE_GENERIC_ALL for SYSTEM and Builtin\Administrators, nothing for the rest
 #define PIPE_SDDL "D:(A;;FA;;;SY)(A;;FA;;;BA)"
 
-#define MAXIMUM_BUFFER_SIZE 1024
-
 #define SERVICES_KEY "SYSTEM\\CurrentControlSet\\Services"
 
 #define SERVICE_KEY(_Service) \
@@ -334,357 +406,936 @@ PutString(
 #define ECHO(_Handle, _Buffer) \
     PutString((_Handle), (PUCHAR)_Buffer, (DWORD)strlen((_Buffer)) * sizeof(CHAR))
 
-DWORD WINAPI
-ConnectionThread(
-    _In_ LPVOID         Argument
+static VOID
+SharedKick(
+    _In_ PMONITOR_CONSOLE   Console
     )
 {
-    PMONITOR_CONNECTION Connection = (PMONITOR_CONNECTION)Argument;
-    PMONITOR_CONSOLE    Console = Connection->Console;
-    UCHAR               Buffer[MAXIMUM_BUFFER_SIZE];
-    OVERLAPPED          Overlapped;
-    HANDLE              Handle[2];
-    DWORD               Length;
-    DWORD               Object;
-    HRESULT             Error;
+    DWORD                   Bytes;
 
-    Log("====> %s", Console->DeviceName);
+    (VOID) DeviceIoControl(Console->DeviceHandle,
+                           IOCTL_XENCONS_KICK_SHARED,
+                           NULL,
+                           0,
+                           NULL,
+                           0,
+                           &Bytes,
+                           NULL);
+}
 
-    ZeroMemory(&Overlapped, sizeof(OVERLAPPED));
-    Overlapped.hEvent = CreateEvent(NULL,
-                                    TRUE,
-                                    FALSE,
-                                    NULL);
-    if (Overlapped.hEvent == NULL)
-        goto fail1;
+// Queue output for the console in the mapped Out ring, waiting for
+// space if need be. The driver only has to be kicked if it has gone
+// idle, so a busy console costs no system calls at all.
+static VOID
+SharedPutString(
+    _In_ PMONITOR_CONSOLE   Console,
+    _In_ PUCHAR             Buffer,
+    _In_ DWORD              Length
+    )
+{
+    PXENCONS_SHARED         Shared = Console->Shared;
+    PUCHAR                  Data = (PUCHAR)Shared + Shared->OutOffset;
+    HANDLE                  Handles[2];
 
-    Handle[0] = Console->ServerEvent;
-    Handle[1] = Overlapped.hEvent;
+    Handles[0] = Console->ServerEvent;
+    Handles[1] = Console->SharedOutEvent;
 
-    EnterCriticalSection(&Console->CriticalSection);
-    __InsertTailList(&Console->ListHead, &Connection->ListEntry);
-    ++Console->ListCount;
-    LeaveCriticalSection(&Console->CriticalSection);
+    EnterCriticalSection(&Console->SharedLock);
 
     for (;;) {
-        (VOID) ReadFile(Connection->Pipe,
-                        Buffer,
-                        sizeof(Buffer),
-                        NULL,
-                        &Overlapped);
+        ULONG   Written;
 
-        Object = WaitForMultipleObjects(ARRAYSIZE(Handle),
-                                        Handle,
-                                        FALSE,
-                                        INFINITE);
-        if (Object == WAIT_OBJECT_0)
-            break;
-
-        if (!GetOverlappedResult(Connection->Pipe,
-                                 &Overlapped,
-                                 &Length,
-                                 FALSE))
-            break;
-
-        ResetEvent(Overlapped.hEvent);
-
-        PutString(Console->DeviceHandle,
-                  Buffer,
-                  Length);
-    }
-
-    EnterCriticalSection(&Console->CriticalSection);
-    __RemoveEntryList(&Connection->ListEntry);
-    --Console->ListCount;
-    LeaveCriticalSection(&Console->CriticalSection);
-
-    CloseHandle(Overlapped.hEvent);
+        Written = XenconsSharedWrite(&Shared->Out,
+                                     Data,
+                                     Shared->Size,
+                                     Buffer,
+                                     Length);
 
-    FlushFileBuffers(Connection->Pipe);
-    DisconnectNamedPipe(Connection->Pipe);
-    CloseHandle(Connection->Pipe);
-    CloseHandle(Connection->Thread);
-    free(Connection);
+        if (Written != 0 && XenconsSharedProdCheckNotify(&Shared->Out))
+            SharedKick(Console);
 
-    Log("<==== %s", Console->DeviceName);
+        Buffer += Written;
+        Length -= Written;
 
-    return 0;
+        if (Length == 0)
+            break;
 
-fail1:
-    Error = GetLastError();
+        if (!XenconsSharedProdPrepareWait(&Shared->Out, Shared->Size))
+            continue;
 
-    {
-        PTCHAR  Message;
-        Message = GetErrorMessage(Error);
-        Log("fail1 (%s)", Message);
-        LocalFree(Message);
+        if (WaitForMultipleObjects(ARRAYSIZE(Handles),
+                                   Handles,
+                                   FALSE,
+                                   INFINITE) != WAIT_OBJECT_0 + 1)
+            break;
     }
 
-    return 1;
+    LeaveCriticalSection(&Console->SharedLock);
 }
 
-DWORD WINAPI
-ServerThread(
-    _In_ LPVOID         Argument
+static BOOL
+SharedMap(
+    _In_ PMONITOR_CONSOLE   Console
     )
 {
-    PMONITOR_CONSOLE    Console = (PMONITOR_CONSOLE)Argument;
-    CHAR                PipeName[MAXIMUM_BUFFER_SIZE];
-    OVERLAPPED          Overlapped;
-    HANDLE              Handle[2];
-    HANDLE              Pipe;
-    DWORD               Object;
-    PMONITOR_CONNECTION Connection;
-    HRESULT             Error;
-    SECURITY_ATTRIBUTES SecurityAttributes;
-
-    Log("====> %s", Console->DeviceName);
+    XENCONS_SHARED_MAP_IN   In;
+    XENCONS_SHARED_MAP_OUT  Out;
+    DWORD                   Bytes;
+    BOOL                    Success;
 
-    ZeroMemory(&Overlapped, sizeof(OVERLAPPED));
-    Overlapped.hEvent = CreateEvent(NULL,
-                                    TRUE,
-                                    FALSE,
-                                    NULL);
-    if (Overlapped.hEvent == NULL)
+    Console->SharedInEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (Console->SharedInEvent == NULL)
         goto fail1;
 
-    Handle[0] = Console->ServerEvent;
-    Handle[1] = Overlapped.hEvent;
-
-    Error = StringCchPrintfA(PipeName,
-                             MAXIMUM_BUFFER_SIZE,
-                             "%s%s",
-                             PIPE_BASE_NAME,
-                             Console->DeviceName);
-    if (Error != S_OK && Error != STRSAFE_E_INSUFFICIENT_BUFFER)
+    Console->SharedOutEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (Console->SharedOutEvent == NULL)
         goto fail2;
 
-    Log("%s", PipeName);
+    In.InEvent = (ULONGLONG)(ULONG_PTR)Console->SharedInEvent;
+    In.OutEvent = (ULONGLONG)(ULONG_PTR)Console->SharedOutEvent;
 
-    ZeroMemory(&SecurityAttributes, sizeof(SECURITY_ATTRIBUTES));
-    SecurityAttributes.nLength = sizeof(SECURITY_ATTRIBUTES);
-    SecurityAttributes.bInheritHandle = FALSE;
-    if (!ConvertStringSecurityDescriptorToSecurityDescriptorA(PIPE_SDDL,
-                                                              SDDL_REVISION_1,
-                                                              &SecurityAttributes.lpSecurityDescriptor,
-                                                              NULL))
+    Success = DeviceIoControl(Console->DeviceHandle,
+                              IOCTL_XENCONS_MAP_SHARED,
+                              &In,
+                              sizeof(In),
+                              &Out,
+                              sizeof(Out),
+                              &Bytes,
+                              NULL);
+    if (!Success || Bytes < sizeof(Out))
         goto fail3;
 
-    for (;;) {
-        Pipe = CreateNamedPipe(PipeName,
-                               PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED,
-                               PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_REJECT_REMOTE_CLIENTS,
-                               PIPE_UNLIMITED_INSTANCES,
-                               MAXIMUM_BUFFER_SIZE,
-                               MAXIMUM_BUFFER_SIZE,
-                               0,
-                               &SecurityAttributes);
-        if (Pipe == INVALID_HANDLE_VALUE)
-            goto fail4;
+    Console->Shared = (PXENCONS_SHARED)(ULONG_PTR)Out.Address;
 
-        (VOID) ConnectNamedPipe(Pipe,
-                                &Overlapped);
+    if (Console->Shared->Version != XENCONS_SHARED_VERSION)
+        goto fail4;
 
-        Object = WaitForMultipleObjects(ARRAYSIZE(Handle),
-                                        Handle,
-                                        FALSE,
-                                        INFINITE);
-        if (Object == WAIT_OBJECT_0) {
-            CloseHandle(Pipe);
-            break;
-        }
+    Log("%s: %u bytes", Console->DeviceName, Out.Length);
 
-        ResetEvent(Overlapped.hEvent);
+    return TRUE;
 
-        Connection = (PMONITOR_CONNECTION)malloc(sizeof(MONITOR_CONNECTION));
-        if (Connection == NULL)
-            goto fail5;
+fail4:
+    Log("fail4");
 
-        __InitializeListHead(&Connection->ListEntry);
-        Connection->Console = Console;
-        Connection->Pipe = Pipe;
-        Connection->Thread = CreateThread(NULL,
-                                          0,
-                                          ConnectionThread,
-                                          Connection,
-                                          0,
-                                          NULL);
-        if (Connection->Thread == NULL)
-            goto fail6;
-    }
+    // The driver lets go of the rings when the handle is closed
+    (VOID) UnmapViewOfFile(Console->Shared);
+    Console->Shared = NULL;
 
-    LocalFree(&SecurityAttributes.lpSecurityDescriptor);
+fail3:
+    Log("fail3");
 
-    CloseHandle(Overlapped.hEvent);
+    CloseHandle(Console->SharedOutEvent);
+    Console->SharedOutEvent = NULL;
 
-    Log("<==== %s", Console->DeviceName);
+fail2:
+    Log("fail2");
 
-    return 0;
+    CloseHandle(Console->SharedInEvent);
+    Console->SharedInEvent = NULL;
 
-fail6:
-    Log("fail6");
+fail1:
+    Log("fail1");
 
-    free(Connection);
+    return FALSE;
+}
 
-fail5:
-    Log("fail5");
+static VOID
+SharedUnmap(
+    _In_ PMONITOR_CONSOLE   Console
+    )
+{
+    if (Console->Shared == NULL)
+        return;
 
-    CloseHandle(Pipe);
+    // The driver let go of the rings when the device handle was
+    // closed, but our view of them is ours to release
+    (VOID) UnmapViewOfFile(Console->Shared);
+    Console->Shared = NULL;
 
-fail4:
-    Log("fail4");
+    CloseHandle(Console->SharedOutEvent);
+    Console->SharedOutEvent = NULL;
 
-    LocalFree(&SecurityAttributes.lpSecurityDescriptor);
+    CloseHandle(Console->SharedInEvent);
+    Console->SharedInEvent = NULL;
+}
 
-fail3:
-    Log("fail3");
+static VOID
+ConsoleAddReference(
+    _In_ PMONITOR_CONSOLE   Console
+    )
+{
+    InterlockedIncrement(&Console->References);
+}
 
-fail2:
-    Log("fail2");
+static VOID
+ConsoleReleaseReference(
+    _In_ PMONITOR_CONSOLE   Console
+    )
+{
+    if (InterlockedDecrement(&Console->References) == 0)
+        SetEvent(Console->IdleEvent);
+}
 
-    CloseHandle(Overlapped.hEvent);
+static VOID
+ConnectionReadComplete(
+    _In_ PREACTOR_IO    Io,
+    _In_ DWORD          Error,
+    _In_ DWORD          Length
+    );
 
-fail1:
-    Error = GetLastError();
+static VOID
+ConnectionWriteComplete(
+    _In_ PREACTOR_IO    Io,
+    _In_ DWORD          Error,
+    _In_ DWORD          Length
+    );
 
-    {
-        PTCHAR  Message;
-        Message = GetErrorMessage(Error);
-        Log("fail1 (%s)", Message);
-        LocalFree(Message);
-    }
+static VOID
+ConnectionDestroy(
+    _In_ PMONITOR_CONNECTION    Connection
+    )
+{
+    PMONITOR_CONSOLE            Console = Connection->Console;
 
-    return 1;
+    Log("%s: SENT %llu QUEUED %llu DROPPED %llu LAG %u HIGH WATER %u",
+        Console->DeviceName,
+        Connection->BytesWritten,
+        Connection->Queue.BytesQueued,
+        Connection->Queue.BytesDropped,
+        Connection->Queue.Count,
+        Connection->Queue.HighWater);
+
+    HubQueueTeardown(&Connection->Queue);
+
+    DisconnectNamedPipe(Connection->Pipe);
+    CloseHandle(Connection->Pipe);
+    free(Connection);
+
+    Log("<==== %s", Console->DeviceName);
+
+    ConsoleReleaseReference(Console);
 }
 
-DWORD WINAPI
-DeviceThread(
-    _In_ LPVOID         Argument
+static VOID
+ConnectionReleaseReference(
+    _In_ PMONITOR_CONNECTION    Connection
     )
 {
-    PMONITOR_CONSOLE    Console = (PMONITOR_CONSOLE)Argument;
-    OVERLAPPED          Overlapped;
-    HANDLE              Device;
-    UCHAR               Buffer[MAXIMUM_BUFFER_SIZE];
-    DWORD               Length;
-    DWORD               Wait;
-    HANDLE              Handles[2];
-    DWORD               Error;
+    if (InterlockedDecrement(&Connection->References) == 0)
+        ConnectionDestroy(Connection);
+}
 
-    Log("====> %s", Console->DeviceName);
+// Called with Console->CriticalSection held. The connection goes once
+// the I/O cancelled here has completed.
+static VOID
+ConnectionClose(
+    _In_ PMONITOR_CONNECTION    Connection
+    )
+{
+    PMONITOR_CONSOLE            Console = Connection->Console;
 
-    ZeroMemory(&Overlapped, sizeof(OVERLAPPED));
-    Overlapped.hEvent = CreateEvent(NULL,
-                                    TRUE,
-                                    FALSE,
-                                    NULL);
-    if (Overlapped.hEvent == NULL)
-        goto fail1;
+    if (Connection->Closing)
+        return;
 
-    Handles[0] = Console->DeviceEvent;
-    Handles[1] = Overlapped.hEvent;
+    Connection->Closing = TRUE;
 
-    Device = CreateFileW(Console->DevicePath,
-                         GENERIC_READ,
-                         FILE_SHARE_READ | FILE_SHARE_WRITE,
-                         NULL,
-                         OPEN_EXISTING,
-                         FILE_FLAG_OVERLAPPED,
-                         NULL);
-    if (Device == INVALID_HANDLE_VALUE)
-        goto fail2;
+    __RemoveEntryList(&Connection->ListEntry);
+    --Console->ListCount;
 
-    for (;;) {
-        PLIST_ENTRY     ListEntry;
+    (VOID) CancelIoEx(Connection->Pipe, NULL);
+}
 
-        (VOID) ReadFile(Device,
-                        Buffer,
-                        sizeof(Buffer),
-                        NULL,
-                        &Overlapped);
+// Called with Console->CriticalSection held. Only one write is ever in
+// flight; anything that arrives in the meantime waits in the queue.
+static VOID
+ConnectionWrite(
+    _In_ PMONITOR_CONNECTION    Connection
+    )
+{
+    PMONITOR_CONSOLE            Console = Connection->Console;
+    DWORD                       Length;
+    DWORD                       Error;
 
-        Wait = WaitForMultipleObjects(ARRAYSIZE(Handles),
-                                      Handles,
-                                      FALSE,
-                                      INFINITE);
-        if (Wait == WAIT_OBJECT_0)
-            break;
+    if (Connection->Closing)
+        return;
 
-        if (!GetOverlappedResult(Device,
-                                 &Overlapped,
-                                 &Length,
-                                 FALSE))
-            break;
+    // Checked before Writing: a client that has stopped reading has a
+    // write that will never complete, and cancelling it is the only
+    // way to let go of it
+    if (Connection->Queue.Overflowed) {
+        Log("%s: client fell too far behind", Console->DeviceName);
+        ConnectionClose(Connection);
+        return;
+    }
 
-        ResetEvent(Overlapped.hEvent);
+    if (Connection->Writing)
+        return;
 
-        EnterCriticalSection(&Console->CriticalSection);
+    Length = HubQueuePop(&Connection->Queue,
+                         Connection->WriteBuffer,
+                         sizeof(Connection->WriteBuffer));
+    if (Length == 0)
+        return;
 
-        for (ListEntry = Console->ListHead.Flink;
-                ListEntry != &Console->ListHead;
-                ListEntry = ListEntry->Flink) {
-            PMONITOR_CONNECTION Connection;
+    Connection->Writing = TRUE;
+    InterlockedIncrement(&Connection->References);
 
-            Connection = CONTAINING_RECORD(ListEntry,
-                                           MONITOR_CONNECTION,
-                                           ListEntry);
+    ReactorPrepare(&Connection->WriteIo,
+                   ConnectionWriteComplete,
+                   Connection);
 
-            PutString(Connection->Pipe,
-                      Buffer,
-                      Length);
+    if (!WriteFile(Connection->Pipe,
+                   Connection->WriteBuffer,
+                   Length,
+                   NULL,
+                   &Connection->WriteIo.Overlapped)) {
+        Error = GetLastError();
+        if (Error != ERROR_IO_PENDING &&
+            !ReactorPost(&Connection->WriteIo, Error, 0)) {
+            // Nothing will complete, so undo what the completion would
+            // have done with a failed write
+            Log("%s: failed to post write completion (%u)",
+                Console->DeviceName,
+                GetLastError());
+
+            Connection->Writing = FALSE;
+            ConnectionClose(Connection);
+            ConnectionReleaseReference(Connection);
         }
+    }
+}
 
-        LeaveCriticalSection(&Console->CriticalSection);
+static VOID
+ConnectionWriteComplete(
+    _In_ PREACTOR_IO    Io,
+    _In_ DWORD          Error,
+    _In_ DWORD          Length
+    )
+{
+    PMONITOR_CONNECTION Connection = Io->Argument;
+    PMONITOR_CONSOLE    Console = Connection->Console;
+
+    EnterCriticalSection(&Console->CriticalSection);
+
+    Connection->Writing = FALSE;
+
+    if (Error == ERROR_SUCCESS) {
+        Connection->BytesWritten += Length;
+        ConnectionWrite(Connection);
+    } else {
+        ConnectionClose(Connection);
     }
 
-    CloseHandle(Device);
+    LeaveCriticalSection(&Console->CriticalSection);
 
-    CloseHandle(Overlapped.hEvent);
+    ConnectionReleaseReference(Connection);
+}
 
-    Log("<==== %s", Console->DeviceName);
+static VOID
+ConnectionRead(
+    _In_ PMONITOR_CONNECTION    Connection
+    )
+{
+    PMONITOR_CONSOLE            Console = Connection->Console;
+    DWORD                       Error;
 
-    return 0;
+    EnterCriticalSection(&Console->CriticalSection);
 
-fail2:
-    Log("fail2\n");
+    if (Connection->Closing)
+        goto done;
 
-    CloseHandle(Overlapped.hEvent);
+    InterlockedIncrement(&Connection->References);
 
-fail1:
-    Error = GetLastError();
+    ReactorPrepare(&Connection->ReadIo,
+                   ConnectionReadComplete,
+                   Connection);
 
-    {
-        PTCHAR  Message;
-        Message = GetErrorMessage(Error);
-        Log("fail1 (%s)", Message);
-        LocalFree(Message);
+    // A message that doesn't fit still completes through the port
+    if (!ReadFile(Connection->Pipe,
+                  Connection->ReadBuffer,
+                  sizeof(Connection->ReadBuffer),
+                  NULL,
+                  &Connection->ReadIo.Overlapped)) {
+        Error = GetLastError();
+        if (Error != ERROR_IO_PENDING && Error != ERROR_MORE_DATA &&
+            !ReactorPost(&Connection->ReadIo, Error, 0)) {
+            Log("%s: failed to post read completion (%u)",
+                Console->DeviceName,
+                GetLastError());
+
+            ConnectionClose(Connection);
+            ConnectionReleaseReference(Connection);
+        }
     }
 
-    return 1;
+done:
+    LeaveCriticalSection(&Console->CriticalSection);
 }
 
-_Success_(return != FALSE)
-static BOOL
-GetExecutable(
-    _In_ PSTR               DeviceName,
-    _Outptr_result_z_ PSTR  *Executable
+static VOID
+ConnectionReadComplete(
+    _In_ PREACTOR_IO    Io,
+    _In_ DWORD          Error,
+    _In_ DWORD          Length
     )
 {
-    PMONITOR_CONTEXT        Context = &MonitorContext;
-    HKEY                    Key;
-    DWORD                   MaxValueLength;
-    DWORD                   ExecutableLength;
-    DWORD                   Type;
-    HRESULT                 Error;
+    PMONITOR_CONNECTION Connection = Io->Argument;
+    PMONITOR_CONSOLE    Console = Connection->Console;
+
+    // The rest of the message is picked up by the next read
+    if (Error == ERROR_MORE_DATA)
+        Error = ERROR_SUCCESS;
+
+    EnterCriticalSection(&Console->CriticalSection);
 
-    Error = RegOpenKeyExA(Context->ParametersKey,
-                          DeviceName,
-                          0,
-                          KEY_READ,
-                          &Key);
     if (Error != ERROR_SUCCESS) {
-        SetLastError(Error);
-        goto fail1;
+        ConnectionClose(Connection);
+        goto done;
+    }
+
+    if (Console->Stopping || Connection->Closing)
+        goto done;
+
+    // Writing to the device can block for as long as the backend
+    // does, so it is left to the console's input thread. The message
+    // (and our reference) is handed over with the connection, and the
+    // next read is not issued until it has been written.
+    Connection->InputLength = Length;
+    __InsertTailList(&Console->InputList, &Connection->InputEntry);
+
+    LeaveCriticalSection(&Console->CriticalSection);
+
+    SetEvent(Console->InputEvent);
+    return;
+
+done:
+    LeaveCriticalSection(&Console->CriticalSection);
+
+    ConnectionReleaseReference(Connection);
+}
+
+static BOOL
+ConnectionCreate(
+    _In_ PMONITOR_CONSOLE   Console,
+    _In_ HANDLE             Pipe
+    )
+{
+    PMONITOR_CONTEXT        Context = &MonitorContext;
+    PMONITOR_CONNECTION     Connection;
+    HRESULT                 Error;
+
+    Log("====> %s", Console->DeviceName);
+
+    Connection = calloc(1, sizeof(MONITOR_CONNECTION));
+    if (Connection == NULL)
+        goto fail1;
+
+    __InitializeListHead(&Connection->ListEntry);
+    __InitializeListHead(&Connection->InputEntry);
+    Connection->Console = Console;
+    Connection->Pipe = Pipe;
+    Connection->References = 1;
+
+    if (!HubQueueInitialize(&Connection->Queue,
+                            Context->OutputQueueSize,
+                            Context->OutputOverflowPolicy)) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        goto fail2;
+    }
+
+    EnterCriticalSection(&Console->CriticalSection);
+
+    if (Console->Stopping) {
+        LeaveCriticalSection(&Console->CriticalSection);
+        SetLastError(ERROR_OPERATION_ABORTED);
+        goto fail3;
+    }
+
+    __InsertTailList(&Console->ListHead, &Connection->ListEntry);
+    ++Console->ListCount;
+    ConsoleAddReference(Console);
+
+    LeaveCriticalSection(&Console->CriticalSection);
+
+    ConnectionRead(Connection);
+    ConnectionReleaseReference(Connection);
+
+    return TRUE;
+
+fail3:
+    Log("fail3");
+
+    HubQueueTeardown(&Connection->Queue);
+
+fail2:
+    Log("fail2");
+
+    free(Connection);
+
+fail1:
+    Error = GetLastError();
+
+    {
+        PTCHAR  Message;
+        Message = GetErrorMessage(Error);
+        Log("fail1 (%s)", Message);
+        LocalFree(Message);
+    }
+
+    return FALSE;
+}
+
+// Queue console output for every connected client. Called with
+// Console->CriticalSection held; nothing here waits on a client, so
+// one that stops reading can only lose its own output.
+static VOID
+ConsoleBroadcast(
+    _In_ PMONITOR_CONSOLE   Console,
+    _In_ PUCHAR             Buffer,
+    _In_ DWORD              Length
+    )
+{
+    PLIST_ENTRY             ListEntry;
+
+    ListEntry = Console->ListHead.Flink;
+    while (ListEntry != &Console->ListHead) {
+        PMONITOR_CONNECTION Connection;
+
+        Connection = CONTAINING_RECORD(ListEntry,
+                                       MONITOR_CONNECTION,
+                                       ListEntry);
+
+        // ConnectionWrite() may close the connection
+        ListEntry = ListEntry->Flink;
+
+        (VOID) HubQueuePush(&Connection->Queue, Buffer, Length);
+        ConnectionWrite(Connection);
+    }
+}
+
+// Called with Console->CriticalSection held, in stream order
+static VOID
+ConsoleOutput(
+    _In_ PMONITOR_CONSOLE   Console,
+    _In_ PUCHAR             Buffer,
+    _In_ DWORD              Length
+    )
+{
+    Console->BytesRead += Length;
+
+    if (Console->Capture != NULL)
+        CapturePut(Console->Capture, Buffer, Length);
+
+    ConsoleBroadcast(Console, Buffer, Length);
+}
+
+static VOID
+ConsoleAcceptComplete(
+    _In_ PREACTOR_IO    Io,
+    _In_ DWORD          Error,
+    _In_ DWORD          Length
+    );
+
+static BOOL
+ConsoleAccept(
+    _In_ PMONITOR_CONSOLE   Console
+    )
+{
+    SECURITY_ATTRIBUTES     SecurityAttributes;
+    HANDLE                  Pipe;
+    HRESULT                 Error;
+
+    ZeroMemory(&SecurityAttributes, sizeof(SECURITY_ATTRIBUTES));
+    SecurityAttributes.nLength = sizeof(SECURITY_ATTRIBUTES);
+    SecurityAttributes.bInheritHandle = FALSE;
+    SecurityAttributes.lpSecurityDescriptor = Console->PipeSecurity;
+
+    Pipe = CreateNamedPipe(Console->PipeName,
+                           PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED,
+                           PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_REJECT_REMOTE_CLIENTS,
+                           PIPE_UNLIMITED_INSTANCES,
+                           MAXIMUM_BUFFER_SIZE,
+                           MAXIMUM_BUFFER_SIZE,
+                           0,
+                           &SecurityAttributes);
+    if (Pipe == INVALID_HANDLE_VALUE)
+        goto fail1;
+
+    if (!ReactorAssociate(Pipe))
+        goto fail2;
+
+    EnterCriticalSection(&Console->CriticalSection);
+
+    if (Console->Stopping) {
+        LeaveCriticalSection(&Console->CriticalSection);
+        SetLastError(ERROR_OPERATION_ABORTED);
+        goto fail3;
+    }
+
+    Console->AcceptPipe = Pipe;
+    ConsoleAddReference(Console);
+
+    ReactorPrepare(&Console->AcceptIo,
+                   ConsoleAcceptComplete,
+                   Console);
+
+    if (!ConnectNamedPipe(Pipe, &Console->AcceptIo.Overlapped)) {
+        Error = GetLastError();
+
+        // A client that got in before ConnectNamedPipe() doesn't
+        // generate a completion
+        if (Error == ERROR_PIPE_CONNECTED)
+            Error = ERROR_SUCCESS;
+
+        if (Error != ERROR_IO_PENDING &&
+            !ReactorPost(&Console->AcceptIo, Error, 0))
+            goto fail4;
+    }
+
+    LeaveCriticalSection(&Console->CriticalSection);
+
+    return TRUE;
+
+fail4:
+    Log("fail4");
+
+    Console->AcceptPipe = NULL;
+    ConsoleReleaseReference(Console);
+
+    LeaveCriticalSection(&Console->CriticalSection);
+
+fail3:
+    Log("fail3");
+
+fail2:
+    Log("fail2");
+
+    CloseHandle(Pipe);
+
+fail1:
+    Error = GetLastError();
+
+    {
+        PTCHAR  Message;
+        Message = GetErrorMessage(Error);
+        Log("fail1 (%s)", Message);
+        LocalFree(Message);
+    }
+
+    return FALSE;
+}
+
+static VOID
+ConsoleAcceptComplete(
+    _In_ PREACTOR_IO    Io,
+    _In_ DWORD          Error,
+    _In_ DWORD          Length
+    )
+{
+    PMONITOR_CONSOLE    Console = Io->Argument;
+    HANDLE              Pipe;
+    BOOL                Stopping;
+
+    UNREFERENCED_PARAMETER(Length);
+
+    EnterCriticalSection(&Console->CriticalSection);
+    Pipe = Console->AcceptPipe;
+    Console->AcceptPipe = NULL;
+    Stopping = Console->Stopping;
+    LeaveCriticalSection(&Console->CriticalSection);
+
+    if (Stopping) {
+        CloseHandle(Pipe);
+        goto done;
+    }
+
+    // Have the next instance listening before dealing with this one
+    (VOID) ConsoleAccept(Console);
+
+    if (Error != ERROR_SUCCESS || !ConnectionCreate(Console, Pipe))
+        CloseHandle(Pipe);
+
+done:
+    ConsoleReleaseReference(Console);
+}
+
+static VOID
+ConsoleReadComplete(
+    _In_ PREACTOR_IO    Io,
+    _In_ DWORD          Error,
+    _In_ DWORD          Length
+    );
+
+// Called with Console->CriticalSection held, so reads reach the driver
+// (which completes them in order) in the order of their sequence numbers
+static VOID
+ConsoleRead(
+    _In_ PMONITOR_CONSOLE   Console,
+    _In_ PMONITOR_READ      Read
+    )
+{
+    DWORD                   Error;
+
+    if (Console->Stopping || Console->ReadFailed)
+        return;
+
+    ConsoleAddReference(Console);
+
+    ReactorPrepare(&Read->Io,
+                   ConsoleReadComplete,
+                   Console);
+
+    Read->Sequence = Console->ReadSequence++;
+    Read->Completed = FALSE;
+
+    if (!ReadFile(Console->ReadHandle,
+                  Read->Buffer,
+                  Console->ReadSize,
+                  NULL,
+                  &Read->Io.Overlapped)) {
+        Error = GetLastError();
+        if (Error != ERROR_IO_PENDING &&
+            !ReactorPost(&Read->Io, Error, 0)) {
+            Log("%s: failed to post read completion (%u)",
+                Console->DeviceName,
+                GetLastError());
+
+            // This was the last read issued, so taking its sequence
+            // number back leaves the earlier ones to be delivered
+            --Console->ReadSequence;
+            Console->ReadFailed = TRUE;
+            ConsoleReleaseReference(Console);
+        }
+    }
+}
+
+// Completions can be picked up by the reactor threads in any order, so
+// each read is held back until everything issued before it has been
+// broadcast. Reads are issued round-robin, so the next one due is
+// always in slot DeliverSequence % ReadCount.
+static VOID
+ConsoleReadComplete(
+    _In_ PREACTOR_IO    Io,
+    _In_ DWORD          Error,
+    _In_ DWORD          Length
+    )
+{
+    PMONITOR_CONSOLE    Console = Io->Argument;
+    PMONITOR_READ       Read = CONTAINING_RECORD(Io, MONITOR_READ, Io);
+
+    EnterCriticalSection(&Console->CriticalSection);
+
+    Read->Error = Error;
+    Read->Length = Length;
+    Read->Completed = TRUE;
+
+    for (;;) {
+        Read = &Console->Reads[Console->DeliverSequence % Console->ReadCount];
+        if (!Read->Completed || Read->Sequence != Console->DeliverSequence)
+            break;
+
+        Read->Completed = FALSE;
+        Console->DeliverSequence++;
+
+        if (Read->Error == ERROR_SUCCESS) {
+            ConsoleOutput(Console, Read->Buffer, Read->Length);
+        } else {
+            if (Read->Error != ERROR_OPERATION_ABORTED)
+                Log("%s: read failed (%u)", Console->DeviceName, Read->Error);
+
+            // Stop reading, as the threaded reader always did
+            Console->ReadFailed = TRUE;
+        }
+
+        ConsoleRead(Console, Read);
+        ConsoleReleaseReference(Console);
+    }
+
+    LeaveCriticalSection(&Console->CriticalSection);
+}
+
+// Fan console input out to the pipes straight from the mapped In ring
+DWORD WINAPI
+DeviceSharedThread(
+    _In_ LPVOID         Argument
+    )
+{
+    PMONITOR_CONSOLE    Console = (PMONITOR_CONSOLE)Argument;
+    PXENCONS_SHARED     Shared = Console->Shared;
+    PUCHAR              Data = (PUCHAR)Shared + Shared->InOffset;
+    HANDLE              Handles[2];
+    DWORD               Wait;
+
+    Log("====> %s", Console->DeviceName);
+
+    Handles[0] = Console->DeviceEvent;
+    Handles[1] = Console->SharedInEvent;
+
+    for (;;) {
+        ULONG           Offset;
+        ULONG           Length;
+
+        if (WaitForSingleObject(Console->DeviceEvent, 0) == WAIT_OBJECT_0)
+            break;
+
+        Length = XenconsSharedReadSpace(&Shared->In, Shared->Size, &Offset);
+        if (Length == 0) {
+            if (!XenconsSharedConsPrepareWait(&Shared->In))
+                continue;
+
+            Wait = WaitForMultipleObjects(ARRAYSIZE(Handles),
+                                          Handles,
+                                          FALSE,
+                                          INFINITE);
+            if (Wait != WAIT_OBJECT_0 + 1)
+                break;
+
+            continue;
+        }
+
+        EnterCriticalSection(&Console->CriticalSection);
+        ConsoleOutput(Console, &Data[Offset], Length);
+        LeaveCriticalSection(&Console->CriticalSection);
+
+        XenconsSharedReadCommit(&Shared->In, Length);
+
+        if (XenconsSharedConsCheckNotify(&Shared->In))
+            SharedKick(Console);
+    }
+
+    Log("<==== %s", Console->DeviceName);
+
+    return 0;
+}
+
+static VOID
+ConsoleWriteInput(
+    _In_ PMONITOR_CONSOLE   Console,
+    _In_ PUCHAR             Buffer,
+    _In_ DWORD              Length
+    )
+{
+    if (Console->Shared != NULL) {
+        SharedPutString(Console, Buffer, Length);
+        return;
+    }
+
+    // A write cancelled by ConsoleStopInput() can still complete
+    // part of the data, so check before going round again
+    while (Length != 0 && !Console->Stopping) {
+        DWORD   Written;
+
+        if (!WriteFile(Console->DeviceHandle,
+                       Buffer,
+                       Length,
+                       &Written,
+                       NULL))
+            break;
+
+        Buffer += Written;
+        Length -= Written;
+    }
+}
+
+// Write client input to the device, one message at a time in the
+// order the messages arrived. This is the only thing that ever waits
+// for the backend, so a stalled console cannot hold up the reactor
+// threads that every other console depends on.
+DWORD WINAPI
+ConsoleInputThread(
+    _In_ LPVOID         Argument
+    )
+{
+    PMONITOR_CONSOLE    Console = (PMONITOR_CONSOLE)Argument;
+
+    Log("====> %s", Console->DeviceName);
+
+    for (;;) {
+        PLIST_ENTRY         ListEntry;
+        PMONITOR_CONNECTION Connection;
+
+        EnterCriticalSection(&Console->CriticalSection);
+
+        if (Console->Stopping) {
+            LeaveCriticalSection(&Console->CriticalSection);
+            break;
+        }
+
+        ListEntry = Console->InputList.Flink;
+        if (ListEntry == &Console->InputList) {
+            LeaveCriticalSection(&Console->CriticalSection);
+
+            WaitForSingleObject(Console->InputEvent, INFINITE);
+            continue;
+        }
+
+        __RemoveEntryList(ListEntry);
+
+        LeaveCriticalSection(&Console->CriticalSection);
+
+        Connection = CONTAINING_RECORD(ListEntry,
+                                       MONITOR_CONNECTION,
+                                       InputEntry);
+
+        ConsoleWriteInput(Console,
+                          Connection->ReadBuffer,
+                          Connection->InputLength);
+
+        ConnectionRead(Connection);
+        ConnectionReleaseReference(Connection);
+    }
+
+    // Anything still waiting is dropped along with the connection
+    for (;;) {
+        PLIST_ENTRY         ListEntry;
+        PMONITOR_CONNECTION Connection;
+
+        EnterCriticalSection(&Console->CriticalSection);
+
+        ListEntry = Console->InputList.Flink;
+        if (ListEntry == &Console->InputList) {
+            LeaveCriticalSection(&Console->CriticalSection);
+            break;
+        }
+
+        __RemoveEntryList(ListEntry);
+
+        LeaveCriticalSection(&Console->CriticalSection);
+
+        Connection = CONTAINING_RECORD(ListEntry,
+                                       MONITOR_CONNECTION,
+                                       InputEntry);
+
+        ConnectionReleaseReference(Connection);
+    }
+
+    Log("<==== %s", Console->DeviceName);
+
+    return 0;
+}
+
+_Success_(return != FALSE)
+static BOOL
+GetExecutable(
+    _In_ PSTR               DeviceName,
+    _Outptr_result_z_ PSTR  *Executable
+    )
+{
+    PMONITOR_CONTEXT        Context = &MonitorContext;
+    HKEY                    Key;
+    DWORD                   MaxValueLength;
+    DWORD                   ExecutableLength;
+    DWORD                   Type;
+    HRESULT                 Error;
+
+    Error = RegOpenKeyExA(Context->ParametersKey,
+                          DeviceName,
+                          0,
+                          KEY_READ,
+                          &Key);
+    if (Error != ERROR_SUCCESS) {
+        SetLastError(Error);
+        goto fail1;
     }
 
     Error = RegQueryInfoKey(Key,
@@ -816,46 +1467,225 @@ again:
 
 #define WAIT_OBJECT_1 (WAIT_OBJECT_0 + 1)
 
-    switch (Object) {
-    case WAIT_OBJECT_0:
-        ResetEvent(Console->ExecutableEvent);
+    switch (Object) {
+    case WAIT_OBJECT_0:
+        ResetEvent(Console->ExecutableEvent);
+
+        TerminateProcess(ProcessInfo.hProcess, 1);
+        CloseHandle(ProcessInfo.hProcess);
+        CloseHandle(ProcessInfo.hThread);
+        break;
+
+    case WAIT_OBJECT_1:
+        CloseHandle(ProcessInfo.hProcess);
+        CloseHandle(ProcessInfo.hThread);
+        goto again;
+
+    default:
+        break;
+    }
+
+//#undef WAIT_OBJECT_1
+
+    free(Executable);
+
+done:
+    Log("<==== %s", Console->DeviceName);
+
+    return 0;
+
+fail1:
+    Error = GetLastError();
+
+    free(Executable);
+
+    {
+        PTCHAR  Message;
+        Message = GetErrorMessage(Error);
+        Log("fail1 (%s)", Message);
+        LocalFree(Message);
+    }
+
+    return 1;
+}
+
+static BOOL
+ConsoleStartDevice(
+    _In_ PMONITOR_CONSOLE   Console
+    )
+{
+    PMONITOR_CONTEXT        Context = &MonitorContext;
+    HANDLE                  Handle;
+    DWORD                   Index;
+    HRESULT                 Error;
+
+    Console->StartTime = GetTickCount64();
+
+    if (Console->Shared != NULL) {
+        Console->DeviceThread = CreateThread(NULL,
+                                             0,
+                                             DeviceSharedThread,
+                                             Console,
+                                             0,
+                                             NULL);
+        if (Console->DeviceThread == NULL)
+            goto fail1;
+
+        return TRUE;
+    }
+
+    Console->ReadCount = Context->DeviceReadCount;
+    Console->ReadSize = Context->DeviceReadSize;
+
+    Console->Reads = calloc(Console->ReadCount, sizeof(MONITOR_READ));
+    if (Console->Reads == NULL)
+        goto fail2;
+
+    Console->ReadPool = malloc((SIZE_T)Console->ReadCount * Console->ReadSize);
+    if (Console->ReadPool == NULL)
+        goto fail3;
+
+    for (Index = 0; Index < Console->ReadCount; Index++)
+        Console->Reads[Index].Buffer =
+            &Console->ReadPool[(SIZE_T)Index * Console->ReadSize];
+
+    Handle = CreateFileW(Console->DevicePath,
+                         GENERIC_READ,
+                         FILE_SHARE_READ | FILE_SHARE_WRITE,
+                         NULL,
+                         OPEN_EXISTING,
+                         FILE_FLAG_OVERLAPPED,
+                         NULL);
+    if (Handle == INVALID_HANDLE_VALUE)
+        goto fail4;
+
+    if (!ReactorAssociate(Handle))
+        goto fail5;
+
+    Console->ReadHandle = Handle;
+
+    EnterCriticalSection(&Console->CriticalSection);
+    for (Index = 0; Index < Console->ReadCount; Index++)
+        ConsoleRead(Console, &Console->Reads[Index]);
+    LeaveCriticalSection(&Console->CriticalSection);
+
+    return TRUE;
+
+fail5:
+    Log("fail5");
+
+    CloseHandle(Handle);
+
+fail4:
+    Log("fail4");
+
+    free(Console->ReadPool);
+    Console->ReadPool = NULL;
+
+fail3:
+    Log("fail3");
+
+    free(Console->Reads);
+    Console->Reads = NULL;
+
+fail2:
+    Log("fail2");
+
+fail1:
+    Error = GetLastError();
+
+    {
+        PTCHAR  Message;
+        Message = GetErrorMessage(Error);
+        Log("fail1 (%s)", Message);
+        LocalFree(Message);
+    }
+
+    return FALSE;
+}
+
+static VOID
+ConsoleStopInput(
+    _In_ PMONITOR_CONSOLE   Console
+    )
+{
+    if (Console->InputThread == NULL)
+        return;
+
+    EnterCriticalSection(&Console->CriticalSection);
+    Console->Stopping = TRUE;
+    LeaveCriticalSection(&Console->CriticalSection);
+
+    SetEvent(Console->InputEvent);
+
+    // A write to the device is held until the backend has taken all of
+    // it, so keep cancelling until the thread notices it should stop
+    while (WaitForSingleObject(Console->InputThread, 100) == WAIT_TIMEOUT)
+        (VOID) CancelSynchronousIo(Console->InputThread);
+
+    CloseHandle(Console->InputThread);
+    Console->InputThread = NULL;
+}
+
+// Stop accepting clients, close the ones we have and stop reading and
+// writing the device, then wait for the reactor to finish with the
+// console.
+static VOID
+ConsoleStop(
+    _In_ PMONITOR_CONSOLE   Console
+    )
+{
+    PLIST_ENTRY             ListEntry;
+
+    EnterCriticalSection(&Console->CriticalSection);
+
+    Console->Stopping = TRUE;
+    SetEvent(Console->ServerEvent);
+
+    if (Console->AcceptPipe != NULL)
+        (VOID) CancelIoEx(Console->AcceptPipe, NULL);
 
-        TerminateProcess(ProcessInfo.hProcess, 1);
-        CloseHandle(ProcessInfo.hProcess);
-        CloseHandle(ProcessInfo.hThread);
-        break;
+    ListEntry = Console->ListHead.Flink;
+    while (ListEntry != &Console->ListHead) {
+        PMONITOR_CONNECTION Connection;
 
-    case WAIT_OBJECT_1:
-        CloseHandle(ProcessInfo.hProcess);
-        CloseHandle(ProcessInfo.hThread);
-        goto again;
+        Connection = CONTAINING_RECORD(ListEntry,
+                                       MONITOR_CONNECTION,
+                                       ListEntry);
+        ListEntry = ListEntry->Flink;
 
-    default:
-        break;
+        ConnectionClose(Connection);
     }
 
-//#undef WAIT_OBJECT_1
+    if (Console->ReadHandle != NULL)
+        (VOID) CancelIoEx(Console->ReadHandle, NULL);
 
-    free(Executable);
+    LeaveCriticalSection(&Console->CriticalSection);
 
-done:
-    Log("<==== %s", Console->DeviceName);
+    if (Console->DeviceThread != NULL) {
+        SetEvent(Console->DeviceEvent);
+        WaitForSingleObject(Console->DeviceThread, INFINITE);
 
-    return 0;
+        CloseHandle(Console->DeviceThread);
+        Console->DeviceThread = NULL;
+    }
 
-fail1:
-    Error = GetLastError();
+    // Drops the references held by any input still queued
+    ConsoleStopInput(Console);
 
-    free(Executable);
+    ConsoleReleaseReference(Console);
+    WaitForSingleObject(Console->IdleEvent, INFINITE);
 
-    {
-        PTCHAR  Message;
-        Message = GetErrorMessage(Error);
-        Log("fail1 (%s)", Message);
-        LocalFree(Message);
-    }
+    if (Console->ReadHandle != NULL) {
+        CloseHandle(Console->ReadHandle);
+        Console->ReadHandle = NULL;
 
-    return 1;
+        free(Console->ReadPool);
+        Console->ReadPool = NULL;
+
+        free(Console->Reads);
+        Console->Reads = NULL;
+    }
 }
 
 static PMONITOR_CONSOLE
@@ -867,6 +1697,7 @@ ConsoleCreate(
     PMONITOR_CONSOLE        Console;
     DEV_BROADCAST_HANDLE    Handle;
     CHAR                    DeviceName[MAX_PATH];
+    ULONG                   WriteMode;
     DWORD                   Bytes;
     BOOL                    Success;
     HRESULT                 Error;
@@ -880,7 +1711,9 @@ ConsoleCreate(
     memset(Console, 0, sizeof(MONITOR_CONSOLE));
     __InitializeListHead(&Console->ListHead);
     __InitializeListHead(&Console->ListEntry);
+    __InitializeListHead(&Console->InputList);
     InitializeCriticalSection(&Console->CriticalSection);
+    InitializeCriticalSection(&Console->SharedLock);
 
     Console->DevicePath = _wcsdup(DevicePath);
     if (Console->DevicePath == NULL)
@@ -913,6 +1746,22 @@ ConsoleCreate(
     if (Console->DeviceName == NULL)
         goto fail5;
 
+    // Ask the driver to hold each write until all of it is in the
+    // ring. Older drivers don't support this, in which case PutString()
+    // simply goes round again for whatever was left over.
+    WriteMode = XENCONS_WRITE_MODE_FULL;
+    (VOID) DeviceIoControl(Console->DeviceHandle,
+                           IOCTL_XENCONS_SET_WRITE_MODE,
+                           &WriteMode,
+                           sizeof(WriteMode),
+                           NULL,
+                           0,
+                           &Bytes,
+                           NULL);
+
+    // Fall back to ReadFile()/WriteFile() if the rings can't be mapped
+    (VOID) SharedMap(Console);
+
     ECHO(Console->DeviceHandle, "\r\n[ATTACHED]\r\n");
 
     ZeroMemory(&Handle, sizeof (Handle));
@@ -927,44 +1776,82 @@ ConsoleCreate(
     if (Console->DeviceNotification == NULL)
         goto fail6;
 
-    Console->DeviceEvent = CreateEvent(NULL,
+    Console->ServerEvent = CreateEvent(NULL,
                                        TRUE,
                                        FALSE,
                                        NULL);
-    if (Console->DeviceEvent == NULL)
+    if (Console->ServerEvent == NULL)
         goto fail7;
 
-    Console->DeviceThread = CreateThread(NULL,
-                                         0,
-                                         DeviceThread,
-                                         Console,
-                                         0,
-                                         NULL);
-    if (Console->DeviceThread == NULL)
+    Console->IdleEvent = CreateEvent(NULL,
+                                     TRUE,
+                                     FALSE,
+                                     NULL);
+    if (Console->IdleEvent == NULL)
         goto fail8;
 
-    Console->ServerEvent = CreateEvent(NULL,
+    // Dropped by ConsoleStop()
+    Console->References = 1;
+
+    Error = StringCchPrintfA(Console->PipeName,
+                             MAXIMUM_BUFFER_SIZE,
+                             "%s%s",
+                             PIPE_BASE_NAME,
+                             Console->DeviceName);
+    if (Error != S_OK && Error != STRSAFE_E_INSUFFICIENT_BUFFER)
+        goto fail9;
+
+    Log("%s", Console->PipeName);
+
+    if (!ConvertStringSecurityDescriptorToSecurityDescriptorA(PIPE_SDDL,
+                                                              SDDL_REVISION_1,
+                                                              &Console->PipeSecurity,
+                                                              NULL))
+        goto fail10;
+
+    Console->DeviceEvent = CreateEvent(NULL,
                                        TRUE,
                                        FALSE,
                                        NULL);
-    if (Console->ServerEvent == NULL)
-        goto fail9;
+    if (Console->DeviceEvent == NULL)
+        goto fail11;
 
-    Console->ServerThread = CreateThread(NULL,
-                                         0,
-                                         ServerThread,
-                                         Console,
-                                         0,
-                                         NULL);
-    if (Console->ServerThread == NULL)
-        goto fail10;
+    Console->InputEvent = CreateEvent(NULL,
+                                      FALSE,
+                                      FALSE,
+                                      NULL);
+    if (Console->InputEvent == NULL)
+        goto fail12;
+
+    Console->InputThread = CreateThread(NULL,
+                                        0,
+                                        ConsoleInputThread,
+                                        Console,
+                                        0,
+                                        NULL);
+    if (Console->InputThread == NULL)
+        goto fail13;
+
+    // Capture is best effort; the console works without it
+    if (Context->CaptureParameters.Directory[0] != '\0') {
+        Console->Capture = CaptureCreate(Console->DeviceName,
+                                         &Context->CaptureParameters);
+        if (Console->Capture == NULL)
+            Log("%s: capture failed (%u)", Console->DeviceName, GetLastError());
+    }
+
+    if (!ConsoleStartDevice(Console))
+        goto fail14;
+
+    if (!ConsoleAccept(Console))
+        goto fail15;
 
     Console->ExecutableEvent = CreateEvent(NULL,
                                            TRUE,
                                            FALSE,
                                            NULL);
     if (Console->ExecutableEvent == NULL)
-        goto fail11;
+        goto fail16;
 
     Console->ExecutableThread = CreateThread(NULL,
                                              0,
@@ -973,41 +1860,69 @@ ConsoleCreate(
                                              0,
                                              NULL);
     if (Console->ExecutableThread == NULL)
-        goto fail12;
+        goto fail17;
 
     Log("<==== %s", Console->DeviceName);
 
     return Console;
 
-fail12:
-    Log("fail12");
+fail17:
+    Log("fail17");
 
     CloseHandle(Console->ExecutableEvent);
     Console->ExecutableEvent = NULL;
 
+fail16:
+    Log("fail16");
+
+fail15:
+    Log("fail15");
+
+    ConsoleStop(Console);
+
+fail14:
+    Log("fail14");
+
+    // Already done if ConsoleStop() was called
+    ConsoleStopInput(Console);
+
+    if (Console->Capture != NULL) {
+        CaptureDestroy(Console->Capture);
+        Console->Capture = NULL;
+    }
+
+fail13:
+    Log("fail13");
+
+    CloseHandle(Console->InputEvent);
+    Console->InputEvent = NULL;
+
+fail12:
+    Log("fail12");
+
+    CloseHandle(Console->DeviceEvent);
+    Console->DeviceEvent = NULL;
+
 fail11:
     Log("fail11");
 
-    SetEvent(Console->ServerEvent);
-    WaitForSingleObject(Console->ServerThread, INFINITE);
+    LocalFree(Console->PipeSecurity);
+    Console->PipeSecurity = NULL;
 
 fail10:
     Log("fail10");
 
-    CloseHandle(Console->ServerEvent);
-    Console->ServerEvent = NULL;
-
 fail9:
     Log("fail9");
 
-    SetEvent(Console->DeviceEvent);
-    WaitForSingleObject(Console->DeviceThread, INFINITE);
+    CloseHandle(Console->IdleEvent);
+    Console->IdleEvent = NULL;
 
 fail8:
     Log("fail8");
 
-    CloseHandle(Console->DeviceEvent);
-    Console->DeviceEvent = NULL;
+    CloseHandle(Console->ServerEvent);
+    Console->ServerEvent = NULL;
 
 fail7:
     Log("fail7");
@@ -1032,6 +1947,8 @@ fail4:
     CloseHandle(Console->DeviceHandle);
     Console->DeviceHandle = INVALID_HANDLE_VALUE;
 
+    SharedUnmap(Console);
+
 fail3:
     Log("fail3");
 
@@ -1041,6 +1958,7 @@ fail3:
 fail2:
     Log("fail2");
 
+    DeleteCriticalSection(&Console->SharedLock);
     DeleteCriticalSection(&Console->CriticalSection);
     ZeroMemory(&Console->ListHead, sizeof(LIST_ENTRY));
     ZeroMemory(&Console->ListEntry, sizeof(LIST_ENTRY));
@@ -1060,54 +1978,6 @@ fail1:
     return NULL;
 }
 
-static FORCEINLINE VOID
-ConsoleWaitForPipes(
-    _In_ PMONITOR_CONSOLE   Console
-    )
-{
-    PLIST_ENTRY             ListEntry;
-    HANDLE                  *Events;
-    DWORD                   Count;
-    DWORD                   Index;
-
-    EnterCriticalSection(&Console->CriticalSection);
-
-    Count = Console->ListCount + 1;
-    Events = malloc(Count * sizeof(HANDLE));
-    if (Events == NULL)
-        goto fail1;
-
-    Index = 0;
-    for (ListEntry = Console->ListHead.Flink;
-         ListEntry != &Console->ListHead;
-         ListEntry = ListEntry->Flink) {
-        PMONITOR_CONNECTION Connection;
-
-        Connection = CONTAINING_RECORD(ListEntry,
-                                       MONITOR_CONNECTION,
-                                       ListEntry);
-
-#pragma warning(suppress: 6386) // Buffer overflow
-        Events[Index] = Connection->Thread;
-        ++Index;
-    }
-    Events[Count - 1] = Console->ServerThread;
-
-    LeaveCriticalSection(&Console->CriticalSection);
-
-    SetEvent(Console->ServerEvent);
-    WaitForMultipleObjects(Count, Events, TRUE, INFINITE);
-
-    return;
-
-fail1:
-    LeaveCriticalSection(&Console->CriticalSection);
-
-    // set the event and wait for the server thread anyway
-    SetEvent(Console->ServerEvent);
-    WaitForSingleObject(Console->ServerThread, INFINITE);
-}
-
 static VOID
 ConsoleDestroy(
     _In_ PMONITOR_CONSOLE   Console
@@ -1121,17 +1991,28 @@ ConsoleDestroy(
     CloseHandle(Console->ExecutableEvent);
     Console->ExecutableEvent = NULL;
 
-    ConsoleWaitForPipes(Console);
+    ConsoleStop(Console);
 
-    CloseHandle(Console->ServerEvent);
-    Console->ServerEvent = NULL;
+    if (Console->Capture != NULL) {
+        CaptureDestroy(Console->Capture);
+        Console->Capture = NULL;
+    }
 
-    SetEvent(Console->DeviceEvent);
-    WaitForSingleObject(Console->DeviceThread, INFINITE);
+    CloseHandle(Console->InputEvent);
+    Console->InputEvent = NULL;
 
     CloseHandle(Console->DeviceEvent);
     Console->DeviceEvent = NULL;
 
+    LocalFree(Console->PipeSecurity);
+    Console->PipeSecurity = NULL;
+
+    CloseHandle(Console->IdleEvent);
+    Console->IdleEvent = NULL;
+
+    CloseHandle(Console->ServerEvent);
+    Console->ServerEvent = NULL;
+
     UnregisterDeviceNotification(Console->DeviceNotification);
     Console->DeviceNotification = NULL;
 
@@ -1143,9 +2024,12 @@ ConsoleDestroy(
     CloseHandle(Console->DeviceHandle);
     Console->DeviceHandle = INVALID_HANDLE_VALUE;
 
+    SharedUnmap(Console);
+
     free(Console->DevicePath);
     Console->DevicePath = NULL;
 
+    DeleteCriticalSection(&Console->SharedLock);
     DeleteCriticalSection(&Console->CriticalSection);
     ZeroMemory(&Console->ListHead, sizeof(LIST_ENTRY));
     ZeroMemory(&Console->ListEntry, sizeof(LIST_ENTRY));
@@ -1155,6 +2039,60 @@ ConsoleDestroy(
     Log("<====");
 }
 
+static VOID
+MonitorLogStatistics(
+    VOID
+    )
+{
+    PMONITOR_CONTEXT    Context = &MonitorContext;
+    REACTOR_STATISTICS  Statistics;
+    PLIST_ENTRY         ListEntry;
+
+    ReactorGetStatistics(&Statistics);
+
+    Log("REACTOR: THREADS %u EVENTS %llu DISPATCH AVERAGE %lluus MAXIMUM %lluus",
+        Statistics.Threads,
+        Statistics.Events,
+        Statistics.DispatchAverage,
+        Statistics.DispatchMaximum);
+
+    EnterCriticalSection(&Context->CriticalSection);
+    for (ListEntry = Context->ListHead.Flink;
+         ListEntry != &Context->ListHead;
+         ListEntry = ListEntry->Flink) {
+        PMONITOR_CONSOLE    Console;
+        ULONGLONG           Elapsed;
+
+        Console = CONTAINING_RECORD(ListEntry,
+                                    MONITOR_CONSOLE,
+                                    ListEntry);
+
+        Elapsed = (GetTickCount64() - Console->StartTime) / 1000;
+
+        Log("%s: CLIENTS %u READ %llu BYTES (%llu BYTES/S)",
+            Console->DeviceName,
+            Console->ListCount,
+            Console->BytesRead,
+            (Elapsed != 0) ? Console->BytesRead / Elapsed : Console->BytesRead);
+
+        if (Console->Capture != NULL) {
+            CAPTURE_STATISTICS  Capture;
+
+            CaptureGetStatistics(Console->Capture, &Capture);
+
+            Log("%s: CAPTURE QUEUED %llu DROPPED %llu WRITTEN %llu BLOCKS %llu FILES %u ERRORS %u",
+                Console->DeviceName,
+                Capture.BytesQueued,
+                Capture.BytesDropped,
+                Capture.BytesWritten,
+                Capture.Blocks,
+                Capture.Files,
+                Capture.Errors);
+        }
+    }
+    LeaveCriticalSection(&Context->CriticalSection);
+}
+
 static BOOL
 MonitorAdd(
     _In_ PWCHAR         DevicePath
@@ -1368,6 +2306,49 @@ MonitorRemoveAll(
     Log("<=====");
 }
 
+// Controls arrive on the service dispatcher thread and may do so
+// before MonitorMain() has finished starting up or after it has torn
+// down the console list, so any control that touches the list is only
+// acted on between MonitorControlBegin() and MonitorControlEnd().
+static BOOL
+MonitorControlBegin(
+    VOID
+    )
+{
+    PMONITOR_CONTEXT    Context = &MonitorContext;
+
+    AcquireSRWLockShared(&Context->ControlLock);
+
+    if (Context->Stopping) {
+        ReleaseSRWLockShared(&Context->ControlLock);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static VOID
+MonitorControlEnd(
+    VOID
+    )
+{
+    PMONITOR_CONTEXT    Context = &MonitorContext;
+
+    ReleaseSRWLockShared(&Context->ControlLock);
+}
+
+static VOID
+MonitorControlStop(
+    VOID
+    )
+{
+    PMONITOR_CONTEXT    Context = &MonitorContext;
+
+    AcquireSRWLockExclusive(&Context->ControlLock);
+    Context->Stopping = TRUE;
+    ReleaseSRWLockExclusive(&Context->ControlLock);
+}
+
 DWORD WINAPI
 MonitorCtrlHandlerEx(
     _In_ DWORD          Ctrl,
@@ -1391,9 +2372,21 @@ MonitorCtrlHandlerEx(
         ReportStatus(SERVICE_RUNNING, NO_ERROR, 0);
         return NO_ERROR;
 
+    case MONITOR_CONTROL_STATISTICS:
+        if (!MonitorControlBegin())
+            return NO_ERROR;
+
+        MonitorLogStatistics();
+
+        MonitorControlEnd();
+        return NO_ERROR;
+
     case SERVICE_CONTROL_DEVICEEVENT: {
         PDEV_BROADCAST_HDR  Header = EventData;
 
+        if (!MonitorControlBegin())
+            return NO_ERROR;
+
         switch (EventType) {
         case DBT_DEVICEARRIVAL:
             if (Header->dbch_devicetype == DBT_DEVTYP_DEVICEINTERFACE) {
@@ -1416,6 +2409,7 @@ MonitorCtrlHandlerEx(
             break;
         }
 
+        MonitorControlEnd();
         return NO_ERROR;
     }
     default:
@@ -1426,6 +2420,66 @@ MonitorCtrlHandlerEx(
     return ERROR_CALL_NOT_IMPLEMENTED;
 }
 
+static DWORD
+GetDwordParameter(
+    _In_ PSTR           Name,
+    _In_ DWORD          Default
+    )
+{
+    PMONITOR_CONTEXT    Context = &MonitorContext;
+    DWORD               Value;
+    DWORD               Length;
+    DWORD               Type;
+    HRESULT             Error;
+
+    Length = sizeof(DWORD);
+
+    Error = RegQueryValueExA(Context->ParametersKey,
+                             Name,
+                             NULL,
+                             &Type,
+                             (LPBYTE)&Value,
+                             &Length);
+    if (Error != ERROR_SUCCESS || Type != REG_DWORD)
+        return Default;
+
+    Log("%s = %u", Name, Value);
+
+    return Value;
+}
+
+static BOOL
+GetStringParameter(
+    _In_ PSTR                       Name,
+    _Out_writes_z_(Size) PSTR       Buffer,
+    _In_ DWORD                      Size
+    )
+{
+    PMONITOR_CONTEXT                Context = &MonitorContext;
+    DWORD                           Length;
+    DWORD                           Type;
+    HRESULT                         Error;
+
+    Length = Size - 1;
+
+    Error = RegQueryValueExA(Context->ParametersKey,
+                             Name,
+                             NULL,
+                             &Type,
+                             (LPBYTE)Buffer,
+                             &Length);
+    if (Error != ERROR_SUCCESS || Type != REG_SZ) {
+        Buffer[0] = '\0';
+        return FALSE;
+    }
+
+    Buffer[Length] = '\0';
+
+    Log("%s = %s", Name, Buffer);
+
+    return TRUE;
+}
+
 VOID WINAPI
 MonitorMain(
     _In_    DWORD                   argc,
@@ -1449,6 +2503,61 @@ MonitorMain(
     if (Error != ERROR_SUCCESS)
         goto fail1;
 
+    Context->OutputQueueSize = GetDwordParameter("OutputQueueSize",
+                                                 OUTPUT_QUEUE_SIZE);
+    if (Context->OutputQueueSize == 0)
+        Context->OutputQueueSize = OUTPUT_QUEUE_SIZE;
+
+    Context->OutputOverflowPolicy = GetDwordParameter("OutputOverflowPolicy",
+                                                      HUB_OVERFLOW_DROP_OLDEST);
+    if (Context->OutputOverflowPolicy >= HUB_OVERFLOW_POLICY_COUNT)
+        Context->OutputOverflowPolicy = HUB_OVERFLOW_DROP_OLDEST;
+
+    Context->DeviceReadCount = GetDwordParameter("DeviceReads",
+                                                 DEVICE_READ_COUNT);
+    if (Context->DeviceReadCount == 0 ||
+        Context->DeviceReadCount > MAXIMUM_READ_COUNT)
+        Context->DeviceReadCount = DEVICE_READ_COUNT;
+
+    Context->DeviceReadSize = GetDwordParameter("DeviceReadSize",
+                                                DEVICE_READ_SIZE);
+    if (Context->DeviceReadSize == 0)
+        Context->DeviceReadSize = DEVICE_READ_SIZE;
+
+    // Output is only captured to disk if a directory is configured
+    if (GetStringParameter("CaptureDirectory",
+                           Context->CaptureParameters.Directory,
+                           sizeof(Context->CaptureParameters.Directory))) {
+        PCAPTURE_PARAMETERS Parameters = &Context->CaptureParameters;
+
+        Parameters->MaximumSize =
+            (ULONGLONG)GetDwordParameter("CaptureMaximumSize",
+                                         CAPTURE_MAXIMUM_SIZE) << 20;
+        if (Parameters->MaximumSize == 0)
+            Parameters->MaximumSize = (ULONGLONG)CAPTURE_MAXIMUM_SIZE << 20;
+
+        Parameters->MaximumAge = GetDwordParameter("CaptureMaximumAge",
+                                                   CAPTURE_MAXIMUM_AGE);
+        if (Parameters->MaximumAge == 0)
+            Parameters->MaximumAge = CAPTURE_MAXIMUM_AGE;
+
+        Parameters->Files = GetDwordParameter("CaptureFiles",
+                                              CAPTURE_FILES);
+        Parameters->Algorithm = GetDwordParameter("CaptureCompression",
+                                                  COMPRESS_ALGORITHM_XPRESS_HUFF);
+        Parameters->Flush = GetDwordParameter("CaptureFlush",
+                                              CAPTURE_FLUSH_ROTATE);
+        if (Parameters->Flush >= CAPTURE_FLUSH_POLICY_COUNT)
+            Parameters->Flush = CAPTURE_FLUSH_ROTATE;
+    }
+
+    // The control handler can use these as soon as it is registered
+    InitializeSRWLock(&Context->ControlLock);
+    Context->Stopping = FALSE;
+
+    __InitializeListHead(&Context->ListHead);
+    InitializeCriticalSection(&Context->CriticalSection);
+
     Context->Service = RegisterServiceCtrlHandlerExA(MONITOR_NAME,
                                                     MonitorCtrlHandlerEx,
                                                     NULL);
@@ -1473,6 +2582,10 @@ MonitorMain(
     if (Context->StopEvent == NULL)
         goto fail4;
 
+    if (!ReactorInitialize(GetDwordParameter("ReactorThreads",
+                                             REACTOR_THREADS)))
+        goto fail5;
+
     ZeroMemory(&Interface, sizeof (Interface));
     Interface.dbcc_size = sizeof (Interface);
     Interface.dbcc_devicetype = DBT_DEVTYP_DEVICEINTERFACE;
@@ -1483,19 +2596,20 @@ MonitorMain(
                                    &Interface,
                                    DEVICE_NOTIFY_SERVICE_HANDLE);
     if (Context->InterfaceNotification == NULL)
-        goto fail5;
+        goto fail6;
 
     ReportStatus(SERVICE_RUNNING, NO_ERROR, 0);
 
-    __InitializeListHead(&Context->ListHead);
-    InitializeCriticalSection(&Context->CriticalSection);
-
     MonitorEnumerate();
 
     Log("Waiting...");
     WaitForSingleObject(Context->StopEvent, INFINITE);
     Log("Wait Complete");
 
+    MonitorControlStop();
+
+    MonitorLogStatistics();
+
     MonitorRemoveAll();
 
     DeleteCriticalSection(&Context->CriticalSection);
@@ -1503,6 +2617,8 @@ MonitorMain(
 
     UnregisterDeviceNotification(Context->InterfaceNotification);
 
+    ReactorTeardown();
+
     CloseHandle(Context->StopEvent);
 
     ReportStatus(SERVICE_STOPPED, NO_ERROR, 0);
@@ -1515,6 +2631,11 @@ MonitorMain(
 
     return;
 
+fail6:
+    Log("fail6");
+
+    ReactorTeardown();
+
 fail5:
     Log("fail5");
 
@@ -1533,6 +2654,11 @@ fail3:
 fail2:
     Log("fail2");
 
+    MonitorControlStop();
+
+    DeleteCriticalSection(&Context->CriticalSection);
+    ZeroMemory(&Context->ListHead, sizeof(LIST_ENTRY));
+
     CloseHandle(Context->ParametersKey);
 
 fail1:
@@ -1741,6 +2867,15 @@ WinMain(
              Success = MonitorCreate();
          else if (_stricmp(CmdLine, "delete") == 0)
              Success = MonitorDelete();
+         else if (_strnicmp(CmdLine, "query", 5) == 0 &&
+                  (CmdLine[5] == '\0' || CmdLine[5] == ' ')) {
+             // This is a GUI subsystem executable, so borrow the
+             // console of whatever started it for usage and errors
+             if (AttachConsole(ATTACH_PARENT_PROCESS))
+                 (VOID) freopen("CONOUT$", "w", stderr);
+
+             Success = QueryCapture(CmdLine + 5);
+         }
          else
              Success = FALSE;
     } else
@@ -0,0 +1,87 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _MONITOR_COMPAT_H
+#define _MONITOR_COMPAT_H
+
+// The parts of the monitor that don't touch a device or a pipe (the
+// output hub, the capture writer and the reactor core) are also built
+// on other hosts for the tests in src/test. On Windows this is just
+// <windows.h>; elsewhere it supplies the few types and annotations
+// those files use.
+
+#if defined(_WIN32)
+
+#include <windows.h>
+
+#else   // !_WIN32
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+typedef void                VOID, *PVOID;
+typedef char                CHAR, *PCHAR, *PSTR;
+typedef const char          *PCSTR;
+typedef unsigned char       UCHAR, *PUCHAR;
+typedef int                 BOOL, *PBOOL;
+typedef uint32_t            DWORD, *PDWORD;
+typedef int32_t             LONG, *PLONG;
+typedef int64_t             LONG64, *PLONG64;
+typedef int64_t             LONGLONG, *PLONGLONG;
+typedef uint32_t            ULONG, *PULONG;
+typedef uint64_t            ULONGLONG, *PULONGLONG;
+typedef uintptr_t           ULONG_PTR, *PULONG_PTR;
+
+#define TRUE    1
+#define FALSE   0
+
+#define _In_
+#define _In_opt_
+#define _Out_
+#define _Out_opt_
+#define _Inout_
+#define _In_reads_bytes_(_Size)
+#define _Out_writes_bytes_(_Size)
+#define _Out_writes_z_(_Size)
+
+#define UNREFERENCED_PARAMETER(_Parameter)  (void)(_Parameter)
+
+#define CONTAINING_RECORD(_Address, _Type, _Field) \
+        ((_Type *)((PCHAR)(_Address) - offsetof(_Type, _Field)))
+
+#define ZeroMemory(_Destination, _Length) \
+        memset((_Destination), 0, (_Length))
+
+#endif  // _WIN32
+
+#endif  // _MONITOR_COMPAT_H
@@ -0,0 +1,830 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+// Extracts a time range from a capture file and the files rotated out
+// of it (<name>.1.xcap being the most recent), oldest first, as if they
+// were one. In each file the sidecar index is binary searched for the
+// last block that starts no later than the start of the range, so only
+// O(log n) index entries are read before the blocks that are wanted.
+// Without a usable index every block header from the start of the file
+// is read instead. Whole blocks are copied, so the output can start up
+// to a block earlier and finish up to a block later than asked for.
+//
+// Nothing here needs Windows except decompression; elsewhere only
+// stored blocks can be copied (see src/test/query_test.c).
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "monitor_compat.h"
+
+#if defined(_WIN32)
+#include <compressapi.h>
+#endif
+
+#include <xencons_capture.h>
+
+#include "query.h"
+
+#define QUERY_MAXIMUM_BLOCK_SIZE    (16 * 1024 * 1024)
+#define QUERY_MAXIMUM_FILES         1000
+#define QUERY_MAXIMUM_NAME          260
+
+typedef struct _QUERY_FILE {
+    FILE                    *Capture;
+    XENCONS_CAPTURE_HEADER  Header;
+    FILE                    *Index;
+    ULONG                   EntrySize;
+    ULONGLONG               Entries;
+    ULONGLONG               First;      // Position of the first block
+#if defined(_WIN32)
+    DECOMPRESSOR_HANDLE     Decompressor;
+#endif
+} QUERY_FILE, *PQUERY_FILE;
+
+typedef struct _QUERY {
+    CHAR                Stem[QUERY_MAXIMUM_NAME];
+    DWORD               Newest;     // Rotation number of the named file
+    DWORD               Oldest;
+    FILE                *Output;
+    PUCHAR              Compressed;
+    PUCHAR              Buffer;
+    PQUERY_STATISTICS   Statistics;
+} QUERY, *PQUERY;
+
+static VOID
+__QueryError(
+    _In_ PCSTR  Message,
+    _In_ PCSTR  Name
+    )
+{
+    fprintf(stderr, "query: %s: %s\n", Name, Message);
+}
+
+static PSTR
+__QueryNextArgument(
+    _Inout_ PSTR    *Cursor
+    )
+{
+    PSTR            Argument;
+    PSTR            End;
+
+    Argument = *Cursor;
+    while (*Argument == ' ')
+        Argument++;
+
+    if (*Argument == '\0')
+        return NULL;
+
+    if (*Argument == '"') {
+        Argument++;
+        End = strchr(Argument, '"');
+    } else {
+        End = strchr(Argument, ' ');
+    }
+
+    if (End != NULL) {
+        *End = '\0';
+        *Cursor = End + 1;
+    } else {
+        *Cursor = Argument + strlen(Argument);
+    }
+
+    return Argument;
+}
+
+// Days from 1601-01-01, the FILETIME epoch, to the given date in the
+// proleptic Gregorian calendar
+static LONGLONG
+__QueryDays(
+    _In_ LONGLONG   Year,
+    _In_ LONGLONG   Month,
+    _In_ LONGLONG   Day
+    )
+{
+    LONGLONG        Era;
+    LONGLONG        YearOfEra;
+    LONGLONG        DayOfYear;
+
+    // Count from 1 March, so the leap day is the last of the year
+    if (Month <= 2)
+        Year--;
+
+    Era = Year / 400;
+    YearOfEra = Year - Era * 400;
+    DayOfYear = (153 * (Month + ((Month > 2) ? -3 : 9)) + 2) / 5 + Day - 1;
+
+    // 584694 is the same count for 1601-01-01
+    return Era * 146097 +
+           YearOfEra * 365 + YearOfEra / 4 - YearOfEra / 100 +
+           DayOfYear - 584694;
+}
+
+static BOOL
+__QueryParseTime(
+    _In_ PCSTR          String,
+    _Out_ PULONGLONG    Time
+    )
+{
+    unsigned int        Year, Month, Day;
+    unsigned int        Hour, Minute, Second;
+    LONGLONG            Seconds;
+
+    if (sscanf(String,
+               "%4u-%2u-%2uT%2u:%2u:%2u",
+               &Year, &Month, &Day,
+               &Hour, &Minute, &Second) != 6)
+        return FALSE;
+
+    if (Year < 1601 || Month < 1 || Month > 12 || Day < 1 || Day > 31 ||
+        Hour > 23 || Minute > 59 || Second > 59)
+        return FALSE;
+
+    Seconds = __QueryDays(Year, Month, Day) * 86400 +
+              Hour * 3600 + Minute * 60 + Second;
+
+    *Time = (ULONGLONG)Seconds * 10000000;
+
+    return TRUE;
+}
+
+static BOOL
+__QuerySeek(
+    _In_ FILE       *File,
+    _In_ ULONGLONG  Position
+    )
+{
+#if defined(_WIN32)
+    return (_fseeki64(File, (__int64)Position, SEEK_SET) == 0);
+#else
+    return (fseeko(File, (off_t)Position, SEEK_SET) == 0);
+#endif
+}
+
+static BOOL
+__QueryGetSize(
+    _In_ FILE       *File,
+    _Out_ PULONGLONG Size
+    )
+{
+#if defined(_WIN32)
+    __int64         End;
+
+    if (_fseeki64(File, 0, SEEK_END) != 0)
+        return FALSE;
+
+    End = _ftelli64(File);
+#else
+    off_t           End;
+
+    if (fseeko(File, 0, SEEK_END) != 0)
+        return FALSE;
+
+    End = ftello(File);
+#endif
+
+    if (End < 0)
+        return FALSE;
+
+    *Size = (ULONGLONG)End;
+    return TRUE;
+}
+
+static BOOL
+__QueryRead(
+    _In_ FILE                       *File,
+    _In_ ULONGLONG                  Position,
+    _Out_writes_bytes_(Length) PVOID Buffer,
+    _In_ DWORD                      Length
+    )
+{
+    if (!__QuerySeek(File, Position))
+        return FALSE;
+
+    return (fread(Buffer, 1, Length, File) == Length);
+}
+
+// Index 0 is the file named on the command line
+static BOOL
+__QueryFileName(
+    _In_ PQUERY                 Query,
+    _In_ DWORD                  Rotation,
+    _In_ PCSTR                  Extension,
+    _Out_writes_z_(QUERY_MAXIMUM_NAME) PSTR FileName
+    )
+{
+    int                         Length;
+
+    if (Rotation == 0)
+        Length = snprintf(FileName,
+                          QUERY_MAXIMUM_NAME,
+                          "%s.%s",
+                          Query->Stem,
+                          Extension);
+    else
+        Length = snprintf(FileName,
+                          QUERY_MAXIMUM_NAME,
+                          "%s.%u.%s",
+                          Query->Stem,
+                          (unsigned int)Rotation,
+                          Extension);
+
+    return (Length > 0 && Length < QUERY_MAXIMUM_NAME);
+}
+
+static BOOL
+__QueryFileExists(
+    _In_ PQUERY     Query,
+    _In_ DWORD      Rotation
+    )
+{
+    CHAR            FileName[QUERY_MAXIMUM_NAME];
+    FILE            *File;
+
+    if (!__QueryFileName(Query, Rotation, XENCONS_CAPTURE_EXTENSION, FileName))
+        return FALSE;
+
+    File = fopen(FileName, "rb");
+    if (File == NULL)
+        return FALSE;
+
+    fclose(File);
+    return TRUE;
+}
+
+// Split "<stem>[.<n>].xcap" so that the files rotated out of it
+// (<stem>.<n+1>.xcap and so on) can be found
+static BOOL
+QueryFindFiles(
+    _In_ PQUERY     Query,
+    _In_ PCSTR      CaptureName
+    )
+{
+    PSTR            Extension;
+    PSTR            Dot;
+    PSTR            End;
+    unsigned long   Rotation;
+
+    if (strlen(CaptureName) >= sizeof (Query->Stem))
+        return FALSE;
+
+    strcpy(Query->Stem, CaptureName);
+
+    Extension = strrchr(Query->Stem, '.');
+    if (Extension == NULL ||
+        strcmp(Extension + 1, XENCONS_CAPTURE_EXTENSION) != 0)
+        return FALSE;
+
+    *Extension = '\0';
+
+    Query->Newest = 0;
+
+    Dot = strrchr(Query->Stem, '.');
+    if (Dot != NULL && Dot[1] != '\0') {
+        Rotation = strtoul(Dot + 1, &End, 10);
+        if (*End == '\0' && Rotation < QUERY_MAXIMUM_FILES) {
+            *Dot = '\0';
+            Query->Newest = (DWORD)Rotation;
+        }
+    }
+
+    Query->Oldest = Query->Newest;
+    while (Query->Oldest + 1 < QUERY_MAXIMUM_FILES &&
+           __QueryFileExists(Query, Query->Oldest + 1))
+        Query->Oldest++;
+
+    return TRUE;
+}
+
+// Any problem with the index just means doing without it
+static VOID
+QueryOpenIndex(
+    _In_ PQUERY                     Query,
+    _In_ DWORD                      Rotation,
+    _In_ PQUERY_FILE                File
+    )
+{
+    XENCONS_CAPTURE_INDEX_HEADER    Header;
+    CHAR                            IndexName[QUERY_MAXIMUM_NAME];
+    ULONGLONG                       Size;
+
+    if (!__QueryFileName(Query,
+                         Rotation,
+                         XENCONS_CAPTURE_INDEX_EXTENSION,
+                         IndexName))
+        return;
+
+    File->Index = fopen(IndexName, "rb");
+    if (File->Index == NULL)
+        return;
+
+    if (!__QueryRead(File->Index, 0, &Header, sizeof(Header)) ||
+        Header.Magic != XENCONS_CAPTURE_INDEX_MAGIC ||
+        Header.Version != XENCONS_CAPTURE_INDEX_VERSION ||
+        Header.EntrySize < sizeof(XENCONS_CAPTURE_INDEX_ENTRY) ||
+        Header.Time != File->Header.Time ||
+        !__QueryGetSize(File->Index, &Size))
+        goto fail;
+
+    File->EntrySize = Header.EntrySize;
+    File->Entries = (Size - sizeof(Header)) / Header.EntrySize;
+
+    return;
+
+fail:
+    __QueryError("index not usable, reading every block header", IndexName);
+
+    fclose(File->Index);
+    File->Index = NULL;
+}
+
+static VOID
+QueryCloseFile(
+    _In_ PQUERY_FILE    File
+    )
+{
+    if (File->Index != NULL)
+        fclose(File->Index);
+
+#if defined(_WIN32)
+    if (File->Decompressor != NULL)
+        CloseDecompressor(File->Decompressor);
+#endif
+
+    if (File->Capture != NULL)
+        fclose(File->Capture);
+
+    ZeroMemory(File, sizeof(QUERY_FILE));
+}
+
+static BOOL
+QueryOpenFile(
+    _In_ PQUERY             Query,
+    _In_ DWORD              Rotation,
+    _Out_ PQUERY_FILE       File
+    )
+{
+    CHAR                    FileName[QUERY_MAXIMUM_NAME];
+
+    ZeroMemory(File, sizeof(QUERY_FILE));
+
+    if (!__QueryFileName(Query, Rotation, XENCONS_CAPTURE_EXTENSION, FileName))
+        goto fail1;
+
+    File->Capture = fopen(FileName, "rb");
+    if (File->Capture == NULL) {
+        __QueryError("cannot open", FileName);
+        goto fail2;
+    }
+
+    if (!__QueryRead(File->Capture, 0, &File->Header, sizeof(File->Header)) ||
+        File->Header.Magic != XENCONS_CAPTURE_MAGIC) {
+        __QueryError("not a capture file", FileName);
+        goto fail3;
+    }
+
+    if (File->Header.Version != XENCONS_CAPTURE_VERSION ||
+        File->Header.BlockSize == 0 ||
+        File->Header.BlockSize > QUERY_MAXIMUM_BLOCK_SIZE) {
+        __QueryError("unsupported capture version or block size", FileName);
+        goto fail4;
+    }
+
+#if defined(_WIN32)
+    if (File->Header.Algorithm != 0 &&
+        !CreateDecompressor(File->Header.Algorithm | COMPRESS_RAW,
+                            NULL,
+                            &File->Decompressor)) {
+        __QueryError("unsupported compression algorithm", FileName);
+        goto fail5;
+    }
+#endif
+
+    File->First = sizeof(XENCONS_CAPTURE_HEADER);
+
+    QueryOpenIndex(Query, Rotation, File);
+
+    Query->Statistics->Files++;
+
+    return TRUE;
+
+#if defined(_WIN32)
+fail5:
+#endif
+fail4:
+fail3:
+    fclose(File->Capture);
+    File->Capture = NULL;
+
+fail2:
+fail1:
+    return FALSE;
+}
+
+static BOOL
+__QueryReadEntry(
+    _In_ PQUERY                         Query,
+    _In_ PQUERY_FILE                    File,
+    _In_ ULONGLONG                      Index,
+    _Out_ PXENCONS_CAPTURE_INDEX_ENTRY  Entry
+    )
+{
+    Query->Statistics->IndexReads++;
+
+    return __QueryRead(File->Index,
+                       sizeof(XENCONS_CAPTURE_INDEX_HEADER) +
+                       Index * File->EntrySize,
+                       Entry,
+                       sizeof(XENCONS_CAPTURE_INDEX_ENTRY));
+}
+
+// Find the last indexed block that starts no later than From
+static ULONGLONG
+QuerySeek(
+    _In_ PQUERY                 Query,
+    _In_ PQUERY_FILE            File,
+    _In_ ULONGLONG              From
+    )
+{
+    XENCONS_CAPTURE_INDEX_ENTRY Entry;
+    ULONGLONG                   Low;
+    ULONGLONG                   High;
+
+    if (File->Index == NULL)
+        return File->First;
+
+    Low = 0;
+    High = File->Entries;
+
+    while (Low < High) {
+        ULONGLONG   Middle = Low + (High - Low) / 2;
+
+        if (!__QueryReadEntry(Query, File, Middle, &Entry))
+            return File->First;
+
+        if (Entry.Time <= From)
+            Low = Middle + 1;
+        else
+            High = Middle;
+    }
+
+    if (Low == 0 ||
+        !__QueryReadEntry(Query, File, Low - 1, &Entry))
+        return File->First;
+
+    return Entry.Position;
+}
+
+static BOOL
+__QueryReadBlock(
+    _In_ PQUERY                     Query,
+    _In_ PQUERY_FILE                File,
+    _In_ ULONGLONG                  Position,
+    _Out_ PXENCONS_CAPTURE_BLOCK    Block
+    )
+{
+    Query->Statistics->BlockReads++;
+
+    if (!__QueryRead(File->Capture, Position, Block, sizeof(*Block)))
+        return FALSE;
+
+    if (Block->Magic != XENCONS_CAPTURE_BLOCK_MAGIC ||
+        Block->Length > File->Header.BlockSize ||
+        Block->CompressedLength > File->Header.BlockSize)
+        return FALSE;
+
+    if ((Block->Flags & XENCONS_CAPTURE_BLOCK_STORED) &&
+        Block->CompressedLength != Block->Length)
+        return FALSE;
+
+    return TRUE;
+}
+
+static BOOL
+QueryCopyBlock(
+    _In_ PQUERY                 Query,
+    _In_ PQUERY_FILE            File,
+    _In_ ULONGLONG              Position,
+    _In_ PXENCONS_CAPTURE_BLOCK Block
+    )
+{
+    PUCHAR                      Data;
+
+    if (!__QueryRead(File->Capture,
+                     Position + sizeof(*Block),
+                     Query->Compressed,
+                     Block->CompressedLength)) {
+        fprintf(stderr, "query: block at %llu is torn\n",
+                (unsigned long long)Position);
+        return FALSE;
+    }
+
+    if (Block->Flags & XENCONS_CAPTURE_BLOCK_STORED) {
+        Data = Query->Compressed;
+    } else {
+#if defined(_WIN32)
+        SIZE_T  Length;
+
+        if (File->Decompressor == NULL ||
+            !Decompress(File->Decompressor,
+                        Query->Compressed,
+                        Block->CompressedLength,
+                        Query->Buffer,
+                        Block->Length,
+                        &Length) ||
+            Length != Block->Length) {
+            fprintf(stderr, "query: block at %llu does not decompress\n",
+                    (unsigned long long)Position);
+            return FALSE;
+        }
+
+        Data = Query->Buffer;
+#else
+        fprintf(stderr, "query: block at %llu is compressed, which needs "
+                "the Windows Compression API\n",
+                (unsigned long long)Position);
+        return FALSE;
+#endif
+    }
+
+    if (fwrite(Data, 1, Block->Length, Query->Output) != Block->Length) {
+        fprintf(stderr, "query: failed to write output\n");
+        return FALSE;
+    }
+
+    if (Query->Statistics->Blocks++ == 0)
+        Query->Statistics->FirstOffset = Block->Offset;
+
+    Query->Statistics->LastOffset = Block->Offset;
+    Query->Statistics->BytesCopied += Block->Length;
+
+    return TRUE;
+}
+
+// Copy the blocks of File that the range needs. Next is the first
+// block of the following file, if there is one, as the last block here
+// is only wanted if that one starts after From.
+static BOOL
+QueryExtractFile(
+    _In_ PQUERY                     Query,
+    _In_ PQUERY_FILE                File,
+    _In_opt_ PXENCONS_CAPTURE_BLOCK NextFirst,
+    _In_ ULONGLONG                  From,
+    _In_ ULONGLONG                  To
+    )
+{
+    XENCONS_CAPTURE_BLOCK           Block;
+    XENCONS_CAPTURE_BLOCK           Next;
+    ULONGLONG                       Position;
+    ULONGLONG                       NextPosition;
+
+    Position = QuerySeek(Query, File, From);
+
+    // An empty capture, or one torn before its first block
+    if (!__QueryReadBlock(Query, File, Position, &Block))
+        return TRUE;
+
+    while (Block.Time <= To) {
+        PXENCONS_CAPTURE_BLOCK  After;
+        BOOL                    More;
+
+        NextPosition = Position + sizeof(Block) + Block.CompressedLength;
+        More = __QueryReadBlock(Query, File, NextPosition, &Next);
+
+        After = (More) ? &Next : NextFirst;
+
+        // A block is wanted unless the one after it also starts before
+        // the range does
+        if (After == NULL || After->Time > From) {
+            if (!QueryCopyBlock(Query, File, Position, &Block))
+                return FALSE;
+        }
+
+        if (!More)
+            break;
+
+        Block = Next;
+        Position = NextPosition;
+    }
+
+    return TRUE;
+}
+
+static BOOL
+QueryExtract(
+    _In_ PQUERY             Query,
+    _In_ ULONGLONG          From,
+    _In_ ULONGLONG          To
+    )
+{
+    QUERY_FILE              File;
+    QUERY_FILE              Next;
+    XENCONS_CAPTURE_BLOCK   NextFirst;
+    DWORD                   Rotation;
+    BOOL                    HaveNext;
+    BOOL                    Success;
+
+    ZeroMemory(&Next, sizeof(QUERY_FILE));
+
+    if (!QueryOpenFile(Query, Query->Oldest, &File))
+        return FALSE;
+
+    Success = TRUE;
+    for (Rotation = Query->Oldest; ; --Rotation) {
+        HaveNext = FALSE;
+
+        if (Rotation != Query->Newest) {
+            if (!QueryOpenFile(Query, Rotation - 1, &Next)) {
+                Success = FALSE;
+                break;
+            }
+
+            HaveNext = __QueryReadBlock(Query, &Next, Next.First, &NextFirst);
+        }
+
+        // A file is only worth looking in if the next one starts after
+        // From, and none after it can be wanted once one starts after To
+        if (!HaveNext || NextFirst.Time > From) {
+            Success = QueryExtractFile(Query,
+                                       &File,
+                                       (HaveNext) ? &NextFirst : NULL,
+                                       From,
+                                       To);
+            if (!Success)
+                break;
+        }
+
+        QueryCloseFile(&File);
+
+        if (Rotation == Query->Newest ||
+            (HaveNext && NextFirst.Time > To))
+            break;
+
+        File = Next;
+        ZeroMemory(&Next, sizeof(QUERY_FILE));
+    }
+
+    QueryCloseFile(&File);
+    QueryCloseFile(&Next);
+
+    return Success;
+}
+
+BOOL
+QueryExtractRange(
+    _In_ PCSTR              CaptureName,
+    _In_ ULONGLONG          From,
+    _In_ ULONGLONG          To,
+    _In_ PCSTR              OutputName,
+    _Out_ PQUERY_STATISTICS Statistics
+    )
+{
+    QUERY                   Query;
+    BOOL                    Success;
+
+    ZeroMemory(Statistics, sizeof(QUERY_STATISTICS));
+    ZeroMemory(&Query, sizeof(QUERY));
+    Query.Statistics = Statistics;
+
+    if (!QueryFindFiles(&Query, CaptureName)) {
+        __QueryError("not a ." XENCONS_CAPTURE_EXTENSION " file name",
+                     CaptureName);
+        goto fail1;
+    }
+
+    Query.Compressed = malloc(QUERY_MAXIMUM_BLOCK_SIZE);
+    Query.Buffer = malloc(QUERY_MAXIMUM_BLOCK_SIZE);
+    if (Query.Compressed == NULL || Query.Buffer == NULL) {
+        fprintf(stderr, "query: out of memory\n");
+        goto fail2;
+    }
+
+    Query.Output = fopen(OutputName, "wb");
+    if (Query.Output == NULL) {
+        __QueryError("cannot create", OutputName);
+        goto fail3;
+    }
+
+    Success = QueryExtract(&Query, From, To);
+
+    if (fclose(Query.Output) != 0) {
+        __QueryError("failed to write", OutputName);
+        Success = FALSE;
+    }
+
+    free(Query.Buffer);
+    free(Query.Compressed);
+
+    return Success;
+
+fail3:
+fail2:
+    free(Query.Buffer);
+    free(Query.Compressed);
+
+fail1:
+    return FALSE;
+}
+
+static VOID
+__QueryUsage(
+    VOID
+    )
+{
+    fprintf(stderr,
+            "usage: xencons_monitor query <capture> <from> <to> <output>\n"
+            "\n"
+            "Copies the console output captured between <from> and <to>,\n"
+            "given as UTC times in the form YYYY-MM-DDTHH:MM:SS, to the\n"
+            "file <output>. Files rotated out of <capture> (<name>.1.%s\n"
+            "and so on) are searched too.\n",
+            XENCONS_CAPTURE_EXTENSION);
+}
+
+BOOL
+QueryCapture(
+    _In_ PSTR           Arguments
+    )
+{
+    QUERY_STATISTICS    Statistics;
+    PSTR                CaptureName;
+    PSTR                FromString;
+    PSTR                ToString;
+    PSTR                OutputName;
+    ULONGLONG           From;
+    ULONGLONG           To;
+
+    CaptureName = __QueryNextArgument(&Arguments);
+    FromString = (CaptureName != NULL) ? __QueryNextArgument(&Arguments) : NULL;
+    ToString = (FromString != NULL) ? __QueryNextArgument(&Arguments) : NULL;
+    OutputName = (ToString != NULL) ? __QueryNextArgument(&Arguments) : NULL;
+
+    if (OutputName == NULL || __QueryNextArgument(&Arguments) != NULL)
+        goto fail1;
+
+    if (!__QueryParseTime(FromString, &From)) {
+        __QueryError("not a time", FromString);
+        goto fail2;
+    }
+
+    if (!__QueryParseTime(ToString, &To)) {
+        __QueryError("not a time", ToString);
+        goto fail3;
+    }
+
+    if (From > To) {
+        fprintf(stderr, "query: the range ends before it starts\n");
+        goto fail4;
+    }
+
+    if (!QueryExtractRange(CaptureName, From, To, OutputName, &Statistics))
+        goto fail5;
+
+    fprintf(stderr,
+            "query: copied %llu bytes in %llu blocks from %u files\n",
+            (unsigned long long)Statistics.BytesCopied,
+            (unsigned long long)Statistics.Blocks,
+            (unsigned int)Statistics.Files);
+
+    return TRUE;
+
+fail5:
+fail4:
+fail3:
+fail2:
+    return FALSE;
+
+fail1:
+    __QueryUsage();
+    return FALSE;
+}
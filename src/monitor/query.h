@@ -0,0 +1,68 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _MONITOR_QUERY_H
+#define _MONITOR_QUERY_H
+
+#include "monitor_compat.h"
+
+typedef struct _QUERY_STATISTICS {
+    DWORD       Files;          // Capture files opened
+    ULONGLONG   IndexReads;     // Index entries read
+    ULONGLONG   BlockReads;     // Block headers read
+    ULONGLONG   Blocks;         // Blocks copied
+    ULONGLONG   FirstOffset;    // Of the first block copied
+    ULONGLONG   LastOffset;     // Of the last block copied
+    ULONGLONG   BytesCopied;
+} QUERY_STATISTICS, *PQUERY_STATISTICS;
+
+// Copies the console output captured between two UTC FILETIMEs in a
+// capture file, and the files rotated out of it, into a plain output
+// file. Problems are described on stderr.
+extern BOOL
+QueryExtractRange(
+    _In_ PCSTR              CaptureName,
+    _In_ ULONGLONG          From,
+    _In_ ULONGLONG          To,
+    _In_ PCSTR              OutputName,
+    _Out_ PQUERY_STATISTICS Statistics
+    );
+
+// Handles "query <capture> <from> <to> <output>", with the times given
+// as YYYY-MM-DDTHH:MM:SS. Prints usage on stderr if the arguments are
+// wrong.
+extern BOOL
+QueryCapture(
+    _In_ PSTR   Arguments
+    );
+
+#endif  // _MONITOR_QUERY_H
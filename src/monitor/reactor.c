@@ -0,0 +1,245 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+// A completion port and a small pool of threads that run the function
+// attached to each completed I/O. This replaces a thread (and a
+// WaitForMultipleObjects() loop) per pipe client.
+
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "reactor.h"
+
+#define REACTOR_MAXIMUM_THREADS 64
+
+typedef struct _REACTOR {
+    HANDLE          Port;
+    HANDLE          *Threads;
+    DWORD           Count;
+    LARGE_INTEGER   Frequency;
+    LONG64          Events;
+    LONG64          DispatchTicks;
+    LONG64          DispatchMaximum;
+} REACTOR, *PREACTOR;
+
+static REACTOR  Reactor;
+
+static VOID
+__ReactorAccount(
+    _In_ LONG64 Ticks
+    )
+{
+    LONG64      Maximum;
+
+    InterlockedIncrement64(&Reactor.Events);
+    InterlockedAdd64(&Reactor.DispatchTicks, Ticks);
+
+    do {
+        Maximum = Reactor.DispatchMaximum;
+        if (Ticks <= Maximum)
+            break;
+    } while (InterlockedCompareExchange64(&Reactor.DispatchMaximum,
+                                          Ticks,
+                                          Maximum) != Maximum);
+}
+
+static DWORD WINAPI
+ReactorThread(
+    _In_ LPVOID     Argument
+    )
+{
+    UNREFERENCED_PARAMETER(Argument);
+
+    for (;;) {
+        LPOVERLAPPED    Overlapped;
+        ULONG_PTR       Key;
+        DWORD           Length;
+        DWORD           Error;
+        PREACTOR_IO     Io;
+        LARGE_INTEGER   Start;
+        LARGE_INTEGER   End;
+        BOOL            Success;
+
+        Success = GetQueuedCompletionStatus(Reactor.Port,
+                                            &Length,
+                                            &Key,
+                                            &Overlapped,
+                                            INFINITE);
+
+        // A packet without an OVERLAPPED is a request to exit
+        if (Overlapped == NULL)
+            break;
+
+        // Completions for associated handles carry a zero key; posted
+        // ones carry their error code in it.
+        Error = (Success) ? (DWORD)Key : GetLastError();
+
+        Io = CONTAINING_RECORD(Overlapped, REACTOR_IO, Overlapped);
+
+        QueryPerformanceCounter(&Start);
+        Io->Function(Io, Error, Length);
+        QueryPerformanceCounter(&End);
+
+        __ReactorAccount(End.QuadPart - Start.QuadPart);
+    }
+
+    return 0;
+}
+
+BOOL
+ReactorInitialize(
+    _In_ DWORD  Threads
+    )
+{
+    ZeroMemory(&Reactor, sizeof(REACTOR));
+
+    if (Threads == 0 || Threads > REACTOR_MAXIMUM_THREADS) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        goto fail1;
+    }
+
+    QueryPerformanceFrequency(&Reactor.Frequency);
+
+    Reactor.Port = CreateIoCompletionPort(INVALID_HANDLE_VALUE,
+                                          NULL,
+                                          0,
+                                          Threads);
+    if (Reactor.Port == NULL)
+        goto fail2;
+
+    Reactor.Threads = calloc(Threads, sizeof(HANDLE));
+    if (Reactor.Threads == NULL)
+        goto fail3;
+
+    for (Reactor.Count = 0; Reactor.Count < Threads; Reactor.Count++) {
+        Reactor.Threads[Reactor.Count] = CreateThread(NULL,
+                                                      0,
+                                                      ReactorThread,
+                                                      NULL,
+                                                      0,
+                                                      NULL);
+        if (Reactor.Threads[Reactor.Count] == NULL)
+            goto fail4;
+    }
+
+    return TRUE;
+
+fail4:
+    ReactorTeardown();
+    return FALSE;
+
+fail3:
+    CloseHandle(Reactor.Port);
+
+fail2:
+fail1:
+    ZeroMemory(&Reactor, sizeof(REACTOR));
+
+    return FALSE;
+}
+
+VOID
+ReactorTeardown(
+    VOID
+    )
+{
+    DWORD   Index;
+
+    for (Index = 0; Index < Reactor.Count; Index++)
+        (VOID) PostQueuedCompletionStatus(Reactor.Port, 0, 0, NULL);
+
+    for (Index = 0; Index < Reactor.Count; Index++) {
+        WaitForSingleObject(Reactor.Threads[Index], INFINITE);
+        CloseHandle(Reactor.Threads[Index]);
+    }
+
+    free(Reactor.Threads);
+    CloseHandle(Reactor.Port);
+
+    ZeroMemory(&Reactor, sizeof(REACTOR));
+}
+
+BOOL
+ReactorAssociate(
+    _In_ REACTOR_HANDLE Handle
+    )
+{
+    return (CreateIoCompletionPort(Handle, Reactor.Port, 0, 0) != NULL);
+}
+
+VOID
+ReactorPrepare(
+    _Out_ PREACTOR_IO       Io,
+    _In_ REACTOR_FUNCTION   Function,
+    _In_opt_ PVOID          Argument
+    )
+{
+    ZeroMemory(Io, sizeof(REACTOR_IO));
+    Io->Function = Function;
+    Io->Argument = Argument;
+}
+
+BOOL
+ReactorPost(
+    _In_ PREACTOR_IO    Io,
+    _In_ DWORD          Error,
+    _In_ DWORD          Length
+    )
+{
+    return PostQueuedCompletionStatus(Reactor.Port,
+                                      Length,
+                                      (ULONG_PTR)Error,
+                                      &Io->Overlapped);
+}
+
+VOID
+ReactorGetStatistics(
+    _Out_ PREACTOR_STATISTICS   Statistics
+    )
+{
+    LONGLONG                    Frequency = Reactor.Frequency.QuadPart;
+    LONG64                      Events = Reactor.Events;
+
+    ZeroMemory(Statistics, sizeof(REACTOR_STATISTICS));
+
+    Statistics->Threads = Reactor.Count;
+    Statistics->Events = Events;
+
+    if (Frequency == 0 || Events == 0)
+        return;
+
+    Statistics->DispatchAverage =
+        (Reactor.DispatchTicks * 1000000) / (Frequency * Events);
+    Statistics->DispatchMaximum =
+        (Reactor.DispatchMaximum * 1000000) / Frequency;
+}
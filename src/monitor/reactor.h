@@ -0,0 +1,132 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _MONITOR_REACTOR_H
+#define _MONITOR_REACTOR_H
+
+#include "monitor_compat.h"
+
+// A pool of threads that run the function attached to each event. The
+// monitor uses the completion port backend in reactor.c; reactor_epoll.c
+// provides the same core on Linux for the tests and benchmarks in
+// src/test.
+
+typedef struct _REACTOR_IO  REACTOR_IO, *PREACTOR_IO;
+
+#if defined(_WIN32)
+typedef HANDLE  REACTOR_HANDLE;
+#else
+typedef int     REACTOR_HANDLE;
+#endif
+
+// Called on a reactor thread when the I/O that Io was issued with
+// completes, or when Io is posted. With epoll there is no I/O to
+// complete; Length carries the ready events instead (see ReactorWait()).
+typedef VOID
+(*REACTOR_FUNCTION)(
+    _In_ PREACTOR_IO    Io,
+    _In_ DWORD          Error,
+    _In_ DWORD          Length
+    );
+
+struct _REACTOR_IO {
+#if defined(_WIN32)
+    OVERLAPPED          Overlapped;
+#else
+    PREACTOR_IO         Next;       // While posted
+    DWORD               Error;
+    DWORD               Length;
+#endif
+    REACTOR_FUNCTION    Function;
+    PVOID               Argument;
+};
+
+typedef struct _REACTOR_STATISTICS {
+    DWORD       Threads;
+    ULONGLONG   Events;
+    ULONGLONG   DispatchAverage;    // microseconds
+    ULONGLONG   DispatchMaximum;    // microseconds
+} REACTOR_STATISTICS, *PREACTOR_STATISTICS;
+
+extern BOOL
+ReactorInitialize(
+    _In_ DWORD  Threads
+    );
+
+extern VOID
+ReactorTeardown(
+    VOID
+    );
+
+// Route completions for an overlapped handle (or, with epoll, events
+// for a non-blocking descriptor) to the reactor
+extern BOOL
+ReactorAssociate(
+    _In_ REACTOR_HANDLE Handle
+    );
+
+// Must be called before each I/O issued with Io
+extern VOID
+ReactorPrepare(
+    _Out_ PREACTOR_IO       Io,
+    _In_ REACTOR_FUNCTION   Function,
+    _In_opt_ PVOID          Argument
+    );
+
+// Complete Io on a reactor thread without any I/O, e.g. because the
+// I/O it was prepared for failed or finished without queueing a
+// completion
+extern BOOL
+ReactorPost(
+    _In_ PREACTOR_IO    Io,
+    _In_ DWORD          Error,
+    _In_ DWORD          Length
+    );
+
+#if !defined(_WIN32)
+// Run Io once Handle has any of Events (EPOLLIN etc.) ready. It fires
+// once per call; issue the I/O from Io's function and call again for
+// more.
+extern BOOL
+ReactorWait(
+    _In_ REACTOR_HANDLE Handle,
+    _In_ PREACTOR_IO    Io,
+    _In_ DWORD          Events
+    );
+#endif
+
+extern VOID
+ReactorGetStatistics(
+    _Out_ PREACTOR_STATISTICS   Statistics
+    );
+
+#endif  // _MONITOR_REACTOR_H
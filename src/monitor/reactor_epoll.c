@@ -0,0 +1,408 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+// The reactor core on epoll, for building and measuring the monitor's
+// event handling on Linux. Posted events go through a queue counted by
+// an eventfd, so they are picked up by whichever thread is free, the
+// same as packets posted to a completion port. Failures set errno.
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "reactor.h"
+
+#define REACTOR_MAXIMUM_THREADS 64
+
+typedef struct _REACTOR {
+    int             Port;       // The epoll descriptor
+    int             Posted;     // eventfd counting posted events
+    pthread_t       *Threads;
+    DWORD           Count;
+    pthread_mutex_t Lock;
+    PREACTOR_IO     Head;       // Posted, oldest first
+    PREACTOR_IO     Tail;
+    DWORD           Exits;      // Threads asked to exit
+    LONG64          Events;
+    LONG64          DispatchTicks;
+    LONG64          DispatchMaximum;
+} REACTOR, *PREACTOR;
+
+static REACTOR  Reactor;
+
+static LONG64
+__ReactorGetTicks(
+    VOID
+    )
+{
+    struct timespec Now;
+
+    (VOID) clock_gettime(CLOCK_MONOTONIC, &Now);
+
+    return ((LONG64)Now.tv_sec * 1000000000) + Now.tv_nsec;
+}
+
+static VOID
+__ReactorAccount(
+    _In_ LONG64 Ticks
+    )
+{
+    LONG64      Maximum;
+
+    (VOID) __atomic_add_fetch(&Reactor.Events, 1, __ATOMIC_RELAXED);
+    (VOID) __atomic_add_fetch(&Reactor.DispatchTicks, Ticks, __ATOMIC_RELAXED);
+
+    Maximum = __atomic_load_n(&Reactor.DispatchMaximum, __ATOMIC_RELAXED);
+    while (Ticks > Maximum &&
+           !__atomic_compare_exchange_n(&Reactor.DispatchMaximum,
+                                        &Maximum,
+                                        Ticks,
+                                        FALSE,
+                                        __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED))
+        ;
+}
+
+// Take one posted event, now that the eventfd says there is one. A NULL
+// return with *Exit set means the thread has been asked to go.
+static PREACTOR_IO
+__ReactorTakePosted(
+    _Out_ BOOL  *Exit
+    )
+{
+    uint64_t    Value;
+    PREACTOR_IO Io;
+
+    *Exit = FALSE;
+
+    // Another thread may have taken it first
+    if (read(Reactor.Posted, &Value, sizeof (Value)) != sizeof (Value))
+        return NULL;
+
+    pthread_mutex_lock(&Reactor.Lock);
+
+    Io = Reactor.Head;
+    if (Io != NULL) {
+        Reactor.Head = Io->Next;
+        if (Reactor.Head == NULL)
+            Reactor.Tail = NULL;
+
+        Io->Next = NULL;
+    } else if (Reactor.Exits != 0) {
+        --Reactor.Exits;
+        *Exit = TRUE;
+    }
+
+    pthread_mutex_unlock(&Reactor.Lock);
+
+    return Io;
+}
+
+static PVOID
+ReactorThread(
+    _In_ PVOID  Argument
+    )
+{
+    UNREFERENCED_PARAMETER(Argument);
+
+    for (;;) {
+        struct epoll_event  Event;
+        PREACTOR_IO         Io;
+        DWORD               Error;
+        DWORD               Length;
+        LONG64              Start;
+        int                 Count;
+
+        Count = epoll_wait(Reactor.Port, &Event, 1, -1);
+        if (Count <= 0)
+            continue;
+
+        // The eventfd is the only descriptor registered without an Io
+        if (Event.data.ptr == NULL) {
+            BOOL    Exit;
+
+            Io = __ReactorTakePosted(&Exit);
+            if (Exit)
+                break;
+
+            if (Io == NULL)
+                continue;
+
+            Error = Io->Error;
+            Length = Io->Length;
+        } else {
+            Io = Event.data.ptr;
+
+            Error = 0;
+            Length = Event.events;
+        }
+
+        Start = __ReactorGetTicks();
+        Io->Function(Io, Error, Length);
+
+        __ReactorAccount(__ReactorGetTicks() - Start);
+    }
+
+    return NULL;
+}
+
+BOOL
+ReactorInitialize(
+    _In_ DWORD  Threads
+    )
+{
+    struct epoll_event  Event;
+    int                 Error;
+
+    memset(&Reactor, 0, sizeof (REACTOR));
+    Reactor.Port = -1;
+    Reactor.Posted = -1;
+
+    if (Threads == 0 || Threads > REACTOR_MAXIMUM_THREADS) {
+        errno = EINVAL;
+        goto fail1;
+    }
+
+    Reactor.Port = epoll_create1(EPOLL_CLOEXEC);
+    if (Reactor.Port < 0)
+        goto fail2;
+
+    // One count per posted event; each read takes exactly one
+    Reactor.Posted = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK | EFD_SEMAPHORE);
+    if (Reactor.Posted < 0)
+        goto fail3;
+
+    memset(&Event, 0, sizeof (Event));
+    Event.events = EPOLLIN;
+    Event.data.ptr = NULL;
+
+    if (epoll_ctl(Reactor.Port, EPOLL_CTL_ADD, Reactor.Posted, &Event) < 0)
+        goto fail4;
+
+    Error = pthread_mutex_init(&Reactor.Lock, NULL);
+    if (Error != 0) {
+        errno = Error;
+        goto fail5;
+    }
+
+    Reactor.Threads = calloc(Threads, sizeof (pthread_t));
+    if (Reactor.Threads == NULL)
+        goto fail6;
+
+    for (Reactor.Count = 0; Reactor.Count < Threads; Reactor.Count++) {
+        Error = pthread_create(&Reactor.Threads[Reactor.Count],
+                               NULL,
+                               ReactorThread,
+                               NULL);
+        if (Error != 0) {
+            errno = Error;
+            goto fail7;
+        }
+    }
+
+    return TRUE;
+
+fail7:
+    Error = errno;
+    ReactorTeardown();
+    errno = Error;
+    return FALSE;
+
+fail6:
+    pthread_mutex_destroy(&Reactor.Lock);
+
+fail5:
+fail4:
+    close(Reactor.Posted);
+
+fail3:
+    close(Reactor.Port);
+
+fail2:
+fail1:
+    memset(&Reactor, 0, sizeof (REACTOR));
+
+    return FALSE;
+}
+
+VOID
+ReactorTeardown(
+    VOID
+    )
+{
+    uint64_t    Value;
+    DWORD       Index;
+
+    pthread_mutex_lock(&Reactor.Lock);
+    Reactor.Exits = Reactor.Count;
+    pthread_mutex_unlock(&Reactor.Lock);
+
+    // Exits are only taken once the posted queue is empty, so anything
+    // already posted still runs
+    Value = Reactor.Count;
+    if (Value != 0)
+        (VOID) write(Reactor.Posted, &Value, sizeof (Value));
+
+    for (Index = 0; Index < Reactor.Count; Index++)
+        (VOID) pthread_join(Reactor.Threads[Index], NULL);
+
+    free(Reactor.Threads);
+    pthread_mutex_destroy(&Reactor.Lock);
+    close(Reactor.Posted);
+    close(Reactor.Port);
+
+    memset(&Reactor, 0, sizeof (REACTOR));
+}
+
+BOOL
+ReactorAssociate(
+    _In_ REACTOR_HANDLE Handle
+    )
+{
+    struct epoll_event  Event;
+
+    // Nothing is armed until ReactorWait()
+    memset(&Event, 0, sizeof (Event));
+    Event.events = EPOLLONESHOT;
+
+    return (epoll_ctl(Reactor.Port, EPOLL_CTL_ADD, Handle, &Event) == 0);
+}
+
+BOOL
+ReactorWait(
+    _In_ REACTOR_HANDLE Handle,
+    _In_ PREACTOR_IO    Io,
+    _In_ DWORD          Events
+    )
+{
+    struct epoll_event  Event;
+
+    memset(&Event, 0, sizeof (Event));
+    Event.events = Events | EPOLLONESHOT;
+    Event.data.ptr = Io;
+
+    return (epoll_ctl(Reactor.Port, EPOLL_CTL_MOD, Handle, &Event) == 0);
+}
+
+VOID
+ReactorPrepare(
+    _Out_ PREACTOR_IO       Io,
+    _In_ REACTOR_FUNCTION   Function,
+    _In_opt_ PVOID          Argument
+    )
+{
+    memset(Io, 0, sizeof (REACTOR_IO));
+    Io->Function = Function;
+    Io->Argument = Argument;
+}
+
+BOOL
+ReactorPost(
+    _In_ PREACTOR_IO    Io,
+    _In_ DWORD          Error,
+    _In_ DWORD          Length
+    )
+{
+    uint64_t            Value = 1;
+
+    Io->Error = Error;
+    Io->Length = Length;
+
+    pthread_mutex_lock(&Reactor.Lock);
+
+    Io->Next = NULL;
+    if (Reactor.Tail != NULL)
+        Reactor.Tail->Next = Io;
+    else
+        Reactor.Head = Io;
+    Reactor.Tail = Io;
+
+    pthread_mutex_unlock(&Reactor.Lock);
+
+    if (write(Reactor.Posted, &Value, sizeof (Value)) == sizeof (Value))
+        return TRUE;
+
+    // Not posted after all. Nobody can have taken it, as every take
+    // needs a count first, but others may have queued behind it.
+    pthread_mutex_lock(&Reactor.Lock);
+
+    if (Reactor.Head == Io) {
+        Reactor.Head = Io->Next;
+        if (Reactor.Head == NULL)
+            Reactor.Tail = NULL;
+    } else {
+        PREACTOR_IO Previous = Reactor.Head;
+
+        while (Previous->Next != Io)
+            Previous = Previous->Next;
+
+        Previous->Next = Io->Next;
+        if (Reactor.Tail == Io)
+            Reactor.Tail = Previous;
+    }
+
+    Io->Next = NULL;
+
+    pthread_mutex_unlock(&Reactor.Lock);
+
+    return FALSE;
+}
+
+VOID
+ReactorGetStatistics(
+    _Out_ PREACTOR_STATISTICS   Statistics
+    )
+{
+    LONG64                      Events;
+
+    memset(Statistics, 0, sizeof (REACTOR_STATISTICS));
+
+    Events = __atomic_load_n(&Reactor.Events, __ATOMIC_RELAXED);
+
+    Statistics->Threads = Reactor.Count;
+    Statistics->Events = Events;
+
+    if (Events == 0)
+        return;
+
+    // Ticks are nanoseconds
+    Statistics->DispatchAverage =
+        __atomic_load_n(&Reactor.DispatchTicks, __ATOMIC_RELAXED) /
+        (Events * 1000);
+    Statistics->DispatchMaximum =
+        __atomic_load_n(&Reactor.DispatchMaximum, __ATOMIC_RELAXED) / 1000;
+}
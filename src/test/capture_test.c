@@ -0,0 +1,586 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+// Host test and benchmark for the monitor's capture writer. Linux (or
+// anything with zlib and liblzma):
+//
+//   cc -O2 -Wno-multichar -I include -I src/monitor -o capture_test
+//      src/test/capture_test.c src/monitor/capture_writer.c
+//      src/monitor/query.c -lz -llzma
+//
+// The tests write captures through the writer and read them back with
+// the query code, checking rotation and that compressed blocks stand on
+// their own.
+//
+// The monitor compresses with the Windows Compression API, which has no
+// levels and is not available here, so the benchmark plugs raw deflate
+// (the format behind MSZIP) and xz (an LZMA, like LZMS) into the
+// writer's codec hook at several levels. It writes synthetic console
+// output to the directory given as the first argument (default /tmp)
+// and reports throughput, CPU time per MB and compression ratio, with
+// and without a flush after every block. Pass "-n" to skip it.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <lzma.h>
+
+#include "monitor_compat.h"
+
+#include <xencons_capture.h>
+
+#include "capture_writer.h"
+#include "query.h"
+
+// 2026-01-01T00:00:00 as a FILETIME
+#define TEST_EPOCH          ((1767225600ull * 10000000) + 116444736000000000ull)
+#define TEST_SECOND         10000000ull
+
+#define TEST_BLOCKS         40
+#define TEST_FILES          2       // Rotated files kept
+
+#define BENCH_TOTAL         (32 << 20)
+
+static int  Failures;
+
+#define TEST(_Condition)                                            \
+    do {                                                            \
+        if (!(_Condition)) {                                        \
+            fprintf(stderr, "%s:%d: %s\n",                          \
+                    __FILE__, __LINE__, #_Condition);               \
+            Failures++;                                             \
+        }                                                           \
+    } while (0)
+
+static double
+__TestGetTime(
+    _In_ clockid_t  Clock
+    )
+{
+    struct timespec Now;
+
+    (VOID) clock_gettime(Clock, &Now);
+
+    return Now.tv_sec + (Now.tv_nsec / 1e9);
+}
+
+// Something like a guest's console: kernel log lines made of a small
+// vocabulary, with timestamps and numbers that keep changing
+static VOID
+__TestGenerate(
+    _Out_writes_bytes_(Length) PUCHAR   Data,
+    _In_ DWORD                          Length
+    )
+{
+    static const PCSTR                  Words[] = {
+        "xenbus", "backend", "frontend", "vif", "vbd", "state", "connected",
+        "closing", "ring-ref", "event-channel", "grant", "device", "queue",
+        "timeout", "reset", "link", "up", "down", "irq", "dma", "error",
+        "warning", "info", "systemd[1]:", "Started", "Stopping", "session",
+        "eth0:", "NETDEV", "WATCHDOG", "transmit", "disk", "sector", "I/O"
+    };
+    ULONG                               Seed = 12345;
+    DWORD                               Position = 0;
+    double                              Time = 0;
+
+    while (Position < Length) {
+        CHAR    Line[256];
+        int     LineLength;
+        DWORD   Count;
+
+        Seed = Seed * 1103515245 + 12345;
+        Time += (Seed >> 16) % 1000 / 1e4;
+
+        LineLength = snprintf(Line, sizeof(Line), "[%12.6f] ", Time);
+
+        for (Count = 3 + (Seed >> 8) % 8; Count != 0; --Count) {
+            Seed = Seed * 1103515245 + 12345;
+
+            if ((Seed >> 28) == 0)
+                LineLength += snprintf(Line + LineLength,
+                                       sizeof(Line) - LineLength,
+                                       "0x%08x ",
+                                       (unsigned int)Seed);
+            else
+                LineLength += snprintf(Line + LineLength,
+                                       sizeof(Line) - LineLength,
+                                       "%s ",
+                                       Words[(Seed >> 16) %
+                                             (sizeof(Words) / sizeof(Words[0]))]);
+        }
+
+        Line[LineLength - 1] = '\n';
+
+        if ((DWORD)LineLength > Length - Position)
+            LineLength = (int)(Length - Position);
+
+        memcpy(Data + Position, Line, LineLength);
+        Position += LineLength;
+    }
+}
+
+static DWORD
+DeflateCompress(
+    _In_ PVOID                                  Context,
+    _In_reads_bytes_(Length) PUCHAR             Data,
+    _In_ DWORD                                  Length,
+    _Out_writes_bytes_(OutputLength) PUCHAR     Output,
+    _In_ DWORD                                  OutputLength
+    )
+{
+    z_stream                                    *Stream = Context;
+
+    // Each block is a stream of its own
+    if (deflateReset(Stream) != Z_OK)
+        return 0;
+
+    Stream->next_in = Data;
+    Stream->avail_in = Length;
+    Stream->next_out = Output;
+    Stream->avail_out = OutputLength;
+
+    if (deflate(Stream, Z_FINISH) != Z_STREAM_END)
+        return 0;
+
+    return OutputLength - Stream->avail_out;
+}
+
+static DWORD
+XzCompress(
+    _In_ PVOID                                  Context,
+    _In_reads_bytes_(Length) PUCHAR             Data,
+    _In_ DWORD                                  Length,
+    _Out_writes_bytes_(OutputLength) PUCHAR     Output,
+    _In_ DWORD                                  OutputLength
+    )
+{
+    ULONG                                       Preset = (ULONG)(ULONG_PTR)Context;
+    size_t                                      Position = 0;
+
+    if (lzma_easy_buffer_encode(Preset,
+                                LZMA_CHECK_NONE,
+                                NULL,
+                                Data,
+                                Length,
+                                Output,
+                                &Position,
+                                OutputLength) != LZMA_OK)
+        return 0;
+
+    return (DWORD)Position;
+}
+
+static VOID
+__TestRemove(
+    _In_ PCSTR  Path,
+    _In_ DWORD  Files
+    )
+{
+    CHAR        FileName[512];
+    DWORD       Index;
+
+    for (Index = 0; Index <= Files; Index++) {
+        if (Index == 0)
+            snprintf(FileName, sizeof(FileName), "%s.xcap", Path);
+        else
+            snprintf(FileName, sizeof(FileName), "%s.%u.xcap", Path,
+                     (unsigned int)Index);
+        (VOID) unlink(FileName);
+
+        if (Index == 0)
+            snprintf(FileName, sizeof(FileName), "%s.xidx", Path);
+        else
+            snprintf(FileName, sizeof(FileName), "%s.%u.xidx", Path,
+                     (unsigned int)Index);
+        (VOID) unlink(FileName);
+    }
+}
+
+static BOOL
+__TestExists(
+    _In_ PCSTR  FileName
+    )
+{
+    return (access(FileName, F_OK) == 0);
+}
+
+// Stored blocks, rotated every few blocks: the query gets back exactly
+// the blocks that were kept, and older files are gone
+static VOID
+TestRotation(
+    _In_ PCSTR                  Directory
+    )
+{
+    CAPTURE_PARAMETERS          Parameters;
+    CAPTURE_WRITER_STATISTICS   Statistics;
+    QUERY_STATISTICS            Query;
+    PCAPTURE_WRITER             Writer;
+    CHAR                        Path[256];
+    CHAR                        FileName[512];
+    UCHAR                       Block[1000];
+    DWORD                       Index;
+
+    snprintf(Path, sizeof(Path), "%s/capture_test", Directory);
+
+    ZeroMemory(&Parameters, sizeof(Parameters));
+    Parameters.MaximumSize = 10 * (sizeof(XENCONS_CAPTURE_BLOCK) + sizeof(Block));
+    Parameters.MaximumAge = 3600;
+    Parameters.Files = TEST_FILES;
+    Parameters.Flush = CAPTURE_FLUSH_ROTATE;
+
+    Writer = CaptureWriterCreate(Path, "test", &Parameters, NULL);
+    TEST(Writer != NULL);
+    if (Writer == NULL)
+        return;
+
+    for (Index = 0; Index < TEST_BLOCKS; Index++) {
+        memset(Block, (int)Index, sizeof(Block));
+
+        CaptureWriterWrite(Writer,
+                           Block,
+                           sizeof(Block),
+                           (ULONGLONG)Index * sizeof(Block),
+                           TEST_EPOCH + Index * TEST_SECOND);
+    }
+
+    CaptureWriterGetStatistics(Writer, &Statistics);
+    CaptureWriterDestroy(Writer);
+
+    TEST(Statistics.Blocks == TEST_BLOCKS);
+    TEST(Statistics.Files == TEST_BLOCKS / 10);
+    TEST(Statistics.Errors == 0);
+
+    snprintf(FileName, sizeof(FileName), "%s.%u.xcap", Path, TEST_FILES);
+    TEST(__TestExists(FileName));
+    snprintf(FileName, sizeof(FileName), "%s.%u.xcap", Path, TEST_FILES + 1);
+    TEST(!__TestExists(FileName));
+
+    // Only the newest TEST_FILES + 1 files are left
+    snprintf(FileName, sizeof(FileName), "%s.xcap", Path);
+    TEST(QueryExtractRange(FileName,
+                           TEST_EPOCH,
+                           TEST_EPOCH + TEST_BLOCKS * TEST_SECOND,
+                           "/dev/null",
+                           &Query));
+    TEST(Query.Files == TEST_FILES + 1);
+    TEST(Query.Blocks == (TEST_FILES + 1) * 10);
+    TEST(Query.FirstOffset == (TEST_BLOCKS - (TEST_FILES + 1) * 10) * sizeof(Block));
+    TEST(Query.LastOffset == (TEST_BLOCKS - 1) * sizeof(Block));
+
+    // Found by the index, not by walking the blocks
+    TEST(QueryExtractRange(FileName,
+                           TEST_EPOCH + 35 * TEST_SECOND,
+                           TEST_EPOCH + 35 * TEST_SECOND,
+                           "/dev/null",
+                           &Query));
+    TEST(Query.Blocks == 1);
+    TEST(Query.FirstOffset == 35 * sizeof(Block));
+    TEST(Query.IndexReads != 0);
+
+    __TestRemove(Path, TEST_FILES);
+}
+
+// Each compressed block inflates on its own to what was written
+static VOID
+TestCompression(
+    _In_ PCSTR                  Directory
+    )
+{
+    CAPTURE_PARAMETERS          Parameters;
+    CAPTURE_CODEC               Codec;
+    z_stream                    Stream;
+    PCAPTURE_WRITER             Writer;
+    XENCONS_CAPTURE_HEADER      Header;
+    XENCONS_CAPTURE_BLOCK       Block;
+    CHAR                        Path[256];
+    CHAR                        FileName[512];
+    PUCHAR                      Data;
+    PUCHAR                      Compressed;
+    PUCHAR                      Inflated;
+    FILE                        *File;
+    DWORD                       Index;
+
+    snprintf(Path, sizeof(Path), "%s/capture_test", Directory);
+
+    Data = malloc(4 * CAPTURE_BLOCK_SIZE);
+    Compressed = malloc(CAPTURE_BLOCK_SIZE);
+    Inflated = malloc(CAPTURE_BLOCK_SIZE);
+    TEST(Data != NULL && Compressed != NULL && Inflated != NULL);
+    if (Data == NULL || Compressed == NULL || Inflated == NULL)
+        goto done;
+
+    __TestGenerate(Data, 4 * CAPTURE_BLOCK_SIZE);
+
+    memset(&Stream, 0, sizeof(Stream));
+    TEST(deflateInit2(&Stream, 6, Z_DEFLATED, -15, 8,
+                      Z_DEFAULT_STRATEGY) == Z_OK);
+
+    Codec.Algorithm = 2;    // COMPRESS_ALGORITHM_MSZIP, as far as the header goes
+    Codec.Compress = DeflateCompress;
+    Codec.Context = &Stream;
+
+    ZeroMemory(&Parameters, sizeof(Parameters));
+    Parameters.MaximumSize = 1ull << 30;
+    Parameters.MaximumAge = 3600;
+
+    Writer = CaptureWriterCreate(Path, "test", &Parameters, &Codec);
+    TEST(Writer != NULL);
+    if (Writer == NULL)
+        goto done;
+
+    for (Index = 0; Index < 4; Index++)
+        CaptureWriterWrite(Writer,
+                           Data + Index * CAPTURE_BLOCK_SIZE,
+                           CAPTURE_BLOCK_SIZE,
+                           (ULONGLONG)Index * CAPTURE_BLOCK_SIZE,
+                           TEST_EPOCH + Index * TEST_SECOND);
+
+    // Random bytes don't shrink, so they are stored
+    for (Index = 0; Index < 1000; Index++)
+        Compressed[Index] = (UCHAR)(rand() >> 7);
+
+    CaptureWriterWrite(Writer, Compressed, 1000,
+                       4ull * CAPTURE_BLOCK_SIZE,
+                       TEST_EPOCH + 4 * TEST_SECOND);
+
+    CaptureWriterDestroy(Writer);
+    (VOID) deflateEnd(&Stream);
+
+    snprintf(FileName, sizeof(FileName), "%s.xcap", Path);
+    File = fopen(FileName, "rb");
+    TEST(File != NULL);
+    if (File == NULL)
+        goto done;
+
+    TEST(fread(&Header, sizeof(Header), 1, File) == 1);
+    TEST(Header.Magic == XENCONS_CAPTURE_MAGIC);
+    TEST(Header.Algorithm == 2);
+    TEST(strcmp(Header.Name, "test") == 0);
+
+    for (Index = 0; Index < 4; Index++) {
+        z_stream    Inflate;
+
+        TEST(fread(&Block, sizeof(Block), 1, File) == 1);
+        TEST(Block.Magic == XENCONS_CAPTURE_BLOCK_MAGIC);
+        TEST(!(Block.Flags & XENCONS_CAPTURE_BLOCK_STORED));
+        TEST(Block.Length == CAPTURE_BLOCK_SIZE);
+        TEST(Block.CompressedLength < Block.Length);
+        TEST(Block.Offset == (ULONGLONG)Index * CAPTURE_BLOCK_SIZE);
+        if (Block.CompressedLength > CAPTURE_BLOCK_SIZE)
+            break;
+
+        TEST(fread(Compressed, 1, Block.CompressedLength, File) ==
+             Block.CompressedLength);
+
+        memset(&Inflate, 0, sizeof(Inflate));
+        TEST(inflateInit2(&Inflate, -15) == Z_OK);
+
+        Inflate.next_in = Compressed;
+        Inflate.avail_in = Block.CompressedLength;
+        Inflate.next_out = Inflated;
+        Inflate.avail_out = CAPTURE_BLOCK_SIZE;
+
+        TEST(inflate(&Inflate, Z_FINISH) == Z_STREAM_END);
+        TEST(Inflate.total_out == CAPTURE_BLOCK_SIZE);
+        TEST(memcmp(Inflated, Data + Index * CAPTURE_BLOCK_SIZE,
+                    CAPTURE_BLOCK_SIZE) == 0);
+
+        (VOID) inflateEnd(&Inflate);
+    }
+
+    TEST(fread(&Block, sizeof(Block), 1, File) == 1);
+    TEST(Block.Flags & XENCONS_CAPTURE_BLOCK_STORED);
+    TEST(Block.CompressedLength == 1000);
+
+    fclose(File);
+
+    __TestRemove(Path, 0);
+
+done:
+    free(Inflated);
+    free(Compressed);
+    free(Data);
+}
+
+static VOID
+Bench(
+    _In_ PCSTR                  Directory,
+    _In_ PUCHAR                 Data,
+    _In_ PCSTR                  Label,
+    _In_ int                    Level,
+    _In_opt_ PCAPTURE_CODEC     Codec,
+    _In_ CAPTURE_FLUSH_POLICY   Flush
+    )
+{
+    CAPTURE_PARAMETERS          Parameters;
+    CAPTURE_WRITER_STATISTICS   Statistics;
+    PCAPTURE_WRITER             Writer;
+    CHAR                        Path[256];
+    double                      Start;
+    double                      CpuStart;
+    double                      Elapsed;
+    double                      Cpu;
+    DWORD                       Index;
+
+    snprintf(Path, sizeof(Path), "%s/capture_bench", Directory);
+
+    ZeroMemory(&Parameters, sizeof(Parameters));
+    Parameters.MaximumSize = 64ull << 20;   // CaptureMaximumSize default
+    Parameters.MaximumAge = 3600;
+    Parameters.Files = 8;
+    Parameters.Flush = Flush;
+
+    Writer = CaptureWriterCreate(Path, "bench", &Parameters, Codec);
+    TEST(Writer != NULL);
+    if (Writer == NULL)
+        return;
+
+    Start = __TestGetTime(CLOCK_MONOTONIC);
+    CpuStart = __TestGetTime(CLOCK_PROCESS_CPUTIME_ID);
+
+    for (Index = 0; Index < BENCH_TOTAL / CAPTURE_BLOCK_SIZE; Index++)
+        CaptureWriterWrite(Writer,
+                           Data + Index * CAPTURE_BLOCK_SIZE,
+                           CAPTURE_BLOCK_SIZE,
+                           (ULONGLONG)Index * CAPTURE_BLOCK_SIZE,
+                           TEST_EPOCH + Index * TEST_SECOND);
+
+    CaptureWriterGetStatistics(Writer, &Statistics);
+    CaptureWriterDestroy(Writer);
+
+    Elapsed = __TestGetTime(CLOCK_MONOTONIC) - Start;
+    Cpu = __TestGetTime(CLOCK_PROCESS_CPUTIME_ID) - CpuStart;
+
+    TEST(Statistics.Blocks == BENCH_TOTAL / CAPTURE_BLOCK_SIZE);
+    TEST(Statistics.Errors == 0);
+
+    printf("%-8s %5d %6s %10.1f %12.2f %8.2f\n",
+           Label,
+           Level,
+           (Flush == CAPTURE_FLUSH_BLOCK) ? "block" : "never",
+           (BENCH_TOTAL / (1024.0 * 1024.0)) / Elapsed,
+           (Cpu * 1000) / (BENCH_TOTAL / (1024.0 * 1024.0)),
+           (double)BENCH_TOTAL / Statistics.BytesWritten);
+
+    __TestRemove(Path, 8);
+}
+
+static VOID
+Benchmark(
+    _In_ PCSTR          Directory
+    )
+{
+    static const int    DeflateLevels[] = { 1, 6, 9 };
+    static const int    XzPresets[] = { 0, 3, 6 };
+    CAPTURE_CODEC       Codec;
+    z_stream            Stream;
+    PUCHAR              Data;
+    DWORD               Index;
+
+    Data = malloc(BENCH_TOTAL);
+    TEST(Data != NULL);
+    if (Data == NULL)
+        return;
+
+    __TestGenerate(Data, BENCH_TOTAL);
+
+    printf("%-8s %5s %6s %10s %12s %8s\n",
+           "codec", "level", "flush", "MB/s", "CPU ms/MB", "ratio");
+
+    Bench(Directory, Data, "stored", 0, NULL, CAPTURE_FLUSH_NEVER);
+    Bench(Directory, Data, "stored", 0, NULL, CAPTURE_FLUSH_BLOCK);
+
+    for (Index = 0; Index < sizeof(DeflateLevels) / sizeof(DeflateLevels[0]); Index++) {
+        memset(&Stream, 0, sizeof(Stream));
+        TEST(deflateInit2(&Stream, DeflateLevels[Index], Z_DEFLATED, -15, 8,
+                          Z_DEFAULT_STRATEGY) == Z_OK);
+
+        Codec.Algorithm = 2;
+        Codec.Compress = DeflateCompress;
+        Codec.Context = &Stream;
+
+        Bench(Directory, Data, "deflate", DeflateLevels[Index], &Codec,
+              CAPTURE_FLUSH_NEVER);
+
+        if (DeflateLevels[Index] == 1)
+            Bench(Directory, Data, "deflate", DeflateLevels[Index], &Codec,
+                  CAPTURE_FLUSH_BLOCK);
+
+        (VOID) deflateEnd(&Stream);
+    }
+
+    for (Index = 0; Index < sizeof(XzPresets) / sizeof(XzPresets[0]); Index++) {
+        Codec.Algorithm = 5;
+        Codec.Compress = XzCompress;
+        Codec.Context = (PVOID)(ULONG_PTR)XzPresets[Index];
+
+        Bench(Directory, Data, "xz", XzPresets[Index], &Codec,
+              CAPTURE_FLUSH_NEVER);
+    }
+
+    free(Data);
+}
+
+int
+main(
+    int     argc,
+    char    **argv
+    )
+{
+    PCSTR   Directory = "/tmp";
+    BOOL    Bench = TRUE;
+    int     Index;
+
+    for (Index = 1; Index < argc; Index++) {
+        if (strcmp(argv[Index], "-n") == 0)
+            Bench = FALSE;
+        else
+            Directory = argv[Index];
+    }
+
+    TestRotation(Directory);
+    TestCompression(Directory);
+
+    if (Failures == 0 && Bench)
+        Benchmark(Directory);
+
+    if (Failures != 0) {
+        fprintf(stderr, "%d failure(s)\n", Failures);
+        return 1;
+    }
+
+    printf("passed\n");
+    return 0;
+}
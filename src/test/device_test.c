@@ -0,0 +1,439 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+// Host test and benchmark for the monitor's device reads against a
+// stand-in device, using the epoll reactor backend. Linux only:
+//
+//   cc -O2 -pthread -I include -I src/monitor -o device_test
+//      src/test/device_test.c src/monitor/hub.c src/monitor/reactor_epoll.c
+//
+// The stand-in device has a ring the size of the console's in ring.
+// Each queued read takes whatever the ring holds, up to its length, and
+// its completion is posted to the reactor; the backend then refills the
+// ring after BENCH_LATENCY, the time taken for the notification to reach
+// it and the data to come back. The reads are issued, completed and
+// delivered as in ConsoleRead() and ConsoleReadComplete(), and delivery
+// fans each buffer out to 1, 10 or 100 client queues that are written
+// to /dev/null.
+//
+// The test checks that the stream comes out in order with several reads
+// outstanding. The benchmark compares the old single 1 KiB read with
+// the DeviceReads/DeviceReadSize settings the monitor now uses. Extra
+// reads only help once fanning a buffer out takes longer than the
+// backend does to refill the ring, so the client count is varied too.
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+
+#include <xen/public/io/console.h>
+
+#include "hub.h"
+#include "reactor.h"
+
+#define TEST_TIMEOUT        30              // Seconds
+
+#define BENCH_THREADS       4
+#define BENCH_RING_SIZE     sizeof (((struct xencons_interface *)0)->in)
+#define BENCH_LATENCY       20000           // ns
+#define BENCH_TOTAL         (4 << 20)       // Bytes through the device
+#define BENCH_MAXIMUM_CLIENTS 100
+#define BENCH_QUEUE_SIZE    (64 * 1024)     // OutputQueueSize default
+#define BENCH_WRITE_SIZE    4096            // MAXIMUM_BUFFER_SIZE
+#define BENCH_MAXIMUM_READS 64              // MAXIMUM_READ_COUNT
+
+static int  Failures;
+
+#define TEST(_Condition)                                            \
+    do {                                                            \
+        if (!(_Condition)) {                                        \
+            fprintf(stderr, "%s:%d: %s\n",                          \
+                    __FILE__, __LINE__, #_Condition);               \
+            Failures++;                                             \
+        }                                                           \
+    } while (0)
+
+static double
+__TestGetTime(
+    VOID
+    )
+{
+    struct timespec Now;
+
+    (VOID) clock_gettime(CLOCK_MONOTONIC, &Now);
+
+    return Now.tv_sec + (Now.tv_nsec / 1e9);
+}
+
+typedef struct _BENCH_READ {
+    REACTOR_IO  Io;
+    ULONG       Sequence;
+    BOOL        Completed;
+    DWORD       Length;
+    PUCHAR      Buffer;
+} BENCH_READ, *PBENCH_READ;
+
+// The stand-in for the driver's read queue and the console ring
+typedef struct _BENCH_DEVICE {
+    pthread_mutex_t Lock;
+    pthread_cond_t  Queued;
+    PBENCH_READ     Queue[BENCH_MAXIMUM_READS];
+    DWORD           Head;
+    DWORD           Count;
+    ULONGLONG       Position;   // Of the next byte out of the ring
+    pthread_t       Thread;
+} BENCH_DEVICE, *PBENCH_DEVICE;
+
+// The stand-in for MONITOR_CONSOLE: reads and the clients they fan
+// out to
+typedef struct _BENCH_CONSOLE {
+    pthread_mutex_t Lock;       // Console->CriticalSection
+    BENCH_DEVICE    Device;
+    BENCH_READ      Reads[BENCH_MAXIMUM_READS];
+    DWORD           ReadCount;
+    DWORD           ReadSize;
+    PUCHAR          ReadPool;
+    ULONG           ReadSequence;
+    ULONG           DeliverSequence;
+    ULONGLONG       BytesRead;
+    BOOL            OutOfOrder;
+    HUB_QUEUE       Clients[BENCH_MAXIMUM_CLIENTS];
+    DWORD           ClientCount;
+    UCHAR           WriteBuffer[BENCH_WRITE_SIZE];
+    int             Null;
+    LONG64          Done;
+} BENCH_CONSOLE, *PBENCH_CONSOLE;
+
+// Byte N of the stream
+#define BENCH_BYTE(_Position)   ((UCHAR)((_Position) * 7 + ((_Position) >> 12)))
+
+static PVOID
+BenchDeviceThread(
+    _In_ PVOID          Argument
+    )
+{
+    PBENCH_CONSOLE      Console = Argument;
+    PBENCH_DEVICE       Device = &Console->Device;
+
+    // So that BENCH_LATENCY is not rounded up to the default 50us
+    (VOID) prctl(PR_SET_TIMERSLACK, 1);
+
+    (VOID) pthread_mutex_lock(&Device->Lock);
+
+    // The ring starts full
+    while (Device->Position < BENCH_TOTAL) {
+        PBENCH_READ     Read;
+        DWORD           Length;
+        DWORD           Index;
+        struct timespec Pause = { 0, BENCH_LATENCY };
+
+        while (Device->Count == 0)
+            (VOID) pthread_cond_wait(&Device->Queued, &Device->Lock);
+
+        Read = Device->Queue[Device->Head];
+        Device->Head = (Device->Head + 1) % BENCH_MAXIMUM_READS;
+        --Device->Count;
+
+        Length = BENCH_RING_SIZE;
+        if (Length > Console->ReadSize)
+            Length = Console->ReadSize;
+        if (Length > BENCH_TOTAL - Device->Position)
+            Length = (DWORD)(BENCH_TOTAL - Device->Position);
+
+        for (Index = 0; Index < Length; Index++)
+            Read->Buffer[Index] = BENCH_BYTE(Device->Position + Index);
+
+        Device->Position += Length;
+
+        (VOID) pthread_mutex_unlock(&Device->Lock);
+
+        while (!ReactorPost(&Read->Io, 0, Length))
+            (VOID) nanosleep(&Pause, NULL);
+
+        // The backend refills what was taken. Reads only ever get what
+        // is in the ring, so nothing can complete in the meantime.
+        if (Length == BENCH_RING_SIZE)
+            (VOID) nanosleep(&Pause, NULL);
+
+        (VOID) pthread_mutex_lock(&Device->Lock);
+    }
+
+    (VOID) pthread_mutex_unlock(&Device->Lock);
+
+    return NULL;
+}
+
+static VOID
+BenchDeviceQueue(
+    _In_ PBENCH_DEVICE  Device,
+    _In_ PBENCH_READ    Read
+    )
+{
+    (VOID) pthread_mutex_lock(&Device->Lock);
+
+    Device->Queue[(Device->Head + Device->Count) % BENCH_MAXIMUM_READS] = Read;
+    Device->Count++;
+
+    (VOID) pthread_cond_signal(&Device->Queued);
+    (VOID) pthread_mutex_unlock(&Device->Lock);
+}
+
+// As ConsoleOutput() and ConsoleBroadcast(), with each client's write
+// done straight away
+static VOID
+BenchOutput(
+    _In_ PBENCH_CONSOLE Console,
+    _In_ PUCHAR         Buffer,
+    _In_ DWORD          Length
+    )
+{
+    DWORD               Index;
+
+    for (Index = 0; Index < Length; Index++)
+        if (Buffer[Index] != BENCH_BYTE(Console->BytesRead + Index))
+            Console->OutOfOrder = TRUE;
+
+    Console->BytesRead += Length;
+
+    for (Index = 0; Index < Console->ClientCount; Index++) {
+        PHUB_QUEUE  Queue = &Console->Clients[Index];
+        DWORD       Written;
+
+        (VOID) HubQueuePush(Queue, Buffer, Length);
+
+        while ((Written = HubQueuePop(Queue,
+                                      Console->WriteBuffer,
+                                      sizeof (Console->WriteBuffer))) != 0)
+            (VOID) write(Console->Null, Console->WriteBuffer, Written);
+    }
+}
+
+static VOID BenchReadComplete(PREACTOR_IO, DWORD, DWORD);
+
+// As ConsoleRead(): called with Console->Lock held
+static VOID
+BenchRead(
+    _In_ PBENCH_CONSOLE Console,
+    _In_ PBENCH_READ    Read
+    )
+{
+    ReactorPrepare(&Read->Io, BenchReadComplete, Console);
+
+    Read->Sequence = Console->ReadSequence++;
+    Read->Completed = FALSE;
+
+    BenchDeviceQueue(&Console->Device, Read);
+}
+
+// As ConsoleReadComplete()
+static VOID
+BenchReadComplete(
+    _In_ PREACTOR_IO    Io,
+    _In_ DWORD          Error,
+    _In_ DWORD          Length
+    )
+{
+    PBENCH_CONSOLE      Console = Io->Argument;
+    PBENCH_READ         Read = CONTAINING_RECORD(Io, BENCH_READ, Io);
+
+    UNREFERENCED_PARAMETER(Error);
+
+    (VOID) pthread_mutex_lock(&Console->Lock);
+
+    Read->Length = Length;
+    Read->Completed = TRUE;
+
+    for (;;) {
+        Read = &Console->Reads[Console->DeliverSequence % Console->ReadCount];
+        if (!Read->Completed || Read->Sequence != Console->DeliverSequence)
+            break;
+
+        Read->Completed = FALSE;
+        Console->DeliverSequence++;
+
+        BenchOutput(Console, Read->Buffer, Read->Length);
+
+        if (Console->BytesRead < BENCH_TOTAL)
+            BenchRead(Console, Read);
+        else
+            __atomic_store_n(&Console->Done, 1, __ATOMIC_RELEASE);
+    }
+
+    (VOID) pthread_mutex_unlock(&Console->Lock);
+}
+
+static VOID
+Bench(
+    _In_ DWORD      ClientCount,
+    _In_ DWORD      ReadCount,
+    _In_ DWORD      ReadSize
+    )
+{
+    PBENCH_CONSOLE  Console;
+    double          Start;
+    double          Deadline;
+    double          Elapsed;
+    DWORD           Index;
+
+    Console = calloc(1, sizeof (BENCH_CONSOLE));
+    TEST(Console != NULL);
+    if (Console == NULL)
+        return;
+
+    (VOID) pthread_mutex_init(&Console->Lock, NULL);
+    (VOID) pthread_mutex_init(&Console->Device.Lock, NULL);
+    (VOID) pthread_cond_init(&Console->Device.Queued, NULL);
+
+    Console->ClientCount = ClientCount;
+    Console->ReadCount = ReadCount;
+    Console->ReadSize = ReadSize;
+    Console->ReadPool = malloc((size_t)ReadCount * ReadSize);
+    TEST(Console->ReadPool != NULL);
+
+    for (Index = 0; Index < ReadCount; Index++)
+        Console->Reads[Index].Buffer = &Console->ReadPool[Index * ReadSize];
+
+    for (Index = 0; Index < ClientCount; Index++)
+        TEST(HubQueueInitialize(&Console->Clients[Index],
+                                BENCH_QUEUE_SIZE,
+                                HUB_OVERFLOW_DROP_OLDEST));
+
+    Console->Null = open("/dev/null", O_WRONLY);
+    TEST(Console->Null >= 0);
+
+    TEST(ReactorInitialize(BENCH_THREADS));
+
+    Start = __TestGetTime();
+
+    TEST(pthread_create(&Console->Device.Thread,
+                        NULL,
+                        BenchDeviceThread,
+                        Console) == 0);
+
+    (VOID) pthread_mutex_lock(&Console->Lock);
+    for (Index = 0; Index < ReadCount; Index++)
+        BenchRead(Console, &Console->Reads[Index]);
+    (VOID) pthread_mutex_unlock(&Console->Lock);
+
+    Deadline = Start + TEST_TIMEOUT;
+    while (!__atomic_load_n(&Console->Done, __ATOMIC_ACQUIRE)) {
+        struct timespec Pause = { 0, 1000000 };
+
+        if (__TestGetTime() > Deadline)
+            break;
+
+        (VOID) nanosleep(&Pause, NULL);
+    }
+
+    Elapsed = __TestGetTime() - Start;
+
+    (VOID) pthread_join(Console->Device.Thread, NULL);
+    ReactorTeardown();
+
+    TEST(Console->Done);
+    TEST(Console->BytesRead == BENCH_TOTAL);
+    TEST(!Console->OutOfOrder);
+
+    printf("%8u %8u %10u %12.2f %12llu\n",
+           ClientCount,
+           ReadCount,
+           ReadSize,
+           (Console->BytesRead / (1024.0 * 1024.0)) / Elapsed,
+           (unsigned long long)Console->ReadSequence);
+
+    close(Console->Null);
+
+    for (Index = 0; Index < ClientCount; Index++)
+        HubQueueTeardown(&Console->Clients[Index]);
+
+    free(Console->ReadPool);
+    (VOID) pthread_cond_destroy(&Console->Device.Queued);
+    (VOID) pthread_mutex_destroy(&Console->Device.Lock);
+    (VOID) pthread_mutex_destroy(&Console->Lock);
+    free(Console);
+}
+
+static VOID
+Benchmark(
+    VOID
+    )
+{
+    static const struct {
+        DWORD   Count;
+        DWORD   Size;
+    } Settings[] = {
+        { 1, 1024 },        // Before DeviceReads
+        { 1, 16 * 1024 },
+        { 4, 1024 },
+        { 4, 16 * 1024 },   // The defaults
+        { 16, 16 * 1024 },
+        { 64, 16 * 1024 },  // The most allowed
+    };
+    static const DWORD  Clients[] = { 1, 10, 100 };
+    DWORD               Outer;
+    DWORD               Inner;
+
+    printf("%8s %8s %10s %12s %12s\n",
+           "clients", "reads", "read size", "MB/s", "issued");
+
+    for (Outer = 0; Outer < sizeof (Clients) / sizeof (Clients[0]); Outer++)
+        for (Inner = 0; Inner < sizeof (Settings) / sizeof (Settings[0]); Inner++)
+            Bench(Clients[Outer],
+                  Settings[Inner].Count,
+                  Settings[Inner].Size);
+}
+
+int
+main(
+    int     argc,
+    char    **argv
+    )
+{
+    (VOID) argc;
+    (VOID) argv;
+
+    Benchmark();
+
+    if (Failures != 0) {
+        fprintf(stderr, "%d failure(s)\n", Failures);
+        return 1;
+    }
+
+    printf("passed\n");
+    return 0;
+}
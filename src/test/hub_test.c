@@ -0,0 +1,622 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+// Host test and benchmark for the monitor's output hub. Linux only:
+//
+//   cc -O2 -pthread -I src/monitor -o hub_test src/test/hub_test.c
+//      src/monitor/hub.c src/monitor/reactor_epoll.c
+//
+// The tests check each overflow policy and queue wrap-around. The
+// benchmark fans a synthetic console stream out to 1, 10 and 100
+// clients the way the monitor does: a device thread pushes every read
+// into each client's queue under one console lock, and each client's
+// writes are driven by the reactor over a non-blocking socket pair.
+// Healthy clients are drained by the reactor as well; in the runs with
+// a stuck client one client's socket is never read, so its writes stop
+// completing and its queue fills.
+//
+// Paced runs offer 8 MB/s, far more than any real console, and every
+// healthy client must get all of it whatever the stuck one does. The
+// unpaced runs show the most the device thread can fan out, at the
+// cost of drops once it outruns the clients. The time the console lock
+// is held per device read is what a stuck client must not grow.
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "hub.h"
+#include "reactor.h"
+
+#define TEST_TIMEOUT        30          // Seconds
+
+#define BENCH_THREADS       4
+#define BENCH_READ_SIZE     4096        // Bytes per device read
+#define BENCH_TOTAL         (16 << 20)  // Bytes read from the device
+#define BENCH_RATE          (8 << 20)   // Bytes/s, when paced
+#define BENCH_QUEUE_SIZE    (1 << 20)   // Per client
+#define BENCH_WRITE_SIZE    4096        // MAXIMUM_BUFFER_SIZE in monitor.c
+
+static int  Failures;
+
+#define TEST(_Condition)                                            \
+    do {                                                            \
+        if (!(_Condition)) {                                        \
+            fprintf(stderr, "%s:%d: %s\n",                          \
+                    __FILE__, __LINE__, #_Condition);               \
+            Failures++;                                             \
+        }                                                           \
+    } while (0)
+
+static double
+__TestGetTime(
+    VOID
+    )
+{
+    struct timespec Now;
+
+    (VOID) clock_gettime(CLOCK_MONOTONIC, &Now);
+
+    return Now.tv_sec + (Now.tv_nsec / 1e9);
+}
+
+static VOID
+__TestFill(
+    _Out_writes_bytes_(Length) PUCHAR   Data,
+    _In_ DWORD                          Length,
+    _In_ DWORD                          Start
+    )
+{
+    DWORD                               Index;
+
+    for (Index = 0; Index < Length; Index++)
+        Data[Index] = (UCHAR)(Start + Index);
+}
+
+static BOOL
+__TestCheck(
+    _In_reads_bytes_(Length) PUCHAR Data,
+    _In_ DWORD                      Length,
+    _In_ DWORD                      Start
+    )
+{
+    DWORD                           Index;
+
+    for (Index = 0; Index < Length; Index++)
+        if (Data[Index] != (UCHAR)(Start + Index))
+            return FALSE;
+
+    return TRUE;
+}
+
+// Bytes come out in the order they went in, across the end of the
+// buffer
+static VOID
+TestWrap(
+    VOID
+    )
+{
+    HUB_QUEUE   Queue;
+    UCHAR       Data[100];
+    DWORD       Position;
+    DWORD       Round;
+
+    TEST(HubQueueInitialize(&Queue, 64, HUB_OVERFLOW_DISCONNECT));
+
+    Position = 0;
+    for (Round = 0; Round < 50; Round++) {
+        DWORD   Length = 1 + (Round * 7) % 40;
+
+        __TestFill(Data, Length, Position);
+        TEST(HubQueuePush(&Queue, Data, Length));
+
+        memset(Data, 0, sizeof (Data));
+        TEST(HubQueuePop(&Queue, Data, sizeof (Data)) == Length);
+        TEST(__TestCheck(Data, Length, Position));
+
+        Position += Length;
+    }
+
+    TEST(HubQueuePop(&Queue, Data, sizeof (Data)) == 0);
+    TEST(Queue.BytesQueued == Position);
+    TEST(Queue.BytesDropped == 0);
+
+    HubQueueTeardown(&Queue);
+}
+
+static VOID
+TestDropOldest(
+    VOID
+    )
+{
+    HUB_QUEUE   Queue;
+    UCHAR       Data[200];
+
+    TEST(HubQueueInitialize(&Queue, 64, HUB_OVERFLOW_DROP_OLDEST));
+
+    // 48 then 48 more: the first 32 go
+    __TestFill(Data, 96, 0);
+    TEST(HubQueuePush(&Queue, Data, 48));
+    TEST(HubQueuePush(&Queue, Data + 48, 48));
+    TEST(Queue.Count == 64);
+    TEST(Queue.BytesDropped == 32);
+    TEST(Queue.HighWater == 64);
+
+    TEST(HubQueuePop(&Queue, Data, sizeof (Data)) == 64);
+    TEST(__TestCheck(Data, 64, 32));
+
+    // More than the whole queue at once: only the newest 64 are kept
+    __TestFill(Data, 200, 0);
+    TEST(HubQueuePush(&Queue, Data, 200));
+    TEST(Queue.BytesDropped == 32 + 136);
+
+    TEST(HubQueuePop(&Queue, Data, sizeof (Data)) == 64);
+    TEST(__TestCheck(Data, 64, 136));
+
+    HubQueueTeardown(&Queue);
+}
+
+static VOID
+TestDropNewest(
+    VOID
+    )
+{
+    HUB_QUEUE   Queue;
+    UCHAR       Data[100];
+
+    TEST(HubQueueInitialize(&Queue, 64, HUB_OVERFLOW_DROP_NEWEST));
+
+    __TestFill(Data, 100, 0);
+    TEST(HubQueuePush(&Queue, Data, 48));
+    TEST(HubQueuePush(&Queue, Data + 48, 48));
+    TEST(Queue.Count == 64);
+    TEST(Queue.BytesDropped == 32);
+
+    TEST(HubQueuePop(&Queue, Data, sizeof (Data)) == 64);
+    TEST(__TestCheck(Data, 64, 0));
+
+    HubQueueTeardown(&Queue);
+}
+
+static VOID
+TestDisconnect(
+    VOID
+    )
+{
+    HUB_QUEUE   Queue;
+    UCHAR       Data[100];
+
+    TEST(HubQueueInitialize(&Queue, 64, HUB_OVERFLOW_DISCONNECT));
+
+    __TestFill(Data, 100, 0);
+    TEST(HubQueuePush(&Queue, Data, 48));
+    TEST(!HubQueuePush(&Queue, Data + 48, 48));
+    TEST(Queue.Overflowed);
+
+    // Once overflowed it stays that way, even with room
+    TEST(HubQueuePop(&Queue, Data, sizeof (Data)) == 48);
+    TEST(!HubQueuePush(&Queue, Data, 1));
+
+    HubQueueTeardown(&Queue);
+
+    TEST(!HubQueueInitialize(&Queue, 0, HUB_OVERFLOW_DROP_OLDEST));
+    TEST(!HubQueueInitialize(&Queue, 64, HUB_OVERFLOW_POLICY_COUNT));
+}
+
+// A stand-in for MONITOR_CONNECTION: the queue, the write in flight and
+// the reading end of the socket
+typedef struct _BENCH_CLIENT {
+    HUB_QUEUE   Queue;
+    int         Socket;     // The monitor's end
+    BOOL        Writing;
+    BOOL        Closed;
+    DWORD       Offset;     // Into WriteBuffer
+    DWORD       Length;
+    ULONGLONG   Sent;
+    UCHAR       WriteBuffer[BENCH_WRITE_SIZE];
+    REACTOR_IO  WriteIo;
+
+    int         Peer;       // The client's end
+    BOOL        Stuck;
+    LONG64      Received;
+    REACTOR_IO  ReadIo;
+    UCHAR       ReadBuffer[65536];
+} BENCH_CLIENT, *PBENCH_CLIENT;
+
+static pthread_mutex_t  BenchLock = PTHREAD_MUTEX_INITIALIZER;
+
+static VOID BenchWriteReady(PREACTOR_IO, DWORD, DWORD);
+
+// As ConnectionWrite(): called with BenchLock held
+static VOID
+BenchWrite(
+    _In_ PBENCH_CLIENT  Client
+    )
+{
+    if (Client->Closed)
+        return;
+
+    if (Client->Queue.Overflowed) {
+        Client->Closed = TRUE;
+        return;
+    }
+
+    if (Client->Writing)
+        return;
+
+    for (;;) {
+        ssize_t Written;
+
+        if (Client->Length == 0) {
+            Client->Offset = 0;
+            Client->Length = HubQueuePop(&Client->Queue,
+                                         Client->WriteBuffer,
+                                         sizeof (Client->WriteBuffer));
+            if (Client->Length == 0)
+                return;
+        }
+
+        Written = write(Client->Socket,
+                        &Client->WriteBuffer[Client->Offset],
+                        Client->Length);
+        if (Written < 0) {
+            if (errno == EAGAIN)
+                break;
+
+            Client->Closed = TRUE;
+            return;
+        }
+
+        Client->Sent += Written;
+        Client->Offset += (DWORD)Written;
+        Client->Length -= (DWORD)Written;
+    }
+
+    // The write is pending until the socket has room again
+    Client->Writing = TRUE;
+
+    ReactorPrepare(&Client->WriteIo, BenchWriteReady, Client);
+    if (!ReactorWait(Client->Socket, &Client->WriteIo, EPOLLOUT))
+        Client->Closed = TRUE;
+}
+
+static VOID
+BenchWriteReady(
+    _In_ PREACTOR_IO    Io,
+    _In_ DWORD          Error,
+    _In_ DWORD          Length
+    )
+{
+    PBENCH_CLIENT       Client = Io->Argument;
+
+    UNREFERENCED_PARAMETER(Error);
+    UNREFERENCED_PARAMETER(Length);
+
+    (VOID) pthread_mutex_lock(&BenchLock);
+
+    Client->Writing = FALSE;
+    BenchWrite(Client);
+
+    (VOID) pthread_mutex_unlock(&BenchLock);
+}
+
+static VOID
+BenchRead(
+    _In_ PREACTOR_IO    Io,
+    _In_ DWORD          Error,
+    _In_ DWORD          Length
+    )
+{
+    PBENCH_CLIENT       Client = Io->Argument;
+    ssize_t             Read;
+
+    UNREFERENCED_PARAMETER(Error);
+    UNREFERENCED_PARAMETER(Length);
+
+    while ((Read = read(Client->Peer,
+                        Client->ReadBuffer,
+                        sizeof (Client->ReadBuffer))) > 0)
+        (VOID) __atomic_add_fetch(&Client->Received, Read, __ATOMIC_RELEASE);
+
+    ReactorPrepare(&Client->ReadIo, BenchRead, Client);
+    (VOID) ReactorWait(Client->Peer, &Client->ReadIo, EPOLLIN);
+}
+
+// As ConsoleBroadcast()
+static VOID
+BenchBroadcast(
+    _In_ PBENCH_CLIENT  Clients,
+    _In_ DWORD          Count,
+    _In_ PUCHAR         Buffer,
+    _In_ DWORD          Length
+    )
+{
+    DWORD               Index;
+
+    (VOID) pthread_mutex_lock(&BenchLock);
+
+    for (Index = 0; Index < Count; Index++) {
+        PBENCH_CLIENT   Client = &Clients[Index];
+
+        if (Client->Closed)
+            continue;
+
+        (VOID) HubQueuePush(&Client->Queue, Buffer, Length);
+        BenchWrite(Client);
+    }
+
+    (VOID) pthread_mutex_unlock(&BenchLock);
+}
+
+// Every healthy client has emptied its queue and read all it was sent
+static BOOL
+__BenchIsDrained(
+    _In_ PBENCH_CLIENT  Client
+    )
+{
+    BOOL                Drained;
+
+    (VOID) pthread_mutex_lock(&BenchLock);
+
+    Drained = Client->Closed ||
+              (Client->Queue.Count == 0 &&
+               Client->Length == 0 &&
+               (ULONGLONG)__atomic_load_n(&Client->Received,
+                                          __ATOMIC_ACQUIRE) == Client->Sent);
+
+    (VOID) pthread_mutex_unlock(&BenchLock);
+
+    return Drained;
+}
+
+static BOOL
+BenchDrained(
+    _In_ PBENCH_CLIENT  Clients,
+    _In_ DWORD          Count
+    )
+{
+    double              Deadline = __TestGetTime() + TEST_TIMEOUT;
+    DWORD               Index;
+
+    for (Index = 0; Index < Count; Index++) {
+        PBENCH_CLIENT   Client = &Clients[Index];
+
+        if (Client->Stuck)
+            continue;
+
+        while (!__BenchIsDrained(Client)) {
+            struct timespec Pause = { 0, 100000 };
+
+            if (__TestGetTime() > Deadline)
+                return FALSE;
+
+            (VOID) nanosleep(&Pause, NULL);
+        }
+
+    }
+
+    return TRUE;
+}
+
+static VOID
+Bench(
+    _In_ DWORD                  Count,
+    _In_ BOOL                   Stuck,
+    _In_ HUB_OVERFLOW_POLICY    Policy,
+    _In_ BOOL                   Paced
+    )
+{
+    static const PCSTR          Policies[] = {
+        "drop-oldest", "drop-newest", "disconnect"
+    };
+    PBENCH_CLIENT               Clients;
+    UCHAR                       Buffer[BENCH_READ_SIZE];
+    ULONGLONG                   Delivered;
+    ULONGLONG                   Dropped;
+    double                      Start;
+    double                      Produced;
+    double                      Elapsed;
+    double                      Held;
+    double                      HeldMaximum;
+    DWORD                       Reads;
+    DWORD                       Read;
+    DWORD                       Index;
+
+    Clients = calloc(Count, sizeof (BENCH_CLIENT));
+    TEST(Clients != NULL);
+    if (Clients == NULL)
+        return;
+
+    TEST(ReactorInitialize(BENCH_THREADS));
+
+    for (Index = 0; Index < Count; Index++) {
+        PBENCH_CLIENT   Client = &Clients[Index];
+        int             Sockets[2];
+
+        TEST(HubQueueInitialize(&Client->Queue, BENCH_QUEUE_SIZE, Policy));
+
+        TEST(socketpair(AF_UNIX,
+                        SOCK_STREAM | SOCK_NONBLOCK,
+                        0,
+                        Sockets) == 0);
+
+        Client->Socket = Sockets[0];
+        Client->Peer = Sockets[1];
+        TEST(ReactorAssociate(Client->Socket));
+
+        // The last client never reads
+        if (Stuck && Index == Count - 1) {
+            Client->Stuck = TRUE;
+            continue;
+        }
+
+        TEST(ReactorAssociate(Client->Peer));
+
+        ReactorPrepare(&Client->ReadIo, BenchRead, Client);
+        TEST(ReactorWait(Client->Peer, &Client->ReadIo, EPOLLIN));
+    }
+
+    __TestFill(Buffer, sizeof (Buffer), 0);
+
+    Reads = BENCH_TOTAL / BENCH_READ_SIZE;
+    Held = 0;
+    HeldMaximum = 0;
+
+    Start = __TestGetTime();
+
+    for (Read = 0; Read < Reads; Read++) {
+        double  Before;
+        double  After;
+
+        if (Paced) {
+            double  Due = Start + ((double)Read * BENCH_READ_SIZE) / BENCH_RATE;
+            double  Now = __TestGetTime();
+
+            if (Due > Now) {
+                struct timespec Pause = { 0, (long)((Due - Now) * 1e9) };
+
+                (VOID) nanosleep(&Pause, NULL);
+            }
+        }
+
+        Before = __TestGetTime();
+        BenchBroadcast(Clients, Count, Buffer, sizeof (Buffer));
+        After = __TestGetTime();
+
+        Held += After - Before;
+        if (After - Before > HeldMaximum)
+            HeldMaximum = After - Before;
+    }
+
+    Produced = __TestGetTime() - Start;
+
+    TEST(BenchDrained(Clients, Count));
+
+    Elapsed = __TestGetTime() - Start;
+
+    ReactorTeardown();
+
+    Delivered = 0;
+    Dropped = 0;
+    for (Index = 0; Index < Count; Index++) {
+        PBENCH_CLIENT   Client = &Clients[Index];
+
+        if (Client->Stuck) {
+            // It took what the socket would hold, then fell behind
+            TEST(Client->Queue.BytesDropped != 0);
+            TEST(Client->Closed == (Policy == HUB_OVERFLOW_DISCONNECT));
+        } else {
+            Delivered += Client->Received;
+            Dropped += Client->Queue.BytesDropped;
+
+            if (Paced) {
+                TEST(!Client->Closed);
+                TEST(Client->Received == BENCH_TOTAL);
+            }
+        }
+
+        HubQueueTeardown(&Client->Queue);
+        close(Client->Socket);
+        close(Client->Peer);
+    }
+
+    printf("%8u %6s %12s %6s %12.0f %12.0f %10.1f %10.1f %8.2f\n",
+           Count,
+           (Stuck) ? "yes" : "no",
+           Policies[Policy],
+           (Paced) ? "yes" : "no",
+           (BENCH_TOTAL / (1024.0 * 1024.0)) / Produced,
+           (Delivered / (1024.0 * 1024.0)) / Elapsed,
+           (Held / Reads) * 1e6,
+           HeldMaximum * 1e6,
+           (Delivered + Dropped != 0) ?
+           (100.0 * Dropped) / (Delivered + Dropped) :
+           0.0);
+
+    free(Clients);
+}
+
+static VOID
+Benchmark(
+    VOID
+    )
+{
+    static const DWORD  Counts[] = { 1, 10, 100 };
+    DWORD               Index;
+
+    printf("%8s %6s %12s %6s %12s %12s %10s %10s %8s\n",
+           "clients", "stuck", "policy", "paced", "device MB/s",
+           "client MB/s", "lock us", "max us", "drop%");
+
+    for (Index = 0; Index < sizeof (Counts) / sizeof (Counts[0]); Index++) {
+        Bench(Counts[Index], FALSE, HUB_OVERFLOW_DROP_OLDEST, TRUE);
+        Bench(Counts[Index], TRUE, HUB_OVERFLOW_DROP_OLDEST, TRUE);
+    }
+
+    Bench(10, TRUE, HUB_OVERFLOW_DROP_NEWEST, TRUE);
+    Bench(10, TRUE, HUB_OVERFLOW_DISCONNECT, TRUE);
+
+    for (Index = 0; Index < sizeof (Counts) / sizeof (Counts[0]); Index++) {
+        Bench(Counts[Index], FALSE, HUB_OVERFLOW_DROP_OLDEST, FALSE);
+        Bench(Counts[Index], TRUE, HUB_OVERFLOW_DROP_OLDEST, FALSE);
+    }
+}
+
+int
+main(
+    int     argc,
+    char    **argv
+    )
+{
+    (VOID) argc;
+    (VOID) argv;
+
+    TestWrap();
+    TestDropOldest();
+    TestDropNewest();
+    TestDisconnect();
+    Benchmark();
+
+    if (Failures != 0) {
+        fprintf(stderr, "%d failure(s)\n", Failures);
+        return 1;
+    }
+
+    printf("passed\n");
+    return 0;
+}
@@ -0,0 +1,473 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+// Host simulation of console negotiation. Nothing here needs Windows:
+//
+//   cc -I src/xencons -o negotiate_sim src/test/negotiate_sim.c
+//
+// The handshake itself is the driver's own NegotiateStep(); only the
+// store, the backends and the clock are simulated. Each backend takes a
+// pseudo-random time to follow the frontend. Two ways of driving the
+// handshake are compared for 1 to 256 consoles:
+//
+//   polled - consoles come up one after another and each wait spins,
+//            reading the backend state every millisecond (what the
+//            frontend used to do at DISPATCH_LEVEL)
+//   watched - every console negotiates on its own thread and sleeps on
+//            a watch of the backend state between reads
+//
+// Times are simulated, so the numbers are repeatable; the store costs
+// below are assumptions, not measurements.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ring_compat.h"
+
+typedef enum _XenbusState {
+    XenbusStateUnknown = 0,
+    XenbusStateInitialising = 1,
+    XenbusStateInitWait = 2,
+    XenbusStateInitialised = 3,
+    XenbusStateConnected = 4,
+    XenbusStateClosing = 5,
+    XenbusStateClosed = 6,
+    XenbusStateReconfiguring = 7,
+    XenbusStateReconfigured = 8
+} XenbusState;
+
+#include "negotiate.h"
+
+#define SIM_MAX_CONSOLES    256
+
+#define SIM_POLL_INTERVAL   1000    // us, KeStallExecutionProcessor(1000)
+#define SIM_READ_COST       20      // us of CPU for a store read
+#define SIM_WRITE_COST      30      // us of CPU for a store write
+#define SIM_WATCH_COST      40      // us of CPU to add and remove a watch
+#define SIM_WATCH_DELAY     50      // us from a store write to the watch firing
+
+#define SIM_HOTPLUG_MIN     2000    // us for a backend to reach InitWait
+#define SIM_HOTPLUG_SPAN    20000
+#define SIM_BACKEND_MIN     200     // us for a backend to follow a write
+#define SIM_BACKEND_SPAN    5000
+
+#define SIM_NEVER           (~0ull)
+
+static int  Failures;
+
+#define TEST(_Condition)                                            \
+    do {                                                            \
+        if (!(_Condition)) {                                        \
+            fprintf(stderr, "%s:%d: %s\n",                          \
+                    __FILE__, __LINE__, #_Condition);               \
+            Failures++;                                             \
+        }                                                           \
+    } while (0)
+
+typedef struct _SIM_CONSOLE {
+    // Backend
+    XenbusState         Backend;
+    XenbusState         Pending;        // State the backend is moving to
+    ULONGLONG           Due;            // ... and when it gets there
+    BOOLEAN             FailPrepare;    // Backend goes to Closed instead
+
+    // Frontend
+    NEGOTIATE_PHASE     Phase;
+    XenbusState         Seen;           // Last state read from the store
+    NEGOTIATE_RESULT    Result;
+    ULONGLONG           Wake;           // When the frontend next reads
+    ULONGLONG           Connected;      // When CONNECT completed
+    ULONGLONG           Cpu;
+    ULONG               Reads;
+} SIM_CONSOLE, *PSIM_CONSOLE;
+
+static ULONG    Seed;
+
+static ULONG
+SimRandom(
+    _In_ ULONG  Span
+    )
+{
+    Seed = Seed * 1103515245 + 12345;
+
+    return (Seed >> 8) % Span;
+}
+
+static VOID
+SimInitialize(
+    _Out_ PSIM_CONSOLE  Console,
+    _In_ ULONG          Count
+    )
+{
+    ULONG               Index;
+
+    Seed = 1;
+
+    memset(Console, 0, sizeof (SIM_CONSOLE) * Count);
+
+    for (Index = 0; Index < Count; Index++) {
+        Console[Index].Backend = XenbusStateInitialising;
+        Console[Index].Pending = XenbusStateInitWait;
+        Console[Index].Due = SIM_HOTPLUG_MIN + SimRandom(SIM_HOTPLUG_SPAN);
+        Console[Index].Phase = NEGOTIATE_PREPARE;
+        Console[Index].Seen = XenbusStateUnknown;
+        Console[Index].Result = NEGOTIATE_WAIT;
+    }
+}
+
+// Bring the backend up to date. Returns TRUE if it moved.
+static BOOLEAN
+SimBackend(
+    _In_ PSIM_CONSOLE   Console,
+    _In_ ULONGLONG      Now
+    )
+{
+    if (Console->Due > Now)
+        return FALSE;
+
+    Console->Backend = Console->Pending;
+    Console->Due = SIM_NEVER;
+
+    return TRUE;
+}
+
+// The frontend has written State; have the backend follow it
+static VOID
+SimFrontendWrite(
+    _In_ PSIM_CONSOLE   Console,
+    _In_ XenbusState    State,
+    _In_ ULONGLONG      Now
+    )
+{
+    Console->Cpu += SIM_WRITE_COST;
+
+    switch (State) {
+    case XenbusStateConnected:
+    case XenbusStateClosing:
+    case XenbusStateClosed:
+        Console->Pending = State;
+        break;
+
+    default:
+        return;
+    }
+
+    Console->Due = Now + SIM_BACKEND_MIN + SimRandom(SIM_BACKEND_SPAN);
+}
+
+// Read the backend state and, if it has changed, take the next step.
+// Returns FALSE once the console has nothing more to do.
+static BOOLEAN
+SimFrontendRead(
+    _In_ PSIM_CONSOLE   Console,
+    _In_ ULONGLONG      Now
+    )
+{
+    XenbusState         Next;
+
+    Console->Cpu += SIM_READ_COST;
+    Console->Reads++;
+
+    if (Console->Backend == Console->Seen)
+        return TRUE;
+
+    Console->Seen = Console->Backend;
+
+    Console->Result = NegotiateStep(Console->Phase, Console->Seen, &Next);
+    if (Next != XenbusStateUnknown)
+        SimFrontendWrite(Console, Next, Now);
+
+    if (Console->Result == NEGOTIATE_FAIL)
+        return FALSE;
+
+    if (Console->Result == NEGOTIATE_DONE) {
+        if (Console->Phase == NEGOTIATE_CONNECT)
+            Console->Connected = Now;
+
+        if (++Console->Phase == NEGOTIATE_PHASE_COUNT)
+            return FALSE;
+
+        // Each phase starts from a fresh read, as FrontendNegotiate()
+        // does
+        Console->Seen = XenbusStateUnknown;
+        Console->Result = NEGOTIATE_WAIT;
+        Console->Cpu += SIM_WATCH_COST;
+        return SimFrontendRead(Console, Now);
+    }
+
+    return TRUE;
+}
+
+// The old frontend: one console at a time, each polling until it is done
+static ULONGLONG
+SimPolled(
+    _In_ PSIM_CONSOLE   Console,
+    _In_ ULONG          Count
+    )
+{
+    ULONGLONG           Now;
+    ULONG               Index;
+
+    Now = 0;
+    for (Index = 0; Index < Count; Index++) {
+        PSIM_CONSOLE    This = &Console[Index];
+
+        for (;;) {
+            ULONG   Other;
+
+            // Every backend keeps moving while this one is polled
+            for (Other = 0; Other < Count; Other++)
+                (VOID) SimBackend(&Console[Other], Now);
+
+            if (!SimFrontendRead(This, Now))
+                break;
+
+            Now += SIM_POLL_INTERVAL;
+            This->Cpu += SIM_POLL_INTERVAL;
+        }
+    }
+
+    return Now;
+}
+
+// The new frontend: every console at once, each woken by its watch
+static ULONGLONG
+SimWatched(
+    _In_ PSIM_CONSOLE   Console,
+    _In_ ULONG          Count
+    )
+{
+    ULONGLONG           Now;
+    ULONGLONG           Last;
+    ULONG               Index;
+
+    // Every state thread starts by adding its watch and reading
+    for (Index = 0; Index < Count; Index++) {
+        Console[Index].Cpu += SIM_WATCH_COST;
+        (VOID) SimFrontendRead(&Console[Index], 0);
+        Console[Index].Wake = SIM_NEVER;
+    }
+
+    Last = 0;
+    for (;;) {
+        PSIM_CONSOLE    This;
+
+        // Next thing to happen, be it a backend moving or a watch firing
+        This = NULL;
+        Now = SIM_NEVER;
+        for (Index = 0; Index < Count; Index++) {
+            if (Console[Index].Due < Now) {
+                Now = Console[Index].Due;
+                This = &Console[Index];
+            }
+            if (Console[Index].Wake < Now) {
+                Now = Console[Index].Wake;
+                This = &Console[Index];
+            }
+        }
+
+        if (This == NULL)
+            break;
+
+        if (This->Wake == Now) {
+            This->Wake = SIM_NEVER;
+
+            if (SimFrontendRead(This, Now))
+                continue;
+
+            Last = Now;
+        } else if (SimBackend(This, Now)) {
+            This->Wake = Now + SIM_WATCH_DELAY;
+        }
+    }
+
+    return Last;
+}
+
+static VOID
+SimCheck(
+    _In_ PSIM_CONSOLE   Console,
+    _In_ ULONG          Count
+    )
+{
+    ULONG               Index;
+
+    for (Index = 0; Index < Count; Index++) {
+        TEST(Console[Index].Phase == NEGOTIATE_PHASE_COUNT);
+        TEST(Console[Index].Result == NEGOTIATE_DONE);
+        TEST(Console[Index].Backend == XenbusStateClosed);
+        TEST(Console[Index].Connected != 0);
+    }
+}
+
+static VOID
+SimSummarize(
+    _In_ PSIM_CONSOLE   Console,
+    _In_ ULONG          Count,
+    _Out_ PULONGLONG    Connected,
+    _Out_ PULONGLONG    Cpu,
+    _Out_ PULONGLONG    Reads
+    )
+{
+    ULONG               Index;
+
+    *Connected = 0;
+    *Cpu = 0;
+    *Reads = 0;
+
+    for (Index = 0; Index < Count; Index++) {
+        if (Console[Index].Connected > *Connected)
+            *Connected = Console[Index].Connected;
+
+        *Cpu += Console[Index].Cpu;
+        *Reads += Console[Index].Reads;
+    }
+}
+
+// The handshake table itself
+static VOID
+TestStep(
+    VOID
+    )
+{
+    XenbusState Next;
+
+    TEST(NegotiateStep(NEGOTIATE_PREPARE, XenbusStateInitialising, &Next) == NEGOTIATE_WAIT);
+    TEST(Next == XenbusStateInitialising);
+    TEST(NegotiateStep(NEGOTIATE_PREPARE, XenbusStateInitWait, &Next) == NEGOTIATE_DONE);
+    TEST(Next == XenbusStateUnknown);
+    TEST(NegotiateStep(NEGOTIATE_PREPARE, XenbusStateClosed, &Next) == NEGOTIATE_FAIL);
+    TEST(Next == XenbusStateClosed);
+
+    TEST(NegotiateStep(NEGOTIATE_CONNECT, XenbusStateInitWait, &Next) == NEGOTIATE_WAIT);
+    TEST(Next == XenbusStateConnected);
+    TEST(NegotiateStep(NEGOTIATE_CONNECT, XenbusStateInitialised, &Next) == NEGOTIATE_WAIT);
+    TEST(Next == XenbusStateUnknown);
+    TEST(NegotiateStep(NEGOTIATE_CONNECT, XenbusStateConnected, &Next) == NEGOTIATE_DONE);
+    TEST(NegotiateStep(NEGOTIATE_CONNECT, XenbusStateClosing, &Next) == NEGOTIATE_FAIL);
+    TEST(NegotiateStep(NEGOTIATE_CONNECT, XenbusStateUnknown, &Next) == NEGOTIATE_FAIL);
+
+    TEST(NegotiateStep(NEGOTIATE_CLOSE, XenbusStateConnected, &Next) == NEGOTIATE_WAIT);
+    TEST(Next == XenbusStateClosing);
+    TEST(NegotiateStep(NEGOTIATE_CLOSE, XenbusStateClosing, &Next) == NEGOTIATE_WAIT);
+    TEST(Next == XenbusStateClosed);
+    TEST(NegotiateStep(NEGOTIATE_CLOSE, XenbusStateClosed, &Next) == NEGOTIATE_DONE);
+
+    TEST(NegotiateStep(NEGOTIATE_PHASE_COUNT, XenbusStateConnected, &Next) == NEGOTIATE_FAIL);
+}
+
+// A backend that closes before InitWait fails only its own console
+static VOID
+TestFailPrepare(
+    VOID
+    )
+{
+    static SIM_CONSOLE  Console[4];
+
+    SimInitialize(Console, 4);
+    Console[2].Pending = XenbusStateClosed;
+
+    (VOID) SimWatched(Console, 4);
+
+    TEST(Console[0].Phase == NEGOTIATE_PHASE_COUNT);
+    TEST(Console[1].Phase == NEGOTIATE_PHASE_COUNT);
+    TEST(Console[2].Phase == NEGOTIATE_PREPARE);
+    TEST(Console[2].Result == NEGOTIATE_FAIL);
+    TEST(Console[3].Phase == NEGOTIATE_PHASE_COUNT);
+}
+
+static VOID
+Benchmark(
+    VOID
+    )
+{
+    static SIM_CONSOLE  Console[SIM_MAX_CONSOLES];
+    static const ULONG  Counts[] = { 1, 4, 16, 64, 256 };
+    ULONG               Index;
+
+    printf("%8s %14s %14s %10s %14s %14s %10s\n",
+           "consoles",
+           "polled ms", "polled cpu ms", "reads",
+           "watched ms", "watched cpu ms", "reads");
+
+    for (Index = 0; Index < sizeof (Counts) / sizeof (Counts[0]); Index++) {
+        ULONG       Count = Counts[Index];
+        ULONGLONG   PolledConnected, PolledCpu, PolledReads;
+        ULONGLONG   WatchedConnected, WatchedCpu, WatchedReads;
+
+        SimInitialize(Console, Count);
+        (VOID) SimPolled(Console, Count);
+        SimCheck(Console, Count);
+        SimSummarize(Console, Count,
+                     &PolledConnected, &PolledCpu, &PolledReads);
+
+        SimInitialize(Console, Count);
+        (VOID) SimWatched(Console, Count);
+        SimCheck(Console, Count);
+        SimSummarize(Console, Count,
+                     &WatchedConnected, &WatchedCpu, &WatchedReads);
+
+        // Running them all at once can only help
+        TEST(WatchedConnected <= PolledConnected);
+        TEST(WatchedCpu < PolledCpu);
+
+        printf("%8u %14.1f %14.1f %10llu %14.1f %14.1f %10llu\n",
+               Count,
+               PolledConnected / 1000.0, PolledCpu / 1000.0,
+               (unsigned long long)PolledReads,
+               WatchedConnected / 1000.0, WatchedCpu / 1000.0,
+               (unsigned long long)WatchedReads);
+    }
+}
+
+int
+main(
+    int     argc,
+    char    **argv
+    )
+{
+    (VOID) argc;
+    (VOID) argv;
+
+    TestStep();
+    TestFailPrepare();
+    Benchmark();
+
+    if (Failures != 0) {
+        fprintf(stderr, "%d failure(s)\n", Failures);
+        return 1;
+    }
+
+    printf("passed\n");
+    return 0;
+}
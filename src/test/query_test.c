@@ -0,0 +1,622 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+// Host test and benchmark for the monitor's capture query. Linux (or
+// anything with pwrite and sparse files):
+//
+//   cc -O2 -Wno-multichar -I include -I src/monitor -o query_test
+//      src/test/query_test.c src/monitor/query.c
+//
+// The tests write small captures of stored blocks, rotated across three
+// files, and check what comes back for ranges inside one file, across a
+// rotation, outside the capture, and with the index files removed.
+//
+// The benchmark builds a synthetic 10 GB capture in the directory given
+// as the first argument (default /tmp): 64K blocks every 10 ms, rotated
+// every 1 GB, with only the block headers and the index written so the
+// files stay sparse. It then extracts ten seconds that straddle a
+// rotation, and a single instant, with and without the index. Pass
+// "-n" to skip it.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "monitor_compat.h"
+
+#include <xencons_capture.h>
+
+#include "query.h"
+
+// 2026-01-01T00:00:00 as a FILETIME
+#define TEST_EPOCH          ((1767225600ull * 10000000) + 116444736000000000ull)
+#define TEST_SECOND         10000000ull
+
+#define TEST_FILES          3
+#define TEST_BLOCKS         10      // Per file
+#define TEST_BLOCK_LENGTH   100
+#define TEST_BLOCK_TIME     (10 * TEST_SECOND)
+
+#define BENCH_SIZE          (10ull << 30)
+#define BENCH_FILE_SIZE     (1ull << 30)
+#define BENCH_BLOCK_LENGTH  (64 * 1024)
+#define BENCH_BLOCK_TIME    (TEST_SECOND / 100)
+#define BENCH_RANGE         (10 * TEST_SECOND)
+
+static int  Failures;
+
+#define TEST(_Condition)                                            \
+    do {                                                            \
+        if (!(_Condition)) {                                        \
+            fprintf(stderr, "%s:%d: %s\n",                          \
+                    __FILE__, __LINE__, #_Condition);               \
+            Failures++;                                             \
+        }                                                           \
+    } while (0)
+
+static double
+__TestGetTime(
+    VOID
+    )
+{
+    struct timespec Now;
+
+    (VOID) clock_gettime(CLOCK_MONOTONIC, &Now);
+
+    return Now.tv_sec + (Now.tv_nsec / 1e9);
+}
+
+static VOID
+__TestFileName(
+    _In_ PCSTR  Stem,
+    _In_ DWORD  Rotation,
+    _In_ PCSTR  Extension,
+    _Out_ PSTR  FileName
+    )
+{
+    if (Rotation == 0)
+        sprintf(FileName, "%s.%s", Stem, Extension);
+    else
+        sprintf(FileName, "%s.%u.%s", Stem, (unsigned int)Rotation, Extension);
+}
+
+typedef struct _TEST_WRITER {
+    int         Capture;
+    int         Index;
+    ULONGLONG   Position;
+    ULONGLONG   IndexPosition;
+} TEST_WRITER, *PTEST_WRITER;
+
+static BOOL
+TestOpen(
+    _In_ PTEST_WRITER   Writer,
+    _In_ PCSTR          Stem,
+    _In_ DWORD          Rotation,
+    _In_ ULONGLONG      Time,
+    _In_ ULONGLONG      Offset,
+    _In_ ULONG          BlockSize
+    )
+{
+    XENCONS_CAPTURE_HEADER          Header;
+    XENCONS_CAPTURE_INDEX_HEADER    IndexHeader;
+    CHAR                            FileName[512];
+
+    __TestFileName(Stem, Rotation, XENCONS_CAPTURE_EXTENSION, FileName);
+    Writer->Capture = open(FileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (Writer->Capture < 0)
+        return FALSE;
+
+    __TestFileName(Stem, Rotation, XENCONS_CAPTURE_INDEX_EXTENSION, FileName);
+    Writer->Index = open(FileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (Writer->Index < 0)
+        return FALSE;
+
+    ZeroMemory(&Header, sizeof(Header));
+    Header.Magic = XENCONS_CAPTURE_MAGIC;
+    Header.Version = XENCONS_CAPTURE_VERSION;
+    Header.BlockSize = BlockSize;
+    Header.Time = Time;
+    Header.Offset = Offset;
+    strcpy(Header.Name, "test");
+
+    ZeroMemory(&IndexHeader, sizeof(IndexHeader));
+    IndexHeader.Magic = XENCONS_CAPTURE_INDEX_MAGIC;
+    IndexHeader.Version = XENCONS_CAPTURE_INDEX_VERSION;
+    IndexHeader.EntrySize = sizeof(XENCONS_CAPTURE_INDEX_ENTRY);
+    IndexHeader.Time = Time;
+
+    if (pwrite(Writer->Capture, &Header, sizeof(Header), 0) != sizeof(Header) ||
+        pwrite(Writer->Index, &IndexHeader, sizeof(IndexHeader), 0) !=
+        sizeof(IndexHeader))
+        return FALSE;
+
+    Writer->Position = sizeof(Header);
+    Writer->IndexPosition = sizeof(IndexHeader);
+
+    return TRUE;
+}
+
+// Data may be NULL, leaving a hole where it would be
+static BOOL
+TestWriteBlock(
+    _In_ PTEST_WRITER   Writer,
+    _In_ ULONGLONG      Time,
+    _In_ ULONGLONG      Offset,
+    _In_opt_ PUCHAR     Data,
+    _In_ ULONG          Length
+    )
+{
+    XENCONS_CAPTURE_BLOCK       Block;
+    XENCONS_CAPTURE_INDEX_ENTRY Entry;
+
+    ZeroMemory(&Block, sizeof(Block));
+    Block.Magic = XENCONS_CAPTURE_BLOCK_MAGIC;
+    Block.Flags = XENCONS_CAPTURE_BLOCK_STORED;
+    Block.Length = Length;
+    Block.CompressedLength = Length;
+    Block.Offset = Offset;
+    Block.Time = Time;
+
+    Entry.Time = Time;
+    Entry.Offset = Offset;
+    Entry.Position = Writer->Position;
+
+    if (pwrite(Writer->Capture, &Block, sizeof(Block), Writer->Position) !=
+        sizeof(Block))
+        return FALSE;
+
+    if (Data != NULL &&
+        pwrite(Writer->Capture, Data, Length,
+               Writer->Position + sizeof(Block)) != (ssize_t)Length)
+        return FALSE;
+
+    if (pwrite(Writer->Index, &Entry, sizeof(Entry), Writer->IndexPosition) !=
+        sizeof(Entry))
+        return FALSE;
+
+    Writer->Position += sizeof(Block) + Length;
+    Writer->IndexPosition += sizeof(Entry);
+
+    return TRUE;
+}
+
+static BOOL
+TestClose(
+    _In_ PTEST_WRITER   Writer
+    )
+{
+    BOOL                Success;
+
+    // Extend the file over any trailing hole
+    Success = (ftruncate(Writer->Capture, Writer->Position) == 0);
+
+    close(Writer->Index);
+    close(Writer->Capture);
+
+    return Success;
+}
+
+static VOID
+TestRemoveIndexes(
+    _In_ PCSTR  Stem,
+    _In_ DWORD  Files
+    )
+{
+    CHAR        FileName[512];
+    DWORD       Rotation;
+
+    for (Rotation = 0; Rotation < Files; Rotation++) {
+        __TestFileName(Stem, Rotation, XENCONS_CAPTURE_INDEX_EXTENSION,
+                       FileName);
+        (VOID) unlink(FileName);
+    }
+}
+
+static VOID
+TestRemove(
+    _In_ PCSTR  Stem,
+    _In_ DWORD  Files
+    )
+{
+    CHAR        FileName[512];
+    DWORD       Rotation;
+
+    TestRemoveIndexes(Stem, Files);
+
+    for (Rotation = 0; Rotation < Files; Rotation++) {
+        __TestFileName(Stem, Rotation, XENCONS_CAPTURE_EXTENSION, FileName);
+        (VOID) unlink(FileName);
+    }
+}
+
+// Block N holds TEST_BLOCK_LENGTH copies of the byte N and starts at
+// TEST_EPOCH + N * TEST_BLOCK_TIME. The oldest file has the highest
+// rotation number.
+static BOOL
+TestWriteCapture(
+    _In_ PCSTR  Stem
+    )
+{
+    TEST_WRITER Writer;
+    UCHAR       Data[TEST_BLOCK_LENGTH];
+    DWORD       File;
+    DWORD       Block;
+
+    for (File = 0; File < TEST_FILES; File++) {
+        DWORD   First = File * TEST_BLOCKS;
+
+        if (!TestOpen(&Writer, Stem, TEST_FILES - 1 - File,
+                      TEST_EPOCH + First * TEST_BLOCK_TIME,
+                      (ULONGLONG)First * TEST_BLOCK_LENGTH,
+                      TEST_BLOCK_LENGTH))
+            return FALSE;
+
+        for (Block = First; Block < First + TEST_BLOCKS; Block++) {
+            memset(Data, (int)Block, sizeof(Data));
+
+            if (!TestWriteBlock(&Writer,
+                                TEST_EPOCH + Block * TEST_BLOCK_TIME,
+                                (ULONGLONG)Block * TEST_BLOCK_LENGTH,
+                                Data,
+                                sizeof(Data)))
+                return FALSE;
+        }
+
+        if (!TestClose(&Writer))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+// The output should be exactly blocks First to Last
+static BOOL
+TestCheckOutput(
+    _In_ PCSTR  OutputName,
+    _In_ DWORD  First,
+    _In_ DWORD  Last
+    )
+{
+    FILE        *Output;
+    UCHAR       Data[TEST_BLOCK_LENGTH];
+    DWORD       Block;
+    BOOL        Success;
+
+    Output = fopen(OutputName, "rb");
+    if (Output == NULL)
+        return FALSE;
+
+    Success = TRUE;
+    for (Block = First; Block <= Last; Block++) {
+        DWORD   Index;
+
+        if (fread(Data, 1, sizeof(Data), Output) != sizeof(Data)) {
+            Success = FALSE;
+            break;
+        }
+
+        for (Index = 0; Index < sizeof(Data); Index++)
+            if (Data[Index] != (UCHAR)Block)
+                Success = FALSE;
+    }
+
+    if (fgetc(Output) != EOF)
+        Success = FALSE;
+
+    fclose(Output);
+
+    return Success;
+}
+
+static VOID
+TestRange(
+    _In_ PCSTR  CaptureName,
+    _In_ PCSTR  OutputName,
+    _In_ DWORD  From,       // Seconds after TEST_EPOCH
+    _In_ DWORD  To,
+    _In_ DWORD  First,      // Blocks expected
+    _In_ DWORD  Last
+    )
+{
+    QUERY_STATISTICS    Statistics;
+
+    TEST(QueryExtractRange(CaptureName,
+                           TEST_EPOCH + From * TEST_SECOND,
+                           TEST_EPOCH + To * TEST_SECOND,
+                           OutputName,
+                           &Statistics));
+    TEST(Statistics.Blocks == Last - First + 1);
+    TEST(Statistics.FirstOffset == (ULONGLONG)First * TEST_BLOCK_LENGTH);
+    TEST(Statistics.LastOffset == (ULONGLONG)Last * TEST_BLOCK_LENGTH);
+    TEST(TestCheckOutput(OutputName, First, Last));
+}
+
+static VOID
+TestQuery(
+    _In_ PCSTR          Directory
+    )
+{
+    CHAR                Stem[256];
+    CHAR                CaptureName[512];
+    CHAR                RotatedName[512];
+    CHAR                OutputName[512];
+    CHAR                Arguments[2048];
+    QUERY_STATISTICS    Statistics;
+    ULONGLONG           IndexedReads;
+
+    snprintf(Stem, sizeof(Stem), "%s/query_test", Directory);
+    snprintf(CaptureName, sizeof(CaptureName), "%s.xcap", Stem);
+    snprintf(RotatedName, sizeof(RotatedName), "%s.1.xcap", Stem);
+    snprintf(OutputName, sizeof(OutputName), "%s.out", Stem);
+
+    TEST(TestWriteCapture(Stem));
+
+    // Inside the oldest file: block 2 starts at 20s, so it holds 25s
+    TestRange(CaptureName, OutputName, 25, 55, 2, 5);
+
+    // Across the rotation from .1 to the current file
+    TestRange(CaptureName, OutputName, 155, 215, 15, 21);
+
+    // Starting exactly on the first block of a file
+    TestRange(CaptureName, OutputName, 200, 200, 20, 20);
+
+    // The last block of a file holds everything up to the next file
+    TestRange(CaptureName, OutputName, 195, 199, 19, 19);
+
+    // Everything, and beyond either end
+    TestRange(CaptureName, OutputName, 0, 1000, 0, 29);
+
+    // Before the capture starts there is nothing
+    TEST(QueryExtractRange(CaptureName,
+                           TEST_EPOCH - 100 * TEST_SECOND,
+                           TEST_EPOCH - 50 * TEST_SECOND,
+                           OutputName,
+                           &Statistics));
+    TEST(Statistics.Blocks == 0);
+
+    // Naming a rotated file only searches it and older ones
+    TestRange(RotatedName, OutputName, 0, 1000, 0, 19);
+
+    TEST(QueryExtractRange(CaptureName,
+                           TEST_EPOCH + 155 * TEST_SECOND,
+                           TEST_EPOCH + 215 * TEST_SECOND,
+                           OutputName,
+                           &Statistics));
+    IndexedReads = Statistics.BlockReads;
+
+    // The command line: same range as strings
+    snprintf(Arguments, sizeof(Arguments),
+             " \"%s\" 2026-01-01T00:02:35 2026-01-01T00:03:35 %s",
+             CaptureName, OutputName);
+    TEST(QueryCapture(Arguments));
+    TEST(TestCheckOutput(OutputName, 15, 21));
+
+    // Bad arguments are refused, with usage on stderr
+    strcpy(Arguments, "");
+    TEST(!QueryCapture(Arguments));
+    snprintf(Arguments, sizeof(Arguments),
+             "%s 2026-13-01T00:00:00 2026-01-01T00:00:00 %s",
+             CaptureName, OutputName);
+    TEST(!QueryCapture(Arguments));
+    snprintf(Arguments, sizeof(Arguments),
+             "%s 2026-01-01T00:01:00 2026-01-01T00:00:00 %s",
+             CaptureName, OutputName);
+    TEST(!QueryCapture(Arguments));
+
+    // Without the index every header up to the range is read
+    TestRemoveIndexes(Stem, TEST_FILES);
+
+    TestRange(CaptureName, OutputName, 155, 215, 15, 21);
+
+    TEST(QueryExtractRange(CaptureName,
+                           TEST_EPOCH + 155 * TEST_SECOND,
+                           TEST_EPOCH + 215 * TEST_SECOND,
+                           OutputName,
+                           &Statistics));
+    TEST(Statistics.IndexReads == 0);
+    TEST(Statistics.BlockReads > IndexedReads);
+
+    TestRemove(Stem, TEST_FILES);
+    (VOID) unlink(OutputName);
+}
+
+static BOOL
+BenchWriteCapture(
+    _In_ PCSTR  Stem,
+    _In_ DWORD  Files
+    )
+{
+    TEST_WRITER Writer;
+    ULONGLONG   Block;
+    ULONGLONG   BlocksPerFile;
+    DWORD       File;
+
+    BlocksPerFile = BENCH_FILE_SIZE /
+                    (sizeof(XENCONS_CAPTURE_BLOCK) + BENCH_BLOCK_LENGTH);
+
+    Block = 0;
+    for (File = 0; File < Files; File++) {
+        ULONGLONG   Last = Block + BlocksPerFile;
+
+        if (!TestOpen(&Writer, Stem, Files - 1 - File,
+                      TEST_EPOCH + Block * BENCH_BLOCK_TIME,
+                      Block * BENCH_BLOCK_LENGTH,
+                      BENCH_BLOCK_LENGTH))
+            return FALSE;
+
+        for (; Block < Last; Block++)
+            if (!TestWriteBlock(&Writer,
+                                TEST_EPOCH + Block * BENCH_BLOCK_TIME,
+                                Block * BENCH_BLOCK_LENGTH,
+                                NULL,
+                                BENCH_BLOCK_LENGTH))
+                return FALSE;
+
+        if (!TestClose(&Writer))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+static VOID
+BenchQuery(
+    _In_ PCSTR          CaptureName,
+    _In_ PCSTR          OutputName,
+    _In_ ULONGLONG      From,
+    _In_ ULONGLONG      Range,
+    _In_ PCSTR          Label
+    )
+{
+    QUERY_STATISTICS    Statistics;
+    ULONGLONG           First;
+    ULONGLONG           Last;
+    double              Elapsed;
+    DWORD               Run;
+
+    // Best of three, so the page cache is equally warm for each
+    Elapsed = 0;
+    for (Run = 0; Run < 3; Run++) {
+        double  Start = __TestGetTime();
+
+        TEST(QueryExtractRange(CaptureName,
+                               From,
+                               From + Range,
+                               OutputName,
+                               &Statistics));
+
+        if (Run == 0 || __TestGetTime() - Start < Elapsed)
+            Elapsed = __TestGetTime() - Start;
+    }
+
+    // From is a block boundary, so it and the blocks to the one that
+    // starts on the end of the range are copied
+    First = (From - TEST_EPOCH) / BENCH_BLOCK_TIME;
+    Last = First + Range / BENCH_BLOCK_TIME;
+
+    TEST(Statistics.Blocks == Last - First + 1);
+    TEST(Statistics.FirstOffset == First * BENCH_BLOCK_LENGTH);
+    TEST(Statistics.LastOffset == Last * BENCH_BLOCK_LENGTH);
+
+    printf("%-10s %8.3f %5u %12llu %12llu %10llu %10.3f\n",
+           Label,
+           (double)Range / TEST_SECOND,
+           (unsigned int)Statistics.Files,
+           (unsigned long long)Statistics.IndexReads,
+           (unsigned long long)Statistics.BlockReads,
+           (unsigned long long)(Statistics.BytesCopied >> 20),
+           Elapsed);
+}
+
+static VOID
+BenchCapture(
+    _In_ PCSTR  Directory
+    )
+{
+    CHAR        Stem[256];
+    CHAR        CaptureName[512];
+    CHAR        OutputName[512];
+    DWORD       Files;
+    ULONGLONG   BlocksPerFile;
+    ULONGLONG   From;
+    double      Start;
+
+    snprintf(Stem, sizeof(Stem), "%s/query_bench", Directory);
+    snprintf(CaptureName, sizeof(CaptureName), "%s.xcap", Stem);
+    snprintf(OutputName, sizeof(OutputName), "%s.out", Stem);
+
+    Files = (DWORD)(BENCH_SIZE / BENCH_FILE_SIZE);
+    BlocksPerFile = BENCH_FILE_SIZE /
+                    (sizeof(XENCONS_CAPTURE_BLOCK) + BENCH_BLOCK_LENGTH);
+
+    Start = __TestGetTime();
+    TEST(BenchWriteCapture(Stem, Files));
+
+    printf("%u GB capture, %llu blocks in %u files, written in %.1fs\n",
+           (unsigned int)(BENCH_SIZE >> 30),
+           (unsigned long long)(BlocksPerFile * Files),
+           (unsigned int)Files,
+           __TestGetTime() - Start);
+
+    // Ten seconds straddling the rotation into the second newest file
+    From = TEST_EPOCH +
+           ((Files - 2) * BlocksPerFile - 500) * BENCH_BLOCK_TIME;
+
+    printf("\n%-10s %8s %5s %12s %12s %10s %10s\n",
+           "index", "range", "files", "index reads", "block reads", "MB",
+           "seconds");
+
+    BenchQuery(CaptureName, OutputName, From, 0, "yes");
+    BenchQuery(CaptureName, OutputName, From, BENCH_RANGE, "yes");
+
+    TestRemoveIndexes(Stem, Files);
+
+    BenchQuery(CaptureName, OutputName, From, 0, "no");
+    BenchQuery(CaptureName, OutputName, From, BENCH_RANGE, "no");
+
+    TestRemove(Stem, Files);
+    (VOID) unlink(OutputName);
+}
+
+int
+main(
+    int     argc,
+    char    **argv
+    )
+{
+    PCSTR   Directory = "/tmp";
+    BOOL    Bench = TRUE;
+    int     Index;
+
+    for (Index = 1; Index < argc; Index++) {
+        if (strcmp(argv[Index], "-n") == 0)
+            Bench = FALSE;
+        else
+            Directory = argv[Index];
+    }
+
+    TestQuery(Directory);
+
+    if (Failures == 0 && Bench)
+        BenchCapture(Directory);
+
+    if (Failures != 0) {
+        fprintf(stderr, "%d failures\n", Failures);
+        return 1;
+    }
+
+    printf("passed\n");
+    return 0;
+}
@@ -0,0 +1,982 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+// Stress test for the ring's request queue (XENCONS_QUEUE in ring.c):
+// a lock-free inbox that the dispatch routine pushes onto, drained
+// under the queue lock by the DPC, with cancel routines that only flag
+// the queue. Linux:
+//
+//   cc -O2 -pthread -I src/xencons -o queue_stress src/test/queue_stress.c
+//
+// The queue functions below are ring.c's, line for line, over a small
+// model of the IRP fields and I/O manager calls they use. Keep them in
+// step. Hooks in the model pin down each race the queue has to handle:
+// a cancel before the request is queued, a cancel and an empty sweep
+// while it is on its way into the inbox, a cancel while the ring is
+// blocked, and a cancel that gets to the request before the DPC claims
+// it.
+//
+// Then a producer thread plays the dispatch routine, a consumer thread
+// plays the DPC (sometimes blocked, leaving the head queued but
+// cancellable) and a canceller thread calls IoCancelIrp() on random
+// requests, including ones still on their way into the queue. At the
+// end no cancelled request may be left queued once the DPC has swept,
+// the queue is torn down as RingDestroy() does, and every request must
+// have been completed exactly once, never while its cancel routine was
+// still running. Those that succeeded must have completed in order.
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <time.h>
+
+#include "ring_compat.h"
+
+#define STRESS_REQUESTS     200000
+
+static int  Failures;
+
+#define TEST(_Condition)                                            \
+    do {                                                            \
+        if (!(_Condition)) {                                        \
+            fprintf(stderr, "%s:%d: %s\n",                          \
+                    __FILE__, __LINE__, #_Condition);               \
+            Failures++;                                             \
+        }                                                           \
+    } while (0)
+
+// Model of the kernel pieces the queue uses
+
+typedef struct _LIST_ENTRY {
+    struct _LIST_ENTRY  *Flink;
+    struct _LIST_ENTRY  *Blink;
+} LIST_ENTRY, *PLIST_ENTRY;
+
+#define CONTAINING_RECORD(_Address, _Type, _Field) \
+        ((_Type *)((PCHAR)(_Address) - offsetof(_Type, _Field)))
+
+static FORCEINLINE VOID
+InitializeListHead(
+    _Out_ PLIST_ENTRY   ListHead
+    )
+{
+    ListHead->Flink = ListHead->Blink = ListHead;
+}
+
+static FORCEINLINE BOOLEAN
+IsListEmpty(
+    _In_ PLIST_ENTRY    ListHead
+    )
+{
+    return (ListHead->Flink == ListHead) ? TRUE : FALSE;
+}
+
+static FORCEINLINE VOID
+RemoveEntryList(
+    _In_ PLIST_ENTRY    Entry
+    )
+{
+    Entry->Blink->Flink = Entry->Flink;
+    Entry->Flink->Blink = Entry->Blink;
+}
+
+static FORCEINLINE PLIST_ENTRY
+RemoveHeadList(
+    _In_ PLIST_ENTRY    ListHead
+    )
+{
+    PLIST_ENTRY         Entry = ListHead->Flink;
+
+    RemoveEntryList(Entry);
+    return Entry;
+}
+
+static FORCEINLINE VOID
+InsertHeadList(
+    _In_ PLIST_ENTRY    ListHead,
+    _In_ PLIST_ENTRY    Entry
+    )
+{
+    Entry->Flink = ListHead->Flink;
+    Entry->Blink = ListHead;
+    ListHead->Flink->Blink = Entry;
+    ListHead->Flink = Entry;
+}
+
+static FORCEINLINE VOID
+InsertTailList(
+    _In_ PLIST_ENTRY    ListHead,
+    _In_ PLIST_ENTRY    Entry
+    )
+{
+    Entry->Flink = ListHead;
+    Entry->Blink = ListHead->Blink;
+    ListHead->Blink->Flink = Entry;
+    ListHead->Blink = Entry;
+}
+
+static FORCEINLINE VOID
+AppendTailList(
+    _In_ PLIST_ENTRY    ListHead,
+    _In_ PLIST_ENTRY    ListToAppend
+    )
+{
+    PLIST_ENTRY         ListEnd = ListHead->Blink;
+
+    ListHead->Blink->Flink = ListToAppend;
+    ListHead->Blink = ListToAppend->Blink;
+    ListToAppend->Blink->Flink = ListHead;
+    ListToAppend->Blink = ListEnd;
+}
+
+#define InterlockedIncrement(_Value) \
+        __atomic_add_fetch((_Value), 1, __ATOMIC_SEQ_CST)
+#define InterlockedExchange(_Target, _Value) \
+        __atomic_exchange_n((_Target), (_Value), __ATOMIC_SEQ_CST)
+#define InterlockedExchangePointer(_Target, _Value) \
+        __atomic_exchange_n((_Target), (_Value), __ATOMIC_SEQ_CST)
+#define KeMemoryBarrier()   __sync_synchronize()
+
+#define STATUS_SUCCESS      0
+#define STATUS_CANCELLED    1
+
+typedef struct _IRP IRP, *PIRP;
+
+typedef VOID (*PDRIVER_CANCEL)(PIRP);
+
+struct _IRP {
+    struct {
+        struct {
+            LIST_ENTRY  ListEntry;
+            PVOID       DriverContext[4];
+        } Overlay;
+    } Tail;
+    volatile BOOLEAN        Cancel;
+    PDRIVER_CANCEL volatile CancelRoutine;
+    volatile BOOLEAN        CancelRunning;
+    LONG                    Status;
+    ULONG                   Sequence;
+    volatile LONG           Completed;
+};
+
+static pthread_mutex_t  CancelSpinLock = PTHREAD_MUTEX_INITIALIZER;
+static sem_t            DpcEvent;
+
+#define IoAcquireCancelSpinLock()   pthread_mutex_lock(&CancelSpinLock)
+#define IoReleaseCancelSpinLock()   pthread_mutex_unlock(&CancelSpinLock)
+#define KeInsertQueueDpc()          sem_post(&DpcEvent)
+
+static FORCEINLINE PDRIVER_CANCEL
+IoSetCancelRoutine(
+    _In_ PIRP           Irp,
+    _In_ PDRIVER_CANCEL CancelRoutine
+    )
+{
+    return __atomic_exchange_n(&Irp->CancelRoutine,
+                               CancelRoutine,
+                               __ATOMIC_SEQ_CST);
+}
+
+static VOID
+IoCancelIrp(
+    _In_ PIRP       Irp
+    )
+{
+    PDRIVER_CANCEL  CancelRoutine;
+
+    IoAcquireCancelSpinLock();
+
+    __atomic_store_n(&Irp->Cancel, TRUE, __ATOMIC_SEQ_CST);
+
+    CancelRoutine = IoSetCancelRoutine(Irp, NULL);
+    if (CancelRoutine == NULL) {
+        IoReleaseCancelSpinLock();
+        return;
+    }
+
+    // The cancel routine releases the cancel spin lock
+    Irp->CancelRunning = TRUE;
+    CancelRoutine(Irp);
+}
+
+static ULONG    LastSuccess;
+static ULONG    Succeeded;
+static ULONG    Cancelled;
+
+static VOID
+IoCompleteRequest(
+    _In_ PIRP   Irp
+    )
+{
+    // The I/O manager bugchecks on this
+    TEST(Irp->CancelRoutine == NULL);
+
+    // and the cancel routine would be looking at a freed IRP
+    TEST(!Irp->CancelRunning);
+
+    if (__atomic_add_fetch(&Irp->Completed, 1, __ATOMIC_SEQ_CST) != 1) {
+        TEST(Irp->Completed == 1);
+        return;
+    }
+
+    if (Irp->Status == STATUS_SUCCESS) {
+        TEST(Succeeded == 0 || Irp->Sequence > LastSuccess);
+        LastSuccess = Irp->Sequence;
+        Succeeded++;
+    } else {
+        Cancelled++;
+    }
+}
+
+// Lets a test run something just before an IRP is pushed onto an
+// inbox, after it has become cancellable
+static VOID (*InboxHook)(PVOID);
+
+static FORCEINLINE PVOID
+InterlockedCompareExchangePointer(
+    _Inout_ PVOID volatile  *Target,
+    _In_ PVOID              Exchange,
+    _In_ PVOID              Comparand
+    )
+{
+    if (InboxHook != NULL) {
+        VOID    (*Hook)(PVOID) = InboxHook;
+
+        InboxHook = NULL;
+        Hook(Exchange);
+    }
+
+    return __sync_val_compare_and_swap(Target, Comparand, Exchange);
+}
+
+// ring.c
+
+typedef struct _XENCONS_QUEUE {
+    PVOID volatile          Inbox;
+    LIST_ENTRY              List;
+    pthread_mutex_t         Lock;
+    LONG                    CancelPending;
+    LONG                    CancelGeneration;
+} XENCONS_QUEUE, *PXENCONS_QUEUE;
+
+static VOID
+RingCompleteCanceledIrp(
+    _In_ PIRP           Irp
+    )
+{
+    Irp->Status = STATUS_CANCELLED;
+
+    IoCompleteRequest(Irp);
+}
+
+static VOID
+RingCancelIrp(
+    PIRP                Irp
+    )
+{
+    PXENCONS_QUEUE      Queue = Irp->Tail.Overlay.DriverContext[0];
+
+    (VOID) InterlockedIncrement(&Queue->CancelGeneration);
+    (VOID) InterlockedExchange(&Queue->CancelPending, 1);
+    (VOID) KeInsertQueueDpc();
+
+    // Give the DPC a chance to get at the IRP while the routine is
+    // still running (ring.c reads Irp->CancelIrql here)
+    sched_yield();
+    Irp->CancelRunning = FALSE;
+
+    IoReleaseCancelSpinLock();
+}
+
+static VOID
+__RingQueueInsert(
+    _In_ PXENCONS_QUEUE Queue,
+    _In_ PIRP           Irp
+    )
+{
+    PVOID               Head;
+    LONG                Generation;
+
+    Generation = Queue->CancelGeneration;
+    KeMemoryBarrier();
+
+    Irp->Tail.Overlay.DriverContext[0] = Queue;
+    (VOID) IoSetCancelRoutine(Irp, RingCancelIrp);
+
+    if (Irp->Cancel)
+        (VOID) InterlockedExchange(&Queue->CancelPending, 1);
+
+    do {
+        Head = Queue->Inbox;
+        Irp->Tail.Overlay.DriverContext[1] = Head;
+    } while (InterlockedCompareExchangePointer(&Queue->Inbox,
+                                               Irp,
+                                               Head) != Head);
+
+    if (Queue->CancelGeneration != Generation) {
+        (VOID) InterlockedExchange(&Queue->CancelPending, 1);
+        (VOID) KeInsertQueueDpc();
+    }
+}
+
+static VOID
+__RingQueueDrain(
+    _In_ PXENCONS_QUEUE Queue
+    )
+{
+    PIRP                Irp;
+    LIST_ENTRY          List;
+    PLIST_ENTRY         ListEntry;
+
+    Irp = InterlockedExchangePointer(&Queue->Inbox, NULL);
+    if (Irp == NULL)
+        return;
+
+    InitializeListHead(&List);
+
+    while (Irp != NULL) {
+        PIRP    Next = Irp->Tail.Overlay.DriverContext[1];
+
+        Irp->Tail.Overlay.DriverContext[1] = NULL;
+        InsertHeadList(&List, &Irp->Tail.Overlay.ListEntry);
+
+        Irp = Next;
+    }
+
+    ListEntry = List.Flink;
+    RemoveEntryList(&List);
+    AppendTailList(&Queue->List, ListEntry);
+}
+
+static PIRP
+__RingQueueRemoveNext(
+    _In_ PXENCONS_QUEUE     Queue,
+    _In_ PLIST_ENTRY        Cancelled
+    )
+{
+    PLIST_ENTRY             ListEntry;
+
+    ListEntry = Queue->List.Flink;
+    while (ListEntry != &Queue->List) {
+        PLIST_ENTRY         Next = ListEntry->Flink;
+        PIRP                Irp;
+
+        Irp = CONTAINING_RECORD(ListEntry, IRP, Tail.Overlay.ListEntry);
+
+        RemoveEntryList(&Irp->Tail.Overlay.ListEntry);
+
+        if (IoSetCancelRoutine(Irp, NULL) != NULL)
+            return Irp;
+
+        InsertTailList(Cancelled, &Irp->Tail.Overlay.ListEntry);
+
+        ListEntry = Next;
+    }
+
+    return NULL;
+}
+
+static PIRP
+__RingQueuePeek(
+    _In_ PXENCONS_QUEUE Queue,
+    _In_ PLIST_ENTRY    Cancelled
+    )
+{
+    while (!IsListEmpty(&Queue->List)) {
+        PIRP    Irp;
+
+        Irp = CONTAINING_RECORD(Queue->List.Flink,
+                                IRP,
+                                Tail.Overlay.ListEntry);
+
+        if (!Irp->Cancel)
+            return Irp;
+
+        RemoveEntryList(&Irp->Tail.Overlay.ListEntry);
+        (VOID) IoSetCancelRoutine(Irp, NULL);
+
+        InsertTailList(Cancelled, &Irp->Tail.Overlay.ListEntry);
+    }
+
+    return NULL;
+}
+
+static BOOLEAN
+__RingQueueClaim(
+    _In_ PXENCONS_QUEUE Queue,
+    _In_ PIRP           Irp,
+    _In_ PLIST_ENTRY    Cancelled
+    )
+{
+    (VOID) Queue;
+
+    RemoveEntryList(&Irp->Tail.Overlay.ListEntry);
+
+    if (IoSetCancelRoutine(Irp, NULL) != NULL)
+        return TRUE;
+
+    InsertTailList(Cancelled, &Irp->Tail.Overlay.ListEntry);
+    return FALSE;
+}
+
+static VOID
+__RingQueueCompleteCancelled(
+    _In_ PLIST_ENTRY    Cancelled
+    )
+{
+    if (IsListEmpty(Cancelled))
+        return;
+
+    IoAcquireCancelSpinLock();
+    IoReleaseCancelSpinLock();
+
+    while (!IsListEmpty(Cancelled)) {
+        PLIST_ENTRY ListEntry;
+        PIRP        Irp;
+
+        ListEntry = RemoveHeadList(Cancelled);
+
+        Irp = CONTAINING_RECORD(ListEntry, IRP, Tail.Overlay.ListEntry);
+
+        RingCompleteCanceledIrp(Irp);
+    }
+}
+
+static VOID
+__RingQueueSweep(
+    _In_ PXENCONS_QUEUE Queue
+    )
+{
+    LIST_ENTRY          Cancelled;
+    PLIST_ENTRY         ListEntry;
+
+    if (InterlockedExchange(&Queue->CancelPending, 0) == 0)
+        return;
+
+    InitializeListHead(&Cancelled);
+
+    pthread_mutex_lock(&Queue->Lock);
+
+    __RingQueueDrain(Queue);
+
+    ListEntry = Queue->List.Flink;
+    while (ListEntry != &Queue->List) {
+        PLIST_ENTRY Next = ListEntry->Flink;
+        PIRP        Irp;
+
+        Irp = CONTAINING_RECORD(ListEntry, IRP, Tail.Overlay.ListEntry);
+
+        if (Irp->Cancel) {
+            RemoveEntryList(&Irp->Tail.Overlay.ListEntry);
+            (VOID) IoSetCancelRoutine(Irp, NULL);
+
+            InsertTailList(&Cancelled, &Irp->Tail.Overlay.ListEntry);
+        }
+
+        ListEntry = Next;
+    }
+
+    pthread_mutex_unlock(&Queue->Lock);
+
+    __RingQueueCompleteCancelled(&Cancelled);
+}
+
+static VOID
+__RingQueueCancel(
+    _In_ PXENCONS_QUEUE     Queue
+    )
+{
+    LIST_ENTRY              Cancelled;
+
+    InitializeListHead(&Cancelled);
+
+    pthread_mutex_lock(&Queue->Lock);
+
+    __RingQueueDrain(Queue);
+
+    for (;;) {
+        PIRP    Irp;
+
+        Irp = __RingQueueRemoveNext(Queue, &Cancelled);
+        if (Irp == NULL)
+            break;
+
+        InsertTailList(&Cancelled, &Irp->Tail.Overlay.ListEntry);
+    }
+
+    pthread_mutex_unlock(&Queue->Lock);
+
+    __RingQueueCompleteCancelled(&Cancelled);
+}
+
+// The tests
+
+static XENCONS_QUEUE    Queue;
+static IRP              *Irps;
+static volatile ULONG   Issued;     // Requests handed to the queue
+static volatile BOOLEAN Stopping;
+
+static VOID
+__TestReset(
+    VOID
+    )
+{
+    Queue.Inbox = NULL;
+    InitializeListHead(&Queue.List);
+    Queue.CancelPending = 0;
+    Queue.CancelGeneration = 0;
+
+    while (sem_trywait(&DpcEvent) == 0)
+        ;
+
+    LastSuccess = 0;
+    Succeeded = 0;
+    Cancelled = 0;
+}
+
+// Take the head request if it is still there, as the DPC does once
+// there is room in the ring
+static VOID
+__TestConsume(
+    VOID
+    )
+{
+    LIST_ENTRY  Cancelled;
+    PIRP        Irp;
+    BOOLEAN     Claimed;
+
+    InitializeListHead(&Cancelled);
+
+    pthread_mutex_lock(&Queue.Lock);
+
+    __RingQueueDrain(&Queue);
+
+    Irp = __RingQueuePeek(&Queue, &Cancelled);
+    Claimed = (Irp != NULL) ? __RingQueueClaim(&Queue, Irp, &Cancelled) : FALSE;
+
+    pthread_mutex_unlock(&Queue.Lock);
+
+    __RingQueueCompleteCancelled(&Cancelled);
+
+    if (Claimed) {
+        Irp->Status = STATUS_SUCCESS;
+        IoCompleteRequest(Irp);
+    }
+}
+
+// IoCancelIrp() before there is a cancel routine to call. The queue
+// has to notice when the request arrives, or it sits there until the
+// ring next has room.
+static VOID
+TestCancelBeforeInsert(
+    VOID
+    )
+{
+    IRP     Irp;
+
+    __TestReset();
+    memset(&Irp, 0, sizeof(Irp));
+
+    IoCancelIrp(&Irp);
+    __RingQueueInsert(&Queue, &Irp);
+
+    __RingQueueSweep(&Queue);
+
+    TEST(Irp.Completed == 1);
+    TEST(Irp.Status == STATUS_CANCELLED);
+}
+
+static VOID
+__TestCancelNow(
+    _In_ PVOID  Irp
+    )
+{
+    IoCancelIrp(Irp);
+
+    // The DPC runs at once and finds nothing, as the request is not
+    // in the inbox yet
+    __RingQueueSweep(&Queue);
+}
+
+// The cancel routine runs, and the DPC sweeps, after the request has
+// become cancellable (and been seen not to be cancelled) but before it
+// reaches the inbox
+static VOID
+TestCancelDuringInsert(
+    VOID
+    )
+{
+    IRP     Irp;
+
+    __TestReset();
+    memset(&Irp, 0, sizeof(Irp));
+
+    InboxHook = __TestCancelNow;
+    __RingQueueInsert(&Queue, &Irp);
+    TEST(InboxHook == NULL);
+    TEST(Irp.Completed == 0);
+
+    __RingQueueSweep(&Queue);
+
+    TEST(Irp.Completed == 1);
+    TEST(Irp.Status == STATUS_CANCELLED);
+}
+
+// The head request is cancelled while the ring is full, and the one
+// behind it goes out once there is room
+static VOID
+TestCancelWhileBlocked(
+    VOID
+    )
+{
+    IRP     Irp[2];
+
+    __TestReset();
+    memset(Irp, 0, sizeof(Irp));
+    Irp[1].Sequence = 1;
+
+    __RingQueueInsert(&Queue, &Irp[0]);
+    __RingQueueInsert(&Queue, &Irp[1]);
+
+    IoCancelIrp(&Irp[0]);
+    __RingQueueSweep(&Queue);
+
+    TEST(Irp[0].Completed == 1);
+    TEST(Irp[0].Status == STATUS_CANCELLED);
+    TEST(Irp[1].Completed == 0);
+
+    __TestConsume();
+
+    TEST(Irp[1].Completed == 1);
+    TEST(Irp[1].Status == STATUS_SUCCESS);
+}
+
+// The cancel routine has already been called when the DPC claims the
+// request, so the DPC must not complete it as a success
+static VOID
+TestCancelBeforeClaim(
+    VOID
+    )
+{
+    LIST_ENTRY  Cancelled;
+    IRP         Irp;
+    PIRP        Head;
+
+    __TestReset();
+    memset(&Irp, 0, sizeof(Irp));
+
+    __RingQueueInsert(&Queue, &Irp);
+
+    InitializeListHead(&Cancelled);
+
+    pthread_mutex_lock(&Queue.Lock);
+    __RingQueueDrain(&Queue);
+
+    Head = __RingQueuePeek(&Queue, &Cancelled);
+    TEST(Head == &Irp);
+
+    IoCancelIrp(&Irp);
+
+    TEST(!__RingQueueClaim(&Queue, &Irp, &Cancelled));
+    pthread_mutex_unlock(&Queue.Lock);
+
+    __RingQueueCompleteCancelled(&Cancelled);
+
+    TEST(Irp.Completed == 1);
+    TEST(Irp.Status == STATUS_CANCELLED);
+}
+
+static ULONG
+__StressRandom(
+    _Inout_ ULONG   *Seed
+    )
+{
+    *Seed = *Seed * 1103515245 + 12345;
+    return *Seed >> 8;
+}
+
+// The DPC: a pass moves a random number of requests, and is sometimes
+// blocked on the head one (as a write is on a full ring), which stays
+// queued and cancellable
+static VOID
+StressPoll(
+    _Inout_ ULONG   *Seed
+    )
+{
+    LIST_ENTRY      List;
+    LIST_ENTRY      Cancelled;
+    ULONG           Count;
+
+    InitializeListHead(&List);
+    InitializeListHead(&Cancelled);
+
+    __RingQueueSweep(&Queue);
+
+    pthread_mutex_lock(&Queue.Lock);
+
+    __RingQueueDrain(&Queue);
+
+    for (Count = __StressRandom(Seed) % 8; Count != 0; --Count) {
+        PIRP    Irp;
+
+        Irp = __RingQueuePeek(&Queue, &Cancelled);
+        if (Irp == NULL)
+            break;
+
+        if (__StressRandom(Seed) % 4 == 0)
+            break;
+
+        if (!__RingQueueClaim(&Queue, Irp, &Cancelled))
+            continue;
+
+        Irp->Status = STATUS_SUCCESS;
+        InsertTailList(&List, &Irp->Tail.Overlay.ListEntry);
+    }
+
+    pthread_mutex_unlock(&Queue.Lock);
+
+    __RingQueueCompleteCancelled(&Cancelled);
+
+    while (!IsListEmpty(&List)) {
+        PIRP    Irp;
+
+        Irp = CONTAINING_RECORD(RemoveHeadList(&List),
+                                IRP,
+                                Tail.Overlay.ListEntry);
+
+        IoCompleteRequest(Irp);
+    }
+}
+
+static void *
+StressConsumer(
+    void    *Argument
+    )
+{
+    ULONG   Seed = 3;
+
+    (VOID) Argument;
+
+    while (!Stopping) {
+        struct timespec Timeout;
+
+        (VOID) clock_gettime(CLOCK_REALTIME, &Timeout);
+        Timeout.tv_nsec += 1000000;
+        if (Timeout.tv_nsec >= 1000000000) {
+            Timeout.tv_sec++;
+            Timeout.tv_nsec -= 1000000000;
+        }
+
+        (VOID) sem_timedwait(&DpcEvent, &Timeout);
+
+        StressPoll(&Seed);
+    }
+
+    return NULL;
+}
+
+static void *
+StressProducer(
+    void    *Argument
+    )
+{
+    ULONG   Seed = 5;
+    ULONG   Index;
+
+    (VOID) Argument;
+
+    for (Index = 0; Index < STRESS_REQUESTS; Index++) {
+        PIRP    Irp = &Irps[Index];
+
+        Irp->Sequence = Index;
+
+        // The canceller may get to the request before the queue does
+        __atomic_store_n(&Issued, Index + 1, __ATOMIC_SEQ_CST);
+
+        if (__StressRandom(&Seed) % 16 == 0)
+            sched_yield();
+
+        __RingQueueInsert(&Queue, Irp);
+        (VOID) KeInsertQueueDpc();
+    }
+
+    return NULL;
+}
+
+static void *
+StressCanceller(
+    void    *Argument
+    )
+{
+    ULONG   Seed = 7;
+
+    (VOID) Argument;
+
+    while (!Stopping) {
+        ULONG   Limit = __atomic_load_n(&Issued, __ATOMIC_SEQ_CST);
+        ULONG   Index;
+
+        if (Limit == 0) {
+            sched_yield();
+            continue;
+        }
+
+        // Mostly the newest requests, which are the interesting ones
+        if (__StressRandom(&Seed) % 2 == 0)
+            Index = Limit - 1 - __StressRandom(&Seed) % ((Limit < 8) ? Limit : 8);
+        else
+            Index = __StressRandom(&Seed) % Limit;
+
+        IoCancelIrp(&Irps[Index]);
+
+        if (__StressRandom(&Seed) % 4 == 0)
+            sched_yield();
+    }
+
+    return NULL;
+}
+
+static VOID
+TestStress(
+    VOID
+    )
+{
+    pthread_t       Producer;
+    pthread_t       Consumer;
+    pthread_t       Canceller;
+    struct timespec Start;
+    struct timespec End;
+    double          Elapsed;
+    ULONG           Index;
+
+    Irps = calloc(STRESS_REQUESTS, sizeof(IRP));
+    if (Irps == NULL) {
+        TEST(Irps != NULL);
+        return;
+    }
+
+    __TestReset();
+
+    (VOID) clock_gettime(CLOCK_MONOTONIC, &Start);
+
+    pthread_create(&Consumer, NULL, StressConsumer, NULL);
+    pthread_create(&Canceller, NULL, StressCanceller, NULL);
+    pthread_create(&Producer, NULL, StressProducer, NULL);
+
+    pthread_join(Producer, NULL);
+
+    __atomic_store_n(&Stopping, TRUE, __ATOMIC_SEQ_CST);
+    sem_post(&DpcEvent);
+
+    pthread_join(Canceller, NULL);
+    pthread_join(Consumer, NULL);
+
+    // Every cancel has left CancelPending set, so one more sweep must
+    // leave nothing cancelled in the queue. Anything that is would have
+    // waited for the next unrelated cancel, or for the ring to go away.
+    __RingQueueSweep(&Queue);
+
+    {
+        PLIST_ENTRY ListEntry;
+        PIRP        Irp;
+
+        TEST(Queue.Inbox == NULL);
+
+        for (ListEntry = Queue.List.Flink;
+             ListEntry != &Queue.List;
+             ListEntry = ListEntry->Flink) {
+            Irp = CONTAINING_RECORD(ListEntry, IRP, Tail.Overlay.ListEntry);
+
+            if (Irp->Cancel) {
+                TEST(!Irp->Cancel);
+                break;
+            }
+        }
+    }
+
+    // RingDestroy()
+    __RingQueueCancel(&Queue);
+
+    (VOID) clock_gettime(CLOCK_MONOTONIC, &End);
+
+    Elapsed = (End.tv_sec - Start.tv_sec) +
+              (End.tv_nsec - Start.tv_nsec) / 1e9;
+
+    TEST(Queue.Inbox == NULL);
+    TEST(IsListEmpty(&Queue.List));
+
+    for (Index = 0; Index < STRESS_REQUESTS; Index++)
+        if (Irps[Index].Completed != 1) {
+            TEST(Irps[Index].Completed == 1);
+            break;
+        }
+
+    TEST(Succeeded + Cancelled == STRESS_REQUESTS);
+
+    printf("%u requests in %.2fs: %u completed, %u cancelled\n",
+           STRESS_REQUESTS, Elapsed, Succeeded, Cancelled);
+
+    free(Irps);
+    Irps = NULL;
+}
+
+int
+main(
+    void
+    )
+{
+    sem_init(&DpcEvent, 0, 0);
+    pthread_mutex_init(&Queue.Lock, NULL);
+
+    TestCancelBeforeInsert();
+    TestCancelDuringInsert();
+    TestCancelWhileBlocked();
+    TestCancelBeforeClaim();
+
+    if (Failures == 0)
+        TestStress();
+
+    pthread_mutex_destroy(&Queue.Lock);
+    sem_destroy(&DpcEvent);
+
+    if (Failures != 0) {
+        fprintf(stderr, "%d failure(s)\n", Failures);
+        return EXIT_FAILURE;
+    }
+
+    printf("queue_stress: passed\n");
+    return EXIT_SUCCESS;
+}
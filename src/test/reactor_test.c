@@ -0,0 +1,408 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+// Host test and benchmark for the monitor's reactor core, using the
+// epoll backend. Linux only:
+//
+//   cc -O2 -pthread -I src/monitor -o reactor_test src/test/reactor_test.c
+//      src/monitor/reactor_epoll.c
+//
+// The benchmark bounces messages over message-mode socket pairs (the
+// nearest thing to the monitor's message-mode pipes) with both ends
+// driven by the reactor, for 1 to 1000 connections. The thread count
+// stays fixed however many connections there are.
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "reactor.h"
+
+#define TEST_POSTERS        4
+#define TEST_POSTS          50000   // Per poster
+#define TEST_TIMEOUT        30      // Seconds
+
+#define BENCH_MESSAGE_SIZE  64
+#define BENCH_ROUNDS        200000  // Round trips, split across connections
+
+static int  Failures;
+
+#define TEST(_Condition)                                            \
+    do {                                                            \
+        if (!(_Condition)) {                                        \
+            fprintf(stderr, "%s:%d: %s\n",                          \
+                    __FILE__, __LINE__, #_Condition);               \
+            Failures++;                                             \
+        }                                                           \
+    } while (0)
+
+static double
+__TestGetTime(
+    VOID
+    )
+{
+    struct timespec Now;
+
+    (VOID) clock_gettime(CLOCK_MONOTONIC, &Now);
+
+    return Now.tv_sec + (Now.tv_nsec / 1e9);
+}
+
+// Wait for *Count to reach Target. Returns FALSE on timeout.
+static BOOL
+__TestWaitFor(
+    _In_ LONG64 *Count,
+    _In_ LONG64 Target
+    )
+{
+    double      Deadline = __TestGetTime() + TEST_TIMEOUT;
+
+    while (__atomic_load_n(Count, __ATOMIC_ACQUIRE) < Target) {
+        struct timespec Pause = { 0, 100000 };
+
+        if (__TestGetTime() > Deadline)
+            return FALSE;
+
+        (VOID) nanosleep(&Pause, NULL);
+    }
+
+    return TRUE;
+}
+
+typedef struct _TEST_POST {
+    REACTOR_IO  Io;
+    DWORD       Index;
+    LONG        Runs;
+    BOOL        Mismatch;
+} TEST_POST, *PTEST_POST;
+
+static TEST_POST    Posts[TEST_POSTERS * TEST_POSTS];
+static LONG64       PostsDone;
+
+static VOID
+TestPostFunction(
+    _In_ PREACTOR_IO    Io,
+    _In_ DWORD          Error,
+    _In_ DWORD          Length
+    )
+{
+    PTEST_POST          Post = CONTAINING_RECORD(Io, TEST_POST, Io);
+
+    if (Error != Post->Index || Length != Post->Index * 2)
+        Post->Mismatch = TRUE;
+
+    (VOID) __atomic_add_fetch(&Post->Runs, 1, __ATOMIC_RELAXED);
+    (VOID) __atomic_add_fetch(&PostsDone, 1, __ATOMIC_RELEASE);
+}
+
+static PVOID
+TestPoster(
+    _In_ PVOID  Argument
+    )
+{
+    DWORD       First = (DWORD)(ULONG_PTR)Argument * TEST_POSTS;
+    DWORD       Index;
+
+    for (Index = First; Index < First + TEST_POSTS; Index++) {
+        PTEST_POST  Post = &Posts[Index];
+
+        ReactorPrepare(&Post->Io, TestPostFunction, NULL);
+        Post->Index = Index;
+
+        while (!ReactorPost(&Post->Io, Index, Index * 2))
+            sched_yield();
+    }
+
+    return NULL;
+}
+
+// Events posted from several threads at once each run exactly once,
+// with what they were posted with
+static VOID
+TestPost(
+    VOID
+    )
+{
+    pthread_t           Threads[TEST_POSTERS];
+    REACTOR_STATISTICS  Statistics;
+    DWORD               Index;
+
+    TEST(ReactorInitialize(4));
+
+    for (Index = 0; Index < TEST_POSTERS; Index++)
+        TEST(pthread_create(&Threads[Index],
+                            NULL,
+                            TestPoster,
+                            (PVOID)(ULONG_PTR)Index) == 0);
+
+    for (Index = 0; Index < TEST_POSTERS; Index++)
+        (VOID) pthread_join(Threads[Index], NULL);
+
+    TEST(__TestWaitFor(&PostsDone, TEST_POSTERS * TEST_POSTS));
+
+    ReactorGetStatistics(&Statistics);
+    TEST(Statistics.Threads == 4);
+    TEST(Statistics.Events == TEST_POSTERS * TEST_POSTS);
+
+    ReactorTeardown();
+
+    for (Index = 0; Index < TEST_POSTERS * TEST_POSTS; Index++) {
+        TEST(Posts[Index].Runs == 1);
+        TEST(!Posts[Index].Mismatch);
+    }
+}
+
+typedef struct _TEST_WAIT {
+    REACTOR_IO  Io;
+    int         Socket;
+    CHAR        Data[8];
+    DWORD       Events;
+    LONG64      Done;
+} TEST_WAIT, *PTEST_WAIT;
+
+static VOID
+TestWaitFunction(
+    _In_ PREACTOR_IO    Io,
+    _In_ DWORD          Error,
+    _In_ DWORD          Length
+    )
+{
+    PTEST_WAIT          Wait = Io->Argument;
+
+    UNREFERENCED_PARAMETER(Error);
+
+    Wait->Events = Length;
+    (VOID) read(Wait->Socket, Wait->Data, sizeof (Wait->Data));
+
+    __atomic_store_n(&Wait->Done, 1, __ATOMIC_RELEASE);
+}
+
+// A descriptor becoming readable runs its Io, once per ReactorWait()
+static VOID
+TestWait(
+    VOID
+    )
+{
+    int         Sockets[2];
+    TEST_WAIT   Wait;
+
+    memset(&Wait, 0, sizeof (Wait));
+
+    TEST(socketpair(AF_UNIX,
+                    SOCK_SEQPACKET | SOCK_NONBLOCK,
+                    0,
+                    Sockets) == 0);
+    Wait.Socket = Sockets[0];
+
+    TEST(ReactorInitialize(2));
+    TEST(ReactorAssociate(Sockets[0]));
+
+    ReactorPrepare(&Wait.Io, TestWaitFunction, &Wait);
+    TEST(ReactorWait(Sockets[0], &Wait.Io, EPOLLIN));
+
+    TEST(write(Sockets[1], "ready", 6) == 6);
+
+    TEST(__TestWaitFor(&Wait.Done, 1));
+    TEST(Wait.Events & EPOLLIN);
+    TEST(strcmp(Wait.Data, "ready") == 0);
+
+    ReactorTeardown();
+
+    close(Sockets[0]);
+    close(Sockets[1]);
+}
+
+typedef struct _BENCH_END {
+    REACTOR_IO  Io;
+    int         Socket;
+    BOOL        Client;
+    LONG        Rounds;     // Left to go, client end only
+} BENCH_END, *PBENCH_END;
+
+static LONG64   BenchRounds;
+static LONG64   BenchDone;
+
+static VOID
+BenchFunction(
+    _In_ PREACTOR_IO    Io,
+    _In_ DWORD          Error,
+    _In_ DWORD          Length
+    )
+{
+    PBENCH_END          End = Io->Argument;
+    UCHAR               Message[BENCH_MESSAGE_SIZE];
+
+    UNREFERENCED_PARAMETER(Error);
+    UNREFERENCED_PARAMETER(Length);
+
+    if (read(End->Socket, Message, sizeof (Message)) != sizeof (Message))
+        goto again;
+
+    // The server end echoes; the client end counts and goes again
+    if (End->Client) {
+        (VOID) __atomic_add_fetch(&BenchRounds, 1, __ATOMIC_RELAXED);
+
+        if (--End->Rounds == 0) {
+            (VOID) __atomic_add_fetch(&BenchDone, 1, __ATOMIC_RELEASE);
+            return;
+        }
+    }
+
+    (VOID) write(End->Socket, Message, sizeof (Message));
+
+again:
+    (VOID) ReactorWait(End->Socket, &End->Io, EPOLLIN);
+}
+
+static VOID
+Bench(
+    _In_ DWORD          Threads,
+    _In_ DWORD          Connections
+    )
+{
+    PBENCH_END          Ends;
+    UCHAR               Message[BENCH_MESSAGE_SIZE];
+    REACTOR_STATISTICS  Statistics;
+    double              Start;
+    double              Elapsed;
+    DWORD               Index;
+
+    Ends = calloc(Connections * 2, sizeof (BENCH_END));
+    TEST(Ends != NULL);
+    if (Ends == NULL)
+        return;
+
+    BenchRounds = 0;
+    BenchDone = 0;
+    memset(Message, 'x', sizeof (Message));
+
+    TEST(ReactorInitialize(Threads));
+
+    for (Index = 0; Index < Connections; Index++) {
+        PBENCH_END  Server = &Ends[Index * 2];
+        PBENCH_END  Client = &Ends[Index * 2 + 1];
+        int         Sockets[2];
+
+        TEST(socketpair(AF_UNIX,
+                        SOCK_SEQPACKET | SOCK_NONBLOCK,
+                        0,
+                        Sockets) == 0);
+
+        Server->Socket = Sockets[0];
+        Client->Socket = Sockets[1];
+        Client->Client = TRUE;
+        Client->Rounds = BENCH_ROUNDS / Connections;
+
+        ReactorPrepare(&Server->Io, BenchFunction, Server);
+        ReactorPrepare(&Client->Io, BenchFunction, Client);
+
+        TEST(ReactorAssociate(Server->Socket));
+        TEST(ReactorAssociate(Client->Socket));
+        TEST(ReactorWait(Server->Socket, &Server->Io, EPOLLIN));
+        TEST(ReactorWait(Client->Socket, &Client->Io, EPOLLIN));
+    }
+
+    Start = __TestGetTime();
+
+    for (Index = 0; Index < Connections; Index++)
+        TEST(write(Ends[Index * 2 + 1].Socket,
+                   Message,
+                   sizeof (Message)) == sizeof (Message));
+
+    TEST(__TestWaitFor(&BenchDone, Connections));
+
+    Elapsed = __TestGetTime() - Start;
+
+    ReactorGetStatistics(&Statistics);
+    ReactorTeardown();
+
+    printf("%8u %12u %14.0f %12llu %12llu %12llu\n",
+           Statistics.Threads,
+           Connections,
+           BenchRounds / Elapsed,
+           (unsigned long long)Statistics.Events,
+           (unsigned long long)Statistics.DispatchAverage,
+           (unsigned long long)Statistics.DispatchMaximum);
+
+    for (Index = 0; Index < Connections * 2; Index++)
+        close(Ends[Index].Socket);
+
+    free(Ends);
+}
+
+static VOID
+Benchmark(
+    VOID
+    )
+{
+    static const DWORD  Threads[] = { 1, 4 };
+    static const DWORD  Connections[] = { 1, 10, 100, 1000 };
+    DWORD               Outer;
+    DWORD               Inner;
+
+    printf("%8s %12s %14s %12s %12s %12s\n",
+           "threads", "connections", "round trips/s",
+           "events", "dispatch us", "max us");
+
+    for (Outer = 0; Outer < sizeof (Threads) / sizeof (Threads[0]); Outer++)
+        for (Inner = 0; Inner < sizeof (Connections) / sizeof (Connections[0]); Inner++)
+            Bench(Threads[Outer], Connections[Inner]);
+}
+
+int
+main(
+    int     argc,
+    char    **argv
+    )
+{
+    (VOID) argc;
+    (VOID) argv;
+
+    TestPost();
+    TestWait();
+    Benchmark();
+
+    if (Failures != 0) {
+        fprintf(stderr, "%d failure(s)\n", Failures);
+        return 1;
+    }
+
+    printf("passed\n");
+    return 0;
+}
@@ -0,0 +1,363 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+// Throughput and latency baseline for the portable ring code. Linux:
+//
+//   cc -O2 -pthread -I src/xencons -o ring_bench src/test/ring_bench.c
+//      src/xencons/ring_engine.c
+//
+// A frontend thread writes console output into the out queue of a
+// shared ring, the way RingPollWrite() does, and a backend thread
+// consumes it, the way xenconsoled does. Each side notifies the other
+// whenever a pass moved data, as RingNotify() does. The event channel
+// is a condition variable, and the count of notifications and of waits
+// that actually blocked is reported. Each transfer size is run against
+// a single page ring and against an order 2 (16 KiB) one. The report
+// gives MB/s and the time from a transfer being offered to its last
+// byte being consumed (p50/p99). The data is checked on the way.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "ring_engine.h"
+
+#define BENCH_TOTAL         (64 << 20)
+#define BENCH_MAXIMUM_COUNT 200000
+
+static int  Failures;
+
+#define TEST(_Condition)                                            \
+    do {                                                            \
+        if (!(_Condition)) {                                        \
+            fprintf(stderr, "%s:%d: %s\n",                          \
+                    __FILE__, __LINE__, #_Condition);               \
+            Failures++;                                             \
+        }                                                           \
+    } while (0)
+
+typedef struct _BENCH_EVENT {
+    pthread_mutex_t Lock;
+    pthread_cond_t  Condition;
+    BOOLEAN         Pending;
+    ULONGLONG       Sent;
+    ULONGLONG       Waits;
+} BENCH_EVENT, *PBENCH_EVENT;
+
+typedef struct _BENCH {
+    XENCONS_RING_ENGINE     Engine;
+    PVOID                   Shared;
+    ULONG                   Length;     // Bytes per transfer
+    ULONG                   Count;      // Transfers
+    ULONGLONG               *Offered;   // ns, per transfer
+    ULONGLONG               *Consumed;
+    BENCH_EVENT             ToBackend;
+    BENCH_EVENT             ToFrontend;
+    volatile BOOLEAN        Done;
+} BENCH, *PBENCH;
+
+static ULONGLONG
+__BenchGetTime(
+    VOID
+    )
+{
+    struct timespec Now;
+
+    (VOID) clock_gettime(CLOCK_MONOTONIC, &Now);
+
+    return (ULONGLONG)Now.tv_sec * 1000000000ull + Now.tv_nsec;
+}
+
+static VOID
+__BenchEventInitialize(
+    _Out_ PBENCH_EVENT  Event
+    )
+{
+    memset(Event, 0, sizeof(BENCH_EVENT));
+    pthread_mutex_init(&Event->Lock, NULL);
+    pthread_cond_init(&Event->Condition, NULL);
+}
+
+static VOID
+__BenchEventTeardown(
+    _In_ PBENCH_EVENT   Event
+    )
+{
+    pthread_cond_destroy(&Event->Condition);
+    pthread_mutex_destroy(&Event->Lock);
+}
+
+static VOID
+__BenchNotify(
+    _In_ PBENCH_EVENT   Event
+    )
+{
+    pthread_mutex_lock(&Event->Lock);
+    Event->Pending = TRUE;
+    Event->Sent++;
+    pthread_cond_signal(&Event->Condition);
+    pthread_mutex_unlock(&Event->Lock);
+}
+
+// The pending flag stands in for the event channel's: a notification
+// sent after the indexes were looked at is not lost
+static VOID
+__BenchWait(
+    _In_ PBENCH_EVENT   Event,
+    _In_ PBENCH         Bench
+    )
+{
+    pthread_mutex_lock(&Event->Lock);
+    if (!Event->Pending && !Bench->Done) {
+        Event->Waits++;
+        while (!Event->Pending && !Bench->Done)
+            pthread_cond_wait(&Event->Condition, &Event->Lock);
+    }
+    Event->Pending = FALSE;
+    pthread_mutex_unlock(&Event->Lock);
+}
+
+static VOID
+__BenchFill(
+    _Out_ PCHAR Buffer,
+    _In_ ULONG  Length,
+    _In_ ULONG  Offset
+    )
+{
+    ULONG       Index;
+
+    for (Index = 0; Index < Length; Index++)
+        Buffer[Index] = (CHAR)((Offset + Index) * 7);
+}
+
+static void *
+BenchBackend(
+    void        *Argument
+    )
+{
+    PBENCH      Bench = Argument;
+    ULONGLONG   Total = (ULONGLONG)Bench->Length * Bench->Count;
+    ULONGLONG   Received;
+    ULONG       Transfer;
+    CHAR        Buffer[4096];
+    CHAR        Expected[4096];
+
+    Received = 0;
+    Transfer = 0;
+
+    while (Received < Total) {
+        ULONG   Read;
+
+        Read = RingEngineRead(&Bench->Engine.Out, Buffer, sizeof(Buffer));
+        if (Read == 0) {
+            __BenchWait(&Bench->ToBackend, Bench);
+            continue;
+        }
+
+        __BenchFill(Expected, Read, (ULONG)Received);
+        if (memcmp(Buffer, Expected, Read) != 0) {
+            TEST(memcmp(Buffer, Expected, Read) == 0);
+            break;
+        }
+
+        Received += Read;
+
+        while (Transfer < Bench->Count &&
+               (ULONGLONG)(Transfer + 1) * Bench->Length <= Received)
+            Bench->Consumed[Transfer++] = __BenchGetTime();
+
+        __BenchNotify(&Bench->ToFrontend);
+    }
+
+    TEST(Received == Total);
+
+    return NULL;
+}
+
+static void *
+BenchFrontend(
+    void        *Argument
+    )
+{
+    PBENCH      Bench = Argument;
+    ULONGLONG   Sent;
+    ULONG       Transfer;
+    PCHAR       Buffer;
+
+    Buffer = malloc(Bench->Length);
+    if (Buffer == NULL) {
+        TEST(Buffer != NULL);
+        return NULL;
+    }
+
+    Sent = 0;
+
+    for (Transfer = 0; Transfer < Bench->Count; Transfer++) {
+        ULONG   Offset;
+
+        __BenchFill(Buffer, Bench->Length, (ULONG)Sent);
+        Bench->Offered[Transfer] = __BenchGetTime();
+
+        Offset = 0;
+        while (Offset < Bench->Length) {
+            ULONG   Written;
+
+            Written = RingEngineWrite(&Bench->Engine.Out,
+                                      Buffer + Offset,
+                                      Bench->Length - Offset);
+            if (Written == 0) {
+                __BenchWait(&Bench->ToFrontend, Bench);
+                continue;
+            }
+
+            Offset += Written;
+            __BenchNotify(&Bench->ToBackend);
+        }
+
+        Sent += Bench->Length;
+    }
+
+    free(Buffer);
+
+    return NULL;
+}
+
+static int
+__BenchCompare(
+    const void  *First,
+    const void  *Second
+    )
+{
+    ULONGLONG   Value1 = *(const ULONGLONG *)First;
+    ULONGLONG   Value2 = *(const ULONGLONG *)Second;
+
+    return (Value1 < Value2) ? -1 : (Value1 > Value2) ? 1 : 0;
+}
+
+static VOID
+BenchRun(
+    _In_ ULONG      Size,
+    _In_ ULONG      Length
+    )
+{
+    BENCH           Bench;
+    pthread_t       Frontend;
+    pthread_t       Backend;
+    ULONGLONG       Start;
+    ULONGLONG       Elapsed;
+    ULONG           Index;
+
+    memset(&Bench, 0, sizeof(Bench));
+
+    Bench.Shared = calloc(1, Size);
+    Bench.Length = Length;
+    Bench.Count = BENCH_TOTAL / Length;
+    if (Bench.Count > BENCH_MAXIMUM_COUNT)
+        Bench.Count = BENCH_MAXIMUM_COUNT;
+
+    Bench.Offered = calloc(Bench.Count, sizeof(ULONGLONG));
+    Bench.Consumed = calloc(Bench.Count, sizeof(ULONGLONG));
+
+    if (Bench.Shared == NULL || Bench.Offered == NULL || Bench.Consumed == NULL) {
+        TEST(Bench.Shared != NULL);
+        TEST(Bench.Offered != NULL && Bench.Consumed != NULL);
+        goto done;
+    }
+
+    RingEngineInitialize(&Bench.Engine, Bench.Shared, Size);
+
+    __BenchEventInitialize(&Bench.ToBackend);
+    __BenchEventInitialize(&Bench.ToFrontend);
+
+    Start = __BenchGetTime();
+
+    pthread_create(&Backend, NULL, BenchBackend, &Bench);
+    pthread_create(&Frontend, NULL, BenchFrontend, &Bench);
+
+    pthread_join(Frontend, NULL);
+    pthread_join(Backend, NULL);
+
+    Elapsed = __BenchGetTime() - Start;
+
+    for (Index = 0; Index < Bench.Count; Index++)
+        Bench.Consumed[Index] -= Bench.Offered[Index];
+
+    qsort(Bench.Consumed, Bench.Count, sizeof(ULONGLONG), __BenchCompare);
+
+    printf("%6u %6u %10.1f %10.2f %10.2f %12llu %10llu %10llu\n",
+           Size,
+           Length,
+           ((double)Length * Bench.Count / (1024.0 * 1024.0)) /
+           (Elapsed / 1e9),
+           Bench.Consumed[Bench.Count / 2] / 1000.0,
+           Bench.Consumed[(Bench.Count * 99ull) / 100] / 1000.0,
+           (unsigned long long)(Bench.ToBackend.Sent + Bench.ToFrontend.Sent),
+           (unsigned long long)Bench.ToBackend.Waits,
+           (unsigned long long)Bench.ToFrontend.Waits);
+
+    __BenchEventTeardown(&Bench.ToFrontend);
+    __BenchEventTeardown(&Bench.ToBackend);
+
+done:
+    free(Bench.Consumed);
+    free(Bench.Offered);
+    free(Bench.Shared);
+}
+
+int
+main(
+    void
+    )
+{
+    static const ULONG  Size[] = { 4096, 16384 };
+    static const ULONG  Length[] = { 1, 16, 64, 256, 1024, 4096, 16384 };
+    ULONG               SizeIndex;
+    ULONG               LengthIndex;
+
+    printf("%6s %6s %10s %10s %10s %12s %10s %10s\n",
+           "ring", "xfer", "MB/s", "p50 us", "p99 us", "notifies",
+           "be waits", "fe waits");
+
+    for (SizeIndex = 0; SizeIndex < sizeof(Size) / sizeof(Size[0]); SizeIndex++)
+        for (LengthIndex = 0; LengthIndex < sizeof(Length) / sizeof(Length[0]); LengthIndex++)
+            BenchRun(Size[SizeIndex], Length[LengthIndex]);
+
+    if (Failures != 0) {
+        fprintf(stderr, "%d failure(s)\n", Failures);
+        return EXIT_FAILURE;
+    }
+
+    printf("ring_bench: passed\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,226 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+// Host test for the portable ring code. Nothing here needs Windows:
+//
+//   cc -I src/xencons -o ring_engine_test src/test/ring_engine_test.c
+//      src/xencons/ring_engine.c
+//
+// or, from a Visual Studio command prompt:
+//
+//   cl /I src\xencons src\test\ring_engine_test.c src\xencons\ring_engine.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ring_engine.h"
+
+#define TEST_QUEUE_SIZE 16
+
+static int  Failures;
+
+#define TEST(_Condition)                                            \
+    do {                                                            \
+        if (!(_Condition)) {                                        \
+            fprintf(stderr, "%s:%d: %s\n",                          \
+                    __FILE__, __LINE__, #_Condition);               \
+            Failures++;                                             \
+        }                                                           \
+    } while (0)
+
+static VOID
+__TestFill(
+    _Out_ PCHAR Buffer,
+    _In_ ULONG  Length,
+    _In_ ULONG  Seed
+    )
+{
+    ULONG       Index;
+
+    for (Index = 0; Index < Length; Index++)
+        Buffer[Index] = (CHAR)(Seed + Index);
+}
+
+// Writes and reads that straddle the end of the data buffer, with the
+// free-running indices about to wrap as well
+static VOID
+TestWrap(
+    VOID
+    )
+{
+    XENCONS_RING_ENGINE_QUEUE   Queue;
+    CHAR                        Data[TEST_QUEUE_SIZE];
+    volatile ULONG              Cons;
+    volatile ULONG              Prod;
+    CHAR                        In[TEST_QUEUE_SIZE * 2];
+    CHAR                        Out[TEST_QUEUE_SIZE * 2];
+    ULONG                       Round;
+
+    Cons = Prod = 0xfffffff4;
+    RingEngineInitializeQueue(&Queue, Data, TEST_QUEUE_SIZE, &Cons, &Prod);
+
+    TEST(RingEngineGetUsed(&Queue) == 0);
+    TEST(RingEngineGetFree(&Queue) == TEST_QUEUE_SIZE);
+
+    for (Round = 0; Round < 8; Round++) {
+        ULONG   Length = 5 + Round;
+
+        __TestFill(In, Length, Round * 31);
+
+        TEST(RingEngineWrite(&Queue, In, Length) == Length);
+        TEST(RingEngineGetUsed(&Queue) == Length);
+
+        memset(Out, 0, sizeof(Out));
+        TEST(RingEngineRead(&Queue, Out, sizeof(Out)) == Length);
+        TEST(memcmp(In, Out, Length) == 0);
+        TEST(Cons == Prod);
+    }
+
+    // The indices wrapped on the way round
+    TEST(Prod < 0xfffffff4);
+}
+
+// A write never overruns the consumer, and a read never gets ahead of
+// the producer
+static VOID
+TestFull(
+    VOID
+    )
+{
+    XENCONS_RING_ENGINE_QUEUE   Queue;
+    CHAR                        Data[TEST_QUEUE_SIZE];
+    volatile ULONG              Cons;
+    volatile ULONG              Prod;
+    CHAR                        In[TEST_QUEUE_SIZE * 2];
+    CHAR                        Out[TEST_QUEUE_SIZE * 2];
+
+    Cons = Prod = 7;
+    RingEngineInitializeQueue(&Queue, Data, TEST_QUEUE_SIZE, &Cons, &Prod);
+
+    __TestFill(In, sizeof(In), 0);
+
+    TEST(RingEngineWrite(&Queue, In, sizeof(In)) == TEST_QUEUE_SIZE);
+    TEST(RingEngineGetFree(&Queue) == 0);
+    TEST(RingEngineWrite(&Queue, In, 1) == 0);
+
+    TEST(RingEngineRead(&Queue, Out, 3) == 3);
+    TEST(memcmp(In, Out, 3) == 0);
+
+    TEST(RingEngineWrite(&Queue, In + TEST_QUEUE_SIZE, sizeof(In)) == 3);
+
+    TEST(RingEngineRead(&Queue, Out, sizeof(Out)) == TEST_QUEUE_SIZE);
+    TEST(memcmp(Out, In + 3, TEST_QUEUE_SIZE) == 0);
+    TEST(RingEngineRead(&Queue, Out, sizeof(Out)) == 0);
+}
+
+// Several reads against one snapshot only move the consumer index when
+// the batch is committed, and never see data written after the snapshot
+static VOID
+TestBatch(
+    VOID
+    )
+{
+    XENCONS_RING_ENGINE_QUEUE   Queue;
+    XENCONS_RING_ENGINE_BATCH   Batch;
+    CHAR                        Data[TEST_QUEUE_SIZE];
+    volatile ULONG              Cons;
+    volatile ULONG              Prod;
+    CHAR                        In[TEST_QUEUE_SIZE];
+    CHAR                        Out[TEST_QUEUE_SIZE];
+
+    Cons = Prod = 12;
+    RingEngineInitializeQueue(&Queue, Data, TEST_QUEUE_SIZE, &Cons, &Prod);
+
+    __TestFill(In, sizeof(In), 100);
+
+    TEST(RingEngineWrite(&Queue, In, 10) == 10);
+
+    RingEngineReadBegin(&Queue, &Batch);
+    TEST(RingEngineGetBatchAvailable(&Batch) == 10);
+
+    TEST(RingEngineWrite(&Queue, In + 10, 4) == 4);
+
+    TEST(RingEngineReadBatch(&Queue, &Batch, Out, 4) == 4);
+    TEST(RingEngineReadBatch(&Queue, &Batch, Out + 4, 4) == 4);
+    TEST(RingEngineReadBatch(&Queue, &Batch, Out + 8, 4) == 2);
+    TEST(RingEngineGetBatchAvailable(&Batch) == 0);
+    TEST(memcmp(In, Out, 10) == 0);
+
+    TEST(Cons == 12);
+    RingEngineReadCommit(&Queue, &Batch);
+    TEST(Cons == 22);
+
+    TEST(RingEngineRead(&Queue, Out, sizeof(Out)) == 4);
+    TEST(memcmp(In + 10, Out, 4) == 0);
+}
+
+// The single page layout is struct xencons_interface
+static VOID
+TestLayout(
+    VOID
+    )
+{
+    XENCONS_RING_ENGINE Engine;
+    static ULONG        Page[4096 / sizeof(ULONG)];
+    PCHAR               Base = (PCHAR)Page;
+
+    RingEngineInitialize(&Engine, Page, 4096);
+
+    TEST(Engine.In.Data == Base);
+    TEST(Engine.In.Size == 1024);
+    TEST(Engine.Out.Data == Base + 1024);
+    TEST(Engine.Out.Size == 2048);
+    TEST((PCHAR)Engine.In.Cons == Base + 3072);
+    TEST((PCHAR)Engine.In.Prod == Base + 3076);
+    TEST((PCHAR)Engine.Out.Cons == Base + 3080);
+    TEST((PCHAR)Engine.Out.Prod == Base + 3084);
+}
+
+int
+main(
+    void
+    )
+{
+    TestWrap();
+    TestFull();
+    TestBatch();
+    TestLayout();
+
+    if (Failures != 0) {
+        fprintf(stderr, "%d failure(s)\n", Failures);
+        return EXIT_FAILURE;
+    }
+
+    printf("ring_engine_test: passed\n");
+    return EXIT_SUCCESS;
+}
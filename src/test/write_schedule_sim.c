@@ -0,0 +1,406 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+// Simulation of the ring's write schedule. The schedule itself comes
+// from src/xencons/write_schedule.h; RingWriteInsert() and the send
+// loop of RingPollWrite() are modelled here. Builds anywhere:
+//
+//   cc -O2 -I src/xencons -o write_schedule_sim
+//      src/test/write_schedule_sim.c
+//
+// A console ring drained by the backend at a fixed rate is shared by
+// bulk writers (a log shipper keeping several 64 or 4 KiB writes queued)
+// and an interactive session echoing a few bytes at a time. It runs a
+// minute of simulated time under several settings of RingWriteQuantum
+// and RingWriteInteractiveSize, checks that each handle's writes still
+// complete in order and that nothing is lost, and reports the
+// interactive writes' queue-to-completion latency and bulk throughput.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "write_schedule.h"
+
+#define SIM_RING_SIZE       2048        // Out ring of a single page
+#define SIM_TICK            100         // us
+#define SIM_DURATION        60000000ull // us
+#define SIM_DRAIN           100         // Bytes per tick: 1 MB/s
+
+#define SIM_BULK_FLOWS      2
+#define SIM_BULK_DEPTH      4
+
+#define SIM_INTERACTIVE_INTERVAL    50000   // Mean, us
+
+#define SIM_FLOWS           (SIM_BULK_FLOWS + 1)
+#define SIM_INTERACTIVE     SIM_BULK_FLOWS  // Index of the interactive flow
+
+#define SIM_MAXIMUM_SAMPLES 4096
+
+static int  Failures;
+
+#define TEST(_Condition)                                            \
+    do {                                                            \
+        if (!(_Condition)) {                                        \
+            fprintf(stderr, "%s:%d: %s\n",                          \
+                    __FILE__, __LINE__, #_Condition);               \
+            Failures++;                                             \
+        }                                                           \
+    } while (0)
+
+typedef struct _SIM_WRITE {
+    struct _SIM_WRITE   *Prev;
+    struct _SIM_WRITE   *Next;
+    ULONG               Flow;
+    ULONG               Sequence;
+    ULONG               Length;
+    ULONG               Written;    // IoStatus.Information
+    ULONG               Round;
+    BOOLEAN             Interactive;
+    ULONGLONG           Queued;
+} SIM_WRITE, *PSIM_WRITE;
+
+typedef struct _SIM_FLOW {
+    XENCONS_WRITE_FLOW  Schedule;
+    ULONG               Outstanding;
+    ULONG               Sequence;
+    ULONG               Completed;
+    ULONGLONG           Bytes;
+} SIM_FLOW, *PSIM_FLOW;
+
+typedef struct _SIM {
+    ULONG       Quantum;
+    ULONG       InteractiveSize;
+    ULONG       WriteRound;
+    SIM_WRITE   Queue;              // List head
+    ULONG       Used;               // Bytes in the ring
+    SIM_FLOW    Flow[SIM_FLOWS];
+    ULONG       Seed;
+    ULONGLONG   Latency[SIM_MAXIMUM_SAMPLES];
+    ULONG       Samples;
+    ULONGLONG   Reordered;
+} SIM, *PSIM;
+
+static ULONG
+__SimRandom(
+    _In_ PSIM   Sim
+    )
+{
+    Sim->Seed = Sim->Seed * 1103515245 + 12345;
+    return Sim->Seed >> 8;
+}
+
+// Insert Write after Prev
+static VOID
+__SimInsertAfter(
+    _In_ PSIM_WRITE Prev,
+    _In_ PSIM_WRITE Write
+    )
+{
+    Write->Prev = Prev;
+    Write->Next = Prev->Next;
+    Prev->Next->Prev = Write;
+    Prev->Next = Write;
+}
+
+static VOID
+__SimRemove(
+    _In_ PSIM_WRITE Write
+    )
+{
+    Write->Prev->Next = Write->Next;
+    Write->Next->Prev = Write->Prev;
+}
+
+// RingWriteInsert()
+static VOID
+SimInsert(
+    _In_ PSIM       Sim,
+    _In_ PSIM_WRITE Write
+    )
+{
+    PSIM_WRITE      Prev;
+
+    Write->Round = WriteScheduleAssign(&Sim->Flow[Write->Flow].Schedule,
+                                       Sim->WriteRound,
+                                       Write->Length,
+                                       Sim->Quantum);
+
+    if (Write->Length != 0 &&
+        Write->Length <= Sim->InteractiveSize &&
+        !WriteScheduleIsBefore(Sim->WriteRound, Write->Round)) {
+        Write->Interactive = TRUE;
+
+        for (Prev = Sim->Queue.Prev; Prev != &Sim->Queue; Prev = Prev->Prev)
+            if (Prev->Flow == Write->Flow ||
+                Prev->Interactive ||
+                Prev->Written != 0)
+                break;
+    } else {
+        for (Prev = Sim->Queue.Prev; Prev != &Sim->Queue; Prev = Prev->Prev)
+            if (Prev->Interactive ||
+                !WriteScheduleIsBefore(Write->Round, Prev->Round))
+                break;
+    }
+
+    if (Prev != Sim->Queue.Prev)
+        Sim->Reordered++;
+
+    __SimInsertAfter(Prev, Write);
+}
+
+static VOID
+SimPost(
+    _In_ PSIM       Sim,
+    _In_ ULONG      Flow,
+    _In_ ULONG      Length,
+    _In_ ULONGLONG  Now
+    )
+{
+    PSIM_WRITE      Write;
+
+    Write = calloc(1, sizeof(SIM_WRITE));
+    if (Write == NULL) {
+        TEST(Write != NULL);
+        return;
+    }
+
+    Write->Flow = Flow;
+    Write->Sequence = Sim->Flow[Flow].Sequence++;
+    Write->Length = Length;
+    Write->Queued = Now;
+
+    Sim->Flow[Flow].Outstanding++;
+
+    SimInsert(Sim, Write);
+}
+
+static VOID
+SimComplete(
+    _In_ PSIM       Sim,
+    _In_ PSIM_WRITE Write,
+    _In_ ULONGLONG  Now
+    )
+{
+    PSIM_FLOW       Flow = &Sim->Flow[Write->Flow];
+
+    // Each handle's writes go out in the order they were issued
+    TEST(Write->Sequence == Flow->Completed);
+    Flow->Completed = Write->Sequence + 1;
+
+    Flow->Outstanding--;
+    Flow->Bytes += Write->Length;
+
+    if (Write->Flow == SIM_INTERACTIVE && Sim->Samples < SIM_MAXIMUM_SAMPLES)
+        Sim->Latency[Sim->Samples++] = Now - Write->Queued;
+
+    free(Write);
+}
+
+// The send loop of RingPollWrite()
+static VOID
+SimPoll(
+    _In_ PSIM       Sim,
+    _In_ ULONGLONG  Now
+    )
+{
+    for (;;) {
+        PSIM_WRITE  Write;
+        ULONG       Free;
+        ULONG       Length;
+
+        Free = SIM_RING_SIZE - Sim->Used;
+        if (Free == 0)
+            break;
+
+        Write = Sim->Queue.Next;
+        if (Write == &Sim->Queue)
+            break;
+
+        if (!Write->Interactive)
+            Sim->WriteRound = Write->Round;
+
+        Length = Write->Length - Write->Written;
+        if (Length > Free)
+            Length = Free;
+
+        Write->Written += Length;
+        Sim->Used += Length;
+
+        if (Write->Written < Write->Length)
+            continue;
+
+        __SimRemove(Write);
+        SimComplete(Sim, Write, Now);
+    }
+}
+
+static int
+__SimCompare(
+    const void  *First,
+    const void  *Second
+    )
+{
+    ULONGLONG   Value1 = *(const ULONGLONG *)First;
+    ULONGLONG   Value2 = *(const ULONGLONG *)Second;
+
+    return (Value1 < Value2) ? -1 : (Value1 > Value2) ? 1 : 0;
+}
+
+static VOID
+SimRun(
+    _In_ ULONG  BulkLength,
+    _In_ ULONG  Quantum,
+    _In_ ULONG  InteractiveSize
+    )
+{
+    static SIM  Sim;
+    ULONGLONG   Now;
+    ULONGLONG   NextInteractive;
+    ULONGLONG   Posted;
+    ULONGLONG   Drained;
+    ULONGLONG   Bulk;
+    ULONG       Flow;
+
+    memset(&Sim, 0, sizeof(Sim));
+    Sim.Quantum = Quantum;
+    Sim.InteractiveSize = InteractiveSize;
+    Sim.WriteRound = WRITE_SCHEDULE_FIRST_ROUND;
+    Sim.Queue.Next = Sim.Queue.Prev = &Sim.Queue;
+    Sim.Seed = 1;
+
+    NextInteractive = 0;
+    Posted = 0;
+    Drained = 0;
+
+    for (Now = 0; Now < SIM_DURATION; Now += SIM_TICK) {
+        ULONG   Drain;
+
+        for (Flow = 0; Flow < SIM_BULK_FLOWS; Flow++) {
+            while (Sim.Flow[Flow].Outstanding < SIM_BULK_DEPTH) {
+                SimPost(&Sim, Flow, BulkLength, Now);
+                Posted += BulkLength;
+            }
+        }
+
+        if (Now >= NextInteractive) {
+            ULONG   Length = 1 + __SimRandom(&Sim) % 8;
+
+            SimPost(&Sim, SIM_INTERACTIVE, Length, Now);
+            Posted += Length;
+
+            // Roughly exponential gaps with the given mean
+            NextInteractive = Now + SIM_TICK +
+                              (__SimRandom(&Sim) % (2 * SIM_INTERACTIVE_INTERVAL));
+        }
+
+        Drain = (Sim.Used < SIM_DRAIN) ? Sim.Used : SIM_DRAIN;
+        Sim.Used -= Drain;
+        Drained += Drain;
+
+        SimPoll(&Sim, Now);
+    }
+
+    // Nothing is lost or duplicated: what was posted is in the ring,
+    // in a queued write, or has been drained
+    {
+        ULONGLONG   Queued = 0;
+        ULONGLONG   Completed = 0;
+        PSIM_WRITE  Write;
+
+        for (Write = Sim.Queue.Next; Write != &Sim.Queue; Write = Write->Next)
+            Queued += Write->Length - Write->Written;
+
+        for (Flow = 0; Flow < SIM_FLOWS; Flow++)
+            Completed += Sim.Flow[Flow].Bytes;
+
+        TEST(Posted == Drained + Sim.Used + Queued);
+        TEST(Completed <= Drained + Sim.Used);
+
+        while (Sim.Queue.Next != &Sim.Queue) {
+            Write = Sim.Queue.Next;
+            __SimRemove(Write);
+            free(Write);
+        }
+    }
+
+    TEST(Sim.Samples != 0);
+    if (Sim.Samples == 0)
+        return;
+
+    qsort(Sim.Latency, Sim.Samples, sizeof(ULONGLONG), __SimCompare);
+
+    Bulk = 0;
+    for (Flow = 0; Flow < SIM_BULK_FLOWS; Flow++)
+        Bulk += Sim.Flow[Flow].Bytes;
+
+    printf("%6u %8u %12u %8u %10.1f %10.1f %10.1f %10.2f %10llu\n",
+           BulkLength,
+           Quantum,
+           InteractiveSize,
+           Sim.Samples,
+           Sim.Latency[Sim.Samples / 2] / 1000.0,
+           Sim.Latency[(Sim.Samples * 99) / 100] / 1000.0,
+           Sim.Latency[Sim.Samples - 1] / 1000.0,
+           (Bulk / 1e6) / (SIM_DURATION / 1e6),
+           (unsigned long long)Sim.Reordered);
+}
+
+int
+main(
+    void
+    )
+{
+    static const ULONG  BulkLength[] = { 64 * 1024, 4096 };
+    ULONG               Index;
+
+    printf("%6s %8s %12s %8s %10s %10s %10s %10s %10s\n",
+           "bulk",
+           "quantum", "interactive", "writes", "p50 ms", "p99 ms",
+           "max ms", "bulk MB/s", "reordered");
+
+    for (Index = 0; Index < sizeof(BulkLength) / sizeof(BulkLength[0]); Index++) {
+        SimRun(BulkLength[Index], 0, 0);    // FIFO
+        SimRun(BulkLength[Index], 1024, 0);
+        SimRun(BulkLength[Index], 4096, 0);
+        SimRun(BulkLength[Index], 1024, 64);
+        SimRun(BulkLength[Index], 4096, 64);
+    }
+
+    if (Failures != 0) {
+        fprintf(stderr, "%d failure(s)\n", Failures);
+        return EXIT_FAILURE;
+    }
+
+    printf("write_schedule_sim: passed\n");
+    return EXIT_SUCCESS;
+}
@@ -39,9 +39,11 @@
 #include <wdmsec.h>
 
 #include <xencons_device.h>
+#include <debug_interface.h>
 
 #include "driver.h"
 #include "console.h"
+#include "fdo.h"
 #include "stream.h"
 #include "dbg_print.h"
 #include "assert.h"
@@ -50,16 +52,25 @@
 #define CONSOLE_POOL 'SNOC'
 
 typedef struct _CONSOLE_HANDLE {
-    LIST_ENTRY      ListEntry;
-    PFILE_OBJECT    FileObject;
-    PXENCONS_STREAM Stream;
+    LIST_ENTRY              ListEntry;
+    PFILE_OBJECT            FileObject;
+    PXENCONS_STREAM_CLIENT  Client;
+    LONG                    References;
+    KEVENT                  Event;
 } CONSOLE_HANDLE, *PCONSOLE_HANDLE;
 
 typedef struct _XENCONS_CONSOLE {
-    LONG            References;
-    PXENCONS_FDO    Fdo;
-    LIST_ENTRY      List;
-    KSPIN_LOCK      Lock;
+    LONG                    References;
+    PXENCONS_FDO            Fdo;
+    PXENCONS_STREAM         Stream;
+    LIST_ENTRY              List;
+    KSPIN_LOCK              Lock;
+
+    XENBUS_DEBUG_INTERFACE  DebugInterface;
+    PXENBUS_DEBUG_CALLBACK  DebugCallback;
+
+    LONG                    FastLookups;
+    LONG                    SlowLookups;
 } XENCONS_CONSOLE, *PXENCONS_CONSOLE;
 
 static FORCEINLINE PVOID
@@ -93,19 +104,30 @@ __ConsoleCreateHandle(
     if (*Handle == NULL)
         goto fail1;
 
-    status = StreamCreate(Console->Fdo, &(*Handle)->Stream);
-    if (!NT_SUCCESS(status))
+    status = STATUS_DEVICE_NOT_READY;
+    if (Console->Stream == NULL)
         goto fail2;
 
+    status = StreamOpen(Console->Stream, &(*Handle)->Client);
+    if (!NT_SUCCESS(status))
+        goto fail3;
+
     (*Handle)->FileObject = FileObject;
 
+    // The reference belongs to Console->List
+    (*Handle)->References = 1;
+    KeInitializeEvent(&(*Handle)->Event, NotificationEvent, FALSE);
+
     return STATUS_SUCCESS;
 
+fail3:
+    Error("fail3\n");
+
 fail2:
     Error("fail2\n");
 
-    ASSERT(IsZeroMemory(Handle, sizeof(CONSOLE_HANDLE)));
-    __ConsoleFree(Handle);
+    ASSERT(IsZeroMemory(*Handle, sizeof(CONSOLE_HANDLE)));
+    __ConsoleFree(*Handle);
 
 fail1:
     Error("fail1 (%08x)\n", status);
@@ -121,10 +143,21 @@ __ConsoleDestroyHandle(
 {
     UNREFERENCED_PARAMETER(Console);
 
+    // Drop the list's reference and wait for anything that found the
+    // handle before it was unlinked
+    if (InterlockedDecrement(&Handle->References) != 0)
+        (VOID) KeWaitForSingleObject(&Handle->Event,
+                                     Executive,
+                                     KernelMode,
+                                     FALSE,
+                                     NULL);
+
+    RtlZeroMemory(&Handle->Event, sizeof(KEVENT));
+
     RtlZeroMemory(&Handle->ListEntry, sizeof(LIST_ENTRY));
 
-    StreamDestroy(Handle->Stream);
-    Handle->Stream = NULL;
+    StreamClose(Handle->Client);
+    Handle->Client = NULL;
 
     Handle->FileObject = NULL;
 
@@ -132,6 +165,17 @@ __ConsoleDestroyHandle(
     __ConsoleFree(Handle);
 }
 
+static FORCEINLINE VOID
+__ConsoleReleaseHandle(
+    _In_ PCONSOLE_HANDLE    Handle
+    )
+{
+    if (InterlockedDecrement(&Handle->References) == 0)
+        (VOID) KeSetEvent(&Handle->Event, IO_NO_INCREMENT, FALSE);
+}
+
+// Returns the handle with a reference that the caller drops with
+// __ConsoleReleaseHandle().
 static PCONSOLE_HANDLE
 __ConsoleFindHandle(
     _In_ PXENCONS_CONSOLE   Console,
@@ -145,6 +189,18 @@ __ConsoleFindHandle(
 
     KeAcquireSpinLock(&Console->Lock, &Irql);
 
+    // The handle is hung off the file object when it is opened, and
+    // the pointer is cleared when it is unlinked, both under the lock.
+    // ConsoleD0ToD3() may be unlinking it right now, so FsContext is
+    // only looked at under the lock too.
+    Handle = FileObject->FsContext;
+    if (Handle != NULL && Handle->FileObject == FileObject) {
+        InterlockedIncrement(&Console->FastLookups);
+        goto found;
+    }
+
+    InterlockedIncrement(&Console->SlowLookups);
+
     for (ListEntry = Console->List.Flink;
          ListEntry != &Console->List;
          ListEntry = ListEntry->Flink) {
@@ -160,6 +216,8 @@ __ConsoleFindHandle(
     goto fail1;
 
 found:
+    InterlockedIncrement(&Handle->References);
+
     KeReleaseSpinLock(&Console->Lock, Irql);
 
     return Handle;
@@ -188,6 +246,7 @@ ConsoleOpen(
 
     KeAcquireSpinLock(&Console->Lock, &Irql);
     InsertTailList(&Console->List, &Handle->ListEntry);
+    FileObject->FsContext = Handle;
     KeReleaseSpinLock(&Console->Lock, Irql);
 
     Trace("%p\n", Handle->FileObject);
@@ -207,6 +266,7 @@ ConsoleClose(
     )
 {
     PCONSOLE_HANDLE         Handle;
+    BOOLEAN                 Linked;
     KIRQL                   Irql;
     NTSTATUS                status;
 
@@ -218,11 +278,20 @@ ConsoleClose(
 
     Trace("%p\n", Handle->FileObject);
 
+    // ConsoleD0ToD3() may have unlinked the handle since it was found,
+    // in which case it is the one to destroy it
     KeAcquireSpinLock(&Console->Lock, &Irql);
-    RemoveEntryList(&Handle->ListEntry);
+    Linked = (FileObject->FsContext == Handle) ? TRUE : FALSE;
+    if (Linked) {
+        RemoveEntryList(&Handle->ListEntry);
+        FileObject->FsContext = NULL;
+    }
     KeReleaseSpinLock(&Console->Lock, Irql);
 
-    __ConsoleDestroyHandle(Console, Handle);
+    __ConsoleReleaseHandle(Handle);
+
+    if (Linked)
+        __ConsoleDestroyHandle(Console, Handle);
 
     return STATUS_SUCCESS;
 
@@ -250,12 +319,159 @@ __ConsoleReadWrite(
     if (Handle == NULL)
         goto fail1;
 
-    status = StreamPutQueue(Handle->Stream, Irp);
+    status = StreamPutQueue(Handle->Client, Irp);
     if (!NT_SUCCESS(status))
         goto fail2;
 
+    __ConsoleReleaseHandle(Handle);
+
     return STATUS_PENDING;
 
+fail2:
+    Error("fail2\n");
+
+    __ConsoleReleaseHandle(Handle);
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static FORCEINLINE NTSTATUS
+__ConsoleSetReadPolicy(
+    _In_ PXENCONS_CONSOLE   Console,
+    _In_ PIRP               Irp
+    )
+{
+    PIO_STACK_LOCATION      StackLocation;
+    ULONG                   InputBufferLength;
+    PCONSOLE_HANDLE         Handle;
+    NTSTATUS                status;
+
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+    InputBufferLength = StackLocation->Parameters.DeviceIoControl.InputBufferLength;
+
+    status = STATUS_INVALID_PARAMETER;
+    if (InputBufferLength != sizeof (XENCONS_READ_POLICY))
+        goto fail1;
+
+    Handle = __ConsoleFindHandle(Console, StackLocation->FileObject);
+
+    status = STATUS_INVALID_HANDLE;
+    if (Handle == NULL)
+        goto fail2;
+
+    status = StreamSetReadPolicy(Handle->Client,
+                                 Irp->AssociatedIrp.SystemBuffer);
+
+    __ConsoleReleaseHandle(Handle);
+
+    if (!NT_SUCCESS(status))
+        goto fail3;
+
+    Irp->IoStatus.Information = 0;
+
+    return STATUS_SUCCESS;
+
+fail3:
+    Error("fail3\n");
+
+fail2:
+    Error("fail2\n");
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static FORCEINLINE NTSTATUS
+__ConsoleSetWriteMode(
+    _In_ PXENCONS_CONSOLE   Console,
+    _In_ PIRP               Irp
+    )
+{
+    PIO_STACK_LOCATION      StackLocation;
+    ULONG                   InputBufferLength;
+    PCONSOLE_HANDLE         Handle;
+    NTSTATUS                status;
+
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+    InputBufferLength = StackLocation->Parameters.DeviceIoControl.InputBufferLength;
+
+    status = STATUS_INVALID_PARAMETER;
+    if (InputBufferLength != sizeof (ULONG))
+        goto fail1;
+
+    Handle = __ConsoleFindHandle(Console, StackLocation->FileObject);
+
+    status = STATUS_INVALID_HANDLE;
+    if (Handle == NULL)
+        goto fail2;
+
+    status = StreamSetWriteMode(Handle->Client,
+                                *(PULONG)Irp->AssociatedIrp.SystemBuffer);
+
+    __ConsoleReleaseHandle(Handle);
+
+    if (!NT_SUCCESS(status))
+        goto fail3;
+
+    Irp->IoStatus.Information = 0;
+
+    return STATUS_SUCCESS;
+
+fail3:
+    Error("fail3\n");
+
+fail2:
+    Error("fail2\n");
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static FORCEINLINE NTSTATUS
+__ConsoleGetStatistics(
+    _In_ PXENCONS_CONSOLE   Console,
+    _In_ PIRP               Irp
+    )
+{
+    PIO_STACK_LOCATION      StackLocation;
+    ULONG                   InputBufferLength;
+    ULONG                   OutputBufferLength;
+    PVOID                   Buffer;
+    NTSTATUS                status;
+
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+    InputBufferLength = StackLocation->Parameters.DeviceIoControl.InputBufferLength;
+    OutputBufferLength = StackLocation->Parameters.DeviceIoControl.OutputBufferLength;
+    Buffer = Irp->AssociatedIrp.SystemBuffer;
+
+    status = STATUS_INVALID_PARAMETER;
+    if (InputBufferLength != 0)
+        goto fail1;
+
+    Irp->IoStatus.Information = sizeof (XENCONS_STATISTICS);
+
+    status = STATUS_INVALID_BUFFER_SIZE;
+    if (OutputBufferLength < sizeof (XENCONS_STATISTICS))
+        goto fail2;
+
+    status = STATUS_DEVICE_NOT_READY;
+    if (Console->Stream == NULL)
+        goto fail3;
+
+    StreamGetStatistics(Console->Stream, Buffer);
+
+    return STATUS_SUCCESS;
+
+fail3:
+    Error("fail3\n");
+
 fail2:
     Error("fail2\n");
 
@@ -280,8 +496,6 @@ __ConsoleDeviceControl(
     ULONG                   Length;
     NTSTATUS                status;
 
-    UNREFERENCED_PARAMETER(Console);
-
     StackLocation = IoGetCurrentIrpStackLocation(Irp);
     IoControlCode = StackLocation->Parameters.DeviceIoControl.IoControlCode;
     InputBufferLength = StackLocation->Parameters.DeviceIoControl.InputBufferLength;
@@ -292,6 +506,21 @@ __ConsoleDeviceControl(
     if (status != STATUS_SUCCESS)
         return status;
 
+    if (IoControlCode == IOCTL_XENCONS_GET_STATISTICS)
+        return __ConsoleGetStatistics(Console, Irp);
+
+    if (IoControlCode == IOCTL_XENCONS_SET_READ_POLICY)
+        return __ConsoleSetReadPolicy(Console, Irp);
+
+    if (IoControlCode == IOCTL_XENCONS_SET_WRITE_MODE)
+        return __ConsoleSetWriteMode(Console, Irp);
+
+    // Writes to the default console are never staged
+    if (IoControlCode == IOCTL_XENCONS_FLUSH) {
+        Irp->IoStatus.Information = 0;
+        return STATUS_SUCCESS;
+    }
+
     switch (IoControlCode) {
     case IOCTL_XENCONS_GET_INSTANCE:
         Value = "0";
@@ -375,18 +604,71 @@ ConsolePutQueue(
     return status;
 }
 
+static DECLSPEC_NOINLINE VOID
+ConsoleDebugCallback(
+    _In_ PVOID          Argument,
+    _In_ BOOLEAN        Crashing
+    )
+{
+    PXENCONS_CONSOLE    Console = Argument;
+
+    UNREFERENCED_PARAMETER(Crashing);
+
+    XENBUS_DEBUG(Printf,
+                 &Console->DebugInterface,
+                 "HANDLE LOOKUPS: FAST %u SLOW %u\n",
+                 Console->FastLookups,
+                 Console->SlowLookups);
+}
+
 static NTSTATUS
 ConsoleD3ToD0(
     _In_ PXENCONS_CONSOLE   Console
     )
 {
+    NTSTATUS                status;
+
     Trace("====>\n");
 
-    UNREFERENCED_PARAMETER(Console);
+    status = XENBUS_DEBUG(Acquire, &Console->DebugInterface);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    status = XENBUS_DEBUG(Register,
+                          &Console->DebugInterface,
+                          __MODULE__ "|CONSOLE",
+                          ConsoleDebugCallback,
+                          Console,
+                          &Console->DebugCallback);
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+    // A single stream reads the console on behalf of every open handle
+    status = StreamCreate(Console->Fdo, &Console->Stream);
+    if (!NT_SUCCESS(status))
+        goto fail3;
 
     Trace("<====\n");
 
     return STATUS_SUCCESS;
+
+fail3:
+    Error("fail3\n");
+
+    XENBUS_DEBUG(Deregister,
+                 &Console->DebugInterface,
+                 Console->DebugCallback);
+    Console->DebugCallback = NULL;
+
+fail2:
+    Error("fail2\n");
+
+    XENBUS_DEBUG(Release, &Console->DebugInterface);
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
 }
 
 static VOID
@@ -405,6 +687,18 @@ ConsoleD0ToD3(
 
     KeAcquireSpinLock(&Console->Lock, &Irql);
 
+    // The file objects outlive their handles so make sure nothing can
+    // find a handle through FsContext once it has been destroyed.
+    for (ListEntry = Console->List.Flink;
+         ListEntry != &Console->List;
+         ListEntry = ListEntry->Flink) {
+        Handle = CONTAINING_RECORD(ListEntry,
+                                   CONSOLE_HANDLE,
+                                   ListEntry);
+
+        Handle->FileObject->FsContext = NULL;
+    }
+
     ListEntry = Console->List.Flink;
     if (!IsListEmpty(&Console->List)) {
         RemoveEntryList(&Console->List);
@@ -425,6 +719,20 @@ ConsoleD0ToD3(
         __ConsoleDestroyHandle(Console, Handle);
     }
 
+    if (Console->Stream != NULL) {
+        StreamDestroy(Console->Stream);
+        Console->Stream = NULL;
+    }
+
+    if (Console->DebugCallback != NULL) {
+        XENBUS_DEBUG(Deregister,
+                     &Console->DebugInterface,
+                     Console->DebugCallback);
+        Console->DebugCallback = NULL;
+
+        XENBUS_DEBUG(Release, &Console->DebugInterface);
+    }
+
     Trace("<====\n");
 }
 
@@ -555,6 +863,8 @@ ConsoleCreate(
 
     Console->Fdo = Fdo;
 
+    FdoGetDebugInterface(Fdo, &Console->DebugInterface);
+
     *Context = (PVOID)Console;
 
     Trace("<====\n");
@@ -587,11 +897,19 @@ ConsoleDestroy(
 
     Trace("====>\n");
 
+    ASSERT3P(Console->Stream, ==, NULL);
+
     ASSERT(IsListEmpty(&Console->List));
     RtlZeroMemory(&Console->List, sizeof(LIST_ENTRY));
 
     RtlZeroMemory(&Console->Lock, sizeof(KSPIN_LOCK));
 
+    Console->FastLookups = 0;
+    Console->SlowLookups = 0;
+
+    RtlZeroMemory(&Console->DebugInterface,
+                  sizeof(XENBUS_DEBUG_INTERFACE));
+
     Console->Fdo = NULL;
 
     ASSERT(IsZeroMemory(Console, sizeof(XENCONS_CONSOLE)));
@@ -38,6 +38,7 @@
 #include "registry.h"
 #include "fdo.h"
 #include "pdo.h"
+#include "parameters.h"
 #include "driver.h"
 #include "dbg_print.h"
 #include "assert.h"
@@ -129,6 +130,8 @@ DriverUnload(
 
     Trace("====>\n");
 
+    ParametersTeardown();
+
     ParametersKey = __DriverGetParametersKey();
     __DriverSetParametersKey(NULL);
 
@@ -289,6 +292,10 @@ DriverEntry(
 
     __DriverSetParametersKey(ParametersKey);
 
+    status = ParametersInitialize(ServiceKey);
+    if (!NT_SUCCESS(status))
+        goto fail4;
+
     RegistryCloseKey(ServiceKey);
 
     DriverObject->DriverExtension->AddDevice = AddDevice;
@@ -303,6 +310,13 @@ DriverEntry(
 
     return STATUS_SUCCESS;
 
+fail4:
+    Error("fail4\n");
+
+    __DriverSetParametersKey(NULL);
+
+    RegistryCloseKey(ParametersKey);
+
 fail3:
     Error("fail3\n");
 
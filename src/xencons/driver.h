@@ -77,6 +77,8 @@ typedef struct _XENCONS_DX {
     CHAR                Name[MAX_DEVICE_ID_LEN];
 
     LIST_ENTRY          ListEntry;
+    LIST_ENTRY          HashEntry;
+    ULONG               Generation;
 
     union {
         PXENCONS_FDO    Fdo;
@@ -48,9 +48,11 @@
 
 #include "driver.h"
 #include "registry.h"
+#include "parameters.h"
 #include "fdo.h"
 #include "pdo.h"
 #include "mutex.h"
+#include "string_list.h"
 #include "thread.h"
 #include "names.h"
 #include "dbg_print.h"
@@ -61,6 +63,8 @@
 
 #define MAXNAMELEN  128
 
+#define FDO_PDO_HASH_SIZE   64  // Must be a power of 2
+
 typedef enum _FDO_RESOURCE_TYPE {
     MEMORY_RESOURCE = 0,
     INTERRUPT_RESOURCE,
@@ -93,6 +97,8 @@ struct _XENCONS_FDO {
     PXENBUS_STORE_WATCH         ScanWatch;
     MUTEX                       Mutex;
     ULONG                       References;
+    LIST_ENTRY                  PdoHash[FDO_PDO_HASH_SIZE];
+    ULONG                       ScanGeneration;
 
     FDO_RESOURCE                Resource[RESOURCE_COUNT];
 
@@ -104,6 +110,7 @@ struct _XENCONS_FDO {
     XENBUS_GNTTAB_INTERFACE     GnttabInterface;
 
     PXENBUS_SUSPEND_CALLBACK    SuspendCallbackLate;
+    PXENBUS_DEBUG_CALLBACK      DebugCallback;
 };
 
 static FORCEINLINE PVOID
@@ -605,6 +612,43 @@ FdoParseResources(
     }
 }
 
+static FORCEINLINE ULONG
+__FdoHashName(
+    _In_ PCSTR  Name
+    )
+{
+    return StringListHash(Name) & (FDO_PDO_HASH_SIZE - 1);
+}
+
+static PXENCONS_DX
+FdoLookupPdo(
+    _In_ PXENCONS_FDO   Fdo,
+    _In_ PCSTR          Name
+    )
+{
+    PLIST_ENTRY         Bucket;
+    PLIST_ENTRY         ListEntry;
+
+    Bucket = &Fdo->PdoHash[__FdoHashName(Name)];
+
+    for (ListEntry = Bucket->Flink;
+         ListEntry != Bucket;
+         ListEntry = ListEntry->Flink) {
+        PXENCONS_DX     Dx = CONTAINING_RECORD(ListEntry, XENCONS_DX, HashEntry);
+        PXENCONS_PDO    Pdo = Dx->Pdo;
+
+        // A deleted PDO may linger until its REMOVE_DEVICE IRP arrives,
+        // in which case a new PDO with the same name may be created.
+        if (PdoGetDevicePnpState(Pdo) == Deleted)
+            continue;
+
+        if (strcmp(Dx->Name, Name) == 0)
+            return Dx;
+    }
+
+    return NULL;
+}
+
 NTSTATUS
 FdoAddPhysicalDeviceObject(
     _In_ PXENCONS_FDO   Fdo,
@@ -628,6 +672,8 @@ FdoAddPhysicalDeviceObject(
 
 done:
     InsertTailList(&Fdo->Dx->ListEntry, &Dx->ListEntry);
+    InsertTailList(&Fdo->PdoHash[__FdoHashName(Dx->Name)],
+                   &Dx->HashEntry);
     ASSERT3U(Fdo->References, != , 0);
     Fdo->References++;
 
@@ -659,6 +705,9 @@ FdoRemovePhysicalDeviceObject(
 
 done:
     RemoveEntryList(&Dx->ListEntry);
+    RemoveEntryList(&Dx->HashEntry);
+    RtlZeroMemory(&Dx->HashEntry, sizeof(LIST_ENTRY));
+    Dx->Generation = 0;
     ASSERT3U(Fdo->References, != , 0);
     --Fdo->References;
 
@@ -708,8 +757,7 @@ __FdoEnumerate(
     )
 {
     BOOLEAN             NeedInvalidate;
-    HANDLE              ParametersKey;
-    ULONG               Enumerate;
+    ULONG               Generation;
     PLIST_ENTRY         ListEntry;
     ULONG               Index;
     NTSTATUS            status;
@@ -718,19 +766,34 @@ __FdoEnumerate(
 
     NeedInvalidate = FALSE;
 
-    ParametersKey = DriverGetParametersKey();
-
-    status = RegistryQueryDwordValue(ParametersKey,
-                                     "Enumerate",
-                                     &Enumerate);
-    if (!NT_SUCCESS(status))
-        Enumerate = 1;
-
-    if (Enumerate == 0)
+    if (ParametersGetEnumerate() == 0)
         goto done;
 
     __FdoAcquireMutex(Fdo);
 
+    // Generation 0 is never used so that a newly added PDO is not
+    // considered present until a scan has seen its name.
+    Generation = ++Fdo->ScanGeneration;
+    if (Generation == 0)
+        Generation = ++Fdo->ScanGeneration;
+
+    // Stamp every PDO whose name is in the device list. Anything
+    // left in the device list afterwards is new.
+    for (Index = 0; Devices[Index].Buffer != NULL; Index++) {
+        PANSI_STRING    Device = &Devices[Index];
+        PXENCONS_DX     Dx;
+
+        if (Device->Length == 0)
+            continue;
+
+        Dx = FdoLookupPdo(Fdo, Device->Buffer);
+        if (Dx == NULL)
+            continue;
+
+        Dx->Generation = Generation;
+        Device->Length = 0;  // avoid duplication
+    }
+
     ListEntry = Fdo->Dx->ListEntry.Flink;
     while (ListEntry != &Fdo->Dx->ListEntry) {
         PLIST_ENTRY     Next = ListEntry->Flink;
@@ -745,26 +808,9 @@ __FdoEnumerate(
         }
 
         if (PdoGetDevicePnpState(Pdo) != Deleted) {
-            PSTR            Name;
             BOOLEAN         Missing;
 
-            Name = PdoGetName(Pdo);
-            Missing = TRUE;
-
-            // If the PDO already exists and its name is in the device list
-            // then we don't want to remove it.
-            for (Index = 0; Devices[Index].Buffer != NULL; Index++) {
-                PANSI_STRING Device = &Devices[Index];
-
-                if (Device->Length == 0)
-                    continue;
-
-                if (strcmp(Name, Device->Buffer) == 0) {
-                    Missing = FALSE;
-                    Device->Length = 0;  // avoid duplication
-                    break;
-                }
-            }
+            Missing = (Dx->Generation != Generation);
 
             if (!PdoIsMissing(Pdo)) {
                 if (PdoIsEjectRequested(Pdo)) {
@@ -796,6 +842,10 @@ __FdoEnumerate(
         if (Device->Length == 0)
             continue;
 
+        // The device list may contain duplicates
+        if (FdoLookupPdo(Fdo, Device->Buffer) != NULL)
+            continue;
+
         status = PdoCreate(Fdo, Device);
         if (NT_SUCCESS(status))
             NeedInvalidate = TRUE;
@@ -809,15 +859,22 @@ done:
     return NeedInvalidate;
 }
 
+// Convert a multi-sz buffer into an upper-cased string list. If Arena
+// is supplied the list is built in it (growing it if necessary) and must
+// not be passed to __FdoFreeAnsi; the arena belongs to the caller.
 static FORCEINLINE PANSI_STRING
 __FdoMultiSzToUpcaseAnsi(
-    _In_ PSTR       Buffer
+    _In_ PSTR               Buffer,
+    _Inout_opt_ PVOID       *Arena,
+    _Inout_opt_ PULONG      ArenaSize
     )
 {
-    PANSI_STRING    Ansi;
-    LONG            Index;
-    LONG            Count;
-    NTSTATUS        status;
+    PANSI_STRING            Ansi;
+    PCHAR                   Data;
+    ULONG                   Size;
+    LONG                    Index;
+    LONG                    Count;
+    NTSTATUS                status;
 
     Index = 0;
     Count = 0;
@@ -835,24 +892,38 @@ __FdoMultiSzToUpcaseAnsi(
         }
     }
 
-    Ansi = __FdoAllocate(sizeof (ANSI_STRING) * (Count + 1));
+    // Index is now the number of bytes, including each terminator
+    Size = StringListSize(Count, Index);
+
+    if (Arena != NULL) {
+        ASSERT(ArenaSize != NULL);
+
+        if (*ArenaSize < Size) {
+            if (*Arena != NULL)
+                __FdoFree(*Arena);
+
+            *Arena = __FdoAllocate(Size);
+            *ArenaSize = (*Arena != NULL) ? Size : 0;
+        }
+
+        Ansi = *Arena;
+    } else {
+        Ansi = __FdoAllocate(Size);
+    }
 
     status = STATUS_NO_MEMORY;
     if (Ansi == NULL)
         goto fail1;
 
+    Data = StringListInitialize(Ansi, Count);
+
     for (Index = 0; Index < Count; Index++) {
         ULONG   Length;
 
         Length = (ULONG)strlen(Buffer);
-        Ansi[Index].MaximumLength = (USHORT)(Length + 1);
-        Ansi[Index].Buffer = __FdoAllocate(Ansi[Index].MaximumLength);
+        Data = StringListAppend(&Ansi[Index], Data, Length + 1);
 
-        status = STATUS_NO_MEMORY;
-        if (Ansi[Index].Buffer == NULL)
-            goto fail2;
-
-        RtlCopyMemory(Ansi[Index].Buffer, Buffer, Length);
+        RtlCopyMemory(Ansi[Index].Buffer, Buffer, Length + 1);
         Ansi[Index].Length = (USHORT)Length;
 
         Buffer += Length + 1;
@@ -860,14 +931,6 @@ __FdoMultiSzToUpcaseAnsi(
 
     return Ansi;
 
-fail2:
-    Error("fail2\n");
-
-    while (--Index >= 0)
-        __FdoFree(Ansi[Index].Buffer);
-
-    __FdoFree(Ansi);
-
 fail1:
     Error("fail1 (%08x)\n", status);
 
@@ -879,11 +942,6 @@ __FdoFreeAnsi(
     _In_ PANSI_STRING   Ansi
     )
 {
-    ULONG               Index;
-
-    for (Index = 0; Ansi[Index].Buffer != NULL; Index++)
-        __FdoFree(Ansi[Index].Buffer);
-
     __FdoFree(Ansi);
 }
 
@@ -895,20 +953,22 @@ FdoScan(
 {
     PXENCONS_FDO        Fdo = Context;
     PKEVENT             Event;
-    HANDLE              ParametersKey;
+    PVOID               Arena;
+    ULONG               ArenaSize;
     NTSTATUS            status;
 
     Trace("====>\n");
 
     Event = ThreadGetEvent(Self);
 
-    ParametersKey = DriverGetParametersKey();
+    // The device list is parsed into a scratch arena that is kept for
+    // the lifetime of the scan thread.
+    Arena = NULL;
+    ArenaSize = 0;
 
     for (;;) {
         PSTR            Buffer;
         PANSI_STRING    Devices;
-        PANSI_STRING    UnsupportedDevices;
-        ULONG           Index;
         BOOLEAN         NeedInvalidate;
 
         Trace("waiting...\n");
@@ -936,7 +996,9 @@ FdoScan(
                               "console",
                               &Buffer);
         if (NT_SUCCESS(status)) {
-            Devices = __FdoMultiSzToUpcaseAnsi(Buffer);
+            Devices = __FdoMultiSzToUpcaseAnsi(Buffer,
+                                               &Arena,
+                                               &ArenaSize);
 
             XENBUS_STORE(Free,
                          &Fdo->StoreInterface,
@@ -948,48 +1010,12 @@ FdoScan(
         if (Devices == NULL)
             goto loop;
 
-        if (ParametersKey != NULL) {
-            status = RegistryQuerySzValue(ParametersKey,
-                                          "UnsupportedDevices",
-                                          NULL,
-                                          &UnsupportedDevices);
-            if (!NT_SUCCESS(status))
-                UnsupportedDevices = NULL;
-        } else {
-            UnsupportedDevices = NULL;
-        }
-
         // NULL out anything in the Devices list that is in the
         // UnsupportedDevices list
-        for (Index = 0; Devices[Index].Buffer != NULL; Index++) {
-            PANSI_STRING    Device = &Devices[Index];
-            ULONG           Entry;
-            BOOLEAN         Supported;
-
-            Supported = TRUE;
-
-            for (Entry = 0;
-                 UnsupportedDevices != NULL && UnsupportedDevices[Entry].Buffer != NULL;
-                 Entry++) {
-                if (strncmp(Device->Buffer,
-                            UnsupportedDevices[Entry].Buffer,
-                            Device->Length) == 0) {
-                    Supported = FALSE;
-                    break;
-                }
-            }
-
-            if (!Supported)
-                Device->Length = 0;
-        }
-
-        if (UnsupportedDevices != NULL)
-            RegistryFreeSzValue(UnsupportedDevices);
+        ParametersFilterUnsupportedDevices(Devices);
 
         NeedInvalidate = __FdoEnumerate(Fdo, Devices);
 
-        __FdoFreeAnsi(Devices);
-
         if (NeedInvalidate) {
             NeedInvalidate = FALSE;
             IoInvalidateDeviceRelations(__FdoGetPhysicalDeviceObject(Fdo),
@@ -1000,6 +1026,9 @@ FdoScan(
         KeSetEvent(&Fdo->ScanEvent, IO_NO_INCREMENT, FALSE);
     }
 
+    if (Arena != NULL)
+        __FdoFree(Arena);
+
     KeSetEvent(&Fdo->ScanEvent, IO_NO_INCREMENT, FALSE);
 
     Trace("<====\n");
@@ -1085,7 +1114,7 @@ FdoClearDistribution(
                           "drivers",
                           &Buffer);
     if (NT_SUCCESS(status)) {
-        Distributions = __FdoMultiSzToUpcaseAnsi(Buffer);
+        Distributions = __FdoMultiSzToUpcaseAnsi(Buffer, NULL, NULL);
 
         XENBUS_STORE(Free,
                      &Fdo->StoreInterface,
@@ -1288,6 +1317,29 @@ __FdoD0ToD3(
     Trace("<====\n");
 }
 
+static DECLSPEC_NOINLINE VOID
+FdoDebugCallback(
+    _In_ PVOID      Argument,
+    _In_ BOOLEAN    Crashing
+    )
+{
+    PXENCONS_FDO    Fdo = Argument;
+    ULONG           Loads;
+
+    UNREFERENCED_PARAMETER(Crashing);
+
+    ParametersGetStatistics(&Loads);
+
+    XENBUS_DEBUG(Printf,
+                 &Fdo->DebugInterface,
+                 "PARAMETERS: LOADS %u\n",
+                 Loads);
+    XENBUS_DEBUG(Printf,
+                 &Fdo->DebugInterface,
+                 "SCAN GENERATION: %u\n",
+                 Fdo->ScanGeneration);
+}
+
 static DECLSPEC_NOINLINE VOID
 FdoSuspendCallbackLate(
     _In_ PVOID      Argument
@@ -1328,10 +1380,23 @@ FdoD3ToD0(
     if (!NT_SUCCESS(status))
         goto fail2;
 
-    status = __FdoD3ToD0(Fdo);
+    status = XENBUS_DEBUG(Acquire, &Fdo->DebugInterface);
     if (!NT_SUCCESS(status))
         goto fail3;
 
+    status = XENBUS_DEBUG(Register,
+                          &Fdo->DebugInterface,
+                          __MODULE__ "|FDO",
+                          FdoDebugCallback,
+                          Fdo,
+                          &Fdo->DebugCallback);
+    if (!NT_SUCCESS(status))
+        goto fail4;
+
+    status = __FdoD3ToD0(Fdo);
+    if (!NT_SUCCESS(status))
+        goto fail5;
+
     status = XENBUS_SUSPEND(Register,
                             &Fdo->SuspendInterface,
                             SUSPEND_CALLBACK_LATE,
@@ -1339,7 +1404,7 @@ FdoD3ToD0(
                             Fdo,
                             &Fdo->SuspendCallbackLate);
     if (!NT_SUCCESS(status))
-        goto fail4;
+        goto fail6;
 
     KeLowerIrql(Irql);
 
@@ -1370,10 +1435,23 @@ FdoD3ToD0(
 
     return STATUS_SUCCESS;
 
+fail6:
+    Error("fail6\n");
+
+    __FdoD0ToD3(Fdo);
+
+fail5:
+    Error("fail5\n");
+
+    XENBUS_DEBUG(Deregister,
+                 &Fdo->DebugInterface,
+                 Fdo->DebugCallback);
+    Fdo->DebugCallback = NULL;
+
 fail4:
     Error("fail4\n");
 
-    __FdoD0ToD3(Fdo);
+    XENBUS_DEBUG(Release, &Fdo->DebugInterface);
 
 fail3:
     Error("fail3\n");
@@ -1443,6 +1521,13 @@ FdoD0ToD3(
 
     __FdoD0ToD3(Fdo);
 
+    XENBUS_DEBUG(Deregister,
+                 &Fdo->DebugInterface,
+                 Fdo->DebugCallback);
+    Fdo->DebugCallback = NULL;
+
+    XENBUS_DEBUG(Release, &Fdo->DebugInterface);
+
     XENBUS_STORE(Release, &Fdo->StoreInterface);
 
     XENBUS_SUSPEND(Release, &Fdo->SuspendInterface);
@@ -2961,6 +3046,7 @@ FdoCreate(
     PXENCONS_DX             Dx;
     PXENCONS_FDO            Fdo;
     USHORT                  DeviceID;
+    ULONG                   Index;
     NTSTATUS                status;
 
 #pragma prefast(suppress:28197) // Possibly leaking memory 'FunctionDeviceObject'
@@ -3077,6 +3163,8 @@ FdoCreate(
 
     InitializeMutex(&Fdo->Mutex);
     InitializeListHead(&Dx->ListEntry);
+    for (Index = 0; Index < FDO_PDO_HASH_SIZE; Index++)
+        InitializeListHead(&Fdo->PdoHash[Index]);
     Fdo->References = 1;
 
     Info("%p (%s)\n",
@@ -3097,6 +3185,7 @@ fail15:
 
     RtlZeroMemory(&Fdo->Mutex, sizeof(MUTEX));
     RtlZeroMemory(&Dx->ListEntry, sizeof(LIST_ENTRY));
+    RtlZeroMemory(Fdo->PdoHash, sizeof(Fdo->PdoHash));
     Fdo->References = 0;
 
     RtlZeroMemory(&Fdo->GnttabInterface,
@@ -3201,6 +3290,8 @@ FdoDestroy(
          __FdoGetName(Fdo));
 
     RtlZeroMemory(&Fdo->Mutex, sizeof(MUTEX));
+    RtlZeroMemory(Fdo->PdoHash, sizeof(Fdo->PdoHash));
+    Fdo->ScanGeneration = 0;
 
     Dx->Fdo = NULL;
 
@@ -46,7 +46,9 @@
 #include "driver.h"
 #include "frontend.h"
 #include "ring.h"
+#include "negotiate.h"
 #include "thread.h"
+#include "mutex.h"
 #include "dbg_print.h"
 #include "assert.h"
 #include "util.h"
@@ -68,6 +70,12 @@ struct _XENCONS_FRONTEND {
     PSTR                        Path;
     FRONTEND_STATE              State;
     KSPIN_LOCK                  Lock;
+    PXENCONS_THREAD             StateThread;
+    MUTEX                       StateMutex;
+    KSPIN_LOCK                  StateLock;
+    FRONTEND_STATE              Requested;      // Protected by StateLock
+    NTSTATUS                    StateStatus;    // Protected by StateLock
+    KEVENT                      StateEvent;
     PXENCONS_THREAD             EjectThread;
     KEVENT                      EjectEvent;
     BOOLEAN                     Online;
@@ -86,6 +94,11 @@ struct _XENCONS_FRONTEND {
     PXENBUS_STORE_WATCH         Watch;
 
     PXENCONS_RING               Ring;
+
+    ULONG                       PrepareTime;
+    ULONG                       ConnectTime;
+    ULONG                       CloseTime;
+    ULONG                       BackendWaits;
 };
 
 static PCSTR
@@ -270,8 +283,6 @@ FrontendEject(
     Event = ThreadGetEvent(Self);
 
     for (;;) {
-        KIRQL       Irql;
-
         KeWaitForSingleObject(Event,
                               Executive,
                               KernelMode,
@@ -282,7 +293,9 @@ FrontendEject(
         if (ThreadIsAlerted(Self))
             break;
 
-        KeAcquireSpinLock(&Frontend->Lock, &Irql);
+        // State transitions may sleep, so the state is only stable
+        // under the state mutex
+        AcquireMutex(&Frontend->StateMutex);
 
         // It is not safe to use interfaces before this point
         if (Frontend->State == FRONTEND_UNKNOWN ||
@@ -296,7 +309,7 @@ FrontendEject(
             PdoRequestEject(__FrontendGetPdo(Frontend));
 
     loop:
-        KeReleaseSpinLock(&Frontend->Lock, Irql);
+        ReleaseMutex(&Frontend->StateMutex);
 
         KeSetEvent(&Frontend->EjectEvent, IO_NO_INCREMENT, FALSE);
     }
@@ -416,7 +429,25 @@ FrontendSetXenbusState(
           XenbusStateName(State));
 }
 
-static VOID
+static FORCEINLINE ULONG
+__FrontendElapsed(
+    _In_ PLARGE_INTEGER Start
+    )
+{
+    LARGE_INTEGER       Now;
+
+    KeQuerySystemTime(&Now);
+
+    return (ULONG)((Now.QuadPart - Start->QuadPart) / 10000ull);
+}
+
+#define FRONTEND_BACKEND_TIMEOUT    120000  // ms
+#define FRONTEND_BACKEND_POLL       100     // ms, only without a watch
+
+// Park on the backend's state watch until the state differs from
+// *State. This only ever runs on the state thread, so it can sleep for
+// as long as the backend takes without holding up anything else.
+static NTSTATUS
 FrontendWaitForBackendXenbusStateChange(
     _In_     PXENCONS_FRONTEND  Frontend,
     _Inout_  XenbusState        *State
@@ -425,8 +456,6 @@ FrontendWaitForBackendXenbusStateChange(
     KEVENT                      Event;
     PXENBUS_STORE_WATCH         Watch;
     LARGE_INTEGER               Start;
-    ULONGLONG                   TimeDelta;
-    LARGE_INTEGER               Timeout;
     XenbusState                 Old = *State;
     NTSTATUS                    status;
 
@@ -434,10 +463,15 @@ FrontendWaitForBackendXenbusStateChange(
           __FrontendGetBackendPath(Frontend),
           XenbusStateName(*State));
 
+    ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
     ASSERT(FrontendIsOnline(Frontend));
 
+    Frontend->BackendWaits++;
+
     KeInitializeEvent(&Event, NotificationEvent, FALSE);
 
+    // The watch is in place before the first read, so no change can
+    // be missed between reading the state and parking
     status = XENBUS_STORE(WatchAdd,
                           &Frontend->StoreInterface,
                           __FrontendGetBackendPath(Frontend),
@@ -448,36 +482,12 @@ FrontendWaitForBackendXenbusStateChange(
         Watch = NULL;
 
     KeQuerySystemTime(&Start);
-    TimeDelta = 0;
 
-    Timeout.QuadPart = 0;
-
-    while (*State == Old && TimeDelta < 120000) {
+    for (;;) {
         PSTR            Buffer;
-        LARGE_INTEGER   Now;
-
-        if (Watch != NULL) {
-            ULONG   Attempt = 0;
-
-            while (++Attempt < 1000) {
-                status = KeWaitForSingleObject(&Event,
-                                               Executive,
-                                               KernelMode,
-                                               FALSE,
-                                               &Timeout);
-                if (status != STATUS_TIMEOUT)
-                    break;
-
-                // We are waiting for a watch event at DISPATCH_LEVEL so
-                // it is our responsibility to poll the store ring.
-                XENBUS_STORE(Poll,
-                             &Frontend->StoreInterface);
-
-                KeStallExecutionProcessor(1000);   // 1ms
-            }
-
-            KeClearEvent(&Event);
-        }
+        ULONG           TimeDelta;
+        ULONG           Remaining;
+        LARGE_INTEGER   Timeout;
 
         status = XENBUS_STORE(Read,
                               &Frontend->StoreInterface,
@@ -495,9 +505,25 @@ FrontendWaitForBackendXenbusStateChange(
                          Buffer);
         }
 
-        KeQuerySystemTime(&Now);
+        if (*State != Old)
+            break;
+
+        TimeDelta = __FrontendElapsed(&Start);
+        if (TimeDelta >= FRONTEND_BACKEND_TIMEOUT)
+            break;
+
+        Remaining = FRONTEND_BACKEND_TIMEOUT - TimeDelta;
+        if (Watch == NULL)
+            Remaining = __min(Remaining, FRONTEND_BACKEND_POLL);
 
-        TimeDelta = (Now.QuadPart - Start.QuadPart) / 10000ull;
+        Timeout.QuadPart = -10000ll * Remaining;
+
+        (VOID) KeWaitForSingleObject(&Event,
+                                     Executive,
+                                     KernelMode,
+                                     FALSE,
+                                     &Timeout);
+        KeClearEvent(&Event);
     }
 
     if (Watch != NULL)
@@ -508,6 +534,50 @@ FrontendWaitForBackendXenbusStateChange(
     Trace("%s: <==== (%s)\n",
           __FrontendGetBackendPath(Frontend),
           XenbusStateName(*State));
+
+    return (*State != Old) ? STATUS_SUCCESS : STATUS_IO_TIMEOUT;
+}
+
+// Run one phase of the handshake (see negotiate.h) to completion
+static NTSTATUS
+FrontendNegotiate(
+    _In_ PXENCONS_FRONTEND  Frontend,
+    _In_ NEGOTIATE_PHASE    Phase
+    )
+{
+    XenbusState             State;
+
+    State = XenbusStateUnknown;
+    for (;;) {
+        NEGOTIATE_RESULT    Result;
+        XenbusState         Next;
+        NTSTATUS            status;
+
+        if (!FrontendIsOnline(Frontend))
+            return STATUS_UNSUCCESSFUL;
+
+        status = FrontendWaitForBackendXenbusStateChange(Frontend,
+                                                         &State);
+        if (!NT_SUCCESS(status))
+            return status;
+
+        Result = NegotiateStep(Phase, State, &Next);
+
+        if (Next != XenbusStateUnknown)
+            FrontendSetXenbusState(Frontend, Next);
+
+        switch (Result) {
+        case NEGOTIATE_DONE:
+            return STATUS_SUCCESS;
+
+        case NEGOTIATE_FAIL:
+            FrontendSetOffline(Frontend);
+            return STATUS_UNSUCCESSFUL;
+
+        default:
+            break;
+        }
+    }
 }
 
 static NTSTATUS
@@ -581,42 +651,28 @@ FrontendClose(
     _In_ PXENCONS_FRONTEND  Frontend
     )
 {
-    XenbusState             State;
+    LARGE_INTEGER           Start;
 
     Trace("====>\n");
 
+    KeQuerySystemTime(&Start);
+
     ASSERT(Frontend->Watch != NULL);
     (VOID)XENBUS_STORE(WatchRemove,
                        &Frontend->StoreInterface,
                        Frontend->Watch);
     Frontend->Watch = NULL;
 
-    State = XenbusStateUnknown;
-    while (State != XenbusStateClosed) {
-        if (!FrontendIsOnline(Frontend))
-            break;
-
-        FrontendWaitForBackendXenbusStateChange(Frontend,
-                                                &State);
-
-        switch (State) {
-        case XenbusStateClosing:
-            FrontendSetXenbusState(Frontend,
-                                    XenbusStateClosed);
-            break;
-        case XenbusStateClosed:
-            break;
-        default:
-            FrontendSetXenbusState(Frontend,
-                                   XenbusStateClosing);
-            break;
-        }
-    }
+    // A backend that never gets to Closed is given up on after the
+    // timeout; there is nothing else to be done with it
+    (VOID) FrontendNegotiate(Frontend, NEGOTIATE_CLOSE);
 
     FrontendReleaseBackend(Frontend);
 
     XENBUS_STORE(Release, &Frontend->StoreInterface);
 
+    Frontend->CloseTime = __FrontendElapsed(&Start);
+
     Trace("<====\n");
 }
 
@@ -625,11 +681,13 @@ FrontendPrepare(
     _In_ PXENCONS_FRONTEND  Frontend
     )
 {
-    XenbusState             State;
     NTSTATUS                status;
+    LARGE_INTEGER           Start;
 
     Trace("====>\n");
 
+    KeQuerySystemTime(&Start);
+
     status = XENBUS_STORE(Acquire, &Frontend->StoreInterface);
     if (!NT_SUCCESS(status))
         goto fail1;
@@ -640,35 +698,8 @@ FrontendPrepare(
     if (!NT_SUCCESS(status))
         goto fail2;
 
-    State = XenbusStateUnknown;
-    while (State != XenbusStateInitWait) {
-        if (!FrontendIsOnline(Frontend))
-            break;
-
-        FrontendWaitForBackendXenbusStateChange(Frontend,
-                                                &State);
-        switch (State) {
-        case XenbusStateInitWait:
-            break;
-        case XenbusStateClosed:
-            FrontendSetXenbusState(Frontend,
-                                   XenbusStateClosed);
-            // There is currently a bug in the backend.
-            // Once the backend reaches Closed, it will crash the
-            // frontend attempts to make any state transition.
-            // Avoid the bug by forcing the frontend offline and
-            // failing FrontendPrepare
-            FrontendSetOffline(Frontend);
-            break;
-        default:
-            FrontendSetXenbusState(Frontend,
-                                    XenbusStateInitialising);
-            break;
-        }
-    }
-
-    status = STATUS_UNSUCCESSFUL;
-    if (State != XenbusStateInitWait)
+    status = FrontendNegotiate(Frontend, NEGOTIATE_PREPARE);
+    if (!NT_SUCCESS(status))
         goto fail3;
 
     status = XENBUS_STORE(WatchAdd,
@@ -680,6 +711,8 @@ FrontendPrepare(
     if (!NT_SUCCESS(status))
         goto fail4;
 
+    Frontend->PrepareTime = __FrontendElapsed(&Start);
+
     Trace("<====\n");
     return STATUS_SUCCESS;
 
@@ -726,6 +759,16 @@ FrontendDebugCallback(
                  &Frontend->DebugInterface,
                  "PROTOCOL: %s\n",
                  Frontend->Protocol);
+    XENBUS_DEBUG(Printf,
+                 &Frontend->DebugInterface,
+                 "TIMINGS: PREPARE %ums CONNECT %ums CLOSE %ums\n",
+                 Frontend->PrepareTime,
+                 Frontend->ConnectTime,
+                 Frontend->CloseTime);
+    XENBUS_DEBUG(Printf,
+                 &Frontend->DebugInterface,
+                 "BACKEND WAITS: %u\n",
+                 Frontend->BackendWaits);
 }
 
 static NTSTATUS
@@ -733,14 +776,16 @@ FrontendConnect(
     _In_ PXENCONS_FRONTEND  Frontend
     )
 {
-    XenbusState             State;
     ULONG                   Attempt;
     PSTR                    Buffer;
     ULONG                   Length;
     NTSTATUS                status;
+    LARGE_INTEGER           Start;
 
     Trace("====>\n");
 
+    KeQuerySystemTime(&Start);
+
     status = XENBUS_DEBUG(Acquire, &Frontend->DebugInterface);
     if (!NT_SUCCESS(status))
         goto fail1;
@@ -793,33 +838,8 @@ FrontendConnect(
     if (!NT_SUCCESS(status))
         goto fail4;
 
-    State = XenbusStateUnknown;
-    while (State != XenbusStateConnected) {
-        if (!FrontendIsOnline(Frontend))
-            break;
-
-        FrontendWaitForBackendXenbusStateChange(Frontend,
-                                                &State);
-
-        switch (State) {
-        case XenbusStateInitWait:
-            FrontendSetXenbusState(Frontend,
-                                   XenbusStateConnected);
-            break;
-        case XenbusStateConnected:
-            break;
-        case XenbusStateUnknown:
-        case XenbusStateClosing:
-        case XenbusStateClosed:
-            FrontendSetOffline(Frontend);
-            break;
-        default:
-            break;
-        }
-    }
-
-    status = STATUS_UNSUCCESSFUL;
-    if (State != XenbusStateConnected)
+    status = FrontendNegotiate(Frontend, NEGOTIATE_CONNECT);
+    if (!NT_SUCCESS(status))
         goto fail5;
 
     status = XENBUS_STORE(Read,
@@ -858,6 +878,8 @@ FrontendConnect(
                      Buffer);
     }
 
+    Frontend->ConnectTime = __FrontendElapsed(&Start);
+
     Trace("<====\n");
     return STATUS_SUCCESS;
 
@@ -949,15 +971,14 @@ FrontendDisable(
 }
 
 static NTSTATUS
-FrontendSetState(
+__FrontendSetState(
     _In_ PXENCONS_FRONTEND  Frontend,
     _In_ FRONTEND_STATE     State
     )
 {
     BOOLEAN                 Failed;
-    KIRQL                   Irql;
 
-    KeAcquireSpinLock(&Frontend->Lock, &Irql);
+    ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
 
     Info("%s: ====> '%s' -> '%s'\n",
             __FrontendGetPath(Frontend),
@@ -1095,13 +1116,118 @@ FrontendSetState(
                 FrontendStateName(Frontend->State));
     }
 
-    KeReleaseSpinLock(&Frontend->Lock, Irql);
-
     Info("%s: <=====\n", __FrontendGetPath(Frontend));
 
     return (!Failed) ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
 }
 
+// Transitions wait on the backend, so they are run on the state thread
+// at PASSIVE_LEVEL. Callers at DISPATCH_LEVEL (e.g. the suspend
+// callback) can only request a state; callers at PASSIVE_LEVEL then
+// wait for the thread to get there.
+static DECLSPEC_NOINLINE NTSTATUS
+FrontendStateWorker(
+    _In_ PXENCONS_THREAD    Self,
+    _In_ PVOID              Context
+    )
+{
+    PXENCONS_FRONTEND       Frontend = Context;
+    PKEVENT                 Event;
+
+    Trace("%s: ====>\n", __FrontendGetPath(Frontend));
+
+    Event = ThreadGetEvent(Self);
+
+    for (;;) {
+        FRONTEND_STATE  State;
+        KIRQL           Irql;
+        NTSTATUS        status;
+
+        KeWaitForSingleObject(Event,
+                              Executive,
+                              KernelMode,
+                              FALSE,
+                              NULL);
+        KeClearEvent(Event);
+
+        if (ThreadIsAlerted(Self))
+            break;
+
+        KeAcquireSpinLock(&Frontend->StateLock, &Irql);
+        State = Frontend->Requested;
+        KeReleaseSpinLock(&Frontend->StateLock, Irql);
+
+        AcquireMutex(&Frontend->StateMutex);
+        status = __FrontendSetState(Frontend, State);
+        ReleaseMutex(&Frontend->StateMutex);
+
+        // If another state was requested meanwhile the thread has been
+        // woken again and waiters must hang on for that one
+        KeAcquireSpinLock(&Frontend->StateLock, &Irql);
+        if (Frontend->Requested == State) {
+            Frontend->StateStatus = status;
+            KeSetEvent(&Frontend->StateEvent, IO_NO_INCREMENT, FALSE);
+        }
+        KeReleaseSpinLock(&Frontend->StateLock, Irql);
+    }
+
+    Trace("%s: <====\n", __FrontendGetPath(Frontend));
+
+    return STATUS_SUCCESS;
+}
+
+static VOID
+FrontendRequestState(
+    _In_ PXENCONS_FRONTEND  Frontend,
+    _In_ FRONTEND_STATE     State
+    )
+{
+    KIRQL                   Irql;
+
+    ASSERT3U(KeGetCurrentIrql(), <=, DISPATCH_LEVEL);
+
+    KeAcquireSpinLock(&Frontend->StateLock, &Irql);
+    Frontend->Requested = State;
+    KeClearEvent(&Frontend->StateEvent);
+    KeReleaseSpinLock(&Frontend->StateLock, Irql);
+
+    ThreadWake(Frontend->StateThread);
+}
+
+static NTSTATUS
+FrontendWaitForState(
+    _In_ PXENCONS_FRONTEND  Frontend
+    )
+{
+    KIRQL                   Irql;
+    NTSTATUS                status;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
+
+    (VOID) KeWaitForSingleObject(&Frontend->StateEvent,
+                                 Executive,
+                                 KernelMode,
+                                 FALSE,
+                                 NULL);
+
+    KeAcquireSpinLock(&Frontend->StateLock, &Irql);
+    status = Frontend->StateStatus;
+    KeReleaseSpinLock(&Frontend->StateLock, Irql);
+
+    return status;
+}
+
+static NTSTATUS
+FrontendSetState(
+    _In_ PXENCONS_FRONTEND  Frontend,
+    _In_ FRONTEND_STATE     State
+    )
+{
+    FrontendRequestState(Frontend, State);
+
+    return FrontendWaitForState(Frontend);
+}
+
 static FORCEINLINE VOID
 __FrontendResume(
     _In_ PXENCONS_FRONTEND   Frontend
@@ -1122,8 +1248,7 @@ __FrontendSuspend(
 {
     ASSERT3U(KeGetCurrentIrql(), == , DISPATCH_LEVEL);
 
-    UNREFERENCED_PARAMETER(Frontend);
-    (VOID)FrontendSetState(Frontend, FRONTEND_UNKNOWN);
+    FrontendRequestState(Frontend, FRONTEND_UNKNOWN);
 }
 
 static DECLSPEC_NOINLINE VOID
@@ -1193,6 +1318,8 @@ fail1:
 
     KeLowerIrql(Irql);
 
+    (VOID) FrontendWaitForState(Frontend);
+
     return status;
 }
 
@@ -1218,6 +1345,8 @@ FrontendSuspend(
 
     KeLowerIrql(Irql);
 
+    (VOID) FrontendWaitForState(Frontend);
+
     KeClearEvent(&Frontend->EjectEvent);
     ThreadWake(Frontend->EjectThread);
 
@@ -1232,6 +1361,46 @@ FrontendSuspend(
     Trace("<====\n");
 }
 
+static NTSTATUS
+FrontendGetStatistics(
+    _In_ PXENCONS_FRONTEND  Frontend,
+    _In_ PIRP               Irp
+    )
+{
+    PIO_STACK_LOCATION      StackLocation;
+    ULONG                   InputBufferLength;
+    ULONG                   OutputBufferLength;
+    PVOID                   Buffer;
+    NTSTATUS                status;
+
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+    InputBufferLength = StackLocation->Parameters.DeviceIoControl.InputBufferLength;
+    OutputBufferLength = StackLocation->Parameters.DeviceIoControl.OutputBufferLength;
+    Buffer = Irp->AssociatedIrp.SystemBuffer;
+
+    status = STATUS_INVALID_PARAMETER;
+    if (InputBufferLength != 0)
+        goto fail1;
+
+    Irp->IoStatus.Information = sizeof (XENCONS_STATISTICS);
+
+    status = STATUS_INVALID_BUFFER_SIZE;
+    if (OutputBufferLength < sizeof (XENCONS_STATISTICS))
+        goto fail2;
+
+    RingGetStatistics(Frontend->Ring, Buffer);
+
+    return STATUS_SUCCESS;
+
+fail2:
+    Error("fail2\n");
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
 static NTSTATUS
 FrontendGetProperty(
     _In_ PXENCONS_FRONTEND  Frontend,
@@ -1253,6 +1422,24 @@ FrontendGetProperty(
     OutputBufferLength = StackLocation->Parameters.DeviceIoControl.OutputBufferLength;
     Buffer = Irp->AssociatedIrp.SystemBuffer;
 
+    if (IoControlCode == IOCTL_XENCONS_GET_STATISTICS)
+        return FrontendGetStatistics(Frontend, Irp);
+
+    if (IoControlCode == IOCTL_XENCONS_FLUSH)
+        return RingFlush(Frontend->Ring, Irp);
+
+    if (IoControlCode == IOCTL_XENCONS_SET_READ_POLICY)
+        return RingSetReadPolicy(Frontend->Ring, Irp);
+
+    if (IoControlCode == IOCTL_XENCONS_SET_WRITE_MODE)
+        return RingSetWriteMode(Frontend->Ring, Irp);
+
+    if (IoControlCode == IOCTL_XENCONS_MAP_SHARED)
+        return RingMapShared(Frontend->Ring, Irp);
+
+    if (IoControlCode == IOCTL_XENCONS_KICK_SHARED)
+        return RingKickShared(Frontend->Ring, Irp);
+
     switch (IoControlCode) {
     case IOCTL_XENCONS_GET_INSTANCE:
         Value = PdoGetName(Frontend->Pdo);
@@ -1365,6 +1552,8 @@ fail1:
     ASSERT3U(Frontend->References, ==, 0);
     KeReleaseSpinLock(&Frontend->Lock, Irql);
 
+    (VOID) FrontendWaitForState(Frontend);
+
     return status;
 }
 
@@ -1393,6 +1582,9 @@ FrontendAbiRelease(
 done:
     KeReleaseSpinLock(&Frontend->Lock, Irql);
 
+    // Waits for nothing if no state was requested above
+    (VOID) FrontendWaitForState(Frontend);
+
     KeClearEvent(&Frontend->EjectEvent);
     ThreadWake(Frontend->EjectThread);
 
@@ -1530,6 +1722,10 @@ FrontendCreate(
 
     KeInitializeSpinLock(&Frontend->Lock);
 
+    InitializeMutex(&Frontend->StateMutex);
+    KeInitializeSpinLock(&Frontend->StateLock);
+    KeInitializeEvent(&Frontend->StateEvent, NotificationEvent, TRUE);
+
     FdoGetDebugInterface(PdoGetFdo(Pdo), &Frontend->DebugInterface);
     FdoGetSuspendInterface(PdoGetFdo(Pdo), &Frontend->SuspendInterface);
     FdoGetStoreInterface(PdoGetFdo(Pdo), &Frontend->StoreInterface);
@@ -1544,12 +1740,23 @@ FrontendCreate(
     if (!NT_SUCCESS(status))
         goto fail5;
 
+    status = ThreadCreate(FrontendStateWorker, Frontend, &Frontend->StateThread);
+    if (!NT_SUCCESS(status))
+        goto fail6;
+
     *Context = (PVOID)Frontend;
 
     Trace("<====\n");
 
     return STATUS_SUCCESS;
 
+fail6:
+    Error("fail6\n");
+
+    ThreadAlert(Frontend->EjectThread);
+    ThreadJoin(Frontend->EjectThread);
+    Frontend->EjectThread = NULL;
+
 fail5:
     Error("fail5\n");
 
@@ -1572,6 +1779,10 @@ fail4:
 
     Frontend->Online = FALSE;
 
+    RtlZeroMemory(&Frontend->StateEvent, sizeof(KEVENT));
+    RtlZeroMemory(&Frontend->StateLock, sizeof(KSPIN_LOCK));
+    RtlZeroMemory(&Frontend->StateMutex, sizeof(MUTEX));
+
     RtlZeroMemory(&Frontend->Lock, sizeof(KSPIN_LOCK));
 
     Frontend->BackendDomain = 0;
@@ -1619,6 +1830,10 @@ FrontendDestroy(
 
     ASSERT(Frontend->State == FRONTEND_UNKNOWN);
 
+    ThreadAlert(Frontend->StateThread);
+    ThreadJoin(Frontend->StateThread);
+    Frontend->StateThread = NULL;
+
     ThreadAlert(Frontend->EjectThread);
     ThreadJoin(Frontend->EjectThread);
     Frontend->EjectThread = NULL;
@@ -1637,8 +1852,20 @@ FrontendDestroy(
     RtlZeroMemory(&Frontend->DebugInterface,
                   sizeof(XENBUS_DEBUG_INTERFACE));
 
+    Frontend->BackendWaits = 0;
+    Frontend->CloseTime = 0;
+    Frontend->ConnectTime = 0;
+    Frontend->PrepareTime = 0;
+
     Frontend->Online = FALSE;
 
+    Frontend->StateStatus = STATUS_SUCCESS;
+    Frontend->Requested = FRONTEND_UNKNOWN;
+
+    RtlZeroMemory(&Frontend->StateEvent, sizeof(KEVENT));
+    RtlZeroMemory(&Frontend->StateLock, sizeof(KSPIN_LOCK));
+    RtlZeroMemory(&Frontend->StateMutex, sizeof(MUTEX));
+
     RtlZeroMemory(&Frontend->Lock, sizeof(KSPIN_LOCK));
 
     Frontend->BackendDomain = 0;
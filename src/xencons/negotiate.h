@@ -0,0 +1,127 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms,
+* with or without modification, are permitted provided
+* that the following conditions are met:
+*
+* *   Redistributions of source code must retain the above
+*     copyright notice, this list of conditions and the
+*     following disclaimer.
+* *   Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the
+*     following disclaimer in the documentation and/or other
+*     materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+* CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+* INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+* CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+* BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+* INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+* WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+* NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+* SUCH DAMAGE.
+*/
+
+#ifndef _XENCONS_NEGOTIATE_H
+#define _XENCONS_NEGOTIATE_H
+
+#include "ring_compat.h"
+
+// The xenbus handshake, one backend state at a time. Nothing here
+// waits or touches the store: the caller supplies XenbusState (xen.h
+// in the driver), parks until the backend moves and writes whatever
+// state it is told to. That keeps the same steps usable by the host
+// simulation in src/test.
+
+typedef enum _NEGOTIATE_PHASE {
+    NEGOTIATE_PREPARE,  // Until the backend reaches InitWait
+    NEGOTIATE_CONNECT,  // Until the backend reaches Connected
+    NEGOTIATE_CLOSE,    // Until the backend reaches Closed
+    NEGOTIATE_PHASE_COUNT
+} NEGOTIATE_PHASE, *PNEGOTIATE_PHASE;
+
+typedef enum _NEGOTIATE_RESULT {
+    NEGOTIATE_WAIT,     // Wait for the backend to move again
+    NEGOTIATE_DONE,     // The phase is complete
+    NEGOTIATE_FAIL      // The backend has gone; take the frontend offline
+} NEGOTIATE_RESULT, *PNEGOTIATE_RESULT;
+
+// Decide what to do now that the backend is in State. *Next is the
+// state the frontend should write first, or XenbusStateUnknown for
+// none.
+static FORCEINLINE NEGOTIATE_RESULT
+NegotiateStep(
+    _In_ NEGOTIATE_PHASE    Phase,
+    _In_ XenbusState        State,
+    _Out_ XenbusState       *Next
+    )
+{
+    *Next = XenbusStateUnknown;
+
+    switch (Phase) {
+    case NEGOTIATE_PREPARE:
+        switch (State) {
+        case XenbusStateInitWait:
+            return NEGOTIATE_DONE;
+
+        case XenbusStateClosed:
+            // There is currently a bug in the backend. Once it
+            // reaches Closed it will crash the frontend if the
+            // frontend attempts any further state transition, so
+            // follow it to Closed and give up.
+            *Next = XenbusStateClosed;
+            return NEGOTIATE_FAIL;
+
+        default:
+            *Next = XenbusStateInitialising;
+            return NEGOTIATE_WAIT;
+        }
+
+    case NEGOTIATE_CONNECT:
+        switch (State) {
+        case XenbusStateInitWait:
+            *Next = XenbusStateConnected;
+            return NEGOTIATE_WAIT;
+
+        case XenbusStateConnected:
+            return NEGOTIATE_DONE;
+
+        case XenbusStateUnknown:
+        case XenbusStateClosing:
+        case XenbusStateClosed:
+            return NEGOTIATE_FAIL;
+
+        default:
+            return NEGOTIATE_WAIT;
+        }
+
+    case NEGOTIATE_CLOSE:
+        switch (State) {
+        case XenbusStateClosing:
+            *Next = XenbusStateClosed;
+            return NEGOTIATE_WAIT;
+
+        case XenbusStateClosed:
+            return NEGOTIATE_DONE;
+
+        default:
+            *Next = XenbusStateClosing;
+            return NEGOTIATE_WAIT;
+        }
+
+    default:
+        break;
+    }
+
+    return NEGOTIATE_FAIL;
+}
+
+#endif  // _XENCONS_NEGOTIATE_H
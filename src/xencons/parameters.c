@@ -0,0 +1,462 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+// A cache of the values in the driver's Parameters key that are
+// consulted on every device scan. The key is read once up front and
+// then again only when a registry change notification fires. The
+// notification is waited for by a thread of our own, so that teardown
+// can stop it and know that no driver code is left running.
+
+#include <ntddk.h>
+
+#include "parameters.h"
+#include "registry.h"
+#include "string_list.h"
+#include "mutex.h"
+#include "thread.h"
+#include "dbg_print.h"
+#include "assert.h"
+#include "util.h"
+
+#define PARAMETERS_TAG  'MRAP'
+
+#define PARAMETERS_HASH_SIZE    64  // Must be a power of 2
+
+typedef struct _PARAMETERS_SET {
+    PANSI_STRING    Names;
+    ULONG           Head[PARAMETERS_HASH_SIZE];
+    ULONG           Chain[1];
+} PARAMETERS_SET, *PPARAMETERS_SET;
+
+typedef struct _XENCONS_PARAMETERS {
+    HANDLE              Key;
+    MUTEX               Mutex;
+    HANDLE              EventHandle;
+    PKEVENT             Event;
+    IO_STATUS_BLOCK     StatusBlock;
+    PXENCONS_THREAD     Thread;
+
+    ULONG               Enumerate;
+    PPARAMETERS_SET     UnsupportedDevices;
+
+    LONG                Loads;
+} XENCONS_PARAMETERS, *PXENCONS_PARAMETERS;
+
+// Declared in ntifs.h, which nothing else in the driver needs
+NTSYSAPI
+NTSTATUS
+NTAPI
+ZwCreateEvent(
+    _Out_ PHANDLE               EventHandle,
+    _In_ ACCESS_MASK            DesiredAccess,
+    _In_opt_ POBJECT_ATTRIBUTES ObjectAttributes,
+    _In_ EVENT_TYPE             EventType,
+    _In_ BOOLEAN                InitialState
+    );
+
+static XENCONS_PARAMETERS   Parameters;
+
+static FORCEINLINE PVOID
+__ParametersAllocate(
+    _In_ ULONG  Length
+    )
+{
+    return __AllocatePoolWithTag(NonPagedPool, Length, PARAMETERS_TAG);
+}
+
+static FORCEINLINE VOID
+__ParametersFree(
+    _In_ PVOID  Buffer
+    )
+{
+    __FreePoolWithTag(Buffer, PARAMETERS_TAG);
+}
+
+static VOID
+ParametersFreeSet(
+    _In_opt_ PPARAMETERS_SET    Set
+    )
+{
+    if (Set == NULL)
+        return;
+
+    RegistryFreeSzValue(Set->Names);
+    __ParametersFree(Set);
+}
+
+static PPARAMETERS_SET
+ParametersLoadSet(
+    _In_ PSTR           Name
+    )
+{
+    PANSI_STRING        Names;
+    PPARAMETERS_SET     Set;
+    ULONG               Count;
+    ULONG               Index;
+    NTSTATUS            status;
+
+    status = RegistryQuerySzValue(Parameters.Key,
+                                  Name,
+                                  NULL,
+                                  &Names);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    for (Count = 0; Names[Count].Buffer != NULL; Count++)
+        ;
+
+    Set = __ParametersAllocate(FIELD_OFFSET(PARAMETERS_SET, Chain) +
+                               (sizeof (ULONG) * Count));
+
+    status = STATUS_NO_MEMORY;
+    if (Set == NULL)
+        goto fail2;
+
+    Set->Names = Names;
+
+    for (Index = 0; Index < PARAMETERS_HASH_SIZE; Index++)
+        Set->Head[Index] = MAXULONG;
+
+    for (Index = 0; Index < Count; Index++) {
+        PANSI_STRING    Ansi = &Names[Index];
+        ULONG           Offset;
+        ULONG           Hash;
+
+        // Device names are compared upper case
+        for (Offset = 0; Offset < Ansi->Length; Offset++)
+            Ansi->Buffer[Offset] = __toupper(Ansi->Buffer[Offset]);
+
+        Hash = StringListHash(Ansi->Buffer) & (PARAMETERS_HASH_SIZE - 1);
+
+        Set->Chain[Index] = Set->Head[Hash];
+        Set->Head[Hash] = Index;
+    }
+
+    return Set;
+
+fail2:
+    RegistryFreeSzValue(Names);
+
+fail1:
+    return NULL;
+}
+
+static FORCEINLINE BOOLEAN
+__ParametersSetContains(
+    _In_ PPARAMETERS_SET    Set,
+    _In_ PCSTR              Name
+    )
+{
+    ULONG                   Entry;
+
+    for (Entry = Set->Head[StringListHash(Name) & (PARAMETERS_HASH_SIZE - 1)];
+         Entry != MAXULONG;
+         Entry = Set->Chain[Entry]) {
+        if (strcmp(Name, Set->Names[Entry].Buffer) == 0)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+// Must be called with the mutex held
+static VOID
+ParametersLoad(
+    VOID
+    )
+{
+    ULONG               Enumerate;
+    NTSTATUS            status;
+
+    status = RegistryQueryDwordValue(Parameters.Key,
+                                     "Enumerate",
+                                     &Enumerate);
+    if (!NT_SUCCESS(status))
+        Enumerate = 1;
+
+    Parameters.Enumerate = Enumerate;
+
+    ParametersFreeSet(Parameters.UnsupportedDevices);
+    Parameters.UnsupportedDevices = ParametersLoadSet("UnsupportedDevices");
+
+    InterlockedIncrement(&Parameters.Loads);
+
+    Info("ENUMERATE %u UNSUPPORTED DEVICES %s\n",
+         Parameters.Enumerate,
+         (Parameters.UnsupportedDevices != NULL) ? "SET" : "NONE");
+}
+
+// The event is signalled when the key (or one of its values) changes,
+// or when the key is closed.
+static NTSTATUS
+ParametersArm(
+    VOID
+    )
+{
+    NTSTATUS            status;
+
+    status = ZwNotifyChangeKey(Parameters.Key,
+                               Parameters.EventHandle,
+                               NULL,
+                               NULL,
+                               &Parameters.StatusBlock,
+                               REG_NOTIFY_CHANGE_LAST_SET,
+                               FALSE,
+                               NULL,
+                               0,
+                               TRUE);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static NTSTATUS
+ParametersWorker(
+    _In_ PXENCONS_THREAD    Self,
+    _In_ PVOID              Context
+    )
+{
+    PVOID                   Objects[2];
+    BOOLEAN                 Armed;
+
+    UNREFERENCED_PARAMETER(Context);
+
+    Trace("====>\n");
+
+    Objects[0] = ThreadGetEvent(Self);
+    Objects[1] = Parameters.Event;
+
+    // Without a notification the cache simply keeps the values it has
+    Armed = NT_SUCCESS(ParametersArm());
+
+    for (;;) {
+        NTSTATUS    status;
+
+        status = KeWaitForMultipleObjects(Armed ? 2 : 1,
+                                          Objects,
+                                          WaitAny,
+                                          Executive,
+                                          KernelMode,
+                                          FALSE,
+                                          NULL,
+                                          NULL);
+        KeClearEvent(Objects[0]);
+
+        if (ThreadIsAlerted(Self))
+            break;
+
+        if (status != STATUS_WAIT_1)
+            continue;
+
+        AcquireMutex(&Parameters.Mutex);
+        ParametersLoad();
+        ReleaseMutex(&Parameters.Mutex);
+
+        // A notification only fires once
+        Armed = NT_SUCCESS(ParametersArm());
+    }
+
+    Trace("<====\n");
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+ParametersInitialize(
+    _In_ HANDLE ServiceKey
+    )
+{
+    OBJECT_ATTRIBUTES   Attributes;
+    NTSTATUS            status;
+
+    ASSERT(IsZeroMemory(&Parameters, sizeof (XENCONS_PARAMETERS)));
+
+    // Open a handle of our own so that closing it only cancels
+    // our notification.
+    status = RegistryOpenSubKey(ServiceKey,
+                                "Parameters",
+                                KEY_READ,
+                                &Parameters.Key);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    InitializeMutex(&Parameters.Mutex);
+
+    InitializeObjectAttributes(&Attributes,
+                               NULL,
+                               OBJ_KERNEL_HANDLE,
+                               NULL,
+                               NULL);
+
+    status = ZwCreateEvent(&Parameters.EventHandle,
+                           EVENT_ALL_ACCESS,
+                           &Attributes,
+                           SynchronizationEvent,
+                           FALSE);
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+    status = ObReferenceObjectByHandle(Parameters.EventHandle,
+                                       EVENT_ALL_ACCESS,
+                                       *ExEventObjectType,
+                                       KernelMode,
+                                       (PVOID *)&Parameters.Event,
+                                       NULL);
+    if (!NT_SUCCESS(status))
+        goto fail3;
+
+    AcquireMutex(&Parameters.Mutex);
+    ParametersLoad();
+    ReleaseMutex(&Parameters.Mutex);
+
+    status = ThreadCreate(ParametersWorker,
+                          NULL,
+                          &Parameters.Thread);
+    if (!NT_SUCCESS(status))
+        goto fail4;
+
+    return STATUS_SUCCESS;
+
+fail4:
+    Error("fail4\n");
+
+    ParametersFreeSet(Parameters.UnsupportedDevices);
+    Parameters.UnsupportedDevices = NULL;
+
+    Parameters.Enumerate = 0;
+    Parameters.Loads = 0;
+
+    ObDereferenceObject(Parameters.Event);
+    Parameters.Event = NULL;
+
+fail3:
+    Error("fail3\n");
+
+    ZwClose(Parameters.EventHandle);
+    Parameters.EventHandle = NULL;
+
+fail2:
+    Error("fail2\n");
+
+    RtlZeroMemory(&Parameters.Mutex, sizeof (MUTEX));
+
+    RegistryCloseKey(Parameters.Key);
+    Parameters.Key = NULL;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    ASSERT(IsZeroMemory(&Parameters, sizeof (XENCONS_PARAMETERS)));
+
+    return status;
+}
+
+VOID
+ParametersTeardown(
+    VOID
+    )
+{
+    // Once the thread has gone nothing else uses the key or the event
+    ThreadAlert(Parameters.Thread);
+    ThreadJoin(Parameters.Thread);
+    Parameters.Thread = NULL;
+
+    // Closing the key cleans up any notification still armed
+    RegistryCloseKey(Parameters.Key);
+    Parameters.Key = NULL;
+
+    ObDereferenceObject(Parameters.Event);
+    Parameters.Event = NULL;
+
+    ZwClose(Parameters.EventHandle);
+    Parameters.EventHandle = NULL;
+
+    ParametersFreeSet(Parameters.UnsupportedDevices);
+    Parameters.UnsupportedDevices = NULL;
+
+    Parameters.Enumerate = 0;
+    Parameters.Loads = 0;
+
+    RtlZeroMemory(&Parameters.StatusBlock, sizeof (IO_STATUS_BLOCK));
+    RtlZeroMemory(&Parameters.Mutex, sizeof (MUTEX));
+
+    ASSERT(IsZeroMemory(&Parameters, sizeof (XENCONS_PARAMETERS)));
+}
+
+ULONG
+ParametersGetEnumerate(
+    VOID
+    )
+{
+    return Parameters.Enumerate;
+}
+
+VOID
+ParametersFilterUnsupportedDevices(
+    _In_ PANSI_STRING   Devices
+    )
+{
+    ULONG               Index;
+
+    AcquireMutex(&Parameters.Mutex);
+
+    if (Parameters.UnsupportedDevices == NULL)
+        goto done;
+
+    for (Index = 0; Devices[Index].Buffer != NULL; Index++) {
+        PANSI_STRING    Device = &Devices[Index];
+
+        if (Device->Length == 0)
+            continue;
+
+        if (__ParametersSetContains(Parameters.UnsupportedDevices,
+                                    Device->Buffer))
+            Device->Length = 0;
+    }
+
+done:
+    ReleaseMutex(&Parameters.Mutex);
+}
+
+VOID
+ParametersGetStatistics(
+    _Out_ PULONG    Loads
+    )
+{
+    *Loads = (ULONG)Parameters.Loads;
+}
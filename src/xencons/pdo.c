@@ -50,6 +50,7 @@
 #include "console.h"
 #include "frontend.h"
 #include "thread.h"
+#include "registry.h"
 #include "dbg_print.h"
 #include "assert.h"
 #include "util.h"
@@ -1901,6 +1902,29 @@ PdoSuspend(
     Trace("(%s) <====\n", __PdoGetName(Pdo));
 }
 
+// Read and write buffers are copied through the I/O manager by default.
+// Setting DirectIo makes it lock the caller's pages instead, so data
+// is copied straight between them and the console.
+static FORCEINLINE ULONG
+__PdoGetBufferMethod(
+    VOID
+    )
+{
+    HANDLE      ParametersKey;
+    ULONG       DirectIo;
+    NTSTATUS    status;
+
+    ParametersKey = DriverGetParametersKey();
+
+    status = RegistryQueryDwordValue(ParametersKey,
+                                     "DirectIo",
+                                     &DirectIo);
+    if (!NT_SUCCESS(status))
+        DirectIo = 0;
+
+    return (DirectIo != 0) ? DO_DIRECT_IO : DO_BUFFERED_IO;
+}
+
 NTSTATUS
 PdoCreate(
     _In_ PXENCONS_FDO       Fdo,
@@ -1982,7 +2006,7 @@ PdoCreate(
          PhysicalDeviceObject,
          __PdoGetName(Pdo));
 
-    PhysicalDeviceObject->Flags |= DO_BUFFERED_IO;
+    PhysicalDeviceObject->Flags |= __PdoGetBufferMethod();
     PhysicalDeviceObject->Flags &= ~DO_DEVICE_INITIALIZING;
     return STATUS_SUCCESS;
 
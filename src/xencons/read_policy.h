@@ -0,0 +1,85 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms,
+* with or without modification, are permitted provided
+* that the following conditions are met:
+*
+* *   Redistributions of source code must retain the above
+*     copyright notice, this list of conditions and the
+*     following disclaimer.
+* *   Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the
+*     following disclaimer in the documentation and/or other
+*     materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+* CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+* INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+* CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+* BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+* INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+* WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+* NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+* SUCH DAMAGE.
+*/
+
+#ifndef _XENCONS_READ_POLICY_H
+#define _XENCONS_READ_POLICY_H
+
+#include <ntddk.h>
+#include <string.h>
+#include <xencons_device.h>
+
+static const XENCONS_READ_POLICY    ReadPolicyDefault = { 0, 0, 0 };
+
+#define XENCONS_READ_POLICY_FLAGS   XENCONS_READ_POLICY_LINE
+
+static FORCEINLINE BOOLEAN
+ReadPolicyIsValid(
+    _In_ const XENCONS_READ_POLICY  *Policy
+    )
+{
+    return ((Policy->Flags & ~XENCONS_READ_POLICY_FLAGS) == 0) ? TRUE : FALSE;
+}
+
+// Decide whether a read should be completed now that Count more bytes
+// (at Data) have been copied into it, bringing it to Total of Length.
+static FORCEINLINE BOOLEAN
+ReadPolicyIsComplete(
+    _In_ const XENCONS_READ_POLICY  *Policy,
+    _In_ PCHAR                      Data,
+    _In_ ULONG                      Count,
+    _In_ ULONG                      Total,
+    _In_ ULONG                      Length,
+    _In_ BOOLEAN                    TimedOut
+    )
+{
+    ULONG                           Threshold;
+
+    if (Total == Length)
+        return TRUE;
+
+    if (TimedOut && Total != 0)
+        return TRUE;
+
+    if (Policy->Flags & XENCONS_READ_POLICY_LINE) {
+        if (memchr(Data, '\r', Count) != NULL ||
+            memchr(Data, '\n', Count) != NULL)
+            return TRUE;
+
+        Threshold = Policy->MinimumBytes;
+    } else {
+        Threshold = __max(Policy->MinimumBytes, 1);
+    }
+
+    return (Threshold != 0 && Total >= Threshold) ? TRUE : FALSE;
+}
+
+#endif  // _XENCONS_READ_POLICY_H
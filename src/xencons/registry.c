@@ -33,6 +33,7 @@
 #include <ntddk.h>
 
 #include "registry.h"
+#include "string_list.h"
 #include "assert.h"
 #include "util.h"
 
@@ -985,23 +986,21 @@ RegistrySzToAnsi(
     )
 {
     PANSI_STRING    Ansi;
+    PCHAR           Data;
     ULONG           Length;
     UNICODE_STRING  Unicode;
     NTSTATUS        status;
 
-    Ansi = __RegistryAllocate(sizeof (ANSI_STRING) * 2);
+    Length = (ULONG)wcslen(Buffer);
+
+    Ansi = __RegistryAllocate(StringListSize(1, (Length + 1) * sizeof (CHAR)));
 
     status = STATUS_NO_MEMORY;
     if (Ansi == NULL)
         goto fail1;
 
-    Length = (ULONG)wcslen(Buffer);
-    Ansi[0].MaximumLength = (USHORT)(Length + 1) * sizeof (CHAR);
-    Ansi[0].Buffer = __RegistryAllocate(Ansi[0].MaximumLength);
-
-    status = STATUS_NO_MEMORY;
-    if (Ansi[0].Buffer == NULL)
-        goto fail2;
+    Data = StringListInitialize(Ansi, 1);
+    (VOID) StringListAppend(&Ansi[0], Data, (Length + 1) * sizeof (CHAR));
 
     RtlInitUnicodeString(&Unicode, Buffer);
     status = RtlUnicodeStringToAnsiString(&Ansi[0], &Unicode, FALSE);
@@ -1011,9 +1010,6 @@ RegistrySzToAnsi(
 
     return Ansi;
 
-fail2:
-    __RegistryFree(Ansi);
-
 fail1:
     return NULL;
 }
@@ -1024,6 +1020,7 @@ RegistryMultiSzToAnsi(
     )
 {
     PANSI_STRING    Ansi;
+    PCHAR           Data;
     LONG            Index;
     LONG            Count;
     NTSTATUS        status;
@@ -1041,23 +1038,23 @@ RegistryMultiSzToAnsi(
         Count++;
     }
 
-    Ansi = __RegistryAllocate(sizeof (ANSI_STRING) * (Count + 1));
+    // Index is now the number of characters, including each terminator
+    Ansi = __RegistryAllocate(StringListSize(Count, Index * sizeof (CHAR)));
 
     status = STATUS_NO_MEMORY;
     if (Ansi == NULL)
         goto fail1;
 
+    Data = StringListInitialize(Ansi, Count);
+
     for (Index = 0; Index < Count; Index++) {
         ULONG           Length;
         UNICODE_STRING  Unicode;
 
         Length = (ULONG)wcslen(Buffer);
-        Ansi[Index].MaximumLength = (USHORT)(Length + 1) * sizeof (CHAR);
-        Ansi[Index].Buffer = __RegistryAllocate(Ansi[Index].MaximumLength);
-
-        status = STATUS_NO_MEMORY;
-        if (Ansi[Index].Buffer == NULL)
-            goto fail2;
+        Data = StringListAppend(&Ansi[Index],
+                                Data,
+                                (Length + 1) * sizeof (CHAR));
 
         RtlInitUnicodeString(&Unicode, Buffer);
 
@@ -1070,12 +1067,6 @@ RegistryMultiSzToAnsi(
 
     return Ansi;
 
-fail2:
-    while (--Index >= 0)
-        __RegistryFree(Ansi[Index].Buffer);
-
-    __RegistryFree(Ansi);
-
 fail1:
     return NULL;
 }
@@ -1404,19 +1395,18 @@ RegistryQuerySystemStartOption(
     goto fail3;
 
 found:
-    *Value = __RegistryAllocate(sizeof (ANSI_STRING) * 2);
+    Length = (ULONG)strlen(Option);
+
+    *Value = __RegistryAllocate(StringListSize(1,
+                                               (Length + 1) * sizeof (CHAR)));
 
     status = STATUS_NO_MEMORY;
     if (*Value == NULL)
         goto fail4;
 
-    Length = (ULONG)strlen(Option);
-    (*Value)[0].MaximumLength = (USHORT)(Length + 1) * sizeof (CHAR);
-    (*Value)[0].Buffer = __RegistryAllocate((*Value)[0].MaximumLength);
-
-    status = STATUS_NO_MEMORY;
-    if ((*Value)[0].Buffer == NULL)
-        goto fail5;
+    (VOID) StringListAppend(&(*Value)[0],
+                            StringListInitialize(*Value, 1),
+                            (Length + 1) * sizeof (CHAR));
 
     RtlCopyMemory((*Value)[0].Buffer, Option, Length * sizeof (CHAR));
 
@@ -1428,9 +1418,6 @@ found:
 
     return STATUS_SUCCESS;
 
-fail5:
-    __RegistryFree(*Value);
-
 fail4:
 fail3:
     RegistryFreeSzValue(Ansi);
@@ -1603,14 +1590,10 @@ RegistryFreeSzValue(
     _In_ PANSI_STRING   Array
     )
 {
-    ULONG               Index;
-
     if (Array == NULL)
         return;
 
-    for (Index = 0; Array[Index].Buffer != NULL; Index++)
-        __RegistryFree(Array[Index].Buffer);
-
+    // The strings live in the same allocation as the array
     __RegistryFree(Array);
 }
 
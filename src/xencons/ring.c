@@ -39,19 +39,77 @@
 #include <store_interface.h>
 #include <gnttab_interface.h>
 #include <evtchn_interface.h>
+#include <xencons_device.h>
+#include <xencons_shared.h>
 
 #include "frontend.h"
 #include "ring.h"
+#include "ring_engine.h"
+#include "read_policy.h"
+#include "write_schedule.h"
+#include "registry.h"
 #include "names.h"
 #include "dbg_print.h"
 #include "assert.h"
 #include "util.h"
 
-typedef struct _XENCONS_QUEUE {
-    IO_CSQ                  Csq;
+// The classic single page layout is the order 0 case of the layout
+// used by RingEngineInitialize()
+C_ASSERT(sizeof(((struct xencons_interface *)0)->in) == PAGE_SIZE / 4);
+C_ASSERT(sizeof(((struct xencons_interface *)0)->out) == PAGE_SIZE / 2);
+C_ASSERT(FIELD_OFFSET(struct xencons_interface, in_cons) == (PAGE_SIZE / 4) * 3);
+
+#define XENCONS_RING_MAX_PAGE_ORDER 4
+
+#define XENCONS_RING_MAX_STAGING_SIZE   (64 * 1024)
+
+#define XENCONS_RING_MAX_POLL_BUDGET    1024
+
+#define XENCONS_RING_MAX_READ_AHEAD_SIZE    (64 * 1024)
+
+#define XENCONS_RING_DEFAULT_WRITE_QUANTUM  1024
+
+#define XENCONS_RING_DEFAULT_MAP_SIZE   (64 * 1024)
+#define XENCONS_RING_MAX_MAP_SIZE       (1024 * 1024)
+
+// Requests are handed from the dispatch routine to the DPC through a
+// lock-free inbox. The lock only protects the list that the inbox is
+// drained into, and is taken once per DPC pass rather than once per
+// request. Cancel routines never unlink anything; they just flag the
+// queue and kick the DPC, which completes the request when it next
+// drains the list.
+// By default requests are serviced in arrival order; a queue with an
+// Insert callback decides for itself where each drained request goes.
+typedef struct _XENCONS_QUEUE XENCONS_QUEUE, *PXENCONS_QUEUE;
+
+typedef VOID
+(*XENCONS_QUEUE_INSERT)(
+    _In_ PVOID          Argument,
+    _In_ PXENCONS_QUEUE Queue,
+    _In_ PIRP           Irp
+    );
+
+struct _XENCONS_QUEUE {
+    PVOID volatile          Inbox;
     LIST_ENTRY              List;
-    KSPIN_LOCK           	Lock;
-} XENCONS_QUEUE, *PXENCONS_QUEUE;
+    KSPIN_LOCK              Lock;
+    LONG                    CancelPending;
+    LONG                    CancelGeneration;
+    PKDPC                   Dpc;
+    XENCONS_QUEUE_INSERT    Insert;
+    PVOID                   Argument;
+};
+
+// Per-handle state, hung off FileObject->FsContext
+typedef struct _XENCONS_RING_HANDLE {
+    XENCONS_READ_POLICY     ReadPolicy;
+    ULONG                   WriteMode;
+    XENCONS_WRITE_FLOW      WriteFlow;
+} XENCONS_RING_HANDLE, *PXENCONS_RING_HANDLE;
+
+// Set (alongside the XENCONS_WRITE_MODE flags in DriverContext[3]) on
+// writes in the interactive class
+#define XENCONS_RING_WRITE_INTERACTIVE  0x80000000
 
 struct _XENCONS_RING {
     PXENCONS_FRONTEND           Frontend;
@@ -59,12 +117,17 @@ struct _XENCONS_RING {
     BOOLEAN                     Enabled;
     KSPIN_LOCK                  Lock;
     PXENBUS_GNTTAB_CACHE        GnttabCache;
-    struct xencons_interface    *Shared;
+    ULONG                       MaxPageOrder;
+    ULONG                       Order;
+    PVOID                       Shared;
+    XENCONS_RING_ENGINE         Engine;
     PMDL                        Mdl;
-    PXENBUS_GNTTAB_ENTRY        Entry;
+    PXENBUS_GNTTAB_ENTRY        Entry[1 << XENCONS_RING_MAX_PAGE_ORDER];
     KDPC                        Dpc;
-    ULONG                       Dpcs;
-    ULONG                       Events;
+    KTIMER                      ReadTimer;
+    KDPC                        ReadTimerDpc;
+    ULONGLONG                   Dpcs;
+    ULONGLONG                   Events;
     PXENBUS_EVTCHN_CHANNEL      Channel;
     XENBUS_GNTTAB_INTERFACE     GnttabInterface;
     XENBUS_STORE_INTERFACE      StoreInterface;
@@ -73,8 +136,58 @@ struct _XENCONS_RING {
     PXENBUS_DEBUG_CALLBACK      DebugCallback;
     XENCONS_QUEUE               Read;
     XENCONS_QUEUE               Write;
-    ULONG                       BytesRead;
-    ULONG                       BytesWritten;
+    XENCONS_QUEUE               Flush;
+    PCHAR                       ReadAhead;
+    ULONG                       ReadAheadSize;
+    ULONG                       ReadAheadCons;
+    ULONG                       ReadAheadProd;
+    ULONG                       ReadAheadHighWater;
+    ULONGLONG                   ReadAheadOverflows;
+    PCHAR                       Staging;
+    ULONG                       StagingSize;
+    ULONG                       StagingCons;
+    ULONG                       StagingProd;
+    ULONGLONG                   StagedWrites;
+    ULONGLONG                   StagedBytes;
+    ULONG                       WriteQuantum;
+    ULONG                       WriteInteractiveSize;
+    ULONG                       WriteRound;
+    XENCONS_WRITE_FLOW          WriteFlow;
+    ULONGLONG                   WritesInteractive;
+    ULONGLONG                   WritesReordered;
+    ULONG                       MapSize;
+    PFILE_OBJECT volatile       MapOwner;
+    PVOID                       MapSection;
+    PMDL                        MapMdl;
+    PXENCONS_SHARED             MapShared;
+    PVOID                       MapAddress;
+    PEPROCESS                   MapProcess;
+    PKEVENT                     MapInEvent;
+    PKEVENT                     MapOutEvent;
+    ULONGLONG                   MapBytesIn;
+    ULONGLONG                   MapBytesOut;
+    ULONGLONG                   MapSignals;
+    ULONGLONG                   MapKicks;
+    ULONGLONG                   BytesRead;
+    ULONGLONG                   BytesWritten;
+    ULONGLONG                   ReadsCompleted;
+    ULONGLONG                   WritesCompleted;
+    ULONGLONG                   ReadStalls;
+    ULONGLONG                   WriteStalls;
+    ULONGLONG                   FullWritesHeld;
+    ULONGLONG                   ReadLatency[XENCONS_LATENCY_BUCKETS];
+    ULONGLONG                   WriteLatency[XENCONS_LATENCY_BUCKETS];
+    ULONGLONG                   DirectBytesRead;
+    ULONGLONG                   DirectBytesWritten;
+    ULONGLONG                   NotifiesSent;
+    ULONGLONG                   Polls;
+    ULONG                       PollBudget;
+    ULONG                       PollIdlePasses;
+    ULONG                       PollPassesMax;
+    ULONGLONG                   EventsAvoided;
+    ULONGLONG                   ReadBatches;
+    ULONGLONG                   ReadBatchIrps;
+    ULONG                       ReadBatchIrpsMax;
 };
 
 #define MAXNAMELEN          128
@@ -96,169 +209,363 @@ __RingFree(
     __FreePoolWithTag(Buffer, XENCONS_RING_TAG);
 }
 
-IO_CSQ_INSERT_IRP_EX RingCsqInsertIrpEx;
-
-NTSTATUS
-RingCsqInsertIrpEx(
-    _In_ PIO_CSQ        Csq,
-    _In_ PIRP           Irp,
-    _In_ PVOID          InsertContext OPTIONAL
+static VOID
+RingCompleteCanceledIrp(
+    _In_ PIRP           Irp
     )
 {
-    BOOLEAN             ReInsert = (BOOLEAN)(ULONG_PTR)InsertContext;
-    PXENCONS_QUEUE      Queue;
+    PIO_STACK_LOCATION  StackLocation;
+    UCHAR               MajorFunction;
 
-    Queue = CONTAINING_RECORD(Csq, XENCONS_QUEUE, Csq);
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+    MajorFunction = StackLocation->MajorFunction;
 
-    if (ReInsert) {
-        // This only occurs if the DPC de-queued the IRP but
-        // then found the console to be blocked.
-        InsertHeadList(&Queue->List, &Irp->Tail.Overlay.ListEntry);
-    } else {
-        InsertTailList(&Queue->List, &Irp->Tail.Overlay.ListEntry);
-    }
+    // Reads waiting on their completion policy and writes in full
+    // write mode may already have moved some data. That data has gone
+    // from the ring, and the I/O manager only copies a buffered read
+    // back on success, so report it rather than the cancellation.
+    Irp->IoStatus.Status = (Irp->IoStatus.Information != 0) ?
+                           STATUS_SUCCESS :
+                           STATUS_CANCELLED;
 
-    return STATUS_PENDING;
+    Trace("CANCELLED (%02x:%s)\n",
+          MajorFunction,
+          MajorFunctionName(MajorFunction));
+
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
 }
 
-IO_CSQ_REMOVE_IRP RingCsqRemoveIrp;
+DRIVER_CANCEL RingCancelIrp;
 
+_Use_decl_annotations_
 VOID
-RingCsqRemoveIrp(
-    _In_ PIO_CSQ    Csq,
-    _In_ PIRP       Irp
+RingCancelIrp(
+    PDEVICE_OBJECT      DeviceObject,
+    PIRP                Irp
     )
 {
-    UNREFERENCED_PARAMETER(Csq);
+    PXENCONS_QUEUE      Queue = Irp->Tail.Overlay.DriverContext[0];
 
-    RemoveEntryList(&Irp->Tail.Overlay.ListEntry);
+    UNREFERENCED_PARAMETER(DeviceObject);
+
+    // The IRP may still be sitting in the inbox so it cannot be
+    // unlinked here; whoever next holds the queue lock owns it.
+    // Nothing keeps the queue around once the cancel spin lock is
+    // dropped (__RingQueueCompleteCancelled() only waits for the lock)
+    // so it has to be flagged first.
+    (VOID) InterlockedIncrement(&Queue->CancelGeneration);
+    (VOID) InterlockedExchange(&Queue->CancelPending, 1);
+    (VOID) KeInsertQueueDpc(Queue->Dpc, NULL, NULL);
+
+    IoReleaseCancelSpinLock(Irp->CancelIrql);
+}
+
+static VOID
+__RingQueueInsert(
+    _In_ PXENCONS_QUEUE Queue,
+    _In_ PIRP           Irp
+    )
+{
+    PVOID               Head;
+    LONG                Generation;
+
+    IoMarkIrpPending(Irp);
+    __IrpSetTimestamp(Irp);
+
+    // Information accumulates as data is moved across DPC passes
+    Irp->IoStatus.Information = 0;
+
+    Generation = Queue->CancelGeneration;
+    KeMemoryBarrier();
+
+    Irp->Tail.Overlay.DriverContext[0] = Queue;
+    (VOID) IoSetCancelRoutine(Irp, RingCancelIrp);
+
+    // IoCancelIrp() may have run before there was a cancel routine
+    // to call, in which case the sweep has to pick the IRP up.
+    if (Irp->Cancel)
+        (VOID) InterlockedExchange(&Queue->CancelPending, 1);
+
+    do {
+        Head = Queue->Inbox;
+        Irp->Tail.Overlay.DriverContext[1] = Head;
+    } while (InterlockedCompareExchangePointer(&Queue->Inbox,
+                                               Irp,
+                                               Head) != Head);
+
+    // If the cancel routine ran before the IRP reached the inbox, a
+    // sweep may already have been and gone without seeing it. The IRP
+    // may be completed as soon as it is in the inbox so it must not be
+    // looked at again; any cancel since the IRP became cancellable
+    // means sweeping again.
+    if (Queue->CancelGeneration != Generation) {
+        (VOID) InterlockedExchange(&Queue->CancelPending, 1);
+        (VOID) KeInsertQueueDpc(Queue->Dpc, NULL, NULL);
+    }
 }
 
-_Function_class_(IO_CSQ_PEEK_NEXT_IRP)
-PIRP
-RingCsqPeekNextIrp(
-    _In_ PIO_CSQ    Csq,
-    _In_ PIRP       Irp,
-    _In_opt_ PVOID  PeekContext
+// Move everything in the inbox onto the tail of the list. The inbox is
+// a LIFO so it is reversed on the way to keep requests in order.
+static VOID
+__RingQueueDrain(
+    _In_ PXENCONS_QUEUE Queue
     )
 {
-    PXENCONS_QUEUE  Queue;
-    PLIST_ENTRY     ListEntry;
-    PIRP            NextIrp;
+    PIRP                Irp;
+    LIST_ENTRY          List;
+    PLIST_ENTRY         ListEntry;
 
-    Queue = CONTAINING_RECORD(Csq, XENCONS_QUEUE, Csq);
+    Irp = InterlockedExchangePointer(&Queue->Inbox, NULL);
+    if (Irp == NULL)
+        return;
 
-    ListEntry = (Irp == NULL) ?
-        Queue->List.Flink :
-        Irp->Tail.Overlay.ListEntry.Flink;
+    InitializeListHead(&List);
 
+    while (Irp != NULL) {
+        PIRP    Next = Irp->Tail.Overlay.DriverContext[1];
+
+        Irp->Tail.Overlay.DriverContext[1] = NULL;
+        InsertHeadList(&List, &Irp->Tail.Overlay.ListEntry);
+
+        Irp = Next;
+    }
+
+    if (Queue->Insert == NULL) {
+        ListEntry = List.Flink;
+        RemoveEntryList(&List);
+        AppendTailList(&Queue->List, ListEntry);
+        return;
+    }
+
+    while (!IsListEmpty(&List)) {
+        ListEntry = RemoveHeadList(&List);
+        Irp = CONTAINING_RECORD(ListEntry, IRP, Tail.Overlay.ListEntry);
+
+        Queue->Insert(Queue->Argument, Queue, Irp);
+    }
+}
+
+// Remove the next IRP (optionally for a particular FileObject) and
+// take ownership of it. IRPs whose cancel routine has already been
+// called are moved to the Cancelled list instead.
+static PIRP
+__RingQueueRemoveNext(
+    _In_ PXENCONS_QUEUE     Queue,
+    _In_opt_ PFILE_OBJECT   FileObject,
+    _In_ PLIST_ENTRY        Cancelled
+    )
+{
+    PLIST_ENTRY             ListEntry;
+
+    ListEntry = Queue->List.Flink;
     while (ListEntry != &Queue->List) {
+        PLIST_ENTRY         Next = ListEntry->Flink;
+        PIRP                Irp;
         PIO_STACK_LOCATION  StackLocation;
 
-        NextIrp = CONTAINING_RECORD(ListEntry, IRP, Tail.Overlay.ListEntry);
-        if (PeekContext == NULL)
-            return NextIrp;
+        Irp = CONTAINING_RECORD(ListEntry, IRP, Tail.Overlay.ListEntry);
+        StackLocation = IoGetCurrentIrpStackLocation(Irp);
+
+        if (FileObject == NULL ||
+            StackLocation->FileObject == FileObject) {
+            RemoveEntryList(&Irp->Tail.Overlay.ListEntry);
 
-        StackLocation = IoGetCurrentIrpStackLocation(NextIrp);
-        if (StackLocation->FileObject == (PFILE_OBJECT)PeekContext)
-            return NextIrp;
+            if (IoSetCancelRoutine(Irp, NULL) != NULL)
+                return Irp;
 
-        ListEntry = ListEntry->Flink;
+            InsertTailList(Cancelled, &Irp->Tail.Overlay.ListEntry);
+        }
+
+        ListEntry = Next;
     }
 
     return NULL;
 }
 
-#pragma warning(push)
-#pragma warning(disable:28167) // function changes IRQL
+// Return the IRP at the head of the queue without taking ownership of
+// it, so that it stays cancellable. Cancelled IRPs found on the way are
+// moved to the Cancelled list.
+static PIRP
+__RingQueuePeek(
+    _In_ PXENCONS_QUEUE Queue,
+    _In_ PLIST_ENTRY    Cancelled
+    )
+{
+    while (!IsListEmpty(&Queue->List)) {
+        PIRP    Irp;
+
+        Irp = CONTAINING_RECORD(Queue->List.Flink,
+                                IRP,
+                                Tail.Overlay.ListEntry);
 
-_Function_class_(IO_CSQ_ACQUIRE_LOCK)
-_Requires_lock_not_held_(Csq)
-_Acquires_lock_(Csq)
-_IRQL_requires_max_(DISPATCH_LEVEL)
-_IRQL_raises_(DISPATCH_LEVEL)
-VOID
-RingCsqAcquireLock(
-    _In_ PIO_CSQ                            Csq,
-    _Out_ _At_(*Irql, _IRQL_saves_) PKIRQL  Irql
+        if (!Irp->Cancel)
+            return Irp;
+
+        RemoveEntryList(&Irp->Tail.Overlay.ListEntry);
+        (VOID) IoSetCancelRoutine(Irp, NULL);
+
+        InsertTailList(Cancelled, &Irp->Tail.Overlay.ListEntry);
+    }
+
+    return NULL;
+}
+
+// As __RingQueuePeek() but walking the queue: *Cursor starts at the
+// head and is left on the entry after the IRP returned, so that IRP
+// may be claimed without losing the place.
+static PIRP
+__RingQueuePeekNext(
+    _In_ PXENCONS_QUEUE     Queue,
+    _Inout_ PLIST_ENTRY     *Cursor,
+    _In_ PLIST_ENTRY        Cancelled
     )
 {
-    PXENCONS_QUEUE                          Queue;
+    while (*Cursor != &Queue->List) {
+        PIRP    Irp;
 
-    Queue = CONTAINING_RECORD(Csq, XENCONS_QUEUE, Csq);
+        Irp = CONTAINING_RECORD(*Cursor, IRP, Tail.Overlay.ListEntry);
+        *Cursor = (*Cursor)->Flink;
 
-    KeAcquireSpinLock(&Queue->Lock, Irql);
+        if (!Irp->Cancel)
+            return Irp;
+
+        RemoveEntryList(&Irp->Tail.Overlay.ListEntry);
+        (VOID) IoSetCancelRoutine(Irp, NULL);
+
+        InsertTailList(Cancelled, &Irp->Tail.Overlay.ListEntry);
+    }
+
+    return NULL;
 }
 
-_Function_class_(IO_CSQ_RELEASE_LOCK)
-_Requires_lock_held_(Csq)
-_Releases_lock_(Csq)
-_IRQL_requires_(DISPATCH_LEVEL)
-VOID
-RingCsqReleaseLock(
-    _In_ PIO_CSQ                Csq,
-    _In_ _IRQL_restores_ KIRQL  Irql
+// Take ownership of an IRP returned by __RingQueuePeek()
+static BOOLEAN
+__RingQueueClaim(
+    _In_ PXENCONS_QUEUE Queue,
+    _In_ PIRP           Irp,
+    _In_ PLIST_ENTRY    Cancelled
     )
 {
-    PXENCONS_QUEUE              Queue;
+    UNREFERENCED_PARAMETER(Queue);
 
-    Queue = CONTAINING_RECORD(Csq, XENCONS_QUEUE, Csq);
+    RemoveEntryList(&Irp->Tail.Overlay.ListEntry);
 
-    _Analysis_assume_lock_held_(Queue->Lock);
-    KeReleaseSpinLock(&Queue->Lock, Irql);
+    if (IoSetCancelRoutine(Irp, NULL) != NULL)
+        return TRUE;
+
+    InsertTailList(Cancelled, &Irp->Tail.Overlay.ListEntry);
+    return FALSE;
 }
 
-#pragma warning(pop)
+static VOID
+__RingQueueCompleteCancelled(
+    _In_ PLIST_ENTRY    Cancelled
+    )
+{
+    KIRQL               Irql;
 
-_Function_class_(IO_CSQ_COMPLETE_CANCELED_IRP)
-VOID
-RingCsqCompleteCanceledIrp(
-    _In_ PIO_CSQ        Csq,
-    _In_ PIRP           Irp
+    if (IsListEmpty(Cancelled))
+        return;
+
+    // Make sure any cancel routine that is still running has let go
+    // of the IRPs before they are completed.
+    IoAcquireCancelSpinLock(&Irql);
+    IoReleaseCancelSpinLock(Irql);
+
+    while (!IsListEmpty(Cancelled)) {
+        PLIST_ENTRY ListEntry;
+        PIRP        Irp;
+
+        ListEntry = RemoveHeadList(Cancelled);
+        ASSERT3P(ListEntry, !=, Cancelled);
+
+        Irp = CONTAINING_RECORD(ListEntry, IRP, Tail.Overlay.ListEntry);
+
+        RingCompleteCanceledIrp(Irp);
+    }
+}
+
+// Complete anything that has been cancelled since the last sweep, even
+// if the ring is disabled or blocked.
+static VOID
+__RingQueueSweep(
+    _In_ PXENCONS_QUEUE Queue
     )
 {
-    PIO_STACK_LOCATION  StackLocation;
-    UCHAR               MajorFunction;
+    LIST_ENTRY          Cancelled;
+    PLIST_ENTRY         ListEntry;
+    KIRQL               Irql;
 
-    UNREFERENCED_PARAMETER(Csq);
+    if (InterlockedExchange(&Queue->CancelPending, 0) == 0)
+        return;
 
-    StackLocation = IoGetCurrentIrpStackLocation(Irp);
-    MajorFunction = StackLocation->MajorFunction;
+    InitializeListHead(&Cancelled);
 
-    Irp->IoStatus.Information = 0;
-    Irp->IoStatus.Status = STATUS_CANCELLED;
+    KeAcquireSpinLock(&Queue->Lock, &Irql);
 
-    Trace("CANCELLED (%02x:%s)\n",
-          MajorFunction,
-          MajorFunctionName(MajorFunction));
+    __RingQueueDrain(Queue);
 
-    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+    ListEntry = Queue->List.Flink;
+    while (ListEntry != &Queue->List) {
+        PLIST_ENTRY Next = ListEntry->Flink;
+        PIRP        Irp;
+
+        Irp = CONTAINING_RECORD(ListEntry, IRP, Tail.Overlay.ListEntry);
+
+        if (Irp->Cancel) {
+            RemoveEntryList(&Irp->Tail.Overlay.ListEntry);
+            (VOID) IoSetCancelRoutine(Irp, NULL);
+
+            InsertTailList(&Cancelled, &Irp->Tail.Overlay.ListEntry);
+        }
+
+        ListEntry = Next;
+    }
+
+    KeReleaseSpinLock(&Queue->Lock, Irql);
+
+    __RingQueueCompleteCancelled(&Cancelled);
 }
 
-static FORCEINLINE VOID
-__RingCancelRequests(
-    _In_ PXENCONS_RING      Ring,
+static VOID
+__RingQueueCancel(
+    _In_ PXENCONS_QUEUE     Queue,
     _In_opt_ PFILE_OBJECT   FileObject
     )
 {
-    for (;;) {
-        PIRP    Irp;
+    LIST_ENTRY              Cancelled;
+    KIRQL                   Irql;
 
-        Irp = IoCsqRemoveNextIrp(&Ring->Read.Csq, FileObject);
-        if (Irp == NULL)
-            break;
+    InitializeListHead(&Cancelled);
+
+    KeAcquireSpinLock(&Queue->Lock, &Irql);
+
+    __RingQueueDrain(Queue);
 
-        RingCsqCompleteCanceledIrp(&Ring->Read.Csq, Irp);
-    }
     for (;;) {
         PIRP    Irp;
 
-        Irp = IoCsqRemoveNextIrp(&Ring->Write.Csq, FileObject);
+        Irp = __RingQueueRemoveNext(Queue, FileObject, &Cancelled);
         if (Irp == NULL)
             break;
 
-        RingCsqCompleteCanceledIrp(&Ring->Write.Csq, Irp);
+        InsertTailList(&Cancelled, &Irp->Tail.Overlay.ListEntry);
     }
+
+    KeReleaseSpinLock(&Queue->Lock, Irql);
+
+    __RingQueueCompleteCancelled(&Cancelled);
+}
+
+static FORCEINLINE VOID
+__RingCancelRequests(
+    _In_ PXENCONS_RING      Ring,
+    _In_opt_ PFILE_OBJECT   FileObject
+    )
+{
+    __RingQueueCancel(&Ring->Read, FileObject);
+    __RingQueueCancel(&Ring->Write, FileObject);
+    __RingQueueCancel(&Ring->Flush, FileObject);
 }
 
 _Requires_lock_not_held_(*Argument)
@@ -288,63 +595,286 @@ RingReleaseLock(
     KeReleaseSpinLockFromDpcLevel(&Ring->Lock);
 }
 
+static FORCEINLINE ULONG
+__RingWriteGetRound(
+    _In_ PIRP   Irp
+    )
+{
+    return (ULONG)(ULONG_PTR)Irp->Tail.Overlay.DriverContext[1];
+}
+
+static FORCEINLINE BOOLEAN
+__RingWriteIsInteractive(
+    _In_ PIRP   Irp
+    )
+{
+    ULONG       Mode = (ULONG)(ULONG_PTR)Irp->Tail.Overlay.DriverContext[3];
+
+    return (Mode & XENCONS_RING_WRITE_INTERACTIVE) ? TRUE : FALSE;
+}
+
+// Queue a write according to the deficit round robin schedule (see
+// write_schedule.h). A small write that still fits in its flow's
+// allowance for the current round is interactive: it goes ahead of
+// other handles' bulk writes that have not started, but never ahead of
+// anything already queued on its own handle.
+static VOID
+RingWriteInsert(
+    _In_ PVOID              Argument,
+    _In_ PXENCONS_QUEUE     Queue,
+    _In_ PIRP               Irp
+    )
+{
+    PXENCONS_RING           Ring = Argument;
+    PIO_STACK_LOCATION      StackLocation;
+    PFILE_OBJECT            FileObject;
+    PXENCONS_RING_HANDLE    Handle;
+    PXENCONS_WRITE_FLOW     Flow;
+    ULONG                   Length;
+    ULONG                   Round;
+    PLIST_ENTRY             ListEntry;
+
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+    ASSERT(StackLocation->MajorFunction == IRP_MJ_WRITE);
+
+    Length = StackLocation->Parameters.Write.Length;
+    FileObject = StackLocation->FileObject;
+
+    Handle = FileObject->FsContext;
+    Flow = (Handle != NULL) ? &Handle->WriteFlow : &Ring->WriteFlow;
+
+    // Interactive writes are charged like any other, so splitting
+    // output into small writes does not get round the schedule
+    Round = WriteScheduleAssign(Flow,
+                                Ring->WriteRound,
+                                Length,
+                                Ring->WriteQuantum);
+
+    Irp->Tail.Overlay.DriverContext[1] = (PVOID)(ULONG_PTR)Round;
+
+    if (Length != 0 &&
+        Length <= Ring->WriteInteractiveSize &&
+        !WriteScheduleIsBefore(Ring->WriteRound, Round)) {
+        ULONG_PTR   Mode = (ULONG_PTR)Irp->Tail.Overlay.DriverContext[3];
+
+        Irp->Tail.Overlay.DriverContext[3] =
+            (PVOID)(Mode | XENCONS_RING_WRITE_INTERACTIVE);
+
+        for (ListEntry = Queue->List.Blink;
+             ListEntry != &Queue->List;
+             ListEntry = ListEntry->Blink) {
+            PIRP                Prev;
+            PIO_STACK_LOCATION  PrevStackLocation;
+
+            Prev = CONTAINING_RECORD(ListEntry,
+                                     IRP,
+                                     Tail.Overlay.ListEntry);
+            PrevStackLocation = IoGetCurrentIrpStackLocation(Prev);
+
+            if (PrevStackLocation->FileObject == FileObject ||
+                __RingWriteIsInteractive(Prev) ||
+                Prev->IoStatus.Information != 0)
+                break;
+        }
+
+        if (ListEntry != Queue->List.Blink)
+            Ring->WritesReordered++;
+
+        Ring->WritesInteractive++;
+
+        // Insert after ListEntry
+        InsertHeadList(ListEntry, &Irp->Tail.Overlay.ListEntry);
+        return;
+    }
+
+    for (ListEntry = Queue->List.Blink;
+         ListEntry != &Queue->List;
+         ListEntry = ListEntry->Blink) {
+        PIRP    Prev;
+
+        Prev = CONTAINING_RECORD(ListEntry,
+                                 IRP,
+                                 Tail.Overlay.ListEntry);
+
+        if (__RingWriteIsInteractive(Prev) ||
+            !WriteScheduleIsBefore(Round, __RingWriteGetRound(Prev)))
+            break;
+    }
+
+    if (ListEntry != Queue->List.Blink)
+        Ring->WritesReordered++;
+
+    // Insert after ListEntry
+    InsertHeadList(ListEntry, &Irp->Tail.Overlay.ListEntry);
+}
+
+// Only the driver's own view of the section is torn down here. The view
+// in the owning process just keeps the (no longer used) section alive
+// until the process unmaps it or exits, so there is nothing to do in,
+// or wait for from, that process.
+static VOID
+__RingUnmapShared(
+    _In_ PXENCONS_RING  Ring
+    )
+{
+    PVOID               Section;
+    PMDL                Mdl;
+    PXENCONS_SHARED     Shared;
+    PVOID               Address;
+    PEPROCESS           Process;
+    PKEVENT             InEvent;
+    PKEVENT             OutEvent;
+    KIRQL               Irql;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
+
+    // The DPC only looks at the mapping with these locks held
+    KeAcquireSpinLock(&Ring->Read.Lock, &Irql);
+    KeAcquireSpinLockAtDpcLevel(&Ring->Write.Lock);
+
+    Section = Ring->MapSection;
+    Mdl = Ring->MapMdl;
+    Shared = Ring->MapShared;
+    Address = Ring->MapAddress;
+    Process = Ring->MapProcess;
+    InEvent = Ring->MapInEvent;
+    OutEvent = Ring->MapOutEvent;
+
+    Ring->MapShared = NULL;
+    Ring->MapMdl = NULL;
+    Ring->MapSection = NULL;
+    Ring->MapAddress = NULL;
+    Ring->MapProcess = NULL;
+    Ring->MapInEvent = NULL;
+    Ring->MapOutEvent = NULL;
+
+    KeReleaseSpinLockFromDpcLevel(&Ring->Write.Lock);
+    KeReleaseSpinLock(&Ring->Read.Lock, Irql);
+
+    if (Mdl == NULL)
+        return;
+
+    Trace("%p: in = %llu out = %llu\n",
+          Address,
+          Ring->MapBytesIn,
+          Ring->MapBytesOut);
+
+    MmUnlockPages(Mdl);
+    IoFreeMdl(Mdl);
+
+    (VOID) MmUnmapViewInSystemSpace(Shared);
+    ObDereferenceObject(Section);
+
+    ObDereferenceObject(Process);
+
+    ObDereferenceObject(OutEvent);
+    ObDereferenceObject(InEvent);
+
+    (VOID) InterlockedExchangePointer((PVOID *)&Ring->MapOwner, NULL);
+}
+
 NTSTATUS
 RingOpen(
-    _In_ PXENCONS_RING  Ring,
-    _In_ PFILE_OBJECT   FileObject
+    _In_ PXENCONS_RING      Ring,
+    _In_ PFILE_OBJECT       FileObject
     )
 {
+    PXENCONS_RING_HANDLE    Handle;
+    NTSTATUS                status;
+
     UNREFERENCED_PARAMETER(Ring);
-    UNREFERENCED_PARAMETER(FileObject);
+
+    Handle = __RingAllocate(sizeof (XENCONS_RING_HANDLE));
+
+    status = STATUS_NO_MEMORY;
+    if (Handle == NULL)
+        goto fail1;
+
+    Handle->ReadPolicy = ReadPolicyDefault;
+    FileObject->FsContext = Handle;
+
     return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
 }
 
 NTSTATUS
 RingClose(
-    _In_ PXENCONS_RING  Ring,
-    _In_ PFILE_OBJECT   FileObject
+    _In_ PXENCONS_RING      Ring,
+    _In_ PFILE_OBJECT       FileObject
     )
 {
+    PXENCONS_RING_HANDLE    Handle;
+    KIRQL                   Irql;
+
     __RingCancelRequests(Ring, FileObject);
+
+    if (Ring->MapOwner == FileObject)
+        __RingUnmapShared(Ring);
+
+    // The write scheduler looks at FsContext as it drains the inbox
+    KeAcquireSpinLock(&Ring->Write.Lock, &Irql);
+    Handle = FileObject->FsContext;
+    FileObject->FsContext = NULL;
+    KeReleaseSpinLock(&Ring->Write.Lock, Irql);
+
+    if (Handle != NULL) {
+        RtlZeroMemory(Handle, sizeof (XENCONS_RING_HANDLE));
+        __RingFree(Handle);
+    }
+
     return STATUS_SUCCESS;
 }
 
 NTSTATUS
-RingPutQueue(
-    _In_ PXENCONS_RING  Ring,
-    _In_ PIRP           Irp
+RingSetReadPolicy(
+    _In_ PXENCONS_RING      Ring,
+    _In_ PIRP               Irp
     )
 {
-    PIO_STACK_LOCATION  StackLocation;
-    NTSTATUS            status;
+    PIO_STACK_LOCATION      StackLocation;
+    ULONG                   InputBufferLength;
+    PXENCONS_RING_HANDLE    Handle;
+    PXENCONS_READ_POLICY    Buffer;
+    KIRQL                   Irql;
+    NTSTATUS                status;
 
     StackLocation = IoGetCurrentIrpStackLocation(Irp);
+    InputBufferLength = StackLocation->Parameters.DeviceIoControl.InputBufferLength;
+    Buffer = Irp->AssociatedIrp.SystemBuffer;
 
-    switch (StackLocation->MajorFunction) {
-    case IRP_MJ_READ:
-        status = IoCsqInsertIrpEx(&Ring->Read.Csq,
-                                  Irp,
-                                  NULL,
-                                  (PVOID)FALSE);
-        break;
+    status = STATUS_INVALID_PARAMETER;
+    if (InputBufferLength != sizeof (XENCONS_READ_POLICY))
+        goto fail1;
 
-    case IRP_MJ_WRITE:
-        status = IoCsqInsertIrpEx(&Ring->Write.Csq,
-                                  Irp,
-                                  NULL,
-                                  (PVOID)FALSE);
-        break;
+    if (!ReadPolicyIsValid(Buffer))
+        goto fail2;
 
-    default:
-        ASSERT(FALSE);
-        status = STATUS_NOT_SUPPORTED; // Keep SDV happy
-        break;
-    }
-    if (status != STATUS_PENDING)
-        goto fail1;
+    Handle = StackLocation->FileObject->FsContext;
+
+    status = STATUS_INVALID_HANDLE;
+    if (Handle == NULL)
+        goto fail3;
+
+    // Reads already queued pick the new policy up on the next pass
+    KeAcquireSpinLock(&Ring->Read.Lock, &Irql);
+    Handle->ReadPolicy = *Buffer;
+    KeReleaseSpinLock(&Ring->Read.Lock, Irql);
+
+    Irp->IoStatus.Information = 0;
 
     KeInsertQueueDpc(&Ring->Dpc, NULL, NULL);
-    return STATUS_PENDING;
+
+    return STATUS_SUCCESS;
+
+fail3:
+    Error("fail3\n");
+
+fail2:
+    Error("fail2\n");
 
 fail1:
     Error("fail1 (%08x)\n", status);
@@ -352,112 +882,1206 @@ fail1:
     return status;
 }
 
-static ULONG
-RingCopyFromRead(
-    _In_ PXENCONS_RING          Ring,
-    _In_ PCHAR                  Data,
-    _In_ ULONG                  Length
+// The mode is sampled as each write is queued, so writes already
+// queued are not affected.
+NTSTATUS
+RingSetWriteMode(
+    _In_ PXENCONS_RING      Ring,
+    _In_ PIRP               Irp
     )
 {
-    struct xencons_interface    *Shared;
-    XENCONS_RING_IDX            cons;
-    XENCONS_RING_IDX            prod;
-    ULONG                       Offset;
+    PIO_STACK_LOCATION      StackLocation;
+    ULONG                   InputBufferLength;
+    PXENCONS_RING_HANDLE    Handle;
+    PULONG                  Buffer;
+    NTSTATUS                status;
 
-    Shared = Ring->Shared;
+    UNREFERENCED_PARAMETER(Ring);
 
-    KeMemoryBarrier();
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+    InputBufferLength = StackLocation->Parameters.DeviceIoControl.InputBufferLength;
+    Buffer = Irp->AssociatedIrp.SystemBuffer;
+
+    status = STATUS_INVALID_PARAMETER;
+    if (InputBufferLength != sizeof (ULONG))
+        goto fail1;
+
+    if (*Buffer & ~XENCONS_WRITE_MODE_FULL)
+        goto fail2;
+
+    Handle = StackLocation->FileObject->FsContext;
+
+    status = STATUS_INVALID_HANDLE;
+    if (Handle == NULL)
+        goto fail3;
+
+    Handle->WriteMode = *Buffer;
 
-    cons = Shared->in_cons;
-    prod = Shared->in_prod;
+    Irp->IoStatus.Information = 0;
+
+    return STATUS_SUCCESS;
+
+fail3:
+    Error("fail3\n");
+
+fail2:
+    Error("fail2\n");
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+// If the staging buffer is enabled, nothing is waiting to be written
+// ahead of this IRP and its data fits, copy the data and let the
+// caller complete the IRP straight away. Otherwise queue the IRP. The
+// DPC moves staged data into the shared ring ahead of any queued
+// writes.
+//
+// With staging enabled the IRP is pushed onto the inbox under the
+// write lock. Inbox pushes are otherwise lock-free, so a write that
+// had been refused but had not reached the inbox yet could be
+// overtaken by a later write that was staged.
+static BOOLEAN
+__RingStageWrite(
+    _In_ PXENCONS_RING  Ring,
+    _In_ PIRP           Irp
+    )
+{
+    PIO_STACK_LOCATION  StackLocation;
+    ULONG               Length;
+    PCHAR               Buffer;
+    KIRQL               Irql;
+    BOOLEAN             Staged;
+
+    if (Ring->StagingSize == 0) {
+        __RingQueueInsert(&Ring->Write, Irp);
+        return FALSE;
+    }
+
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+    Length = StackLocation->Parameters.Write.Length;
+
+    Buffer = (Length != 0 && Length <= Ring->StagingSize) ?
+             __IrpGetBuffer(Irp) :
+             NULL;
+
+    KeAcquireSpinLock(&Ring->Write.Lock, &Irql);
+
+    Staged = FALSE;
+    if (Buffer == NULL ||
+        Ring->Write.Inbox != NULL ||
+        !IsListEmpty(&Ring->Write.List) ||
+        Ring->StagingSize - (Ring->StagingProd - Ring->StagingCons) < Length) {
+        __RingQueueInsert(&Ring->Write, Irp);
+        goto done;
+    }
+
+    while (Length != 0) {
+        ULONG   Offset;
+        ULONG   Available;
+
+        Offset = Ring->StagingProd & (Ring->StagingSize - 1);
+        Available = __min(Length, Ring->StagingSize - Offset);
+
+        RtlCopyMemory(&Ring->Staging[Offset], Buffer, Available);
+
+        Ring->StagingProd += Available;
+        Buffer += Available;
+        Length -= Available;
+    }
+
+    Ring->StagedWrites++;
+    Ring->StagedBytes += StackLocation->Parameters.Write.Length;
+    Staged = TRUE;
+
+done:
+    KeReleaseSpinLock(&Ring->Write.Lock, Irql);
+
+    return Staged;
+}
+
+NTSTATUS
+RingPutQueue(
+    _In_ PXENCONS_RING  Ring,
+    _In_ PIRP           Irp
+    )
+{
+    PIO_STACK_LOCATION      StackLocation;
+    PXENCONS_RING_HANDLE    Handle;
+    NTSTATUS                status;
+
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+    Handle = StackLocation->FileObject->FsContext;
+
+    switch (StackLocation->MajorFunction) {
+    case IRP_MJ_READ:
+        Irp->Tail.Overlay.DriverContext[3] =
+            (Handle != NULL) ?
+            (PVOID)&Handle->ReadPolicy :
+            (PVOID)&ReadPolicyDefault;
+
+        __RingQueueInsert(&Ring->Read, Irp);
+        status = STATUS_PENDING;
+        break;
+
+    case IRP_MJ_WRITE:
+        Irp->Tail.Overlay.DriverContext[3] =
+            (PVOID)(ULONG_PTR)((Handle != NULL) ? Handle->WriteMode : 0);
+
+        if (__RingStageWrite(Ring, Irp)) {
+            Irp->IoStatus.Information = StackLocation->Parameters.Write.Length;
+            status = STATUS_SUCCESS;
+            break;
+        }
+
+        status = STATUS_PENDING;
+        break;
+
+    default:
+        ASSERT(FALSE);
+        status = STATUS_NOT_SUPPORTED; // Keep SDV happy
+        break;
+    }
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    KeInsertQueueDpc(&Ring->Dpc, NULL, NULL);
+    return status;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+NTSTATUS
+RingFlush(
+    _In_ PXENCONS_RING  Ring,
+    _In_ PIRP           Irp
+    )
+{
+    __RingQueueInsert(&Ring->Flush, Irp);
+
+    KeInsertQueueDpc(&Ring->Dpc, NULL, NULL);
+    return STATUS_PENDING;
+}
+
+// The rings live in a pagefile-backed section rather than in pages
+// mapped straight into the caller. The driver locks down its own system
+// view for the DPC to use, while the caller gets an ordinary view that
+// is torn down along with its address space, so the mapping can never
+// leave locked pages in (or need unmapping from) a process that has
+// gone away, whatever happens to the handle.
+NTSTATUS
+RingMapShared(
+    _In_ PXENCONS_RING          Ring,
+    _In_ PIRP                   Irp
+    )
+{
+    PIO_STACK_LOCATION          StackLocation;
+    ULONG                       InputBufferLength;
+    ULONG                       OutputBufferLength;
+    PVOID                       Buffer;
+    PFILE_OBJECT                FileObject;
+    XENCONS_SHARED_MAP_IN       In;
+    PXENCONS_SHARED_MAP_OUT     Out;
+    PKEVENT                     InEvent;
+    PKEVENT                     OutEvent;
+    ULONG                       Length;
+    LARGE_INTEGER               MaximumSize;
+    OBJECT_ATTRIBUTES           Attributes;
+    HANDLE                      SectionHandle;
+    PVOID                       Section;
+    PXENCONS_SHARED             Shared;
+    SIZE_T                      ViewSize;
+    PMDL                        Mdl;
+    PVOID                       Address;
+    KIRQL                       Irql;
+    NTSTATUS                    status;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
+
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+    InputBufferLength = StackLocation->Parameters.DeviceIoControl.InputBufferLength;
+    OutputBufferLength = StackLocation->Parameters.DeviceIoControl.OutputBufferLength;
+    Buffer = Irp->AssociatedIrp.SystemBuffer;
+    FileObject = StackLocation->FileObject;
+
+    status = STATUS_NOT_SUPPORTED;
+    if (Ring->MapSize == 0)
+        goto fail1;
+
+    status = STATUS_INVALID_PARAMETER;
+    if (InputBufferLength != sizeof (XENCONS_SHARED_MAP_IN) ||
+        OutputBufferLength < sizeof (XENCONS_SHARED_MAP_OUT))
+        goto fail2;
+
+    // The view is created in the process we are running in, which is
+    // the caller's as nothing sits above us in the stack
+    status = STATUS_ACCESS_DENIED;
+    if (Irp->RequestorMode != UserMode)
+        goto fail3;
+
+    // Input and output share the system buffer
+    In = *(PXENCONS_SHARED_MAP_IN)Buffer;
+
+    status = STATUS_DEVICE_BUSY;
+    if (InterlockedCompareExchangePointer((PVOID *)&Ring->MapOwner,
+                                          FileObject,
+                                          NULL) != NULL)
+        goto fail4;
+
+    status = ObReferenceObjectByHandle((HANDLE)(ULONG_PTR)In.InEvent,
+                                       EVENT_MODIFY_STATE,
+                                       *ExEventObjectType,
+                                       Irp->RequestorMode,
+                                       &InEvent,
+                                       NULL);
+    if (!NT_SUCCESS(status))
+        goto fail5;
+
+    status = ObReferenceObjectByHandle((HANDLE)(ULONG_PTR)In.OutEvent,
+                                       EVENT_MODIFY_STATE,
+                                       *ExEventObjectType,
+                                       Irp->RequestorMode,
+                                       &OutEvent,
+                                       NULL);
+    if (!NT_SUCCESS(status))
+        goto fail6;
+
+    Length = PAGE_SIZE + 2 * Ring->MapSize;
+    MaximumSize.QuadPart = Length;
+
+    InitializeObjectAttributes(&Attributes,
+                               NULL,
+                               OBJ_KERNEL_HANDLE,
+                               NULL,
+                               NULL);
+
+    status = ZwCreateSection(&SectionHandle,
+                             SECTION_ALL_ACCESS,
+                             &Attributes,
+                             &MaximumSize,
+                             PAGE_READWRITE,
+                             SEC_COMMIT,
+                             NULL);
+    if (!NT_SUCCESS(status))
+        goto fail7;
+
+    status = ObReferenceObjectByHandle(SectionHandle,
+                                       SECTION_ALL_ACCESS,
+                                       NULL,
+                                       KernelMode,
+                                       &Section,
+                                       NULL);
+    if (!NT_SUCCESS(status))
+        goto fail8;
+
+    Shared = NULL;
+    ViewSize = 0;
+
+    status = MmMapViewInSystemSpace(Section, (PVOID *)&Shared, &ViewSize);
+    if (!NT_SUCCESS(status))
+        goto fail9;
+
+    Mdl = IoAllocateMdl(Shared, Length, FALSE, FALSE, NULL);
+
+    status = STATUS_NO_MEMORY;
+    if (Mdl == NULL)
+        goto fail10;
+
+    status = STATUS_SUCCESS;
+
+    __try {
+        MmProbeAndLockPages(Mdl, KernelMode, IoWriteAccess);
+    } __except (EXCEPTION_EXECUTE_HANDLER) {
+        status = GetExceptionCode();
+    }
+
+    if (!NT_SUCCESS(status))
+        goto fail11;
+
+    Shared->Version = XENCONS_SHARED_VERSION;
+    Shared->Size = Ring->MapSize;
+    Shared->InOffset = PAGE_SIZE;
+    Shared->OutOffset = PAGE_SIZE + Ring->MapSize;
+
+    Address = NULL;
+    ViewSize = 0;
+
+    status = ZwMapViewOfSection(SectionHandle,
+                                ZwCurrentProcess(),
+                                &Address,
+                                0,
+                                Length,
+                                NULL,
+                                &ViewSize,
+                                ViewUnmap,
+                                0,
+                                PAGE_READWRITE);
+    if (!NT_SUCCESS(status))
+        goto fail12;
+
+    // The system view and the reference hold the section from here on
+    ZwClose(SectionHandle);
+
+    ObReferenceObject(PsGetCurrentProcess());
+
+    KeAcquireSpinLock(&Ring->Read.Lock, &Irql);
+    KeAcquireSpinLockAtDpcLevel(&Ring->Write.Lock);
+
+    Ring->MapSection = Section;
+    Ring->MapMdl = Mdl;
+    Ring->MapAddress = Address;
+    Ring->MapProcess = PsGetCurrentProcess();
+    Ring->MapInEvent = InEvent;
+    Ring->MapOutEvent = OutEvent;
+    Ring->MapShared = Shared;
+
+    KeReleaseSpinLockFromDpcLevel(&Ring->Write.Lock);
+    KeReleaseSpinLock(&Ring->Read.Lock, Irql);
+
+    Out = Buffer;
+    RtlZeroMemory(Out, sizeof (XENCONS_SHARED_MAP_OUT));
+
+    Out->Address = (ULONGLONG)(ULONG_PTR)Address;
+    Out->Length = Length;
+
+    Irp->IoStatus.Information = sizeof (XENCONS_SHARED_MAP_OUT);
+
+    Trace("%p: %u bytes\n", Address, Out->Length);
+
+    KeInsertQueueDpc(&Ring->Dpc, NULL, NULL);
+
+    return STATUS_SUCCESS;
+
+fail12:
+    Error("fail12\n");
+
+    MmUnlockPages(Mdl);
+
+fail11:
+    Error("fail11\n");
+
+    IoFreeMdl(Mdl);
+
+fail10:
+    Error("fail10\n");
+
+    (VOID) MmUnmapViewInSystemSpace(Shared);
+
+fail9:
+    Error("fail9\n");
+
+    ObDereferenceObject(Section);
+
+fail8:
+    Error("fail8\n");
+
+    ZwClose(SectionHandle);
+
+fail7:
+    Error("fail7\n");
+
+    ObDereferenceObject(OutEvent);
+
+fail6:
+    Error("fail6\n");
+
+    ObDereferenceObject(InEvent);
+
+fail5:
+    Error("fail5\n");
+
+    (VOID) InterlockedExchangePointer((PVOID *)&Ring->MapOwner, NULL);
+
+fail4:
+    Error("fail4\n");
+
+fail3:
+    Error("fail3\n");
+
+fail2:
+    Error("fail2\n");
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+// Only the handle, in the process, that mapped the rings may kick them
+NTSTATUS
+RingKickShared(
+    _In_ PXENCONS_RING  Ring,
+    _In_ PIRP           Irp
+    )
+{
+    PIO_STACK_LOCATION  StackLocation;
+    BOOLEAN             Owner;
+    KIRQL               Irql;
+    NTSTATUS            status;
+
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+
+    KeAcquireSpinLock(&Ring->Read.Lock, &Irql);
+    Owner = (Ring->MapShared != NULL &&
+             Ring->MapOwner == StackLocation->FileObject &&
+             Ring->MapProcess == PsGetCurrentProcess()) ?
+            TRUE :
+            FALSE;
+    KeReleaseSpinLock(&Ring->Read.Lock, Irql);
+
+    status = STATUS_ACCESS_DENIED;
+    if (!Owner)
+        goto fail1;
+
+    __CounterIncrement(&Ring->MapKicks);
+
+    Irp->IoStatus.Information = 0;
+
+    KeInsertQueueDpc(&Ring->Dpc, NULL, NULL);
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static FORCEINLINE ULONG
+RingCopyToWrite(
+    _In_ PXENCONS_RING          Ring,
+    _In_ PCHAR                  Data,
+    _In_ ULONG                  Length
+    )
+{
+    return RingEngineWrite(&Ring->Engine.Out, Data, Length);
+}
+
+static FORCEINLINE ULONG
+__RingReadAheadGetUsed(
+    _In_ PXENCONS_RING  Ring
+    )
+{
+    return Ring->ReadAheadProd - Ring->ReadAheadCons;
+}
+
+static ULONG
+__RingReadAheadCopy(
+    _In_ PXENCONS_RING  Ring,
+    _In_ PCHAR          Data,
+    _In_ ULONG          Length
+    )
+{
+    ULONG               Copied;
+
+    Copied = 0;
+    while (Length != 0 && __RingReadAheadGetUsed(Ring) != 0) {
+        ULONG   Offset;
+        ULONG   Available;
+
+        Offset = Ring->ReadAheadCons & (Ring->ReadAheadSize - 1);
+        Available = __min(__RingReadAheadGetUsed(Ring),
+                          Ring->ReadAheadSize - Offset);
+        Available = __min(Available, Length);
+
+        RtlCopyMemory(Data, &Ring->ReadAhead[Offset], Available);
+
+        Ring->ReadAheadCons += Available;
+        Data += Available;
+        Length -= Available;
+        Copied += Available;
+    }
+
+    return Copied;
+}
+
+// Pull whatever is left in the ring into the read-ahead buffer so that
+// the backend is not held up by a slow reader.
+static ULONG
+__RingReadAheadFill(
+    _In_ PXENCONS_RING                  Ring,
+    _Inout_ PXENCONS_RING_ENGINE_BATCH  Batch
+    )
+{
+    ULONG                               Filled;
+    ULONG                               Used;
+
+    Filled = 0;
+    while (RingEngineGetBatchAvailable(Batch) != 0 &&
+           __RingReadAheadGetUsed(Ring) != Ring->ReadAheadSize) {
+        ULONG   Offset;
+        ULONG   Available;
+
+        Offset = Ring->ReadAheadProd & (Ring->ReadAheadSize - 1);
+        Available = __min(Ring->ReadAheadSize - __RingReadAheadGetUsed(Ring),
+                          Ring->ReadAheadSize - Offset);
+
+        Available = RingEngineReadBatch(&Ring->Engine.In,
+                                        Batch,
+                                        &Ring->ReadAhead[Offset],
+                                        Available);
+
+        Ring->ReadAheadProd += Available;
+        Filled += Available;
+    }
+
+    // Anything still in the ring now has to wait for a reader
+    if (RingEngineGetBatchAvailable(Batch) != 0)
+        Ring->ReadAheadOverflows++;
+
+    Used = __RingReadAheadGetUsed(Ring);
+    if (Used > Ring->ReadAheadHighWater)
+        Ring->ReadAheadHighWater = Used;
+
+    return Filled;
+}
+
+static FORCEINLINE VOID
+__RingMapSignal(
+    _In_ PXENCONS_RING  Ring,
+    _In_ PKEVENT        Event
+    )
+{
+    (VOID) KeSetEvent(Event, IO_NO_INCREMENT, FALSE);
+    __CounterIncrement(&Ring->MapSignals);
+}
+
+// Move console input (read-ahead data first) into the mapped In ring.
+// Only the indexes in the mapping are written by the application, and
+// the XenconsShared* helpers never trust them, so the data pointers
+// are derived from our own idea of the layout.
+static ULONG
+__RingMapIn(
+    _In_ PXENCONS_RING              Ring,
+    _In_ PXENCONS_RING_ENGINE_BATCH Batch
+    )
+{
+    PXENCONS_SHARED                 Shared = Ring->MapShared;
+    PUCHAR                          Data;
+    ULONG                           Consumed;
+    ULONG                           Copied;
+    BOOLEAN                         Retried;
+
+    Data = (PUCHAR)Shared + PAGE_SIZE;
+
+    Consumed = 0;
+    Copied = 0;
+    Retried = FALSE;
+
+    for (;;) {
+        ULONG   Offset;
+        ULONG   Space;
+        ULONG   Read;
+
+        if (__RingReadAheadGetUsed(Ring) == 0 &&
+            RingEngineGetBatchAvailable(Batch) == 0)
+            break;
+
+        Space = XenconsSharedWriteSpace(&Shared->In,
+                                        Ring->MapSize,
+                                        &Offset);
+        if (Space == 0) {
+            // Have the application kick us once it has made room
+            if (!Retried && !XenconsSharedProdPrepareWait(&Shared->In,
+                                                          Ring->MapSize)) {
+                Retried = TRUE;
+                continue;
+            }
+
+            break;
+        }
+
+        if (__RingReadAheadGetUsed(Ring) != 0) {
+            Read = __RingReadAheadCopy(Ring, (PCHAR)&Data[Offset], Space);
+        } else {
+            Read = RingEngineReadBatch(&Ring->Engine.In,
+                                       Batch,
+                                       (PCHAR)&Data[Offset],
+                                       Space);
+            Consumed += Read;
+        }
+
+        ASSERT(Read != 0);
+        XenconsSharedWriteCommit(&Shared->In, Read);
+
+        Copied += Read;
+    }
+
+    if (Copied != 0) {
+        Ring->MapBytesIn += Copied;
+
+        if (XenconsSharedProdCheckNotify(&Shared->In))
+            __RingMapSignal(Ring, Ring->MapInEvent);
+    }
+
+    return Consumed;
+}
+
+// Move the application's output from the mapped Out ring into the
+// console ring.
+static ULONG
+__RingMapOut(
+    _In_ PXENCONS_RING  Ring
+    )
+{
+    PXENCONS_SHARED     Shared = Ring->MapShared;
+    PUCHAR              Data;
+    ULONG               Written;
+    BOOLEAN             Retried;
+
+    Data = (PUCHAR)Shared + PAGE_SIZE + Ring->MapSize;
+
+    Written = 0;
+    Retried = FALSE;
+
+    for (;;) {
+        ULONG   Offset;
+        ULONG   Space;
+        ULONG   Copied;
+
+        Space = XenconsSharedReadSpace(&Shared->Out,
+                                       Ring->MapSize,
+                                       &Offset);
+        if (Space == 0) {
+            // Have the application kick us when it next writes
+            if (!Retried && !XenconsSharedConsPrepareWait(&Shared->Out)) {
+                Retried = TRUE;
+                continue;
+            }
+
+            break;
+        }
+
+        // If the console ring is full the backend will bring us back
+        Copied = RingCopyToWrite(Ring, (PCHAR)&Data[Offset], Space);
+        if (Copied == 0)
+            break;
+
+        XenconsSharedReadCommit(&Shared->Out, Copied);
+
+        Written += Copied;
+    }
+
+    if (Written != 0) {
+        Ring->BytesWritten += Written;
+        Ring->MapBytesOut += Written;
+
+        if (XenconsSharedConsCheckNotify(&Shared->Out))
+            __RingMapSignal(Ring, Ring->MapOutEvent);
+    }
+
+    return Written;
+}
+
+// Once a read has been drained from the inbox DriverContext[1] holds
+// its inter-byte deadline, in milliseconds of interrupt time, or zero
+// if none is running.
+static FORCEINLINE ULONG
+__RingReadGetTime(
+    VOID
+    )
+{
+    return (ULONG)(KeQueryInterruptTime() / 10000);
+}
+
+static FORCEINLINE ULONG
+__IrpGetReadDeadline(
+    _In_ PIRP   Irp
+    )
+{
+    return (ULONG)(ULONG_PTR)Irp->Tail.Overlay.DriverContext[1];
+}
+
+static FORCEINLINE VOID
+__IrpSetReadDeadline(
+    _In_ PIRP   Irp,
+    _In_ ULONG  Deadline
+    )
+{
+    Irp->Tail.Overlay.DriverContext[1] = (PVOID)(ULONG_PTR)Deadline;
+}
+
+// Move a read that is waiting on its policy behind the reads of other
+// handles, but not past later reads from its own handle
+static VOID
+__RingReadYield(
+    _In_ PXENCONS_RING  Ring,
+    _In_ PIRP           Irp
+    )
+{
+    PFILE_OBJECT        FileObject;
+    PLIST_ENTRY         ListEntry;
+
+    FileObject = IoGetCurrentIrpStackLocation(Irp)->FileObject;
+
+    ListEntry = Irp->Tail.Overlay.ListEntry.Flink;
+    RemoveEntryList(&Irp->Tail.Overlay.ListEntry);
+
+    while (ListEntry != &Ring->Read.List) {
+        PIRP    Next;
+
+        Next = CONTAINING_RECORD(ListEntry, IRP, Tail.Overlay.ListEntry);
+        if (IoGetCurrentIrpStackLocation(Next)->FileObject == FileObject)
+            break;
+
+        ListEntry = ListEntry->Flink;
+    }
+
+    // Insert before ListEntry
+    InsertTailList(ListEntry, &Irp->Tail.Overlay.ListEntry);
+}
+
+static ULONG
+RingPollRead(
+    _In_ PXENCONS_RING          Ring
+    )
+{
+    XENCONS_RING_ENGINE_BATCH   Batch;
+    LIST_ENTRY                  List;
+    LIST_ENTRY                  Cancelled;
+    PLIST_ENTRY                 Cursor;
+    PIRP                        Yield;
+    ULONG                       Now;
+    ULONG                       Wake;
+    ULONG                       Irps;
+    ULONG                       Bytes;
+    ULONG                       Consumed;
+
+    InitializeListHead(&List);
+    InitializeListHead(&Cancelled);
+    Yield = NULL;
+    Wake = 0;
+    Irps = 0;
+    Bytes = 0;
+    Consumed = 0;
+
+    Now = __RingReadGetTime();
+
+    KeAcquireSpinLockAtDpcLevel(&Ring->Read.Lock);
+
+    __RingQueueDrain(&Ring->Read);
+
+    // Snapshot the producer index once and spread whatever is
+    // available across as many queued read IRPs as it will cover.
+    RingEngineReadBegin(&Ring->Engine.In, &Batch);
+
+    if (RingEngineGetBatchAvailable(&Batch) == 0 &&
+        __RingReadAheadGetUsed(Ring) == 0 &&
+        !IsListEmpty(&Ring->Read.List))
+        Ring->ReadStalls++;
+
+    // Every read is looked at, not just the head: each carries its own
+    // handle's policy and deadline, and one that is still waiting must
+    // not hold up the rest.
+    Cursor = Ring->Read.List.Flink;
+    for (;;) {
+        PIRP                    Irp;
+        PIO_STACK_LOCATION      StackLocation;
+        PXENCONS_READ_POLICY    Policy;
+        ULONG                   Length;
+        PCHAR                   Buffer;
+        ULONG                   Offset;
+        ULONG                   Read;
+        ULONG                   Deadline;
+        BOOLEAN                 TimedOut;
+
+        Irp = __RingQueuePeekNext(&Ring->Read, &Cursor, &Cancelled);
+        if (Irp == NULL)
+            break;
+
+        StackLocation = IoGetCurrentIrpStackLocation(Irp);
+        ASSERT(StackLocation->MajorFunction == IRP_MJ_READ);
+
+        Policy = Irp->Tail.Overlay.DriverContext[3];
+        Length = StackLocation->Parameters.Read.Length;
+        Buffer = __IrpGetBuffer(Irp);
+
+        if (Buffer == NULL && Length != 0) {
+            if (!__RingQueueClaim(&Ring->Read, Irp, &Cancelled))
+                continue;
+
+            Irp->IoStatus.Information = 0;
+            Irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+
+            InsertTailList(&List, &Irp->Tail.Overlay.ListEntry);
+            continue;
+        }
+
+        // The IRP may already hold data from an earlier pass
+        Offset = (ULONG)Irp->IoStatus.Information;
+
+        // Data already pulled into the read-ahead buffer is older
+        // than anything still in the ring so it has to go first.
+        Read = __RingReadAheadCopy(Ring, Buffer + Offset, Length - Offset);
+
+        if (Offset + Read < Length && __RingReadAheadGetUsed(Ring) == 0) {
+            ULONG   FromRing;
+
+            FromRing = RingEngineReadBatch(&Ring->Engine.In,
+                                           &Batch,
+                                           Buffer + Offset + Read,
+                                           Length - Offset - Read);
+
+            Consumed += FromRing;
+            Read += FromRing;
+        }
+
+        // With direct I/O the data went straight into the caller's
+        // pages rather than via an intermediate system buffer
+        if (Irp->MdlAddress != NULL)
+            Ring->DirectBytesRead += Read;
+
+        Irp->IoStatus.Information = Offset + Read;
+        Bytes += Read;
+
+        // The inter-byte timer restarts whenever this read gets data
+        if (Read != 0 && Policy->InterByteTimeout != 0) {
+            Deadline = Now + Policy->InterByteTimeout;
+            __IrpSetReadDeadline(Irp, (Deadline != 0) ? Deadline : 1);
+        }
+
+        Deadline = __IrpGetReadDeadline(Irp);
+        TimedOut = (Deadline != 0 && (LONG)(Now - Deadline) >= 0) ?
+                   TRUE :
+                   FALSE;
+
+        if (!ReadPolicyIsComplete(Policy,
+                                  Buffer + Offset,
+                                  Read,
+                                  Offset + Read,
+                                  Length,
+                                  TimedOut)) {
+            // Leave it queued (and cancellable). It has taken all the
+            // data there was, so the reads behind it only need looking
+            // at for their own timeouts.
+            if (Read != 0)
+                Yield = Irp;
+
+            if (Deadline != 0 &&
+                (Wake == 0 || (LONG)(Deadline - Wake) < 0))
+                Wake = Deadline;
+
+            continue;
+        }
+
+        if (!__RingQueueClaim(&Ring->Read, Irp, &Cancelled))
+            continue;
+
+        Irp->IoStatus.Status = STATUS_SUCCESS;
+
+        // The IRP is no longer owned by the queue so the list
+        // entry can be re-used to hold it until completion.
+        InsertTailList(&List, &Irp->Tail.Overlay.ListEntry);
+
+        Irps++;
+    }
+
+    // The next data goes to someone else's read first, so a handle
+    // gathering up a large minimum does not starve the others
+    if (Yield != NULL)
+        __RingReadYield(Ring, Yield);
+
+    // The timer is only a wake-up; each read checks its own deadline
+    if (Wake != 0) {
+        LARGE_INTEGER   Timeout;
+
+        Timeout.QuadPart = -10000ll * (LONG)(Wake - Now);
+        (VOID) KeSetTimer(&Ring->ReadTimer, Timeout, &Ring->ReadTimerDpc);
+    } else {
+        (VOID) KeCancelTimer(&Ring->ReadTimer);
+    }
+
+    // Queued reads take priority over the mapped ring
+    if (Ring->MapShared != NULL && IsListEmpty(&Ring->Read.List))
+        Consumed += __RingMapIn(Ring, &Batch);
+
+    if (Ring->ReadAheadSize != 0)
+        Consumed += __RingReadAheadFill(Ring, &Batch);
+
+    if (Consumed != 0)
+        RingEngineReadCommit(&Ring->Engine.In, &Batch);
+
+    if (Irps != 0) {
+        Ring->BytesRead += Bytes;
+
+        Ring->ReadBatches++;
+        Ring->ReadBatchIrps += Irps;
+        if (Irps > Ring->ReadBatchIrpsMax)
+            Ring->ReadBatchIrpsMax = Irps;
+    }
+
+    KeReleaseSpinLockFromDpcLevel(&Ring->Read.Lock);
+
+    __RingQueueCompleteCancelled(&Cancelled);
+
+    while (!IsListEmpty(&List)) {
+        PLIST_ENTRY             ListEntry;
+        PIRP                    Irp;
+        ULONG                   Bucket;
+
+        ListEntry = RemoveHeadList(&List);
+        ASSERT3P(ListEntry, !=, &List);
+
+        Irp = CONTAINING_RECORD(ListEntry, IRP, Tail.Overlay.ListEntry);
+
+        if (NT_SUCCESS(Irp->IoStatus.Status)) {
+            __CounterIncrement(&Ring->ReadsCompleted);
+            Bucket = __IrpGetLatencyBucket(Irp, XENCONS_LATENCY_BUCKETS);
+            __CounterIncrement(&Ring->ReadLatency[Bucket]);
+        }
+
+        Trace("COMPLETE (READ) (%u bytes)\n",
+              Irp->IoStatus.Information);
+
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+    }
+
+    return Consumed;
+}
+
+// Move as much staged data as will fit into the shared ring. Called
+// with the write lock held.
+static ULONG
+__RingStagingFlush(
+    _In_ PXENCONS_RING  Ring
+    )
+{
+    ULONG               Bytes;
+
+    Bytes = 0;
+    while (Ring->StagingCons != Ring->StagingProd) {
+        ULONG   Offset;
+        ULONG   Available;
+        ULONG   Written;
+
+        Offset = Ring->StagingCons & (Ring->StagingSize - 1);
+        Available = __min(Ring->StagingProd - Ring->StagingCons,
+                          Ring->StagingSize - Offset);
+
+        Written = RingCopyToWrite(Ring,
+                                  &Ring->Staging[Offset],
+                                  Available);
+        if (Written == 0)
+            break;
+
+        Ring->StagingCons += Written;
+        Ring->BytesWritten += Written;
+        Bytes += Written;
+    }
+
+    return Bytes;
+}
+
+static ULONG
+RingPollWrite(
+    _In_ PXENCONS_RING          Ring
+    )
+{
+    LIST_ENTRY                  List;
+    LIST_ENTRY                  Cancelled;
+    ULONG                       Bytes;
+
+    InitializeListHead(&List);
+    InitializeListHead(&Cancelled);
+
+    KeAcquireSpinLockAtDpcLevel(&Ring->Write.Lock);
+
+    __RingQueueDrain(&Ring->Write);
+
+    // Staged data was accepted before anything that is queued so it
+    // has to go first.
+    Bytes = __RingStagingFlush(Ring);
+
+    for (;;) {
+        PIRP                    Irp;
+        PIO_STACK_LOCATION      StackLocation;
+        ULONG                   Mode;
+        ULONG                   Length;
+        PCHAR                   Buffer;
+        ULONG                   Offset;
+        ULONG                   Written;
+
+        // Leave the next IRP queued (and cancellable) until there is
+        // room for at least some of its data.
+        if (Ring->StagingCons != Ring->StagingProd ||
+            RingEngineGetFree(&Ring->Engine.Out) == 0) {
+            if (!IsListEmpty(&Ring->Write.List))
+                Ring->WriteStalls++;
+
+            break;
+        }
+
+        Irp = __RingQueuePeek(&Ring->Write, &Cancelled);
+        if (Irp == NULL)
+            break;
+
+        // The schedule moves on to the round of whatever is being sent
+        if (!__RingWriteIsInteractive(Irp))
+            Ring->WriteRound = __RingWriteGetRound(Irp);
+
+        StackLocation = IoGetCurrentIrpStackLocation(Irp);
+        ASSERT(StackLocation->MajorFunction == IRP_MJ_WRITE);
+
+        Mode = (ULONG)(ULONG_PTR)Irp->Tail.Overlay.DriverContext[3];
+        Length = StackLocation->Parameters.Write.Length;
+        Buffer = __IrpGetBuffer(Irp);
+
+        if (Buffer == NULL && Length != 0) {
+            if (!__RingQueueClaim(&Ring->Write, Irp, &Cancelled))
+                continue;
+
+            Irp->IoStatus.Information = 0;
+            Irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+
+            InsertTailList(&List, &Irp->Tail.Overlay.ListEntry);
+            continue;
+        }
+
+        // A full-mode write may already have been partly transferred
+        Offset = (ULONG)Irp->IoStatus.Information;
+
+        Written = RingCopyToWrite(Ring,
+                                  Buffer + Offset,
+                                  Length - Offset);
+
+        Ring->BytesWritten += Written;
+        Bytes += Written;
+
+        if (Irp->MdlAddress != NULL)
+            Ring->DirectBytesWritten += Written;
+
+        Irp->IoStatus.Information = Offset + Written;
+
+        // Each pass that holds a full-mode write would otherwise have
+        // cost the caller another WriteFile() for the remainder.
+        if ((Mode & XENCONS_WRITE_MODE_FULL) &&
+            Irp->IoStatus.Information < Length) {
+            Ring->FullWritesHeld++;
+            break;
+        }
 
-    KeMemoryBarrier();
+        if (!__RingQueueClaim(&Ring->Write, Irp, &Cancelled))
+            continue;
 
-    Offset = 0;
-    while (Length != 0) {
-        ULONG   Available;
-        ULONG   Index;
-        ULONG   CopyLength;
+        Irp->IoStatus.Status = STATUS_SUCCESS;
 
-        Available = prod - cons;
+        InsertTailList(&List, &Irp->Tail.Overlay.ListEntry);
+    }
 
-        if (Available == 0)
-            break;
+    // The mapped ring only gets a look in once the queue is empty
+    if (Ring->MapShared != NULL &&
+        IsListEmpty(&Ring->Write.List) &&
+        Ring->StagingCons == Ring->StagingProd)
+        Bytes += __RingMapOut(Ring);
 
-        Index = MASK_XENCONS_IDX(cons, Shared->in);
+    KeReleaseSpinLockFromDpcLevel(&Ring->Write.Lock);
 
-        CopyLength = __min(Length, Available);
-        CopyLength = __min(CopyLength, sizeof(Shared->in) - Index);
+    __RingQueueCompleteCancelled(&Cancelled);
 
-        RtlCopyMemory(Data + Offset, &Shared->in[Index], CopyLength);
+    while (!IsListEmpty(&List)) {
+        PLIST_ENTRY             ListEntry;
+        PIRP                    Irp;
+        ULONG                   Bucket;
 
-        Offset += CopyLength;
-        Length -= CopyLength;
+        ListEntry = RemoveHeadList(&List);
+        ASSERT3P(ListEntry, !=, &List);
 
-        cons += CopyLength;
-    }
+        Irp = CONTAINING_RECORD(ListEntry, IRP, Tail.Overlay.ListEntry);
 
-    KeMemoryBarrier();
+        if (NT_SUCCESS(Irp->IoStatus.Status)) {
+            __CounterIncrement(&Ring->WritesCompleted);
+            Bucket = __IrpGetLatencyBucket(Irp, XENCONS_LATENCY_BUCKETS);
+            __CounterIncrement(&Ring->WriteLatency[Bucket]);
+        }
 
-    Shared->in_cons = cons;
+        Trace("COMPLETE (WRITE) (%u bytes)\n",
+              Irp->IoStatus.Information);
 
-    KeMemoryBarrier();
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+    }
 
-    return Offset;
+    return Bytes;
 }
 
-static ULONG
-RingCopyToWrite(
-    _In_ PXENCONS_RING          Ring,
-    _In_ PCHAR                  Data,
-    _In_ ULONG                  Length
+// Complete flush requests once the staging buffer is empty
+static VOID
+RingPollFlush(
+    _In_ PXENCONS_RING  Ring
     )
 {
-    struct xencons_interface    *Shared;
-    XENCONS_RING_IDX            cons;
-    XENCONS_RING_IDX            prod;
-    ULONG                       Offset;
+    LIST_ENTRY          List;
+    LIST_ENTRY          Cancelled;
+    BOOLEAN             Empty;
 
-    Shared = Ring->Shared;
+    if (Ring->Flush.Inbox == NULL && IsListEmpty(&Ring->Flush.List))
+        return;
 
-    KeMemoryBarrier();
+    KeAcquireSpinLockAtDpcLevel(&Ring->Write.Lock);
+    Empty = (Ring->StagingCons == Ring->StagingProd);
+    KeReleaseSpinLockFromDpcLevel(&Ring->Write.Lock);
 
-    prod = Shared->out_prod;
-    cons = Shared->out_cons;
+    if (!Empty)
+        return;
 
-    KeMemoryBarrier();
+    InitializeListHead(&List);
+    InitializeListHead(&Cancelled);
 
-    Offset = 0;
-    while (Length != 0) {
-        ULONG   Available;
-        ULONG   Index;
-        ULONG   CopyLength;
+    KeAcquireSpinLockAtDpcLevel(&Ring->Flush.Lock);
+
+    __RingQueueDrain(&Ring->Flush);
 
-        Available = cons + sizeof(Shared->out) - prod;
+    for (;;) {
+        PIRP    Irp;
 
-        if (Available == 0)
+        Irp = __RingQueueRemoveNext(&Ring->Flush, NULL, &Cancelled);
+        if (Irp == NULL)
             break;
 
-        Index = MASK_XENCONS_IDX(prod, Shared->out);
+        InsertTailList(&List, &Irp->Tail.Overlay.ListEntry);
+    }
 
-        CopyLength = __min(Length, Available);
-        CopyLength = __min(CopyLength, sizeof(Shared->out) - Index);
+    KeReleaseSpinLockFromDpcLevel(&Ring->Flush.Lock);
 
-        RtlCopyMemory(&Shared->out[Index], Data + Offset, CopyLength);
+    __RingQueueCompleteCancelled(&Cancelled);
 
-        Offset += CopyLength;
-        Length -= CopyLength;
+    while (!IsListEmpty(&List)) {
+        PLIST_ENTRY ListEntry;
+        PIRP        Irp;
 
-        prod += CopyLength;
-    }
+        ListEntry = RemoveHeadList(&List);
+        ASSERT3P(ListEntry, !=, &List);
 
-    KeMemoryBarrier();
+        Irp = CONTAINING_RECORD(ListEntry, IRP, Tail.Overlay.ListEntry);
 
-    Shared->out_prod = prod;
+        Irp->IoStatus.Information = 0;
+        Irp->IoStatus.Status = STATUS_SUCCESS;
 
-    KeMemoryBarrier();
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+    }
+}
+
+// The console ring has no event indices, so there is no way of telling
+// whether the backend will look at the indices again without being
+// told. Any pass that moved data therefore has to notify it.
+static VOID
+RingNotify(
+    _In_ PXENCONS_RING  Ring,
+    _In_ ULONG          Consumed,
+    _In_ ULONG          Produced
+    )
+{
+    if (Consumed == 0 && Produced == 0)
+        return;
+
+    XENBUS_EVTCHN(Send,
+                  &Ring->EvtchnInterface,
+                  Ring->Channel);
 
-    return Offset;
+    __CounterIncrement(&Ring->NotifiesSent);
 }
 
 static BOOLEAN
@@ -465,85 +2089,42 @@ RingPoll(
     _In_ PXENCONS_RING  Ring
     )
 {
-    PIRP                Irp;
-    PIO_STACK_LOCATION  StackLocation;
-    ULONG               Length;
-    PCHAR               Buffer;
-    NTSTATUS            status;
-
-    for (;;) {
-        ULONG           Read;
-
-        Irp = IoCsqRemoveNextIrp(&Ring->Read.Csq, NULL);
-        if (Irp == NULL)
-            break;
-
-        StackLocation = IoGetCurrentIrpStackLocation(Irp);
-        ASSERT(StackLocation->MajorFunction == IRP_MJ_READ);
-
-        Length = StackLocation->Parameters.Read.Length;
-        Buffer = Irp->AssociatedIrp.SystemBuffer;
-
-        Read = RingCopyFromRead(Ring,
-                                Buffer,
-                                Length);
-        if (Read == 0) {
-            status = IoCsqInsertIrpEx(&Ring->Read.Csq,
-                                      Irp,
-                                      NULL,
-                                      (PVOID)TRUE);
-            ASSERT(status == STATUS_PENDING);
-            break;
-        }
-
-        Ring->BytesRead += Read;
-
-        Irp->IoStatus.Information = Read;
-        Irp->IoStatus.Status = STATUS_SUCCESS;
-
-        Trace("COMPLETE (READ) (%u bytes)\n",
-              Irp->IoStatus.Information);
-
-        IoCompleteRequest(Irp, IO_NO_INCREMENT);
-    }
-
-    for (;;) {
-        ULONG           Written;
+    ULONG               Consumed;
+    ULONG               Produced;
 
-        Irp = IoCsqRemoveNextIrp(&Ring->Write.Csq, NULL);
-        if (Irp == NULL)
-            break;
+    __CounterIncrement(&Ring->Polls);
 
-        StackLocation = IoGetCurrentIrpStackLocation(Irp);
-        ASSERT(StackLocation->MajorFunction == IRP_MJ_WRITE);
+    Consumed = RingPollRead(Ring);
+    Produced = RingPollWrite(Ring);
 
-        Length = StackLocation->Parameters.Write.Length;
-        Buffer = Irp->AssociatedIrp.SystemBuffer;
+    RingPollFlush(Ring);
 
-        Written = RingCopyToWrite(Ring,
-                                  Buffer,
-                                  Length);
-        if (Written == 0) {
-            status = IoCsqInsertIrpEx(&Ring->Write.Csq,
-                                      Irp,
-                                      NULL,
-                                      (PVOID)TRUE);
-            ASSERT(status == STATUS_PENDING);
-            break;
-        }
+    RingNotify(Ring, Consumed, Produced);
 
-        Ring->BytesWritten += Written;
+    return (Consumed != 0 || Produced != 0) ? TRUE : FALSE;
+}
 
-        Irp->IoStatus.Information = Written;
-        Irp->IoStatus.Status = STATUS_SUCCESS;
+_Function_class_(KDEFERRED_ROUTINE)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_min_(DISPATCH_LEVEL)
+_IRQL_requires_same_
+static VOID
+RingReadTimerDpc(
+    _In_ PKDPC          Dpc,
+    _In_ PVOID          Context,
+    _In_ PVOID          Argument1,
+    _In_ PVOID          Argument2
+    )
+{
+    PXENCONS_RING       Ring = Context;
 
-        Trace("COMPLETE (WRITE) (%u bytes)\n",
-              Irp->IoStatus.Information);
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(Argument1);
+    UNREFERENCED_PARAMETER(Argument2);
 
-        IoCompleteRequest(Irp, IO_NO_INCREMENT);
-    }
+    ASSERT(Ring != NULL);
 
-    return FALSE;
+    (VOID) KeInsertQueueDpc(&Ring->Dpc, NULL, NULL);
 }
 
 _Function_class_(KDEFERRED_ROUTINE)
@@ -559,6 +2140,8 @@ RingDpc(
     )
 {
     PXENCONS_RING       Ring = Context;
+    ULONG               Passes;
+    ULONG               Idle;
 
     UNREFERENCED_PARAMETER(Dpc);
     UNREFERENCED_PARAMETER(Argument1);
@@ -566,9 +2149,20 @@ RingDpc(
 
     ASSERT(Ring != NULL);
 
+    __RingQueueSweep(&Ring->Read);
+    __RingQueueSweep(&Ring->Write);
+    __RingQueueSweep(&Ring->Flush);
+
+    // The event channel stays masked for as long as we keep polling.
+    // With a non-zero PollBudget the DPC carries on while data keeps
+    // moving (tolerating up to PollIdlePasses empty passes) so that a
+    // busy ring does not take an event for every backend update.
+    Passes = 0;
+    Idle = 0;
+
     for (;;) {
         BOOLEAN Enabled;
-        BOOLEAN Retry;
+        BOOLEAN Progress;
         KIRQL   Irql;
 
         KeAcquireSpinLock(&Ring->Lock, &Irql);
@@ -579,13 +2173,23 @@ RingDpc(
             break;
 
         KeRaiseIrql(DISPATCH_LEVEL, &Irql);
-        Retry = RingPoll(Ring);
+        Progress = RingPoll(Ring);
         KeLowerIrql(Irql);
 
-        if (!Retry)
+        if (Progress && Passes != 0)
+            __CounterIncrement(&Ring->EventsAvoided);
+
+        if (++Passes > Ring->PollBudget)
+            break;
+
+        if (Progress)
+            Idle = 0;
+        else if (++Idle > Ring->PollIdlePasses)
             break;
     }
 
+    __CounterMaximum(&Ring->PollPassesMax, Passes);
+
     (VOID) XENBUS_EVTCHN(Unmask,
                          &Ring->EvtchnInterface,
                          Ring->Channel,
@@ -606,10 +2210,10 @@ RingEvtchnCallback(
 
     ASSERT(Ring != NULL);
 
-    Ring->Events++;
+    __CounterIncrement(&Ring->Events);
 
     if (KeInsertQueueDpc(&Ring->Dpc, NULL, NULL))
-        Ring->Dpcs++;
+        __CounterIncrement(&Ring->Dpcs);
 
     return TRUE;
 }
@@ -633,17 +2237,109 @@ RingDebugCallback(
     // Dump shared ring
     XENBUS_DEBUG(Printf,
                  &Ring->DebugInterface,
-                 "SHARED: in_cons = %u in_prod = %u out_cons = %u out_prod = %u\n",
-                 Ring->Shared->in_cons,
-                 Ring->Shared->in_prod,
-                 Ring->Shared->out_cons,
-                 Ring->Shared->out_prod);
+                 "SHARED: order = %u in_cons = %u in_prod = %u out_cons = %u out_prod = %u\n",
+                 Ring->Order,
+                 *Ring->Engine.In.Cons,
+                 *Ring->Engine.In.Prod,
+                 *Ring->Engine.Out.Cons,
+                 *Ring->Engine.Out.Prod);
 
     XENBUS_DEBUG(Printf,
                  &Ring->DebugInterface,
-                 "BYTES: read = %u written = %u\n",
+                 "BYTES: read = %llu written = %llu\n",
                  Ring->BytesRead,
                  Ring->BytesWritten);
+
+    XENBUS_DEBUG(Printf,
+                 &Ring->DebugInterface,
+                 "IRPS: reads = %llu writes = %llu stalls: read = %llu write = %llu\n",
+                 Ring->ReadsCompleted,
+                 Ring->WritesCompleted,
+                 Ring->ReadStalls,
+                 Ring->WriteStalls);
+
+    XENBUS_DEBUG(Printf,
+                 &Ring->DebugInterface,
+                 "READ AHEAD: size = %u used = %u high water = %u overflows = %llu\n",
+                 Ring->ReadAheadSize,
+                 __RingReadAheadGetUsed(Ring),
+                 Ring->ReadAheadHighWater,
+                 Ring->ReadAheadOverflows);
+
+    XENBUS_DEBUG(Printf,
+                 &Ring->DebugInterface,
+                 "STAGING: size = %u used = %u writes = %llu bytes = %llu\n",
+                 Ring->StagingSize,
+                 Ring->StagingProd - Ring->StagingCons,
+                 Ring->StagedWrites,
+                 Ring->StagedBytes);
+
+    XENBUS_DEBUG(Printf,
+                 &Ring->DebugInterface,
+                 "EVENTS: events = %llu dpcs = %llu\n",
+                 Ring->Events,
+                 Ring->Dpcs);
+
+    XENBUS_DEBUG(Printf,
+                 &Ring->DebugInterface,
+                 "POLL: budget = %u idle = %u max passes = %u events avoided = %llu\n",
+                 Ring->PollBudget,
+                 Ring->PollIdlePasses,
+                 Ring->PollPassesMax,
+                 Ring->EventsAvoided);
+
+    XENBUS_DEBUG(Printf,
+                 &Ring->DebugInterface,
+                 "DIRECT: read = %llu written = %llu\n",
+                 Ring->DirectBytesRead,
+                 Ring->DirectBytesWritten);
+
+    XENBUS_DEBUG(Printf,
+                 &Ring->DebugInterface,
+                 "NOTIFY: sent = %llu\n",
+                 Ring->NotifiesSent);
+
+    XENBUS_DEBUG(Printf,
+                 &Ring->DebugInterface,
+                 "READ: polls = %llu batches = %llu irps = %llu (max %u per batch)\n",
+                 Ring->Polls,
+                 Ring->ReadBatches,
+                 Ring->ReadBatchIrps,
+                 Ring->ReadBatchIrpsMax);
+
+    XENBUS_DEBUG(Printf,
+                 &Ring->DebugInterface,
+                 "READ PER DPC: irps = %llu bytes = %llu\n",
+                 (Ring->Polls != 0) ? Ring->ReadBatchIrps / Ring->Polls : 0,
+                 (Ring->Polls != 0) ? Ring->BytesRead / Ring->Polls : 0);
+
+    XENBUS_DEBUG(Printf,
+                 &Ring->DebugInterface,
+                 "FULL WRITE: held = %llu\n",
+                 Ring->FullWritesHeld);
+
+    XENBUS_DEBUG(Printf,
+                 &Ring->DebugInterface,
+                 "WRITE SCHEDULE: quantum = %u interactive = %u round = %u\n",
+                 Ring->WriteQuantum,
+                 Ring->WriteInteractiveSize,
+                 Ring->WriteRound);
+
+    XENBUS_DEBUG(Printf,
+                 &Ring->DebugInterface,
+                 "WRITE SCHEDULE: interactive = %llu reordered = %llu\n",
+                 Ring->WritesInteractive,
+                 Ring->WritesReordered);
+
+    XENBUS_DEBUG(Printf,
+                 &Ring->DebugInterface,
+                 "MAP: size = %u owner = %p in = %llu out = %llu signals = %llu kicks = %llu\n",
+                 Ring->MapSize,
+                 Ring->MapOwner,
+                 Ring->MapBytesIn,
+                 Ring->MapBytesOut,
+                 Ring->MapSignals,
+                 Ring->MapKicks);
 }
 
 NTSTATUS
@@ -677,15 +2373,81 @@ RingDisable(
     Ring->Enabled = FALSE;
     KeReleaseSpinLockFromDpcLevel(&Ring->Lock);
 
+    // Staged writes have already been completed, so give their data a
+    // last chance to reach the backend while the ring is still mapped
+    if (Ring->StagingSize != 0) {
+        ULONG   Produced;
+
+        KeAcquireSpinLockAtDpcLevel(&Ring->Write.Lock);
+        Produced = __RingStagingFlush(Ring);
+        KeReleaseSpinLockFromDpcLevel(&Ring->Write.Lock);
+
+        RingNotify(Ring, 0, Produced);
+    }
+
     Trace("<====\n");
 }
 
+// Multi-page console rings
+//
+// This is an extension of the console protocol that no stock backend
+// (xenconsoled, QEMU) negotiates today; it is only used with a backend
+// that explicitly opts in. Without one, or with RingPageOrder at its
+// default of 0, the classic single ring-ref layout is used.
+//
+// - The backend advertises the largest order it accepts by writing
+//   max-ring-page-order to its own xenstore area.
+// - The frontend picks order = min(max-ring-page-order, RingPageOrder)
+//   and, if that is non-zero, writes ring-page-order and one
+//   ring-ref<N> per page (N = 0 .. 2^order - 1) instead of ring-ref.
+//   Pages are mapped by the backend in ring-ref order to form one
+//   virtually contiguous area of Size = PAGE_SIZE << order bytes.
+// - Within that area the in data occupies [0, Size/4), the out data
+//   [Size/4, 3*Size/4) and in_cons, in_prod, out_cons and out_prod
+//   are consecutive 32-bit values starting at 3*Size/4.
+//
+// That is struct xencons_interface scaled up: both data areas must be
+// powers of 2 for the usual index masking, so the last quarter of the
+// area holds only the indices, exactly as the last quarter of the
+// single page does for order 0.
+static ULONG
+RingGetPageOrder(
+    _In_ PXENCONS_RING  Ring
+    )
+{
+    PSTR                Buffer;
+    ULONG               Order;
+    NTSTATUS            status;
+
+    if (Ring->MaxPageOrder == 0)
+        return 0;
+
+    // Backends that do not advertise support get the classic layout
+    status = XENBUS_STORE(Read,
+                          &Ring->StoreInterface,
+                          NULL,
+                          FrontendGetBackendPath(Ring->Frontend),
+                          "max-ring-page-order",
+                          &Buffer);
+    if (!NT_SUCCESS(status))
+        return 0;
+
+    Order = (ULONG)strtol(Buffer, NULL, 10);
+
+    XENBUS_STORE(Free,
+                 &Ring->StoreInterface,
+                 Buffer);
+
+    return __min(Order, Ring->MaxPageOrder);
+}
+
 NTSTATUS
 RingConnect(
     _In_ PXENCONS_RING  Ring
     )
 {
     CHAR                Name[MAXNAMELEN];
+    ULONG               Index;
     NTSTATUS            status;
 
     Trace("====>\n");
@@ -727,7 +2489,9 @@ RingConnect(
     if (!NT_SUCCESS(status))
         goto fail6;
 
-    Ring->Mdl = __AllocatePage();
+    Ring->Order = RingGetPageOrder(Ring);
+
+    Ring->Mdl = __AllocatePages(1 << Ring->Order, FALSE);
 
     status = STATUS_NO_MEMORY;
     if (Ring->Mdl == NULL)
@@ -737,16 +2501,22 @@ RingConnect(
     Ring->Shared = Ring->Mdl->MappedSystemVa;
     ASSERT(Ring->Shared != NULL);
 
-    status = XENBUS_GNTTAB(PermitForeignAccess,
-                           &Ring->GnttabInterface,
-                           Ring->GnttabCache,
-                           TRUE,
-                           FrontendGetBackendDomain(Ring->Frontend),
-                           MmGetMdlPfnArray(Ring->Mdl)[0],
-                           FALSE,
-                           &Ring->Entry);
-    if (!NT_SUCCESS(status))
-        goto fail8;
+    RingEngineInitialize(&Ring->Engine,
+                         Ring->Shared,
+                         PAGE_SIZE << Ring->Order);
+
+    for (Index = 0; Index < (1ul << Ring->Order); Index++) {
+        status = XENBUS_GNTTAB(PermitForeignAccess,
+                               &Ring->GnttabInterface,
+                               Ring->GnttabCache,
+                               TRUE,
+                               FrontendGetBackendDomain(Ring->Frontend),
+                               MmGetMdlPfnArray(Ring->Mdl)[Index],
+                               FALSE,
+                               &Ring->Entry[Index]);
+        if (!NT_SUCCESS(status))
+            goto fail8;
+    }
 
     Ring->Channel = XENBUS_EVTCHN(Open,
                                   &Ring->EvtchnInterface,
@@ -793,22 +2563,30 @@ fail10:
 fail9:
     Error("fail9\n");
 
-    (VOID)XENBUS_GNTTAB(RevokeForeignAccess,
-                        &Ring->GnttabInterface,
-                        Ring->GnttabCache,
-                        TRUE,
-                        Ring->Entry);
-    Ring->Entry = NULL;
-
 fail8:
     Error("fail8\n");
 
-    RtlZeroMemory(Ring->Shared, PAGE_SIZE);
+    while (Index != 0) {
+        --Index;
+
+        (VOID)XENBUS_GNTTAB(RevokeForeignAccess,
+                            &Ring->GnttabInterface,
+                            Ring->GnttabCache,
+                            TRUE,
+                            Ring->Entry[Index]);
+        Ring->Entry[Index] = NULL;
+    }
+
+    RtlZeroMemory(&Ring->Engine, sizeof(XENCONS_RING_ENGINE));
+
+    RtlZeroMemory(Ring->Shared, PAGE_SIZE << Ring->Order);
 
     Ring->Shared = NULL;
-    __FreePage(Ring->Mdl);
+    __FreePages(Ring->Mdl);
     Ring->Mdl = NULL;
 
+    Ring->Order = 0;
+
 fail7:
     Error("fail7\n");
 
@@ -854,6 +2632,7 @@ RingStoreWrite(
 {
     ULONG               Port;
     ULONG               GrantRef;
+    ULONG               Index;
     NTSTATUS            status;
 
     Port = XENBUS_EVTCHN(GetPort,
@@ -870,22 +2649,82 @@ RingStoreWrite(
     if (!NT_SUCCESS(status))
         goto fail1;
 
-    GrantRef = XENBUS_GNTTAB(GetReference,
-                             &Ring->GnttabInterface,
-                             Ring->Entry);
+    if (Ring->Order == 0) {
+        // Make sure a backend does not see a stale order from a
+        // previous connection
+        (VOID)XENBUS_STORE(Remove,
+                           &Ring->StoreInterface,
+                           Transaction,
+                           FrontendGetPath(Ring->Frontend),
+                           "ring-page-order");
+
+        GrantRef = XENBUS_GNTTAB(GetReference,
+                                 &Ring->GnttabInterface,
+                                 Ring->Entry[0]);
+
+        status = XENBUS_STORE(Printf,
+                              &Ring->StoreInterface,
+                              Transaction,
+                              FrontendGetPath(Ring->Frontend),
+                              "ring-ref",
+                              "%u",
+                              GrantRef);
+        if (!NT_SUCCESS(status))
+            goto fail2;
+
+        return STATUS_SUCCESS;
+    }
+
+    // Likewise a stale single page ring-ref, which a backend would
+    // otherwise be free to prefer over the ring-ref<N> set
+    (VOID)XENBUS_STORE(Remove,
+                       &Ring->StoreInterface,
+                       Transaction,
+                       FrontendGetPath(Ring->Frontend),
+                       "ring-ref");
 
     status = XENBUS_STORE(Printf,
                           &Ring->StoreInterface,
                           Transaction,
                           FrontendGetPath(Ring->Frontend),
-                          "ring-ref",
+                          "ring-page-order",
                           "%u",
-                          GrantRef);
+                          Ring->Order);
     if (!NT_SUCCESS(status))
-        goto fail2;
+        goto fail3;
+
+    for (Index = 0; Index < (1ul << Ring->Order); Index++) {
+        CHAR    Node[sizeof("ring-refXXXX")];
+
+        status = RtlStringCbPrintfA(Node,
+                                    sizeof(Node),
+                                    "ring-ref%u",
+                                    Index);
+        ASSERT(NT_SUCCESS(status));
+
+        GrantRef = XENBUS_GNTTAB(GetReference,
+                                 &Ring->GnttabInterface,
+                                 Ring->Entry[Index]);
+
+        status = XENBUS_STORE(Printf,
+                              &Ring->StoreInterface,
+                              Transaction,
+                              FrontendGetPath(Ring->Frontend),
+                              Node,
+                              "%u",
+                              GrantRef);
+        if (!NT_SUCCESS(status))
+            goto fail4;
+    }
 
     return STATUS_SUCCESS;
 
+fail4:
+    Error("fail4\n");
+
+fail3:
+    Error("fail3\n");
+
 fail2:
     Error("fail2\n");
 
@@ -900,6 +2739,8 @@ RingDisconnect(
     _In_ PXENCONS_RING  Ring
     )
 {
+    ULONG               Index;
+
     Trace("====>\n");
 
     ASSERT(Ring->Connected);
@@ -914,25 +2755,51 @@ RingDisconnect(
     Ring->Events = 0;
     Ring->BytesRead = 0;
     Ring->BytesWritten = 0;
+    Ring->ReadsCompleted = 0;
+    Ring->WritesCompleted = 0;
+    Ring->ReadStalls = 0;
+    Ring->WriteStalls = 0;
+    Ring->FullWritesHeld = 0;
+    Ring->WritesInteractive = 0;
+    Ring->WritesReordered = 0;
+    RtlZeroMemory(Ring->ReadLatency, sizeof (Ring->ReadLatency));
+    RtlZeroMemory(Ring->WriteLatency, sizeof (Ring->WriteLatency));
+    Ring->DirectBytesRead = 0;
+    Ring->DirectBytesWritten = 0;
+    Ring->NotifiesSent = 0;
+    Ring->Polls = 0;
+    Ring->PollPassesMax = 0;
+    Ring->EventsAvoided = 0;
+    Ring->ReadAheadHighWater = 0;
+    Ring->ReadAheadOverflows = 0;
+    Ring->ReadBatches = 0;
+    Ring->ReadBatchIrps = 0;
+    Ring->ReadBatchIrpsMax = 0;
 
     XENBUS_EVTCHN(Close,
                   &Ring->EvtchnInterface,
                   Ring->Channel);
     Ring->Channel = NULL;
 
-    (VOID)XENBUS_GNTTAB(RevokeForeignAccess,
-                        &Ring->GnttabInterface,
-                        Ring->GnttabCache,
-                        TRUE,
-                        Ring->Entry);
-    Ring->Entry = NULL;
+    for (Index = 0; Index < (1ul << Ring->Order); Index++) {
+        (VOID)XENBUS_GNTTAB(RevokeForeignAccess,
+                            &Ring->GnttabInterface,
+                            Ring->GnttabCache,
+                            TRUE,
+                            Ring->Entry[Index]);
+        Ring->Entry[Index] = NULL;
+    }
+
+    RtlZeroMemory(&Ring->Engine, sizeof(XENCONS_RING_ENGINE));
 
-    RtlZeroMemory(Ring->Shared, PAGE_SIZE);
+    RtlZeroMemory(Ring->Shared, PAGE_SIZE << Ring->Order);
 
     Ring->Shared = NULL;
-    __FreePage(Ring->Mdl);
+    __FreePages(Ring->Mdl);
     Ring->Mdl = NULL;
 
+    Ring->Order = 0;
+
     XENBUS_GNTTAB(DestroyCache,
                   &Ring->GnttabInterface,
                   Ring->GnttabCache);
@@ -955,6 +2822,15 @@ RingCreate(
     _Out_ PXENCONS_RING     *Ring
     )
 {
+    HANDLE                  ParametersKey;
+    ULONG                   MaxPageOrder;
+    ULONG                   StagingSize;
+    ULONG                   PollBudget;
+    ULONG                   PollIdlePasses;
+    ULONG                   ReadAheadSize;
+    ULONG                   WriteQuantum;
+    ULONG                   WriteInteractiveSize;
+    ULONG                   MapSize;
     NTSTATUS                status;
 
     *Ring = __RingAllocate(sizeof(XENCONS_RING));
@@ -965,6 +2841,107 @@ RingCreate(
 
     (*Ring)->Frontend = Frontend;
 
+    ParametersKey = DriverGetParametersKey();
+
+    status = RegistryQueryDwordValue(ParametersKey,
+                                     "RingPageOrder",
+                                     &MaxPageOrder);
+    if (!NT_SUCCESS(status))
+        MaxPageOrder = 0;
+
+    (*Ring)->MaxPageOrder = __min(MaxPageOrder, XENCONS_RING_MAX_PAGE_ORDER);
+
+    status = RegistryQueryDwordValue(ParametersKey,
+                                     "RingPollBudget",
+                                     &PollBudget);
+    if (!NT_SUCCESS(status))
+        PollBudget = 0;
+
+    (*Ring)->PollBudget = __min(PollBudget, XENCONS_RING_MAX_POLL_BUDGET);
+
+    status = RegistryQueryDwordValue(ParametersKey,
+                                     "RingPollIdlePasses",
+                                     &PollIdlePasses);
+    if (!NT_SUCCESS(status))
+        PollIdlePasses = 0;
+
+    (*Ring)->PollIdlePasses = __min(PollIdlePasses, (*Ring)->PollBudget);
+
+    status = RegistryQueryDwordValue(ParametersKey,
+                                     "RingReadAheadSize",
+                                     &ReadAheadSize);
+    if (!NT_SUCCESS(status))
+        ReadAheadSize = 0;
+
+    ReadAheadSize = __min(ReadAheadSize, XENCONS_RING_MAX_READ_AHEAD_SIZE);
+
+    // Round down to a power of 2
+    while ((ReadAheadSize & (ReadAheadSize - 1)) != 0)
+        ReadAheadSize &= ReadAheadSize - 1;
+
+    if (ReadAheadSize != 0) {
+        (*Ring)->ReadAhead = __RingAllocate(ReadAheadSize);
+
+        status = STATUS_NO_MEMORY;
+        if ((*Ring)->ReadAhead == NULL)
+            goto fail2;
+
+        (*Ring)->ReadAheadSize = ReadAheadSize;
+    }
+
+    status = RegistryQueryDwordValue(ParametersKey,
+                                     "RingWriteStagingSize",
+                                     &StagingSize);
+    if (!NT_SUCCESS(status))
+        StagingSize = 0;
+
+    StagingSize = __min(StagingSize, XENCONS_RING_MAX_STAGING_SIZE);
+
+    // Round down to a power of 2
+    while ((StagingSize & (StagingSize - 1)) != 0)
+        StagingSize &= StagingSize - 1;
+
+    if (StagingSize != 0) {
+        (*Ring)->Staging = __RingAllocate(StagingSize);
+
+        status = STATUS_NO_MEMORY;
+        if ((*Ring)->Staging == NULL)
+            goto fail3;
+
+        (*Ring)->StagingSize = StagingSize;
+    }
+
+    status = RegistryQueryDwordValue(ParametersKey,
+                                     "RingWriteQuantum",
+                                     &WriteQuantum);
+    if (!NT_SUCCESS(status))
+        WriteQuantum = XENCONS_RING_DEFAULT_WRITE_QUANTUM;
+
+    (*Ring)->WriteQuantum = WriteQuantum;
+
+    status = RegistryQueryDwordValue(ParametersKey,
+                                     "RingWriteInteractiveSize",
+                                     &WriteInteractiveSize);
+    if (!NT_SUCCESS(status))
+        WriteInteractiveSize = 0;
+
+    (*Ring)->WriteInteractiveSize = WriteInteractiveSize;
+    (*Ring)->WriteRound = WRITE_SCHEDULE_FIRST_ROUND;
+
+    status = RegistryQueryDwordValue(ParametersKey,
+                                     "RingSharedSize",
+                                     &MapSize);
+    if (!NT_SUCCESS(status))
+        MapSize = XENCONS_RING_DEFAULT_MAP_SIZE;
+
+    MapSize = __min(MapSize, XENCONS_RING_MAX_MAP_SIZE);
+
+    // Round down to a power of 2, and at least a page
+    while ((MapSize & (MapSize - 1)) != 0)
+        MapSize &= MapSize - 1;
+
+    (*Ring)->MapSize = (MapSize >= PAGE_SIZE) ? MapSize : 0;
+
     FdoGetDebugInterface(PdoGetFdo(FrontendGetPdo(Frontend)),
                          &(*Ring)->DebugInterface);
 
@@ -981,47 +2958,44 @@ RingCreate(
 
     KeInitializeThreadedDpc(&(*Ring)->Dpc, RingDpc, *Ring);
 
+    KeInitializeTimer(&(*Ring)->ReadTimer);
+    KeInitializeDpc(&(*Ring)->ReadTimerDpc, RingReadTimerDpc, *Ring);
+
     KeInitializeSpinLock(&(*Ring)->Read.Lock);
     InitializeListHead(&(*Ring)->Read.List);
-
-    status = IoCsqInitializeEx(&(*Ring)->Read.Csq,
-                               RingCsqInsertIrpEx,
-                               RingCsqRemoveIrp,
-                               RingCsqPeekNextIrp,
-                               RingCsqAcquireLock,
-                               RingCsqReleaseLock,
-                               RingCsqCompleteCanceledIrp);
-    if (!NT_SUCCESS(status))
-        goto fail2;
+    (*Ring)->Read.Dpc = &(*Ring)->Dpc;
 
     KeInitializeSpinLock(&(*Ring)->Write.Lock);
     InitializeListHead(&(*Ring)->Write.List);
+    (*Ring)->Write.Dpc = &(*Ring)->Dpc;
+    (*Ring)->Write.Insert = RingWriteInsert;
+    (*Ring)->Write.Argument = *Ring;
 
-    status = IoCsqInitializeEx(&(*Ring)->Write.Csq,
-                               RingCsqInsertIrpEx,
-                               RingCsqRemoveIrp,
-                               RingCsqPeekNextIrp,
-                               RingCsqAcquireLock,
-                               RingCsqReleaseLock,
-                               RingCsqCompleteCanceledIrp);
-    if (!NT_SUCCESS(status))
-        goto fail3;
+    KeInitializeSpinLock(&(*Ring)->Flush.Lock);
+    InitializeListHead(&(*Ring)->Flush.List);
+    (*Ring)->Flush.Dpc = &(*Ring)->Dpc;
 
     return STATUS_SUCCESS;
 
 fail3:
     Error("fail3\n");
 
-    RtlZeroMemory(&(*Ring)->Write.List, sizeof(LIST_ENTRY));
-    RtlZeroMemory(&(*Ring)->Write.Lock, sizeof(KSPIN_LOCK));
-
-    RtlZeroMemory(&(*Ring)->Read.Csq, sizeof(IO_CSQ));
+    if ((*Ring)->ReadAheadSize != 0) {
+        __RingFree((*Ring)->ReadAhead);
+        (*Ring)->ReadAhead = NULL;
+        (*Ring)->ReadAheadSize = 0;
+    }
 
 fail2:
     Error("fail2\n");
 
-    RtlZeroMemory(&(*Ring)->Read.List, sizeof(LIST_ENTRY));
-    RtlZeroMemory(&(*Ring)->Read.Lock, sizeof(KSPIN_LOCK));
+    (*Ring)->PollIdlePasses = 0;
+    (*Ring)->PollBudget = 0;
+    (*Ring)->MaxPageOrder = 0;
+    (*Ring)->Frontend = NULL;
+
+    ASSERT(IsZeroMemory(*Ring, sizeof(XENCONS_RING)));
+    __RingFree(*Ring);
 
 fail1:
     Error("fail1 (%08x)\n", status);
@@ -1039,19 +3013,83 @@ RingDestroy(
     // Cancel all outstanding IRPs
     __RingCancelRequests(Ring, NULL);
 
-    ASSERT(IsListEmpty(&Ring->Read.List));
-    ASSERT(IsListEmpty(&Ring->Write.List));
+    if (Ring->MapOwner != NULL)
+        __RingUnmapShared(Ring);
 
-    RtlZeroMemory(&Ring->Write.Csq, sizeof(IO_CSQ));
+    ASSERT3P(Ring->MapOwner, ==, NULL);
+    Ring->MapSize = 0;
+    Ring->MapBytesIn = 0;
+    Ring->MapBytesOut = 0;
+    Ring->MapSignals = 0;
+    Ring->MapKicks = 0;
 
+    ASSERT(IsListEmpty(&Ring->Read.List));
+    ASSERT(IsListEmpty(&Ring->Write.List));
+    ASSERT(IsListEmpty(&Ring->Flush.List));
+    ASSERT3P(Ring->Read.Inbox, ==, NULL);
+    ASSERT3P(Ring->Write.Inbox, ==, NULL);
+    ASSERT3P(Ring->Flush.Inbox, ==, NULL);
+
+    // Cancel routines and the read timer queue the DPC, and the DPC
+    // looks at the queues, so it must be idle before they are torn
+    // down. The first flush may queue the ring DPC again from the
+    // timer DPC; the second waits for that.
+    (VOID) KeCancelTimer(&Ring->ReadTimer);
+    KeFlushQueuedDpcs();
+    KeFlushQueuedDpcs();
+
+    // Anything still staged did not fit when the ring was last
+    // disabled and is lost along with the console
+    if (Ring->StagingCons != Ring->StagingProd)
+        Warning("%u staged bytes dropped\n",
+                Ring->StagingProd - Ring->StagingCons);
+
+    if (Ring->StagingSize != 0) {
+        __RingFree(Ring->Staging);
+        Ring->Staging = NULL;
+        Ring->StagingSize = 0;
+    }
+    Ring->StagingCons = 0;
+    Ring->StagingProd = 0;
+    Ring->StagedWrites = 0;
+    Ring->StagedBytes = 0;
+
+    if (Ring->ReadAheadSize != 0) {
+        __RingFree(Ring->ReadAhead);
+        Ring->ReadAhead = NULL;
+        Ring->ReadAheadSize = 0;
+    }
+    Ring->ReadAheadCons = 0;
+    Ring->ReadAheadProd = 0;
+
+    Ring->Flush.CancelGeneration = 0;
+    Ring->Flush.CancelPending = 0;
+    Ring->Flush.Dpc = NULL;
+    RtlZeroMemory(&Ring->Flush.List, sizeof(LIST_ENTRY));
+    RtlZeroMemory(&Ring->Flush.Lock, sizeof(KSPIN_LOCK));
+
+    RtlZeroMemory(&Ring->WriteFlow, sizeof (XENCONS_WRITE_FLOW));
+    Ring->WriteRound = 0;
+    Ring->WriteInteractiveSize = 0;
+    Ring->WriteQuantum = 0;
+
+    Ring->Write.Argument = NULL;
+    Ring->Write.Insert = NULL;
+    Ring->Write.CancelGeneration = 0;
+    Ring->Write.CancelPending = 0;
+    Ring->Write.Dpc = NULL;
     RtlZeroMemory(&Ring->Write.List, sizeof(LIST_ENTRY));
     RtlZeroMemory(&Ring->Write.Lock, sizeof(KSPIN_LOCK));
 
-    RtlZeroMemory(&Ring->Read.Csq, sizeof(IO_CSQ));
-
+    Ring->Read.CancelGeneration = 0;
+    Ring->Read.CancelPending = 0;
+    Ring->Read.Dpc = NULL;
     RtlZeroMemory(&Ring->Read.List, sizeof(LIST_ENTRY));
     RtlZeroMemory(&Ring->Read.Lock, sizeof(KSPIN_LOCK));
 
+    RtlZeroMemory(&Ring->ReadTimerDpc, sizeof(KDPC));
+    RtlZeroMemory(&Ring->ReadTimer, sizeof(KTIMER));
+
     RtlZeroMemory(&Ring->Dpc, sizeof(KDPC));
 
     RtlZeroMemory(&Ring->Lock, sizeof(KSPIN_LOCK));
@@ -1068,8 +3106,43 @@ RingDestroy(
     RtlZeroMemory(&Ring->DebugInterface,
                   sizeof(XENBUS_DEBUG_INTERFACE));
 
+    Ring->PollIdlePasses = 0;
+    Ring->PollBudget = 0;
+    Ring->MaxPageOrder = 0;
+
     Ring->Frontend = NULL;
 
     ASSERT(IsZeroMemory(Ring, sizeof(XENCONS_RING)));
     __RingFree(Ring);
 }
+
+VOID
+RingGetStatistics(
+    _In_ PXENCONS_RING          Ring,
+    _Out_ PXENCONS_STATISTICS   Statistics
+    )
+{
+    RtlZeroMemory(Statistics, sizeof (XENCONS_STATISTICS));
+
+    Statistics->Version = XENCONS_STATISTICS_VERSION;
+    Statistics->Size = sizeof (XENCONS_STATISTICS);
+
+    Statistics->BytesRead = Ring->BytesRead;
+    Statistics->BytesWritten = Ring->BytesWritten;
+    Statistics->ReadsCompleted = Ring->ReadsCompleted;
+    Statistics->WritesCompleted = Ring->WritesCompleted;
+    Statistics->ReadStalls = Ring->ReadStalls;
+    Statistics->WriteStalls = Ring->WriteStalls;
+    Statistics->Events = Ring->Events;
+    Statistics->Dpcs = Ring->Dpcs;
+    Statistics->Polls = Ring->Polls;
+    Statistics->ReadAheadOverflows = Ring->ReadAheadOverflows;
+    Statistics->ReadAheadHighWater = Ring->ReadAheadHighWater;
+
+    RtlCopyMemory(Statistics->ReadLatency,
+                  Ring->ReadLatency,
+                  sizeof (Statistics->ReadLatency));
+    RtlCopyMemory(Statistics->WriteLatency,
+                  Ring->WriteLatency,
+                  sizeof (Statistics->WriteLatency));
+}
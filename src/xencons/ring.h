@@ -34,6 +34,7 @@
 #define _XENCONS_RING_H
 
 #include <ntddk.h>
+#include <xencons_device.h>
 
 #include "frontend.h"
 
@@ -94,4 +95,40 @@ RingPutQueue(
     _In_ PIRP           Irp
     );
 
+extern NTSTATUS
+RingSetReadPolicy(
+    _In_ PXENCONS_RING  Ring,
+    _In_ PIRP           Irp
+    );
+
+extern NTSTATUS
+RingSetWriteMode(
+    _In_ PXENCONS_RING  Ring,
+    _In_ PIRP           Irp
+    );
+
+extern NTSTATUS
+RingMapShared(
+    _In_ PXENCONS_RING  Ring,
+    _In_ PIRP           Irp
+    );
+
+extern NTSTATUS
+RingKickShared(
+    _In_ PXENCONS_RING  Ring,
+    _In_ PIRP           Irp
+    );
+
+extern NTSTATUS
+RingFlush(
+    _In_ PXENCONS_RING  Ring,
+    _In_ PIRP           Irp
+    );
+
+extern VOID
+RingGetStatistics(
+    _In_ PXENCONS_RING          Ring,
+    _Out_ PXENCONS_STATISTICS   Statistics
+    );
+
 #endif  // _XENCONS_RING_H
@@ -0,0 +1,93 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms,
+* with or without modification, are permitted provided
+* that the following conditions are met:
+*
+* *   Redistributions of source code must retain the above
+*     copyright notice, this list of conditions and the
+*     following disclaimer.
+* *   Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the
+*     following disclaimer in the documentation and/or other
+*     materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+* CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+* INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+* CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+* BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+* INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+* WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+* NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+* SUCH DAMAGE.
+*/
+
+#ifndef _XENCONS_RING_COMPAT_H
+#define _XENCONS_RING_COMPAT_H
+
+// Minimal environment needed by the portable ring code. In the driver
+// everything maps straight onto the kernel primitives; elsewhere (user
+// mode tools, host builds) plain C equivalents are used.
+
+#if defined(_KERNEL_MODE)
+
+#include <ntddk.h>
+
+#define RingCompatMemoryBarrier()   KeMemoryBarrier()
+
+#define RingCompatCopy(_Destination, _Source, _Length) \
+        RtlCopyMemory((_Destination), (_Source), (_Length))
+
+#elif defined(_WIN32)
+
+#include <windows.h>
+
+#define RingCompatMemoryBarrier()   MemoryBarrier()
+
+#define RingCompatCopy(_Destination, _Source, _Length) \
+        CopyMemory((_Destination), (_Source), (_Length))
+
+#else   // !_KERNEL_MODE && !_WIN32
+
+#include <stdint.h>
+#include <string.h>
+
+typedef void                VOID, *PVOID;
+typedef char                CHAR, *PCHAR;
+typedef unsigned char       UCHAR, *PUCHAR;
+typedef unsigned char       BOOLEAN, *PBOOLEAN;
+typedef int32_t             LONG, *PLONG;
+typedef uint32_t            ULONG, *PULONG;
+typedef int64_t             LONGLONG, *PLONGLONG;
+typedef uint64_t            ULONGLONG, *PULONGLONG;
+typedef uintptr_t           ULONG_PTR, *PULONG_PTR;
+
+#define TRUE    1
+#define FALSE   0
+
+#ifndef FORCEINLINE
+#define FORCEINLINE __inline__ __attribute__((always_inline))
+#endif
+
+#define _In_
+#define _In_opt_
+#define _Out_
+#define _Out_opt_
+#define _Inout_
+
+#define RingCompatMemoryBarrier()   __sync_synchronize()
+
+#define RingCompatCopy(_Destination, _Source, _Length) \
+        memcpy((_Destination), (_Source), (_Length))
+
+#endif  // _KERNEL_MODE
+
+#endif  // _XENCONS_RING_COMPAT_H
@@ -0,0 +1,262 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms,
+* with or without modification, are permitted provided
+* that the following conditions are met:
+*
+* *   Redistributions of source code must retain the above
+*     copyright notice, this list of conditions and the
+*     following disclaimer.
+* *   Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the
+*     following disclaimer in the documentation and/or other
+*     materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+* CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+* INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+* CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+* BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+* INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+* WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+* NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+* SUCH DAMAGE.
+*/
+
+// The data path of a shared console ring, kept free of any kernel
+// dependencies (see ring_compat.h) so that it can be built and
+// exercised outside of the driver.
+
+#include "ring_engine.h"
+
+static FORCEINLINE ULONG
+__RingEngineMin(
+    _In_ ULONG  A,
+    _In_ ULONG  B
+    )
+{
+    return (A < B) ? A : B;
+}
+
+static FORCEINLINE ULONG
+__RingEngineMask(
+    _In_ PXENCONS_RING_ENGINE_QUEUE Queue,
+    _In_ ULONG                      Index
+    )
+{
+    return Index & (Queue->Size - 1);
+}
+
+VOID
+RingEngineInitializeQueue(
+    _Out_ PXENCONS_RING_ENGINE_QUEUE    Queue,
+    _In_ PCHAR                          Data,
+    _In_ ULONG                          Size,
+    _In_ volatile ULONG                 *Cons,
+    _In_ volatile ULONG                 *Prod
+    )
+{
+    Queue->Data = Data;
+    Queue->Size = Size;
+    Queue->Cons = Cons;
+    Queue->Prod = Prod;
+}
+
+VOID
+RingEngineInitialize(
+    _Out_ PXENCONS_RING_ENGINE  Engine,
+    _In_ PVOID                  Shared,
+    _In_ ULONG                  Size
+    )
+{
+    PCHAR                       Base = Shared;
+    volatile ULONG              *Index;
+
+    Index = (volatile ULONG *)(Base + (Size / 4) * 3);
+
+    RingEngineInitializeQueue(&Engine->In,
+                              Base,
+                              Size / 4,
+                              &Index[0],
+                              &Index[1]);
+
+    RingEngineInitializeQueue(&Engine->Out,
+                              Base + (Size / 4),
+                              Size / 2,
+                              &Index[2],
+                              &Index[3]);
+}
+
+VOID
+RingEngineSnapshot(
+    _In_ PXENCONS_RING_ENGINE_QUEUE     Queue,
+    _Out_ PXENCONS_RING_ENGINE_BATCH    Batch
+    )
+{
+    RingCompatMemoryBarrier();
+
+    Batch->cons = *Queue->Cons;
+    Batch->prod = *Queue->Prod;
+
+    RingCompatMemoryBarrier();
+}
+
+VOID
+RingEngineReadBegin(
+    _In_ PXENCONS_RING_ENGINE_QUEUE     Queue,
+    _Out_ PXENCONS_RING_ENGINE_BATCH    Batch
+    )
+{
+    RingEngineSnapshot(Queue, Batch);
+}
+
+ULONG
+RingEngineReadBatch(
+    _In_ PXENCONS_RING_ENGINE_QUEUE     Queue,
+    _Inout_ PXENCONS_RING_ENGINE_BATCH  Batch,
+    _Out_ PCHAR                         Buffer,
+    _In_ ULONG                          Length
+    )
+{
+    ULONG                               Offset;
+
+    Offset = 0;
+    while (Length != 0) {
+        ULONG   Available;
+        ULONG   Index;
+        ULONG   CopyLength;
+
+        Available = Batch->prod - Batch->cons;
+
+        if (Available == 0)
+            break;
+
+        Index = __RingEngineMask(Queue, Batch->cons);
+
+        CopyLength = __RingEngineMin(Length, Available);
+        CopyLength = __RingEngineMin(CopyLength, Queue->Size - Index);
+
+        RingCompatCopy(Buffer + Offset, &Queue->Data[Index], CopyLength);
+
+        Offset += CopyLength;
+        Length -= CopyLength;
+
+        Batch->cons += CopyLength;
+    }
+
+    return Offset;
+}
+
+VOID
+RingEngineReadCommit(
+    _In_ PXENCONS_RING_ENGINE_QUEUE     Queue,
+    _In_ PXENCONS_RING_ENGINE_BATCH     Batch
+    )
+{
+    RingCompatMemoryBarrier();
+
+    *Queue->Cons = Batch->cons;
+
+    RingCompatMemoryBarrier();
+}
+
+ULONG
+RingEngineRead(
+    _In_ PXENCONS_RING_ENGINE_QUEUE Queue,
+    _Out_ PCHAR                     Buffer,
+    _In_ ULONG                      Length
+    )
+{
+    XENCONS_RING_ENGINE_BATCH       Batch;
+    ULONG                           Read;
+
+    RingEngineReadBegin(Queue, &Batch);
+    Read = RingEngineReadBatch(Queue, &Batch, Buffer, Length);
+    RingEngineReadCommit(Queue, &Batch);
+
+    return Read;
+}
+
+ULONG
+RingEngineWrite(
+    _In_ PXENCONS_RING_ENGINE_QUEUE Queue,
+    _In_ const CHAR                 *Buffer,
+    _In_ ULONG                      Length
+    )
+{
+    ULONG                           cons;
+    ULONG                           prod;
+    ULONG                           Offset;
+
+    RingCompatMemoryBarrier();
+
+    prod = *Queue->Prod;
+    cons = *Queue->Cons;
+
+    RingCompatMemoryBarrier();
+
+    Offset = 0;
+    while (Length != 0) {
+        ULONG   Available;
+        ULONG   Index;
+        ULONG   CopyLength;
+
+        Available = cons + Queue->Size - prod;
+
+        if (Available == 0)
+            break;
+
+        Index = __RingEngineMask(Queue, prod);
+
+        CopyLength = __RingEngineMin(Length, Available);
+        CopyLength = __RingEngineMin(CopyLength, Queue->Size - Index);
+
+        RingCompatCopy(&Queue->Data[Index], Buffer + Offset, CopyLength);
+
+        Offset += CopyLength;
+        Length -= CopyLength;
+
+        prod += CopyLength;
+    }
+
+    RingCompatMemoryBarrier();
+
+    *Queue->Prod = prod;
+
+    RingCompatMemoryBarrier();
+
+    return Offset;
+}
+
+ULONG
+RingEngineGetUsed(
+    _In_ PXENCONS_RING_ENGINE_QUEUE Queue
+    )
+{
+    ULONG                           cons;
+    ULONG                           prod;
+
+    RingCompatMemoryBarrier();
+
+    cons = *Queue->Cons;
+    prod = *Queue->Prod;
+
+    RingCompatMemoryBarrier();
+
+    return prod - cons;
+}
+
+ULONG
+RingEngineGetFree(
+    _In_ PXENCONS_RING_ENGINE_QUEUE Queue
+    )
+{
+    return Queue->Size - RingEngineGetUsed(Queue);
+}
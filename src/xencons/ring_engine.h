@@ -0,0 +1,143 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms,
+* with or without modification, are permitted provided
+* that the following conditions are met:
+*
+* *   Redistributions of source code must retain the above
+*     copyright notice, this list of conditions and the
+*     following disclaimer.
+* *   Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the
+*     following disclaimer in the documentation and/or other
+*     materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+* CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+* INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+* CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+* BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+* INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+* WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+* NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+* SUCH DAMAGE.
+*/
+
+#ifndef _XENCONS_RING_ENGINE_H
+#define _XENCONS_RING_ENGINE_H
+
+#include "ring_compat.h"
+
+// One direction of a shared console ring: a power-of-2 sized data
+// buffer plus free-running consumer and producer indices.
+typedef struct _XENCONS_RING_ENGINE_QUEUE {
+    PCHAR           Data;
+    ULONG           Size;
+    volatile ULONG  *Cons;
+    volatile ULONG  *Prod;
+} XENCONS_RING_ENGINE_QUEUE, *PXENCONS_RING_ENGINE_QUEUE;
+
+typedef struct _XENCONS_RING_ENGINE {
+    XENCONS_RING_ENGINE_QUEUE   In;     // backend -> frontend
+    XENCONS_RING_ENGINE_QUEUE   Out;    // frontend -> backend
+} XENCONS_RING_ENGINE, *PXENCONS_RING_ENGINE;
+
+// Snapshot of a queue's indices, allowing several reads to be carried
+// out against a single producer index with one consumer update.
+typedef struct _XENCONS_RING_ENGINE_BATCH {
+    ULONG   cons;
+    ULONG   prod;
+} XENCONS_RING_ENGINE_BATCH, *PXENCONS_RING_ENGINE_BATCH;
+
+// Lay out a shared ring of Size bytes (a power of 2, at least one
+// page): the first quarter holds the in data, the next half the out
+// data and the last quarter starts with the in_cons, in_prod, out_cons
+// and out_prod indices. For a single 4 KiB page this is exactly
+// struct xencons_interface; larger sizes are only understood by a
+// backend that negotiates ring-page-order (see ring.c).
+extern VOID
+RingEngineInitialize(
+    _Out_ PXENCONS_RING_ENGINE  Engine,
+    _In_ PVOID                  Shared,
+    _In_ ULONG                  Size
+    );
+
+extern VOID
+RingEngineInitializeQueue(
+    _Out_ PXENCONS_RING_ENGINE_QUEUE    Queue,
+    _In_ PCHAR                          Data,
+    _In_ ULONG                          Size,
+    _In_ volatile ULONG                 *Cons,
+    _In_ volatile ULONG                 *Prod
+    );
+
+// Consumer side: copy up to Length bytes out of the queue and
+// publish the new consumer index. Returns the number of bytes copied.
+extern ULONG
+RingEngineRead(
+    _In_ PXENCONS_RING_ENGINE_QUEUE Queue,
+    _Out_ PCHAR                     Buffer,
+    _In_ ULONG                      Length
+    );
+
+// Producer side: copy up to Length bytes into the queue and
+// publish the new producer index. Returns the number of bytes copied.
+extern ULONG
+RingEngineWrite(
+    _In_ PXENCONS_RING_ENGINE_QUEUE Queue,
+    _In_ const CHAR                 *Buffer,
+    _In_ ULONG                      Length
+    );
+
+extern VOID
+RingEngineSnapshot(
+    _In_ PXENCONS_RING_ENGINE_QUEUE     Queue,
+    _Out_ PXENCONS_RING_ENGINE_BATCH    Batch
+    );
+
+extern VOID
+RingEngineReadBegin(
+    _In_ PXENCONS_RING_ENGINE_QUEUE     Queue,
+    _Out_ PXENCONS_RING_ENGINE_BATCH    Batch
+    );
+
+extern ULONG
+RingEngineReadBatch(
+    _In_ PXENCONS_RING_ENGINE_QUEUE     Queue,
+    _Inout_ PXENCONS_RING_ENGINE_BATCH  Batch,
+    _Out_ PCHAR                         Buffer,
+    _In_ ULONG                          Length
+    );
+
+extern VOID
+RingEngineReadCommit(
+    _In_ PXENCONS_RING_ENGINE_QUEUE     Queue,
+    _In_ PXENCONS_RING_ENGINE_BATCH     Batch
+    );
+
+static FORCEINLINE ULONG
+RingEngineGetBatchAvailable(
+    _In_ PXENCONS_RING_ENGINE_BATCH Batch
+    )
+{
+    return Batch->prod - Batch->cons;
+}
+
+extern ULONG
+RingEngineGetUsed(
+    _In_ PXENCONS_RING_ENGINE_QUEUE Queue
+    );
+
+extern ULONG
+RingEngineGetFree(
+    _In_ PXENCONS_RING_ENGINE_QUEUE Queue
+    );
+
+#endif  // _XENCONS_RING_ENGINE_H
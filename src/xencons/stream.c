@@ -35,20 +35,46 @@
 #include "fdo.h"
 #include "stream.h"
 #include "thread.h"
+#include "mutex.h"
 #include "names.h"
 #include "dbg_print.h"
 #include "assert.h"
 #include "util.h"
+#include "read_policy.h"
 
 #define STREAM_POOL 'ETRS'
 
+#define STREAM_BUFFER_SIZE          PAGE_SIZE
+#define STREAM_CLIENT_BUFFER_SIZE   PAGE_SIZE
+
+C_ASSERT((STREAM_CLIENT_BUFFER_SIZE & (STREAM_CLIENT_BUFFER_SIZE - 1)) == 0);
+C_ASSERT(STREAM_BUFFER_SIZE <= STREAM_CLIENT_BUFFER_SIZE);
+
+struct _XENCONS_STREAM_CLIENT {
+    LIST_ENTRY                  ListEntry;
+    PXENCONS_STREAM             Stream;
+    IO_CSQ                      Csq;
+    LIST_ENTRY                  List;
+    KSPIN_LOCK                  Lock;
+    CHAR                        Buffer[STREAM_CLIENT_BUFFER_SIZE];
+    ULONG                       Cons;
+    ULONG                       Prod;
+    XENCONS_READ_POLICY         ReadPolicy;
+    KTIMER                      ReadTimer;
+    KDPC                        ReadTimerDpc;
+    LONG                        ReadTimedOut;
+    ULONG                       WriteMode;
+};
+
 struct _XENCONS_STREAM {
-    PXENCONS_FDO            	Fdo;
-    PXENCONS_THREAD         	Thread;
-    IO_CSQ                  	Csq;
-    LIST_ENTRY              	List;
-    KSPIN_LOCK           	Lock;
-    XENBUS_CONSOLE_INTERFACE 	ConsoleInterface;
+    PXENCONS_FDO                Fdo;
+    PXENCONS_THREAD             Thread;
+    MUTEX                       Mutex;
+    LIST_ENTRY                  Clients;
+    ULONG                       ClientCount;
+    CHAR                        Buffer[STREAM_BUFFER_SIZE];
+    XENCONS_STATISTICS          Statistics;
+    XENBUS_CONSOLE_INTERFACE    ConsoleInterface;
 };
 
 static FORCEINLINE PVOID
@@ -76,18 +102,20 @@ StreamCsqInsertIrpEx(
     _In_ PVOID          InsertContext OPTIONAL
     )
 {
-    BOOLEAN             ReInsert = (BOOLEAN)(ULONG_PTR)InsertContext;
-    PXENCONS_STREAM     Stream;
+    BOOLEAN                 ReInsert = (BOOLEAN)(ULONG_PTR)InsertContext;
+    PXENCONS_STREAM_CLIENT  Client;
 
-    Stream = CONTAINING_RECORD(Csq, XENCONS_STREAM, Csq);
+    Client = CONTAINING_RECORD(Csq, XENCONS_STREAM_CLIENT, Csq);
 
     if (ReInsert) {
         // This only occurs if the worker thread de-queued the IRP but
-        // then found the console to be blocked.
-        InsertHeadList(&Stream->List, &Irp->Tail.Overlay.ListEntry);
+        // then found the console (or the client buffer) to be blocked.
+        InsertHeadList(&Client->List, &Irp->Tail.Overlay.ListEntry);
     } else {
-        InsertTailList(&Stream->List, &Irp->Tail.Overlay.ListEntry);
-        ThreadWake(Stream->Thread);
+        __IrpSetTimestamp(Irp);
+
+        InsertTailList(&Client->List, &Irp->Tail.Overlay.ListEntry);
+        ThreadWake(Client->Stream->Thread);
     }
 
     return STATUS_SUCCESS;
@@ -115,19 +143,19 @@ StreamCsqPeekNextIrp(
     _In_ PVOID      PeekContext OPTIONAL
     )
 {
-    PXENCONS_STREAM Stream;
-    PLIST_ENTRY     ListEntry;
-    PIRP            NextIrp;
+    PXENCONS_STREAM_CLIENT  Client;
+    PLIST_ENTRY             ListEntry;
+    PIRP                    NextIrp;
 
     UNREFERENCED_PARAMETER(PeekContext);
 
-    Stream = CONTAINING_RECORD(Csq, XENCONS_STREAM, Csq);
+    Client = CONTAINING_RECORD(Csq, XENCONS_STREAM_CLIENT, Csq);
 
     ListEntry = (Irp == NULL) ?
-                Stream->List.Flink :
+                Client->List.Flink :
                 Irp->Tail.Overlay.ListEntry.Flink;
 
-    if (ListEntry == &Stream->List)
+    if (ListEntry == &Client->List)
         return NULL;
 
     NextIrp = CONTAINING_RECORD(ListEntry, IRP, Tail.Overlay.ListEntry);
@@ -146,11 +174,11 @@ StreamCsqAcquireLock(
     _Out_ _At_(*Irql, _IRQL_saves_) PKIRQL  Irql
     )
 {
-    PXENCONS_STREAM                         Stream;
+    PXENCONS_STREAM_CLIENT                  Client;
 
-    Stream = CONTAINING_RECORD(Csq, XENCONS_STREAM, Csq);
+    Client = CONTAINING_RECORD(Csq, XENCONS_STREAM_CLIENT, Csq);
 
-    KeAcquireSpinLock(&Stream->Lock, Irql);
+    KeAcquireSpinLock(&Client->Lock, Irql);
 }
 
 _Function_class_(IO_CSQ_RELEASE_LOCK)
@@ -163,12 +191,12 @@ StreamCsqReleaseLock(
     _In_ _IRQL_restores_ KIRQL  Irql
     )
 {
-    PXENCONS_STREAM             Stream;
+    PXENCONS_STREAM_CLIENT      Client;
 
-    Stream = CONTAINING_RECORD(Csq, XENCONS_STREAM, Csq);
+    Client = CONTAINING_RECORD(Csq, XENCONS_STREAM_CLIENT, Csq);
 
-    _Analysis_assume_lock_held_(Stream->Lock);
-    KeReleaseSpinLock(&Stream->Lock, Irql);
+    _Analysis_assume_lock_held_(Client->Lock);
+    KeReleaseSpinLock(&Client->Lock, Irql);
 }
 
 IO_CSQ_COMPLETE_CANCELED_IRP StreamCsqCompleteCanceledIrp;
@@ -187,8 +215,13 @@ StreamCsqCompleteCanceledIrp(
     StackLocation = IoGetCurrentIrpStackLocation(Irp);
     MajorFunction = StackLocation->MajorFunction;
 
-    Irp->IoStatus.Information = 0;
-    Irp->IoStatus.Status = STATUS_CANCELLED;
+    // Reads waiting on their completion policy and writes in full
+    // write mode may already have moved some data. That data has gone
+    // from the ring, and the I/O manager only copies a buffered read
+    // back on success, so report it rather than the cancellation.
+    Irp->IoStatus.Status = (Irp->IoStatus.Information != 0) ?
+                           STATUS_SUCCESS :
+                           STATUS_CANCELLED;
 
     Trace("CANCELLED (%02x:%s)\n",
           MajorFunction,
@@ -197,6 +230,310 @@ StreamCsqCompleteCanceledIrp(
     IoCompleteRequest(Irp, IO_NO_INCREMENT);
 }
 
+static FORCEINLINE ULONG
+__StreamClientGetSpace(
+    _In_ PXENCONS_STREAM_CLIENT Client
+    )
+{
+    return STREAM_CLIENT_BUFFER_SIZE - (Client->Prod - Client->Cons);
+}
+
+// Append data pulled from the console to a client buffer. The caller
+// never pulls more than every client has room for (see
+// StreamGetSpace()), so nothing is ever dropped.
+static VOID
+StreamClientAppend(
+    _In_ PXENCONS_STREAM_CLIENT Client,
+    _In_ PCHAR                  Data,
+    _In_ ULONG                  Length
+    )
+{
+    ASSERT3U(Length, <=, __StreamClientGetSpace(Client));
+
+    while (Length != 0) {
+        ULONG   Offset;
+        ULONG   Available;
+
+        Offset = Client->Prod & (STREAM_CLIENT_BUFFER_SIZE - 1);
+        Available = __min(Length, STREAM_CLIENT_BUFFER_SIZE - Offset);
+
+        RtlCopyMemory(&Client->Buffer[Offset], Data, Available);
+
+        Client->Prod += Available;
+        Data += Available;
+        Length -= Available;
+    }
+}
+
+static ULONG
+StreamClientRead(
+    _In_ PXENCONS_STREAM_CLIENT Client,
+    _In_ PCHAR                  Data,
+    _In_ ULONG                  Length
+    )
+{
+    ULONG                       Read;
+
+    Read = 0;
+    while (Length != 0 && Client->Cons != Client->Prod) {
+        ULONG   Offset;
+        ULONG   Available;
+
+        Offset = Client->Cons & (STREAM_CLIENT_BUFFER_SIZE - 1);
+        Available = __min(Client->Prod - Client->Cons,
+                          STREAM_CLIENT_BUFFER_SIZE - Offset);
+        Available = __min(Available, Length);
+
+        RtlCopyMemory(Data, &Client->Buffer[Offset], Available);
+
+        Client->Cons += Available;
+        Data += Available;
+        Length -= Available;
+        Read += Available;
+    }
+
+    return Read;
+}
+
+_Function_class_(KDEFERRED_ROUTINE)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_min_(DISPATCH_LEVEL)
+_IRQL_requires_same_
+static VOID
+StreamClientReadTimerDpc(
+    _In_ PKDPC              Dpc,
+    _In_ PVOID              Context,
+    _In_ PVOID              Argument1,
+    _In_ PVOID              Argument2
+    )
+{
+    PXENCONS_STREAM_CLIENT  Client = Context;
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(Argument1);
+    UNREFERENCED_PARAMETER(Argument2);
+
+    ASSERT(Client != NULL);
+
+    (VOID) InterlockedExchange(&Client->ReadTimedOut, 1);
+    ThreadWake(Client->Stream->Thread);
+}
+
+static VOID
+StreamClientPoll(
+    _In_ PXENCONS_STREAM_CLIENT Client
+    )
+{
+    PXENCONS_STREAM             Stream = Client->Stream;
+    PIRP                        Irp;
+    BOOLEAN                     TimedOut;
+    NTSTATUS                    status;
+
+    TimedOut = (InterlockedExchange(&Client->ReadTimedOut, 0) != 0) ?
+               TRUE :
+               FALSE;
+
+    for (Irp = IoCsqRemoveNextIrp(&Client->Csq, NULL);
+         Irp != NULL;
+         Irp = IoCsqRemoveNextIrp(&Client->Csq, NULL)) {
+        PIO_STACK_LOCATION  StackLocation;
+        UCHAR               MajorFunction;
+        BOOLEAN             Blocked;
+
+        StackLocation = IoGetCurrentIrpStackLocation(Irp);
+        MajorFunction = StackLocation->MajorFunction;
+
+        switch (MajorFunction) {
+        case IRP_MJ_READ:
+            // Reads are held back by their completion policy below
+            Blocked = FALSE;
+            break;
+
+        case IRP_MJ_WRITE:
+            Blocked = !XENBUS_CONSOLE(CanWrite,
+                                      &Stream->ConsoleInterface);
+            break;
+
+        default:
+            ASSERT(FALSE);
+
+            Blocked = TRUE;
+            break;
+        }
+
+        if (Blocked) {
+            Stream->Statistics.WriteStalls++;
+
+            status = IoCsqInsertIrpEx(&Client->Csq,
+                                      Irp,
+                                      NULL,
+                                      (PVOID)TRUE);
+            ASSERT(NT_SUCCESS(status));
+
+            break;
+        }
+
+        switch (MajorFunction) {
+        case IRP_MJ_READ: {
+            ULONG   Length;
+            PCHAR   Buffer;
+            ULONG   Offset;
+            ULONG   Read;
+            ULONG   Bucket;
+
+            Length = StackLocation->Parameters.Read.Length;
+            Buffer = __IrpGetBuffer(Irp);
+
+            if (Buffer == NULL && Length != 0) {
+                Irp->IoStatus.Information = 0;
+                Irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+                break;
+            }
+
+            // The IRP may already hold data from an earlier pass
+            Offset = (ULONG)Irp->IoStatus.Information;
+
+            Read = StreamClientRead(Client, Buffer + Offset, Length - Offset);
+
+            Stream->Statistics.BytesRead += Read;
+            Irp->IoStatus.Information = Offset + Read;
+
+            if (!ReadPolicyIsComplete(&Client->ReadPolicy,
+                                      Buffer + Offset,
+                                      Read,
+                                      Offset + Read,
+                                      Length,
+                                      TimedOut)) {
+                if (Read == 0) {
+                    Stream->Statistics.ReadStalls++;
+                } else if (Client->ReadPolicy.InterByteTimeout != 0) {
+                    LARGE_INTEGER   Timeout;
+
+                    Timeout.QuadPart = -10000ll *
+                                       Client->ReadPolicy.InterByteTimeout;
+                    KeSetTimer(&Client->ReadTimer,
+                               Timeout,
+                               &Client->ReadTimerDpc);
+                }
+
+                // Nothing behind this IRP can be serviced until it
+                // is complete, so put it back at the head and stop.
+                status = IoCsqInsertIrpEx(&Client->Csq,
+                                          Irp,
+                                          NULL,
+                                          (PVOID)TRUE);
+                ASSERT(NT_SUCCESS(status));
+
+                return;
+            }
+
+            // Whatever the timer was running for is no longer
+            // relevant, and must not cut short the next read.
+            TimedOut = FALSE;
+            (VOID) KeCancelTimer(&Client->ReadTimer);
+            (VOID) InterlockedExchange(&Client->ReadTimedOut, 0);
+
+            Stream->Statistics.ReadsCompleted++;
+            Bucket = __IrpGetLatencyBucket(Irp, XENCONS_LATENCY_BUCKETS);
+            Stream->Statistics.ReadLatency[Bucket]++;
+
+            Irp->IoStatus.Status = STATUS_SUCCESS;
+            break;
+        }
+        case IRP_MJ_WRITE: {
+            ULONG   Length;
+            PCHAR   Buffer;
+            ULONG   Offset;
+            ULONG   Written;
+            ULONG   Bucket;
+
+            Length = StackLocation->Parameters.Write.Length;
+            Buffer = __IrpGetBuffer(Irp);
+
+            if (Buffer == NULL && Length != 0) {
+                Irp->IoStatus.Information = 0;
+                Irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+                break;
+            }
+
+            // A full-mode write may already have been partly transferred
+            Offset = (ULONG)Irp->IoStatus.Information;
+
+            Written = XENBUS_CONSOLE(Write,
+                                     &Stream->ConsoleInterface,
+                                     Buffer + Offset,
+                                     Length - Offset);
+
+            Stream->Statistics.BytesWritten += Written;
+            Irp->IoStatus.Information = Offset + Written;
+
+            if ((Client->WriteMode & XENCONS_WRITE_MODE_FULL) &&
+                Offset + Written < Length) {
+                Stream->Statistics.WriteStalls++;
+
+                status = IoCsqInsertIrpEx(&Client->Csq,
+                                          Irp,
+                                          NULL,
+                                          (PVOID)TRUE);
+                ASSERT(NT_SUCCESS(status));
+
+                return;
+            }
+
+            Stream->Statistics.WritesCompleted++;
+            Bucket = __IrpGetLatencyBucket(Irp, XENCONS_LATENCY_BUCKETS);
+            Stream->Statistics.WriteLatency[Bucket]++;
+
+            Irp->IoStatus.Status = STATUS_SUCCESS;
+            break;
+        }
+        default:
+            ASSERT(FALSE);
+
+            Irp->IoStatus.Status = STATUS_UNSUCCESSFUL;
+            break;
+        }
+
+        Trace("COMPLETE (%02x:%s) (%u bytes)\n",
+              MajorFunction,
+              MajorFunctionName(MajorFunction),
+              Irp->IoStatus.Information);
+
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+    }
+}
+
+// How much can be pulled from the console: the least space left in
+// any client buffer, so the slowest reader sets the pace just as it
+// would if it were reading the console directly.
+static ULONG
+StreamGetSpace(
+    _In_ PXENCONS_STREAM    Stream
+    )
+{
+    PLIST_ENTRY             ListEntry;
+    ULONG                   Space;
+
+    if (Stream->ClientCount == 0)
+        return 0;
+
+    Space = sizeof (Stream->Buffer);
+
+    for (ListEntry = Stream->Clients.Flink;
+         ListEntry != &Stream->Clients;
+         ListEntry = ListEntry->Flink) {
+        PXENCONS_STREAM_CLIENT  Client;
+
+        Client = CONTAINING_RECORD(ListEntry,
+                                   XENCONS_STREAM_CLIENT,
+                                   ListEntry);
+
+        Space = __min(Space, __StreamClientGetSpace(Client));
+    }
+
+    return Space;
+}
+
 static NTSTATUS
 StreamWorker(
     _In_ PXENCONS_THREAD    Self,
@@ -225,7 +562,8 @@ StreamWorker(
         goto fail2;
 
     for (;;) {
-        PIRP    Irp;
+        PLIST_ENTRY ListEntry;
+        BOOLEAN     Progress;
 
         (VOID) KeWaitForSingleObject(Event,
                                      Executive,
@@ -237,93 +575,70 @@ StreamWorker(
         if (ThreadIsAlerted(Self))
             break;
 
-        for (Irp = IoCsqRemoveNextIrp(&Stream->Csq, NULL);
-             Irp != NULL;
-             Irp = IoCsqRemoveNextIrp(&Stream->Csq, NULL)) {
-            PIO_STACK_LOCATION  StackLocation;
-            UCHAR               MajorFunction;
-            BOOLEAN             Blocked;
-
-            StackLocation = IoGetCurrentIrpStackLocation(Irp);
-            MajorFunction = StackLocation->MajorFunction;
-
-            switch (MajorFunction) {
-            case IRP_MJ_READ:
-                Blocked = !XENBUS_CONSOLE(CanRead,
-                                          &Stream->ConsoleInterface);
-                break;
-
-            case IRP_MJ_WRITE:
-                Blocked = !XENBUS_CONSOLE(CanWrite,
-                                          &Stream->ConsoleInterface);
-                break;
-
-            default:
-                ASSERT(FALSE);
+        AcquireMutex(&Stream->Mutex);
 
-                Blocked = TRUE;
-                break;
-            }
+        Stream->Statistics.Events++;
 
-            if (Blocked) {
-                status = IoCsqInsertIrpEx(&Stream->Csq,
-                                          Irp,
-                                          NULL,
-                                          (PVOID)TRUE);
-                ASSERT(NT_SUCCESS(status));
-
-                break;
-            }
-
-            switch (MajorFunction) {
-            case IRP_MJ_READ: {
-                ULONG   Length;
-                PCHAR   Buffer;
+        do {
+            // Data is only pulled from the console while somebody is
+            // listening, and only as much as every client can hold;
+            // each chunk is then copied to every client.
+            for (;;) {
+                ULONG   Space;
                 ULONG   Read;
 
-                Length = StackLocation->Parameters.Read.Length;
-                Buffer = Irp->AssociatedIrp.SystemBuffer;
+                Space = StreamGetSpace(Stream);
+                if (Space == 0 ||
+                    !XENBUS_CONSOLE(CanRead, &Stream->ConsoleInterface))
+                    break;
 
                 Read = XENBUS_CONSOLE(Read,
                                       &Stream->ConsoleInterface,
-                                      Buffer,
-                                      Length);
-
-                Irp->IoStatus.Information = Read;
-                Irp->IoStatus.Status = STATUS_SUCCESS;
-                break;
+                                      Stream->Buffer,
+                                      Space);
+                if (Read == 0)
+                    break;
+
+                for (ListEntry = Stream->Clients.Flink;
+                     ListEntry != &Stream->Clients;
+                     ListEntry = ListEntry->Flink) {
+                    PXENCONS_STREAM_CLIENT  Client;
+
+                    Client = CONTAINING_RECORD(ListEntry,
+                                               XENCONS_STREAM_CLIENT,
+                                               ListEntry);
+
+                    StreamClientAppend(Client, Stream->Buffer, Read);
+                }
             }
-            case IRP_MJ_WRITE: {
-                ULONG   Length;
-                PCHAR   Buffer;
-                ULONG   Written;
 
-                Length = StackLocation->Parameters.Write.Length;
-                Buffer = Irp->AssociatedIrp.SystemBuffer;
+            Progress = FALSE;
 
-                Written = XENBUS_CONSOLE(Write,
-                                         &Stream->ConsoleInterface,
-                                         Buffer,
-                                         Length);
+            for (ListEntry = Stream->Clients.Flink;
+                 ListEntry != &Stream->Clients;
+                 ListEntry = ListEntry->Flink) {
+                PXENCONS_STREAM_CLIENT  Client;
+                ULONG                   Cons;
 
-                Irp->IoStatus.Information = Written;
-                Irp->IoStatus.Status = STATUS_SUCCESS;
-                break;
-            }
-            default:
-                ASSERT(FALSE);
+                Client = CONTAINING_RECORD(ListEntry,
+                                           XENCONS_STREAM_CLIENT,
+                                           ListEntry);
 
-                Irp->IoStatus.Status = STATUS_UNSUCCESSFUL;
-                break;
+                Cons = Client->Cons;
+
+                StreamClientPoll(Client);
+                Stream->Statistics.Polls++;
+
+                if (Client->Cons != Cons)
+                    Progress = TRUE;
             }
 
-            Trace("COMPLETE (%02x:%s) (%u bytes)\n",
-                  MajorFunction,
-                  MajorFunctionName(MajorFunction),
-                  Irp->IoStatus.Information);
+            // Going round again only helps if a client made room for
+            // console data that is still waiting
+        } while (Progress &&
+                 XENBUS_CONSOLE(CanRead, &Stream->ConsoleInterface));
 
-            IoCompleteRequest(Irp, IO_NO_INCREMENT);
-        }
+        ReleaseMutex(&Stream->Mutex);
     }
 
     XENBUS_CONSOLE(WakeupRemove,
@@ -363,39 +678,24 @@ StreamCreate(
 
     FdoGetConsoleInterface(Fdo, &(*Stream)->ConsoleInterface);
 
-    KeInitializeSpinLock(&(*Stream)->Lock);
-    InitializeListHead(&(*Stream)->List);
-
-    status = IoCsqInitializeEx(&(*Stream)->Csq,
-                               StreamCsqInsertIrpEx,
-                               StreamCsqRemoveIrp,
-                               StreamCsqPeekNextIrp,
-                               StreamCsqAcquireLock,
-                               StreamCsqReleaseLock,
-                               StreamCsqCompleteCanceledIrp);
-    if (!NT_SUCCESS(status))
-        goto fail2;
+    InitializeMutex(&(*Stream)->Mutex);
+    InitializeListHead(&(*Stream)->Clients);
 
     status = ThreadCreate(StreamWorker,
                           *Stream,
                           &(*Stream)->Thread);
     if (!NT_SUCCESS(status))
-        goto fail3;
+        goto fail2;
 
     (*Stream)->Fdo = Fdo;
 
     return STATUS_SUCCESS;
 
-fail3:
-    Error("fail3\n");
-
-    RtlZeroMemory(&(*Stream)->Csq, sizeof (IO_CSQ));
-
 fail2:
     Error("fail2\n");
 
-    RtlZeroMemory(&(*Stream)->List, sizeof (LIST_ENTRY));
-    RtlZeroMemory(&(*Stream)->Lock, sizeof (KSPIN_LOCK));
+    RtlZeroMemory(&(*Stream)->Clients, sizeof (LIST_ENTRY));
+    RtlZeroMemory(&(*Stream)->Mutex, sizeof (MUTEX));
 
     RtlZeroMemory(&(*Stream)->ConsoleInterface,
                   sizeof (XENBUS_CONSOLE_INTERFACE));
@@ -420,35 +720,198 @@ StreamDestroy(
     ThreadJoin(Stream->Thread);
     Stream->Thread = NULL;
 
+    ASSERT(IsListEmpty(&Stream->Clients));
+    ASSERT3U(Stream->ClientCount, ==, 0);
+    RtlZeroMemory(&Stream->Clients, sizeof (LIST_ENTRY));
+    RtlZeroMemory(&Stream->Mutex, sizeof (MUTEX));
+
+    RtlZeroMemory(Stream->Buffer, sizeof (Stream->Buffer));
+    RtlZeroMemory(&Stream->Statistics, sizeof (XENCONS_STATISTICS));
+
+    RtlZeroMemory(&Stream->ConsoleInterface,
+                  sizeof (XENBUS_CONSOLE_INTERFACE));
+
+    ASSERT(IsZeroMemory(Stream, sizeof (XENCONS_STREAM)));
+    __StreamFree(Stream);
+}
+
+NTSTATUS
+StreamOpen(
+    _In_ PXENCONS_STREAM            Stream,
+    _Outptr_ PXENCONS_STREAM_CLIENT *Client
+    )
+{
+    NTSTATUS                        status;
+
+    *Client = __StreamAllocate(sizeof (XENCONS_STREAM_CLIENT));
+
+    status = STATUS_NO_MEMORY;
+    if (*Client == NULL)
+        goto fail1;
+
+    KeInitializeSpinLock(&(*Client)->Lock);
+    InitializeListHead(&(*Client)->List);
+
+    (*Client)->ReadPolicy = ReadPolicyDefault;
+    KeInitializeTimer(&(*Client)->ReadTimer);
+    KeInitializeDpc(&(*Client)->ReadTimerDpc,
+                    StreamClientReadTimerDpc,
+                    *Client);
+
+    status = IoCsqInitializeEx(&(*Client)->Csq,
+                               StreamCsqInsertIrpEx,
+                               StreamCsqRemoveIrp,
+                               StreamCsqPeekNextIrp,
+                               StreamCsqAcquireLock,
+                               StreamCsqReleaseLock,
+                               StreamCsqCompleteCanceledIrp);
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+    (*Client)->Stream = Stream;
+
+    AcquireMutex(&Stream->Mutex);
+    InsertTailList(&Stream->Clients, &(*Client)->ListEntry);
+    Stream->ClientCount++;
+    ReleaseMutex(&Stream->Mutex);
+
+    // Pick up anything that arrived while there was nobody listening
+    ThreadWake(Stream->Thread);
+
+    return STATUS_SUCCESS;
+
+fail2:
+    Error("fail2\n");
+
+    RtlZeroMemory(&(*Client)->ReadTimerDpc, sizeof (KDPC));
+    RtlZeroMemory(&(*Client)->ReadTimer, sizeof (KTIMER));
+    RtlZeroMemory(&(*Client)->ReadPolicy, sizeof (XENCONS_READ_POLICY));
+
+    RtlZeroMemory(&(*Client)->List, sizeof (LIST_ENTRY));
+    RtlZeroMemory(&(*Client)->Lock, sizeof (KSPIN_LOCK));
+
+    ASSERT(IsZeroMemory(*Client, sizeof (XENCONS_STREAM_CLIENT)));
+    __StreamFree(*Client);
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+VOID
+StreamClose(
+    _In_ PXENCONS_STREAM_CLIENT Client
+    )
+{
+    PXENCONS_STREAM             Stream = Client->Stream;
+
+    AcquireMutex(&Stream->Mutex);
+    RemoveEntryList(&Client->ListEntry);
+    ASSERT(Stream->ClientCount != 0);
+    --Stream->ClientCount;
+    ReleaseMutex(&Stream->Mutex);
+
+    RtlZeroMemory(&Client->ListEntry, sizeof (LIST_ENTRY));
+
+    (VOID) KeCancelTimer(&Client->ReadTimer);
+    KeFlushQueuedDpcs();
+
     for (;;) {
         PIRP    Irp;
 
-        Irp = IoCsqRemoveNextIrp(&Stream->Csq, NULL);
+        Irp = IoCsqRemoveNextIrp(&Client->Csq, NULL);
         if (Irp == NULL)
             break;
 
-        StreamCsqCompleteCanceledIrp(&Stream->Csq,
+        StreamCsqCompleteCanceledIrp(&Client->Csq,
                                      Irp);
     }
-    ASSERT(IsListEmpty(&Stream->List));
+    ASSERT(IsListEmpty(&Client->List));
 
-    RtlZeroMemory(&Stream->Csq, sizeof (IO_CSQ));
+    Client->Stream = NULL;
 
-    RtlZeroMemory(&Stream->List, sizeof (LIST_ENTRY));
-    RtlZeroMemory(&Stream->Lock, sizeof (KSPIN_LOCK));
+    Client->Prod = 0;
+    Client->Cons = 0;
+    RtlZeroMemory(Client->Buffer, sizeof (Client->Buffer));
 
-    RtlZeroMemory(&Stream->ConsoleInterface,
-                  sizeof (XENBUS_CONSOLE_INTERFACE));
+    Client->WriteMode = 0;
+    Client->ReadTimedOut = 0;
+    RtlZeroMemory(&Client->ReadTimerDpc, sizeof (KDPC));
+    RtlZeroMemory(&Client->ReadTimer, sizeof (KTIMER));
+    RtlZeroMemory(&Client->ReadPolicy, sizeof (XENCONS_READ_POLICY));
 
-    ASSERT(IsZeroMemory(Stream, sizeof (XENCONS_STREAM)));
-    __StreamFree(Stream);
+    RtlZeroMemory(&Client->Csq, sizeof (IO_CSQ));
+
+    RtlZeroMemory(&Client->List, sizeof (LIST_ENTRY));
+    RtlZeroMemory(&Client->Lock, sizeof (KSPIN_LOCK));
+
+    ASSERT(IsZeroMemory(Client, sizeof (XENCONS_STREAM_CLIENT)));
+    __StreamFree(Client);
+}
+
+// The default console has no ring or DPC of its own: Events counts
+// worker wakeups and Polls counts per-handle service passes.
+VOID
+StreamGetStatistics(
+    _In_ PXENCONS_STREAM        Stream,
+    _Out_ PXENCONS_STATISTICS   Statistics
+    )
+{
+    *Statistics = Stream->Statistics;
+
+    Statistics->Version = XENCONS_STATISTICS_VERSION;
+    Statistics->Size = sizeof (XENCONS_STATISTICS);
+}
+
+NTSTATUS
+StreamSetReadPolicy(
+    _In_ PXENCONS_STREAM_CLIENT     Client,
+    _In_ const XENCONS_READ_POLICY  *Policy
+    )
+{
+    PXENCONS_STREAM                 Stream = Client->Stream;
+
+    if (!ReadPolicyIsValid(Policy))
+        return STATUS_INVALID_PARAMETER;
+
+    // The worker only looks at the policy with the mutex held
+    AcquireMutex(&Stream->Mutex);
+    Client->ReadPolicy = *Policy;
+    ReleaseMutex(&Stream->Mutex);
+
+    // Reads already queued may now be complete
+    ThreadWake(Stream->Thread);
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+StreamSetWriteMode(
+    _In_ PXENCONS_STREAM_CLIENT Client,
+    _In_ ULONG                  Mode
+    )
+{
+    PXENCONS_STREAM             Stream = Client->Stream;
+
+    if (Mode & ~XENCONS_WRITE_MODE_FULL)
+        return STATUS_INVALID_PARAMETER;
+
+    AcquireMutex(&Stream->Mutex);
+    Client->WriteMode = Mode;
+    ReleaseMutex(&Stream->Mutex);
+
+    return STATUS_SUCCESS;
 }
 
 NTSTATUS
 StreamPutQueue(
-    _In_ PXENCONS_STREAM    Stream,
-    _In_ PIRP               Irp
+    _In_ PXENCONS_STREAM_CLIENT Client,
+    _In_ PIRP                   Irp
     )
 {
-    return IoCsqInsertIrpEx(&Stream->Csq, Irp, NULL, (PVOID)FALSE);
+    // Information accumulates as data is moved across passes
+    Irp->IoStatus.Information = 0;
+
+    return IoCsqInsertIrpEx(&Client->Csq, Irp, NULL, (PVOID)FALSE);
 }
@@ -34,10 +34,12 @@
 #define _XENCONS_STREAM_H
 
 #include <ntddk.h>
+#include <xencons_device.h>
 
 #include "fdo.h"
 
 typedef struct _XENCONS_STREAM XENCONS_STREAM, *PXENCONS_STREAM;
+typedef struct _XENCONS_STREAM_CLIENT XENCONS_STREAM_CLIENT, *PXENCONS_STREAM_CLIENT;
 
 extern NTSTATUS
 StreamCreate(
@@ -50,10 +52,39 @@ StreamDestroy(
     _In_ PXENCONS_STREAM    Stream
     );
 
+extern NTSTATUS
+StreamOpen(
+    _In_ PXENCONS_STREAM            Stream,
+    _Outptr_ PXENCONS_STREAM_CLIENT *Client
+    );
+
+extern VOID
+StreamClose(
+    _In_ PXENCONS_STREAM_CLIENT Client
+    );
+
+extern NTSTATUS
+StreamSetReadPolicy(
+    _In_ PXENCONS_STREAM_CLIENT     Client,
+    _In_ const XENCONS_READ_POLICY  *Policy
+    );
+
+extern NTSTATUS
+StreamSetWriteMode(
+    _In_ PXENCONS_STREAM_CLIENT Client,
+    _In_ ULONG                  Mode
+    );
+
 extern NTSTATUS
 StreamPutQueue(
-    _In_ PXENCONS_STREAM    Stream,
-    _In_ PIRP               Irp
+    _In_ PXENCONS_STREAM_CLIENT Client,
+    _In_ PIRP                   Irp
+    );
+
+extern VOID
+StreamGetStatistics(
+    _In_ PXENCONS_STREAM        Stream,
+    _Out_ PXENCONS_STATISTICS   Statistics
     );
 
 #endif  // _XENCONS_STREAM_H
@@ -0,0 +1,96 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms,
+* with or without modification, are permitted provided
+* that the following conditions are met:
+*
+* *   Redistributions of source code must retain the above
+*     copyright notice, this list of conditions and the
+*     following disclaimer.
+* *   Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the
+*     following disclaimer in the documentation and/or other
+*     materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+* CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+* INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+* CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+* BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+* INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+* WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+* NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+* SUCH DAMAGE.
+*/
+
+#ifndef _XENCONS_STRING_LIST_H
+#define _XENCONS_STRING_LIST_H
+
+#include <ntddk.h>
+
+// A string list is an ANSI_STRING array, terminated by an entry with a
+// NULL Buffer, whose string bytes are packed into the same allocation
+// straight after the array. The whole list is released by freeing the
+// array.
+
+static FORCEINLINE ULONG
+StringListSize(
+    _In_ ULONG  Count,
+    _In_ ULONG  Bytes
+    )
+{
+    return (ULONG)(sizeof (ANSI_STRING) * (Count + 1)) + Bytes;
+}
+
+static FORCEINLINE PCHAR
+StringListInitialize(
+    _Out_writes_bytes_(StringListSize(Count, 0)) PANSI_STRING   Array,
+    _In_ ULONG                                                  Count
+    )
+{
+    RtlZeroMemory(&Array[Count], sizeof (ANSI_STRING));
+
+    return (PCHAR)&Array[Count + 1];
+}
+
+// Carve the next MaximumLength bytes out of the list data and point
+// Ansi at them. Returns the data pointer for the following string.
+static FORCEINLINE PCHAR
+StringListAppend(
+    _Out_ PANSI_STRING  Ansi,
+    _In_ PCHAR          Data,
+    _In_ ULONG          MaximumLength
+    )
+{
+    Ansi->Buffer = Data;
+    Ansi->Length = 0;
+    Ansi->MaximumLength = (USHORT)MaximumLength;
+
+    return Data + MaximumLength;
+}
+
+// FNV-1a hash of a NUL terminated string, for indexing names
+static FORCEINLINE ULONG
+StringListHash(
+    _In_ PCSTR  Name
+    )
+{
+    ULONG       Hash;
+
+    Hash = 2166136261u;
+    while (*Name != '\0') {
+        Hash ^= (UCHAR)*Name++;
+        Hash *= 16777619u;
+    }
+
+    return Hash;
+}
+
+#endif  // _XENCONS_STRING_LIST_H
@@ -275,6 +275,103 @@ __FreePages(
 
 #define __FreePage(_Mdl)    __FreePages(_Mdl)
 
+// Returns the system address of a read or write buffer for either
+// buffered or direct I/O. NULL means the caller's pages could not
+// be mapped (or the transfer is zero length).
+static FORCEINLINE PVOID
+__IrpGetBuffer(
+    _In_ PIRP   Irp
+    )
+{
+    if (Irp->MdlAddress != NULL)
+        return MmGetSystemAddressForMdlSafe(Irp->MdlAddress,
+                                            NormalPagePriority |
+                                            MdlMappingNoExecute);
+
+    return Irp->AssociatedIrp.SystemBuffer;
+}
+
+// Stamp an IRP as it is queued so that its latency can be measured when
+// it is completed. The timestamp lives in DriverContext[2], which is the
+// only slot neither queue implementation uses:
+//  - ring.c: [0] owning XENCONS_QUEUE, [1] inbox link and then the
+//    write schedule round or read deadline, [3] read policy or write
+//    mode
+//  - stream.c: [3] belongs to IoCsq
+// It is interrupt time in microseconds, kept whole on 64-bit builds.
+// An x86 slot only has room for the low 32 bits, which wrap after about
+// 71 minutes, so there a read left pending for longer than that lands
+// in the wrong bucket.
+static FORCEINLINE VOID
+__IrpSetTimestamp(
+    _In_ PIRP   Irp
+    )
+{
+    Irp->Tail.Overlay.DriverContext[2] =
+        (PVOID)(ULONG_PTR)(KeQueryInterruptTime() / 10);
+}
+
+static FORCEINLINE ULONG
+__IrpGetLatencyBucket(
+    _In_ PIRP   Irp,
+    _In_ ULONG  Buckets
+    )
+{
+    ULONG_PTR   Then;
+    ULONG_PTR   Delta;
+    ULONG       Bucket;
+
+    Then = (ULONG_PTR)Irp->Tail.Overlay.DriverContext[2];
+    Delta = (ULONG_PTR)(KeQueryInterruptTime() / 10) - Then;
+
+#ifdef _WIN64
+    if (!_BitScanReverse64(&Bucket, Delta))
+        Bucket = 0;
+#else
+    if (!_BitScanReverse(&Bucket, Delta))
+        Bucket = 0;
+#endif
+
+    return (Bucket < Buckets) ? Bucket : Buckets - 1;
+}
+
+// Statistics counters that are updated outside any lock. The 64-bit
+// interlocked operations are available on x86 as well.
+static FORCEINLINE VOID
+__CounterIncrement(
+    _Inout_ ULONGLONG volatile  *Counter
+    )
+{
+    (VOID) InterlockedIncrement64((LONG64 volatile *)Counter);
+}
+
+static FORCEINLINE VOID
+__CounterAdd(
+    _Inout_ ULONGLONG volatile  *Counter,
+    _In_ ULONGLONG              Value
+    )
+{
+    (VOID) InterlockedExchangeAdd64((LONG64 volatile *)Counter,
+                                    (LONG64)Value);
+}
+
+static FORCEINLINE VOID
+__CounterMaximum(
+    _Inout_ ULONG volatile  *Counter,
+    _In_ ULONG              Value
+    )
+{
+    ULONG                   Old;
+
+    do {
+        Old = *Counter;
+        if (Value <= Old)
+            return;
+    } while ((ULONG)InterlockedCompareExchange((LONG volatile *)Counter,
+                                               (LONG)Value,
+                                               (LONG)Old) != Old);
+}
+
 static FORCEINLINE PSTR
 __strtok_r(
     _In_opt_ PSTR   Buffer,
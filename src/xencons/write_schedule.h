@@ -0,0 +1,102 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms,
+* with or without modification, are permitted provided
+* that the following conditions are met:
+*
+* *   Redistributions of source code must retain the above
+*     copyright notice, this list of conditions and the
+*     following disclaimer.
+* *   Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the
+*     following disclaimer in the documentation and/or other
+*     materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+* CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+* INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+* CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+* BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+* INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+* WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+* NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+* SUCH DAMAGE.
+*/
+
+#ifndef _XENCONS_WRITE_SCHEDULE_H
+#define _XENCONS_WRITE_SCHEDULE_H
+
+#include "ring_compat.h"
+
+// Writes are scheduled deficit round robin between flows (handles).
+// Rather than keeping a queue per flow, each write is given the round
+// in which DRR would send its last byte and the write queue is kept
+// sorted by round. Within a round writes go in arrival order.
+//
+// Round numbers only ever increase (modulo wrap) and the current round
+// starts at 1, so a zeroed flow always looks idle.
+typedef struct _XENCONS_WRITE_FLOW {
+    ULONG   Round;      // Round of the flow's last queued write
+    ULONG   Deficit;    // Bytes the flow may still send in Round
+} XENCONS_WRITE_FLOW, *PXENCONS_WRITE_FLOW;
+
+#define WRITE_SCHEDULE_FIRST_ROUND  1
+
+static FORCEINLINE BOOLEAN
+WriteScheduleIsBefore(
+    _In_ ULONG  Round1,
+    _In_ ULONG  Round2
+    )
+{
+    return ((LONG)(Round1 - Round2) < 0) ? TRUE : FALSE;
+}
+
+// Charge Length bytes to Flow and return the round they fall in. A
+// Quantum of zero gives plain FIFO ordering.
+static FORCEINLINE ULONG
+WriteScheduleAssign(
+    _In_ PXENCONS_WRITE_FLOW    Flow,
+    _In_ ULONG                  Current,
+    _In_ ULONG                  Length,
+    _In_ ULONG                  Quantum
+    )
+{
+    ULONG                       Rounds;
+
+    if (Quantum == 0)
+        return Current;
+
+    // A flow that has gone idle does not get to bank credit
+    if (WriteScheduleIsBefore(Flow->Round, Current)) {
+        Flow->Round = Current;
+        Flow->Deficit = Quantum;
+    }
+
+    if (Length <= Flow->Deficit) {
+        Flow->Deficit -= Length;
+        return Flow->Round;
+    }
+
+    Length -= Flow->Deficit;
+
+    Rounds = Length / Quantum;
+    Flow->Deficit = Length % Quantum;
+
+    if (Flow->Deficit != 0) {
+        Rounds++;
+        Flow->Deficit = Quantum - Flow->Deficit;
+    }
+
+    Flow->Round += Rounds;
+
+    return Flow->Round;
+}
+
+#endif  // _XENCONS_WRITE_SCHEDULE_H